@@ -0,0 +1,36 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+#define MAX_CPUS 8
+#define ISA_IRQS 16
+
+/* Everything the kernel needs from the MADT */
+struct madt_info {
+    uint32_t lapic_address;
+    uint8_t num_cpus;
+    uint8_t cpu_apic_ids[MAX_CPUS];
+    uint8_t has_ioapic;
+    uint8_t ioapic_id;
+    uint32_t ioapic_address;
+    uint32_t ioapic_gsi_base;
+    uint32_t irq_gsi[ISA_IRQS];    /* ISA IRQ -> global system interrupt, after overrides */
+    uint16_t irq_flags[ISA_IRQS];  /* MPS INTI flags of the override, 0 = ISA defaults */
+};
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+uint8_t acpi_parse_madt(struct madt_info *info);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include "cpu/acpi.h"
+
+/* Vectors owned by the local APIC, above the 16 remapped ISA IRQs */
+#define LAPIC_TIMER_VECTOR    48
+#define IPI_RESCHEDULE_VECTOR 49
+#define LAPIC_SPURIOUS_VECTOR 255
+
+/* Interrupt command register delivery modes */
+#define ICR_INIT    0x00000500
+#define ICR_STARTUP 0x00000600
+#define ICR_FIXED   0x00000000
+#define ICR_ASSERT  0x00004000
+#define ICR_LEVEL   0x00008000
+
+void lapic_init(uint32_t base);
+uint8_t lapic_is_enabled();
+uint8_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint8_t apic_id, uint32_t command);
+void lapic_timer_oneshot(uint32_t count, uint8_t masked);
+uint32_t lapic_timer_current();
+void lapic_timer_stop();
+
+void ioapic_init(struct madt_info *info, uint8_t bsp_apic_id);
+uint8_t ioapic_is_enabled();
+void ioapic_set_masked(uint8_t irq, uint8_t masked);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef APIC_TIMER_H
+#define APIC_TIMER_H
+
+#include <stdint.h>
+
+uint8_t apic_timer_calibrate();
+uint64_t apic_timer_now_us();
+uint32_t apic_timer_tsc_per_us();
+void apic_timer_set_deadline(uint64_t deadline_us);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+/* Control register bits */
+#define CR0_MP (1 << 1)  /* Monitor coprocessor: wait/fwait honour TS */
+#define CR0_EM (1 << 2)  /* Emulate coprocessor: must be clear for x87/SSE */
+#define CR0_TS (1 << 3)  /* Task switched: next FPU instruction raises #NM */
+#define CR0_NE (1 << 5)  /* Native x87 error reporting */
+
+#define CR4_OSFXSR     (1 << 9)  /* OS supports fxsave/fxrstor and SSE */
+#define CR4_OSXMMEXCPT (1 << 10) /* OS handles unmasked SSE exceptions */
+
+/* CPUID leaf 1, edx feature bits */
+#define CPUID_EDX_FPU  (1 << 0)
+#define CPUID_EDX_TSC  (1 << 4)
+#define CPUID_EDX_MSR  (1 << 5)
+#define CPUID_EDX_APIC (1 << 9)
+#define CPUID_EDX_SEP  (1 << 11)
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE  (1 << 25)
+#define CPUID_EDX_SSE2 (1 << 26)
+
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+uint32_t cpu_features_edx();
+uint32_t read_cr0();
+void write_cr0(uint32_t value);
+uint32_t read_cr4();
+void write_cr4(uint32_t value);
+uint64_t rdtsc();
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+
+#endif
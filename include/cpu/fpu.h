@@ -0,0 +1,18 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include "cpu/task_manager.h"
+
+/* fxsave needs a 512 byte, 16 byte aligned area */
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+void init_fpu();
+void fpu_task_switched(TASK *prev, TASK *next);
+void fpu_fork(TASK *parent, TASK *child);
+void fpu_task_exit(TASK *task);
+uint32_t fpu_kernel_begin();
+void fpu_kernel_end(uint32_t flags);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+
+#define FUTEX_BUCKETS 64 /* Must be a power of two */
+
+uint32_t futex_wait(uint32_t *address, uint32_t expected);
+uint32_t futex_wake(uint32_t *address, uint32_t count);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+#include "cpu/acpi.h"
+
+/* Segment selectors. The user selectors follow the kernel ones so that sysexit
+ * (which derives them from IA32_SYSENTER_CS + 16 / + 24) lands on them */
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x18
+#define GDT_USER_DATA   0x20
+#define GDT_TSS_BASE    0x28 /* One TSS per cpu, starting here */
+
+#define GDT_ENTRIES (5 + MAX_CPUS)
+
+typedef struct {
+    uint16_t limit_low;
+    uint16_t base_low;
+    uint8_t base_middle;
+    uint8_t access;
+    uint8_t granularity; /* Flags (high nibble) + limit bits 16-19 */
+    uint8_t base_high;
+} __attribute__((packed)) gdt_entry_t;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) gdt_register_t;
+
+/* Only ss0/esp0 are used: the stack the cpu switches to when an interrupt arrives in ring 3 */
+typedef struct {
+    uint32_t prev_tss;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t unused[22];
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed)) tss_t;
+
+void init_gdt();
+void load_gdt();
+void load_tss(uint8_t cpu_index);
+void tss_set_esp0(uint8_t cpu_index, uint32_t esp0);
+
+#endif
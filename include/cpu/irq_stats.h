@@ -0,0 +1,35 @@
+#ifndef IRQ_STATS_H
+#define IRQ_STATS_H
+
+#include <stdint.h>
+
+#define IRQ_STATS_HIST_VECTORS 64 /* Exceptions, ISA IRQs and the local APIC vectors get duration histograms */
+#define IRQ_STATS_HIST_BUCKETS 16 /* Bucket n counts durations below 2^(n+8) cycles; the last one everything longer */
+
+/* Taken on entry to an interrupt, so that its exit can be accounted */
+struct irq_sample {
+    uint64_t start;
+    uint32_t switches; /* The cpu's context switch count at entry */
+    uint8_t cpu;
+    uint8_t vector;
+};
+
+/* One cpu's interrupt accounting, in TSC cycles */
+struct irq_cpu_stats {
+    uint32_t count[256];
+    uint64_t cycles[256];
+    uint32_t max_cycles[256];
+    uint32_t hist[IRQ_STATS_HIST_VECTORS][IRQ_STATS_HIST_BUCKETS];
+    uint32_t nested;    /* Interrupts taken while another was being handled */
+    uint32_t spurious;
+    uint32_t unhandled; /* Vectors with no registered handler */
+};
+
+void irq_stats_init(uint8_t cpu_count);
+void irq_stats_enter(struct irq_sample *sample, uint8_t vector);
+void irq_stats_exit(struct irq_sample *sample);
+void irq_stats_spurious();
+void irq_stats_unhandled();
+struct irq_cpu_stats *irq_stats_cpu(uint8_t cpu_index);
+
+#endif
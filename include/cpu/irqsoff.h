@@ -0,0 +1,44 @@
+#ifndef IRQSOFF_H
+#define IRQSOFF_H
+
+#include <stdint.h>
+#include "cpu/isr.h"
+
+#define EFLAGS_IF          0x200
+#define IRQSOFF_WORST      8      /* Longest sections kept per cpu */
+#define IRQSOFF_NO_VECTOR  0xFFFF /* The section was not started by an interrupt */
+
+/* One stretch of time a cpu spent with interrupts disabled */
+struct irqsoff_section {
+    uint64_t cycles;
+    uint32_t off_eip; /* Where interrupts were disabled; the interrupted eip if vector is set */
+    uint32_t on_eip;  /* Where they were enabled again */
+    uint16_t vector;
+    uint8_t cpu;
+};
+
+struct irqsoff_cpu {
+    uint8_t open;     /* Interrupts were disabled at a traced point and have not been re-enabled since */
+    uint16_t vector;
+    uint32_t off_eip;
+    uint64_t since;
+    uint32_t sections;
+    uint64_t total_cycles;
+    struct irqsoff_section worst[IRQSOFF_WORST]; /* Unsorted */
+};
+
+void irqsoff_init(uint8_t cpu_count);
+
+/* These act on this cpu's interrupt flag. irq_enable(n) and irq_disable(n) in isr.h mask an IRQ line instead. */
+uint32_t local_irq_save();
+void local_irq_restore(uint32_t flags);
+void local_irq_disable();
+void local_irq_enable();
+void local_irq_enable_and_halt();
+
+void irqsoff_irq_enter(registers_t *r);
+void irqsoff_irq_exit(registers_t *r);
+struct irqsoff_cpu *irqsoff_cpu(uint8_t cpu_index);
+void irqsoff_reset();
+
+#endif
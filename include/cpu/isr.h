@@ -53,6 +53,10 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+/* Local APIC vectors */
+extern void irq_lapic_timer();
+extern void irq_reschedule();
+extern void irq_spurious();
 
 //void irq14();
 
@@ -93,7 +97,13 @@ void isr_install();
 void isr_handler(registers_t *r);
 void irq_install();
 
+#define IRQ_SHARED_MAX 4 /* Handlers that can share one ISA IRQ line, as PCI devices' INTx lines often do */
+
 typedef void (*isr_t)(registers_t*);
 void register_interrupt_handler(uint8_t n, isr_t handler);
+uint8_t register_shared_interrupt_handler(uint8_t n, isr_t handler);
+void irq_enable(uint8_t irq);
+void irq_disable(uint8_t irq);
+uint8_t irq_is_enabled(uint8_t irq);
 
 #endif
\ No newline at end of file
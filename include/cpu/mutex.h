@@ -0,0 +1,22 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include <stdint.h>
+#include "cpu/spinlock.h"
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+
+/* A sleeping lock for long critical sections. Only tasks may take it, never interrupt handlers or deferred work. */
+struct mutex {
+    uint8_t locked;
+    TASK *owner;
+    struct wait_queue waiters; /* Its lock also guards locked and owner */
+    struct lock_stats stats;
+};
+
+void mutex_init(struct mutex *mutex, const char *name);
+void mutex_lock(struct mutex *mutex);
+uint8_t mutex_trylock(struct mutex *mutex);
+void mutex_unlock(struct mutex *mutex);
+
+#endif
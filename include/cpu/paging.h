@@ -7,6 +7,7 @@ typedef struct page_struct_t {
     uint32_t page_directory[1024] __attribute__((aligned(4096)));
     uint32_t *page_tables[1024] __attribute__((aligned(4096)));
     unsigned char *bitmap;
+    uint8_t maps_kernel; // The kernel is mapped at its usual addresses, so syscalls need no cr3 switch
 } PAGE_STRUCT;
 
 void enable_paging();
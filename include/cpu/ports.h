@@ -7,5 +7,9 @@ unsigned char port_byte_in (uint16_t port);
 void port_byte_out (uint16_t port, uint8_t data);
 unsigned short port_word_in (uint16_t port);
 void port_word_out (uint16_t port, uint16_t data);
+uint32_t port_dword_in (uint16_t port);
+void port_dword_out (uint16_t port, uint32_t data);
+void port_words_in (uint16_t port, uint16_t *buffer, uint32_t count);
+void port_words_out (uint16_t port, uint16_t *buffer, uint32_t count);
 
 #endif
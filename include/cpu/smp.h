@@ -0,0 +1,44 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "cpu/acpi.h"
+#include "cpu/task_manager.h"
+#include "cpu/softirq.h"
+#include "cpu/timer_wheel.h"
+
+#define SMP_TRAMPOLINE_ADDR 0x90000 /* Must match TRAMPOLINE_BASE in smp_trampoline.asm; below 1MiB and page aligned */
+#define AP_STACK_SIZE       0x4000
+
+/* Per-CPU data */
+struct cpu {
+    uint8_t index;
+    uint8_t apic_id;
+    volatile uint8_t online;
+    TASK *current;         /* Task running on this cpu */
+    TASK *switched_from;   /* Task this cpu just switched away from, requeued by finish_task_switch */
+    TASK idle;             /* The cpu's boot context; runs until the cpu finds work */
+    TASK *fpu_owner;       /* Task whose FPU state is live in this cpu's registers */
+    uint64_t slice_end;    /* End of the current timeslice, in timer_now_us microseconds (0 = none) */
+    uint64_t wakeup_deadline; /* Earliest time something on this cpu asked to be woken (0 = none) */
+    struct run_queue run_queue;
+    struct softirq_queue softirq;
+    struct timer_wheel timers;
+    uint8_t irq_depth;      /* Interrupt handlers this cpu is inside of; saved per task across switches */
+    uint32_t context_switches;
+    uint8_t preempt_count;  /* Nonzero while the current task must not be switched out */
+    volatile uint8_t need_resched; /* A switch was refused because of preempt_count */
+    uint8_t *stack;
+    uint8_t *syscall_stack; /* Stack sysenter switches to */
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern uint8_t num_cpus;
+
+void smp_init();
+void smp_boot_aps();
+struct cpu *this_cpu();
+void smp_kick_idle_cpu();
+void smp_kick_cpu(struct cpu *cpu);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stdint.h>
+
+#define SOFTIRQ_QUEUE_SIZE 64 /* Must be a power of two */
+
+typedef void (*softirq_fn)(uint32_t data);
+
+struct softirq_work {
+    softirq_fn fn;
+    uint32_t data;
+};
+
+/* A per-CPU ring of deferred work. Interrupt handlers on the owning cpu produce at the tail, the IRQ exit path
+ * on the same cpu consumes from the head, so neither side needs a lock. */
+struct softirq_queue {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint8_t running; /* Set while the queue is being drained; nested IRQ exits leave it to the outer one */
+    uint32_t dropped;         /* Work lost because the ring was full */
+    uint32_t processed;
+    uint64_t cycles;          /* TSC cycles spent running work */
+    struct softirq_work work[SOFTIRQ_QUEUE_SIZE];
+};
+
+uint8_t softirq_raise(softirq_fn fn, uint32_t data);
+void softirq_run();
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+/* Contention and hold time of one lock, in TSC cycles. Registered stats are listed by the `locks` command. */
+struct lock_stats {
+    const char *name;
+    uint32_t acquisitions;
+    uint32_t contended;       /* Acquisitions that had to wait */
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    uint64_t max_hold_cycles;
+    uint64_t acquired_at;
+    struct lock_stats *next;
+};
+
+typedef struct spinlock {
+    volatile uint32_t locked;
+    struct lock_stats *stats; /* NULL if the lock is not tracked */
+} spinlock_t;
+
+#define SPINLOCK_INIT { .locked = 0, .stats = NULL }
+
+void spin_init(spinlock_t *lock);
+void spin_init_tracked(spinlock_t *lock, struct lock_stats *stats, const char *name);
+void spin_lock(spinlock_t *lock);
+uint8_t spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+uint32_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags);
+
+void lock_stats_register(struct lock_stats *stats, const char *name);
+void lock_stats_acquired(struct lock_stats *stats, uint64_t wait_start, uint8_t contended);
+void lock_stats_released(struct lock_stats *stats);
+struct lock_stats *lock_stats_list();
+
+#endif
@@ -1,6 +1,28 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
 #include "cpu/paging.h"
 
+#define SYSCALL_VECTOR 0x80
+#define SYSCALL_ERROR  0xFFFFFFFF
+
+/* Syscall numbers, passed in eax. Arguments go in ebx, ecx, edx, esi, edi and the result comes back in eax. */
+#define SYS_INSERT_TASK       0
+#define SYS_FORK              1
+#define SYS_SETUP_TASK_PAGING 2
+#define SYS_NULL              3
+#define SYS_FUTEX_WAIT        4 /* ebx = address, ecx = expected value */
+#define SYS_FUTEX_WAKE        5 /* ebx = address, ecx = most tasks to wake */
+#define SYSCALL_COUNT         6
+
 int enable_syscalls();
+void syscall_init_cpu();
+uint8_t syscall_fast_available();
+uint32_t syscall_int(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+uint32_t syscall_fast(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3);
 int sys_fork(PAGE_STRUCT *paging_struct);
 int sys_insert_task(PAGE_STRUCT *paging_struct);
-int sys_stp();
\ No newline at end of file
+int sys_stp();
+
+#endif
@@ -1,16 +1,62 @@
+#ifndef TASK_MANAGER_H
+#define TASK_MANAGER_H
+
 #include "cpu/isr.h"
 #include "cpu/paging.h"
-#include "cpu/isr.h"
+#include "cpu/spinlock.h"
 #include <stdatomic.h>
 
+#define RUN_QUEUE_SIZE 256
+#define MAX_TASKS 256
+#define KERNEL_STACK_SIZE 0x4000
+
+/* Task states */
+#define TASK_UNUSED   0
+#define TASK_RUNNABLE 1
+#define TASK_DEAD     2 // Exited, but still on its kernel stack until the next switch
+#define TASK_BLOCKED  3 // Waiting for task_wake
+
 typedef struct task {
-	registers_t regs; 
+	uint32_t esp; // Kernel stack pointer while switched out; everything else is saved on the stack
+	uint8_t *kernel_stack;
 	PAGE_STRUCT *assoc_paging_struc;
+	uint8_t *fpu_state; // fxsave area, allocated on the task's first FPU instruction
+	volatile uint8_t state;
+	uint8_t pinned; // Never taken by work stealing
+	uint8_t last_cpu;
+	uint8_t irq_depth; // The cpu's interrupt nesting while this task is switched out
+	spinlock_t lock; // Held by a blocking task until it is off its cpu, so a waker cannot requeue it too early
+	struct task *wait_next; // Link in a wait queue
+	uint32_t wait_key;
 } TASK;
 
-TASK tasks[256];
+/* A per-CPU ring of runnable tasks. The owner pops from the head, thieves take the unpinned task nearest the tail. */
+struct run_queue {
+	spinlock_t lock;
+	uint32_t head;
+	volatile uint32_t count;
+	TASK *tasks[RUN_QUEUE_SIZE];
+};
+
+TASK tasks[MAX_TASKS];
 
 void switch_task(registers_t* regs);
 void insert_task(registers_t* regs);
 void fork(registers_t* regs);
-void setup_task_paging(registers_t *regs);
\ No newline at end of file
+void setup_task_paging(registers_t *regs);
+TASK *get_current_task();
+TASK *kthread_create(void (*entry)(void *), void *arg, uint8_t pinned);
+void task_yield();
+void task_exit();
+void task_block();
+void task_wake(TASK *task);
+void cpu_idle();
+uint8_t task_can_block();
+void finish_task_switch();
+uint32_t task_stack_top(TASK *task);
+
+void run_queue_init(struct run_queue *queue);
+void run_queue_push(struct run_queue *queue, TASK *task);
+TASK *run_queue_pop(struct run_queue *queue);
+
+#endif
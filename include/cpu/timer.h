@@ -5,5 +5,10 @@
 
 void init_timer(uint32_t freq);
 void wait_ticks(uint32_t n_ticks);
+uint32_t get_ticks();
+uint64_t timer_now_us();
+void timer_request_wakeup(uint64_t deadline);
+void timer_start_slice();
+void timer_reprogram();
 
 #endif
@@ -0,0 +1,45 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include "cpu/spinlock.h"
+
+#define TIMER_WHEEL_TICK_US 1000 /* Resolution of kernel timers */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4    /* 64^4 ticks: delays up to about 4.6 hours; longer ones are re-filed as they near */
+
+struct timer_wheel;
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;       /* The pointer that points at this timer, for O(1) removal */
+    uint64_t expires;           /* In wheel ticks */
+    uint64_t period;            /* In wheel ticks; 0 for a one-shot timer */
+    void (*fn)(void *data);     /* Runs as deferred interrupt work: must not sleep */
+    void *data;
+    struct timer_wheel *wheel;  /* The wheel it is pending on, or NULL */
+    uint8_t level;
+    uint8_t slot;
+};
+
+/* A per-CPU hashed hierarchical timing wheel. Level n slots each cover 64^n ticks; timers move down a level when
+ * the wheel reaches their slot. */
+struct timer_wheel {
+    spinlock_t lock;
+    uint64_t now;                /* Next tick to process */
+    uint32_t pending;
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; /* Bit n set if slot n holds timers */
+    struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel);
+void timer_init(struct timer *timer, void (*fn)(void *data), void *data);
+void timer_add(struct timer *timer, uint64_t delay_us);
+void timer_add_periodic(struct timer *timer, uint64_t period_us);
+uint8_t timer_cancel(struct timer *timer);
+void timer_sleep_us(uint64_t us);
+void timer_wheel_tick();
+uint64_t timer_wheel_next_us();
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+
+#include <stdint.h>
+#include "cpu/spinlock.h"
+#include "cpu/task_manager.h"
+
+#define WAIT_KEY_ANY 0
+
+/* A FIFO of blocked tasks. The lock also protects whatever condition the sleepers are waiting on. */
+struct wait_queue {
+    spinlock_t lock;
+    TASK *head;
+    TASK *tail;
+};
+
+#define WAIT_QUEUE_INIT { .lock = SPINLOCK_INIT, .head = NULL, .tail = NULL }
+
+void wait_queue_init(struct wait_queue *queue);
+void wait_queue_sleep_locked(struct wait_queue *queue, uint32_t key, uint32_t flags);
+uint32_t wait_queue_wake_locked(struct wait_queue *queue, uint32_t key, uint32_t count);
+uint32_t wait_queue_wake(struct wait_queue *queue, uint32_t key, uint32_t count);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include <stdint.h>
+
+#define AHCI_MAX_PORTS     32
+#define AHCI_MAX_SLOTS     32      /* Command slots per port, and NCQ tags */
+#define AHCI_PRDT_ENTRIES  32      /* Scatter-gather entries per command; one per merged disk queue request */
+#define AHCI_OPTIMAL       256     /* Sectors per command the disk queue aims for */
+#define AHCI_POLL_US       10000   /* How often ports are checked in case an interrupt was missed */
+#define AHCI_TIMEOUT_US    2000000 /* How long a command may take before the port is reset */
+
+void init_ahci();
+
+#endif
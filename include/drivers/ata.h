@@ -1,7 +1,52 @@
 #ifndef ATA_H
 #define ATA_H
 
-void read_sectors_ATA_PIO(uint32_t target_address, uint32_t LBA, uint8_t sector_count);
-void write_sectors_ATA_PIO(uint32_t LBA, uint8_t sector_count, uint16_t* bytes);
+#include <stdint.h>
+
+#define ATA_OK              0
+#define ATA_ERR_TIMEOUT    -1 // The drive stayed busy or never became ready
+#define ATA_ERR_DMA        -2 // The bus master reported an error during a DMA transfer
+#define ATA_ERR_ABORTED    -3 // The drive aborted the command
+#define ATA_ERR_BAD_SECTOR -4 // Uncorrectable data error or a block marked bad
+#define ATA_ERR_NOT_FOUND  -5 // The sector's address or ID could not be found
+#define ATA_ERR_DEVICE     -6 // Device fault, or an error the drive did not explain
+#define ATA_ERR_RANGE      -7 // The request goes past the end of the disk, or past LBA28 on a drive without LBA48
+
+#define ATA_CHANNELS 2 // Primary and secondary
+#define ATA_DRIVES   4 // A master and a slave on each channel
+
+/* What IDENTIFY DEVICE reported about the drive */
+struct ata_identity {
+    uint8_t present;
+    uint8_t lba48;
+    uint64_t sectors;       /* Capacity in 512-byte sectors */
+    uint8_t max_multiple;   /* Largest READ/WRITE MULTIPLE block, 0 if unsupported */
+    uint8_t dma;            /* The drive supports DMA */
+    uint8_t mwdma_modes;    /* Bit n set: multiword DMA mode n supported */
+    uint8_t udma_modes;     /* Bit n set: Ultra DMA mode n supported */
+    char model[41];
+};
+
+/* How a drive's commands were carried out */
+struct ata_stats {
+    uint32_t dma_commands;
+    uint32_t pio_commands;
+    uint32_t dma_fallbacks; /* DMA commands the bus master failed, redone with PIO */
+    uint64_t pio_sectors;
+    uint64_t pio_cycles;    /* Spent in PIO commands, most of it copying through the data port */
+};
+
+void init_ata();
+int read_sectors_ATA(uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+int write_sectors_ATA(uint32_t LBA, uint32_t sector_count, uint16_t* bytes);
+uint8_t ata_use_dma(uint8_t enabled);
+const struct ata_identity *ata_identity();
+const struct ata_identity *ata_drive_identity(uint8_t index);
+const struct ata_stats *ata_drive_stats(uint8_t index);
+uint32_t ata_optimal_sectors();
+int flush_cache_ATA();
+int read_sectors_ATA_PIO(uint32_t target_address, uint32_t LBA, uint8_t sector_count);
+int write_sectors_ATA_PIO(uint32_t LBA, uint8_t sector_count, uint16_t* bytes);
+const char *ata_strerror(int error);
 
 #endif
\ No newline at end of file
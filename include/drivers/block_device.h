@@ -0,0 +1,46 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stdint.h>
+#include "drivers/disk_queue.h"
+
+#define BLOCK_DEVICE_NAME 8
+
+struct block_device;
+
+/* What a driver provides. Results are ATA_OK or an ATA_ERR_* code, whatever the hardware. */
+struct block_device_ops {
+    int (*read)(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+    int (*write)(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+    int (*flush)(struct block_device *device);               /* Makes written data durable */
+    uint64_t (*capacity)(struct block_device *device);       /* In 512-byte sectors */
+    uint32_t (*optimal_sectors)(struct block_device *device); /* The best size for one request */
+
+    /* Optional, for devices that take several commands at once. submit starts one command for requests that
+       continue each other and returns without waiting; reap hands finished ones to disk_queue_finish. read and
+       write are still needed for callers that cannot wait for the dispatcher. */
+    int (*submit)(struct block_device *device, struct disk_request **batch, uint32_t count);
+    void (*reap)(struct block_device *device);
+};
+
+struct block_device {
+    char name[BLOCK_DEVICE_NAME];
+    const struct block_device_ops *ops;
+    void *private;              /* The driver's */
+    uint32_t queue_depth;       /* Commands the device takes at once, if it has a submit op; set before registering */
+    struct disk_queue queue;
+    struct block_device *next;
+};
+
+void block_device_register(struct block_device *device, const char *name, const struct block_device_ops *ops,
+                           void *private);
+void block_devices_start();
+struct block_device *block_device_find(const char *name);
+struct block_device *block_device_list();
+int block_device_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+int block_device_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+int block_device_flush(struct block_device *device);
+uint64_t block_device_capacity(struct block_device *device);
+uint32_t block_device_optimal_sectors(struct block_device *device);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef DISK_QUEUE_H
+#define DISK_QUEUE_H
+
+#include <stdint.h>
+#include "cpu/wait_queue.h"
+
+#define DISK_READ_DEADLINE_US  50000  /* A read waiting longer than this is served before the elevator's next pick */
+#define DISK_WRITE_DEADLINE_US 500000
+#define DISK_QUEUE_MERGE_MAX   32     /* Most requests merged into one command */
+#define DISK_STATS_HIST_BUCKETS 20    /* Bucket n counts commands served in under 2^(n+12) cycles; the last, the rest */
+
+struct disk_request;
+struct block_device;
+typedef void (*disk_end_io_t)(struct disk_request *request);
+
+/* One read or write, owned by the submitter until it completes */
+struct disk_request {
+    uint32_t lba;
+    uint32_t count;             /* Sectors */
+    uint8_t *buffer;
+    uint8_t write;
+    int result;                 /* ATA_OK or an ATA_ERR_* code, once done */
+    disk_end_io_t end_io;       /* Called by the dispatcher when the request completes, or NULL. May sleep. */
+    void *private;              /* For end_io */
+
+    /* Owned by the queue */
+    volatile uint8_t done;
+    uint64_t deadline;
+    uint64_t submitted;         /* rdtsc when it was queued */
+    uint64_t dispatched;        /* rdtsc when its command went to the device */
+    struct disk_request *next;
+};
+
+/* What a queue's device has done since the queue was set up. Arrays are indexed by the request's write flag. */
+struct disk_stats {
+    uint32_t requests[2];
+    uint64_t sectors[2];
+    uint32_t commands[2];       /* After merging */
+    uint32_t seeks;             /* Commands that did not start where the one before ended */
+    uint32_t errors;            /* Requests that completed with an error */
+    uint64_t service_cycles[2]; /* Dispatch to completion, summed over commands */
+    uint64_t max_service_cycles[2];
+    uint64_t wait_cycles[2];    /* Submission to completion, summed over requests */
+    uint32_t hist[2][DISK_STATS_HIST_BUCKETS]; /* Of service times */
+    uint64_t busy_cycles;       /* With at least one command at the device */
+    uint64_t depth_cycles;      /* The queue's depth integrated over time, for its average */
+    uint64_t since;             /* rdtsc when counting started */
+    uint64_t last_change;       /* rdtsc when busy_cycles and depth_cycles were last brought up to date */
+    uint32_t active;            /* Commands at the device now */
+};
+
+/* Requests for one device, sorted by LBA and served by a dispatcher thread in C-LOOK order */
+struct disk_queue {
+    struct block_device *device; /* Whose ops carry the requests out */
+    uint32_t max_sectors;       /* Requests are merged up to this size */
+
+    struct wait_queue wait;     /* The lock guards everything below, and requests' done flags */
+    struct disk_request *pending;
+    uint32_t head_lba;          /* Where the last dispatched command ended */
+    uint8_t running;            /* The dispatcher thread has started */
+    uint8_t reap_requested;     /* The device has finished commands for its reap op to collect */
+    uint32_t depth;             /* Requests submitted and not yet completed */
+    uint32_t in_flight;         /* Commands handed to the device and not yet finished */
+    uint8_t *bounce;            /* Holds merged requests whose buffers are not back to back; the dispatcher's own */
+
+    /* Statistics */
+    uint32_t submitted;
+    uint32_t dispatched;        /* Commands sent to the driver */
+    uint32_t merged;            /* Requests that rode along in another request's command */
+    uint32_t expired;           /* Commands started early because a request passed its deadline */
+    uint32_t max_depth;
+    struct disk_stats stats;
+};
+
+void disk_queue_init(struct disk_queue *queue, struct block_device *device, uint32_t max_sectors);
+void disk_queue_start(struct disk_queue *queue);
+void disk_queue_submit(struct disk_queue *queue, struct disk_request *request);
+int disk_queue_wait(struct disk_queue *queue, struct disk_request *request);
+void disk_queue_kick(struct disk_queue *queue);
+void disk_queue_finish(struct disk_queue *queue, struct disk_request **batch, uint32_t count, int result);
+void disk_queue_get_stats(struct disk_queue *queue, struct disk_stats *stats);
+int disk_queue_read(struct disk_queue *queue, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+int disk_queue_write(struct disk_queue *queue, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+
+#endif
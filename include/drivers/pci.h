@@ -0,0 +1,49 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+/* Configuration space offsets */
+#define PCI_VENDOR_ID     0x00
+#define PCI_COMMAND       0x04
+#define PCI_CLASS         0x08 /* Revision, prog IF, subclass, class */
+#define PCI_HEADER_TYPE   0x0C /* In bits 16-23 of this dword */
+#define PCI_BAR0          0x10
+#define PCI_BAR4          0x20
+#define PCI_BAR5          0x24
+#define PCI_INTERRUPT     0x3C /* Interrupt line in bits 0-7 */
+
+#define PCI_COMMAND_IO         0x1
+#define PCI_COMMAND_MEMORY     0x2
+#define PCI_COMMAND_BUS_MASTER 0x4
+
+#define PCI_BAR_IO          0x1 /* The BAR is an I/O port range; otherwise memory */
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+#define PCI_SUBCLASS_SATA   0x06
+#define PCI_PROG_IF_AHCI    0x01
+
+#define PCI_MAX_DEVICES     32
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+};
+
+uint32_t pci_config_read(struct pci_device *device, uint8_t offset);
+void pci_config_write(struct pci_device *device, uint8_t offset, uint32_t value);
+struct pci_device *pci_devices(uint32_t *count);
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *device);
+uint8_t pci_find_device(uint16_t vendor_id, uint16_t device_id, uint32_t index, struct pci_device *device);
+void pci_enable(struct pci_device *device, uint16_t command_bits);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef RAID0_H
+#define RAID0_H
+
+#include <stdint.h>
+#include "drivers/block_device.h"
+
+#define RAID0_MAX_MEMBERS     8
+#define RAID0_DEFAULT_STRIPE  128 /* Sectors, 64 KiB */
+#define RAID0_BATCH           8   /* Stripes of one request kept in flight at once */
+
+struct block_device *raid0_create(struct block_device **members, uint32_t count, uint32_t stripe_sectors);
+
+#endif
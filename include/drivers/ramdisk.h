@@ -0,0 +1,12 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include "drivers/block_device.h"
+
+#define RAMDISK_DEFAULT_SECTORS 8192 /* 4 MiB */
+#define RAMDISK_OPTIMAL_SECTORS 256
+
+struct block_device *ramdisk_create(uint32_t sectors);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+
+#define VIRTIO_VENDOR_ID       0x1AF4
+#define VIRTIO_BLK_DEVICE_ID   0x1001 /* The transitional (legacy) block device */
+
+#define VIRTIO_BLK_SEGMENTS    14     /* Most data buffers one command points at; more go through a bounce buffer */
+#define VIRTIO_BLK_MAX_SLOTS   32     /* Most commands in flight at once */
+#define VIRTIO_BLK_OPTIMAL     256    /* Sectors per command the disk queue aims for */
+#define VIRTIO_BLK_POLL_US     10000  /* How often the ring is checked in case an interrupt was missed */
+#define VIRTIO_BLK_TIMEOUT_US  2000000
+
+void init_virtio_blk();
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+#include "cpu/wait_queue.h"
+#include "filesystem/filesystem.h"
+#include "drivers/block_device.h"
+
+#define AIO_QUEUE_DEPTH 32 /* Most operations a context can have in flight or waiting to be reaped */
+
+#define AIO_ERR_BUSY  -16 // The context already has AIO_QUEUE_DEPTH operations outstanding
+#define AIO_ERR_ALIGN -17 // File offsets and sizes must be whole sectors
+#define AIO_ERR_RANGE -18 // The operation goes past the end of the file
+#define AIO_ERR_NOMEM -19
+
+/* A finished operation */
+struct aio_event {
+    uint32_t token;      /* What the submitter passed */
+    int result;          /* ATA_OK or an ATA_ERR_* code */
+    uint32_t bytes;      /* Bytes transferred, 0 on error */
+};
+
+/* A completion queue: operations are submitted to it and reaped from it */
+struct aio_context {
+    struct wait_queue wait;     /* The lock guards everything below */
+    struct aio_event events[AIO_QUEUE_DEPTH];
+    uint32_t head;              /* Next event to reap */
+    uint32_t ready;             /* Events waiting to be reaped */
+    uint32_t in_flight;
+};
+
+struct aio_context *aio_create();
+void aio_destroy(struct aio_context *context);
+int aio_submit(struct aio_context *context, struct block_device *device, uint8_t write, uint32_t LBA,
+               uint32_t sector_count, void *buffer, uint32_t token);
+int aio_submit_file(struct aio_context *context, uint8_t write, struct open_file *file, uint32_t offset,
+                    void *buffer, uint32_t size_bytes, uint32_t token);
+uint32_t aio_poll(struct aio_context *context, struct aio_event *events, uint32_t max);
+uint32_t aio_wait(struct aio_context *context, struct aio_event *events, uint32_t min, uint32_t max);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include "drivers/block_device.h"
+
+#define BLOCK_CACHE_BLOCKS     512     /* 512-byte sectors kept in memory: 256 KiB */
+#define BLOCK_CACHE_BUCKETS    128
+#define BLOCK_CACHE_BYPASS     64      /* Requests longer than this go straight to the disk, so they cannot flush the cache */
+#define BLOCK_CACHE_FLUSH_US   5000000 /* Dirty sectors reach the disk at least this often */
+
+/* A write going around the cache, registered while it is in flight; see block_cache_write_begin */
+struct block_cache_write {
+    struct block_device *device;
+    uint32_t lba;
+    uint32_t count;
+    struct block_cache_write *next;
+};
+
+struct block_cache_stats {
+    uint32_t hits;       /* Sectors served from memory */
+    uint32_t misses;     /* Sectors read from the disk */
+    uint32_t evictions;
+    uint32_t writebacks; /* Dirty sectors written to the disk */
+    uint32_t dirty;      /* Sectors waiting to be written */
+    uint32_t prefetched; /* Sectors read ahead into the cache */
+};
+
+void init_block_cache();
+int block_cache_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+void block_cache_prefetch(struct block_device *device, uint32_t LBA, uint32_t sector_count);
+int block_cache_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+int block_cache_flush();
+int block_cache_sync_range(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint8_t invalidate);
+void block_cache_disk_written();
+void block_cache_write_begin(struct block_cache_write *write, struct block_device *device, uint32_t LBA,
+                             uint32_t sector_count);
+void block_cache_write_end(struct block_cache_write *write);
+void block_cache_get_stats(struct block_cache_stats *stats);
+
+#endif
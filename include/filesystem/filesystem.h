@@ -2,14 +2,27 @@
 #define FILESYSTEM_H
 
 #include <stdint.h>
+#include "cpu/mutex.h"
+#include "drivers/block_device.h"
 
 #define initial_node_name "INIT_NODE"
-#define FAT_LBA 184
-#define FIRST_DATA_LBA 190
+#define FAT_LBA 2048              // Past the kernel and the stock programs; the Makefile checks os-image.bin ends before it
+#define FAT_SECTORS 6             // The table's home; a table that outgrows it is moved into the data area
+#define FIRST_DATA_LBA 2054
+#define FILE_INDEX_MIN_BUCKETS 64 // The name index has at least as many buckets as the table has entries
+#define FILE_NOT_FOUND 0xFFFFFFFF
+#define READAHEAD_MIN_SECTORS 8   // The first read-ahead window once reads look sequential
+#define READAHEAD_MAX_SECTORS 128 // The window doubles up to this while they stay sequential
 
 struct file *fat_head;
 uint32_t num_registered_files;
 uint32_t first_ta_free_sector;
+extern struct mutex fat_mutex;
+extern struct block_device *fs_volume;
+extern uint32_t fat_lba;     // Where the table is: FAT_LBA, or an extent in the data area once it has grown
+extern uint32_t fat_sectors; // Its size, on the disk and in fat_head's buffer
+
+typedef uint32_t file_handle_t; // A file's index in the table. Entry 0 is INIT_NODE, which is not a file.
 
 struct file {
 	char name[32];
@@ -24,6 +37,24 @@ struct file_descriptor {
 	uint32_t size_bytes;
 };
 
+/* A file opened for reading in pieces, with its read-ahead state */
+struct open_file {
+	struct block_device *device;
+	uint32_t lba;
+	uint32_t length;       // In sectors
+	uint32_t next_sector;  // Where a sequential read would start, relative to the file
+	uint32_t ra_start;     // The last window read ahead, relative to the file
+	uint32_t ra_size;      // 0 while reads do not look sequential
+};
+
+/* Where the filesystem's writes went, to tell file data from FAT rewrites */
+struct fs_stats {
+	uint32_t file_writes;
+	uint32_t file_sectors;
+	uint32_t fat_writes;   // Every write_file and overwrite_file rewrites the FAT
+	uint32_t fat_sectors;
+};
+
 struct program_identifier {
     uint32_t magic[4];
     char name[32];
@@ -31,11 +62,18 @@ struct program_identifier {
     uint32_t length;
 } __attribute__((packed));
 
+int mount_filesystem(struct block_device *device);
 void load_fat_from_disk();
 void write_file(char* name, void *file_data, uint32_t size_bytes);
 void overwrite_file(char* name, void *file_data, uint32_t size_bytes);
 struct file_descriptor read_file(char* name);
+struct open_file *open_file(char* name);
+uint32_t read_file_at(struct open_file *file, uint32_t offset, void *buffer, uint32_t size_bytes);
+void close_file(struct open_file *file);
 struct file *get_files();
+file_handle_t find_file(char* name);
+void index_files();
+void fs_get_stats(struct fs_stats *stats);
 void init_fat_info();
 
 #endif
\ No newline at end of file
@@ -11,6 +11,20 @@ void LS(char *args);
 void HELP(char *args);
 void DEBUG_PAUSE(char *args);
 void RUN(char *args);
+void CPUS(char *args);
+void SYSBENCH(char *args);
+void CTXBENCH(char *args);
+void PRIMES(char *args);
+void LOCKS(char *args);
+void IRQSTAT(char *args);
+void IRQSOFF(char *args);
+void DISKBENCH(char *args);
+void SYNC(char *args);
+void BCACHE(char *args);
+void MOUNT(char *args);
+void LSPCI(char *args);
+void IOSTAT(char *args);
+void RAID(char *args);
 
 struct command_block {
 	void (*function)();
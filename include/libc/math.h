@@ -4,5 +4,6 @@
 #include <stddef.h>
 #include <stdint.h>
 uint16_t logi(uint32_t n, uint8_t base);
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t *remainder);
 
 #endif
\ No newline at end of file
@@ -53,4 +53,7 @@ SECTIONS
   }
 
   end = .;
-}
\ No newline at end of file
+}
+
+/* The boot sector loads KERNEL_SECTORS sectors; .bss has to be among them, since that is what zeroes it */
+ASSERT(LOADADDR(.bss) + SIZEOF(.bss) <= phys + KERNEL_SECTORS * 512, "The kernel outgrew KERNEL_SECTORS in the Makefile")
@@ -1,10 +1,30 @@
-[org 0x7c00]               ; Memory location is 0x7c00
-KERNEL_OFFSET equ 0x1000   ; The kernel location is 0x7c00
- 
+[org 0x600]                ; The BIOS loads us at 0x7c00; we move here first, out of the kernel's way
+KERNEL_OFFSET equ 0x1000   ; The kernel location, as linked
+KERNEL_STAGING equ 0x20000 ; Where the kernel is read to in real mode, before it is moved down to KERNEL_OFFSET
+
+%ifndef KERNEL_SECTORS
+%fatal "KERNEL_SECTORS must be defined; the Makefile passes it"
+%endif
+
+    cli                    ; Only immediates until the jump: this runs at 0x7c00, not where it was assembled for
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov sp, 0x7c00
+    mov si, 0x7c00
+    mov di, 0x600
+    mov cx, 256
+    cld
+    rep movsw
+    jmp 0:relocated
+relocated:
+    sti
+
     mov [BOOT_DRIVE], dl   ; The BIOS places the boot drive in DL; retrieve it
     mov bp, 0x9000         ; Place the stack at 0x9000
     mov sp, bp             ; ^
-    
+
      mov ax, 0003h
     int 10h
 
@@ -24,26 +44,25 @@ KERNEL_OFFSET equ 0x1000   ; The kernel location is 0x7c00
 
 [bits 16]                  ; This section is 16-bit
 load_kernel:               ; Load the kernel from disk
-    mov bx, KERNEL_OFFSET  ; Read from disk and store in 0x1000
-    mov dh, 36             ; Load 32 sectors of kernel
     mov dl, [BOOT_DRIVE]   ; Select the boot drive
-    call disk_load         ; Load from the disk
+    call disk_load         ; Load KERNEL_SECTORS sectors to KERNEL_STAGING
     ret                    ; Return
- 
+
 [bits 32]                  ; This section is 32-bit
 BEGIN_PM:                  ; Here, we enter protected mode
     mov ebp, 0x8000000 ; 6. update the stack right at the top of the ta_free space
     mov esp, ebp
+    mov esi, KERNEL_STAGING ; Move the kernel down to where it was linked. It is larger than the 0x1000-0x7c00 gap
+    mov edi, KERNEL_OFFSET  ; real mode could read it into directly; copying forward is safe since it moves down
+    mov ecx, KERNEL_SECTORS * 128
+    cld
+    rep movsd
     call KERNEL_OFFSET     ; Go to the kernel
     jmp $                  ; Loop if the kernel ever stops
 
 
 BOOT_DRIVE db 0x81
-MSG_REAL_MODE db "Started in 16-bit Real Mode", 0
-MSG_PROT_MODE db "Landed in 32-bit Protected Mode", 0
-MSG_LOAD_KERNEL db "Loading kernel into memory", 0
-MSG_RETURNED_KERNEL db "Returned from kernel. Error?", 0
 
 
 times 510 - ($-$$) db 0
-dw 0xaa55
\ No newline at end of file
+dw 0xaa55
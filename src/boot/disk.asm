@@ -1,20 +1,35 @@
-; Load 'dh' sectors from drive 'dl' into ES:BX
+LOAD_CHUNK equ 64 ; Sectors per read: 32 KiB, so the buffer offset never wraps within its segment
+
+; Load KERNEL_SECTORS sectors, from LBA 1 of drive 'dl', to KERNEL_STAGING, with BIOS extended reads
 disk_load:
     pusha
-    push dx
+    mov cx, KERNEL_SECTORS
 
-    mov si, 0
-    mov es, si
-    mov ah, 0x02
-    mov al, dh
-    mov cl, 0x02
-    mov ch, 0x00
-    mov dh, 0x00
+disk_chunk:
+    mov ax, LOAD_CHUNK
+    cmp cx, ax
+    jae disk_read
+    mov ax, cx ; The last, short chunk
 
+disk_read:
+    mov [dap_count], ax
+    push cx
+    push dx
+    mov si, dap
+    mov ah, 0x42
     int 0x13
+    pop dx
+    pop cx
     jc disk_error
 
-    pop dx
+    mov ax, [dap_count]
+    sub cx, ax
+    add [dap_lba], ax
+    shl ax, 5 ; Sectors to 16-byte paragraphs
+    add [dap_segment], ax
+    test cx, cx
+    jnz disk_chunk
+
     popa
     ret
 
@@ -29,4 +44,16 @@ disk_error:
 disk_loop:
     jmp $
 
-DISK_ERROR: db "Disk read error", 0
\ No newline at end of file
+; Disk address packet for int 0x13, ah = 0x42
+dap:
+    db 0x10, 0
+dap_count:
+    dw 0
+dap_offset:
+    dw 0
+dap_segment:
+    dw KERNEL_STAGING >> 4
+dap_lba:
+    dd 1, 0
+
+DISK_ERROR: db "Disk read error", 0
@@ -0,0 +1,148 @@
+/**
+ * @defgroup   ACPI acpi
+ * @ingroup    CPU
+ * @brief      This file implements the small part of ACPI needed for SMP: finding the MADT.
+ *
+ * @par
+ * The RSDP is searched for in the first KiB of the EBDA and in the BIOS area 0xE0000-0xFFFFF. The RSDT it points to
+ * is walked to find the "APIC" table (MADT), whose entries describe the local APICs, the IOAPIC and the ISA interrupt
+ * source overrides.
+ *
+ * @note       Tables are read through the identity mapping, so this should run before paging is enabled.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/acpi.h"
+#include "libc/mem.h"
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_AREA_START  0xE0000
+#define BIOS_AREA_END    0x100000
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_ISO            2
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED        0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+struct rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed));
+
+// Private function definitions
+static uint8_t checksum_ok(uint8_t *data, uint32_t length);
+static struct rsdp *find_rsdp_in(uint32_t start, uint32_t end);
+static struct rsdp *find_rsdp();
+static struct acpi_sdt_header *find_table(struct rsdp *rsdp, char *signature);
+
+/**
+ * @brief      Finds the MADT and fills in the cpu and interrupt routing information
+ * @ingroup    ACPI
+ * @param      info  The structure to fill in
+ *
+ * @return     1 if a MADT was found, 0 otherwise
+ */
+uint8_t acpi_parse_madt(struct madt_info *info) {
+    memory_set((uint8_t*)info, 0, sizeof(struct madt_info));
+    int i;
+    for(i = 0; i < ISA_IRQS; i++) info->irq_gsi[i] = i;
+
+    struct rsdp *rsdp = find_rsdp();
+    if(rsdp == NULL) return 0;
+    struct madt *madt = (struct madt*)find_table(rsdp, "APIC");
+    if(madt == NULL) return 0;
+
+    info->lapic_address = madt->lapic_address;
+
+    uint8_t *entry = madt->entries;
+    uint8_t *end = (uint8_t*)madt + madt->header.length;
+    while(entry + 2 <= end && entry[1] >= 2) {
+        switch(entry[0]) {
+            case MADT_LAPIC:
+                if((entry[4] & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && info->num_cpus < MAX_CPUS) {
+                    info->cpu_apic_ids[info->num_cpus++] = entry[3];
+                }
+                break;
+            case MADT_IOAPIC:
+                // Only the first IOAPIC is used; it carries the ISA interrupts
+                if(!info->has_ioapic) {
+                    info->has_ioapic = 1;
+                    info->ioapic_id = entry[2];
+                    info->ioapic_address = *(uint32_t*)(entry + 4);
+                    info->ioapic_gsi_base = *(uint32_t*)(entry + 8);
+                }
+                break;
+            case MADT_ISO:
+                if(entry[3] < ISA_IRQS) {
+                    info->irq_gsi[entry[3]] = *(uint32_t*)(entry + 4);
+                    info->irq_flags[entry[3]] = *(uint16_t*)(entry + 8);
+                }
+                break;
+            case MADT_LAPIC_OVERRIDE:
+                info->lapic_address = *(uint32_t*)(entry + 4);
+                break;
+        }
+        entry += entry[1];
+    }
+
+    return info->num_cpus > 0;
+}
+
+static uint8_t checksum_ok(uint8_t *data, uint32_t length) {
+    uint8_t sum = 0;
+    uint32_t i;
+    for(i = 0; i < length; i++) sum += data[i];
+    return sum == 0;
+}
+
+static struct rsdp *find_rsdp_in(uint32_t start, uint32_t end) {
+    uint32_t address;
+    for(address = start; address + sizeof(struct rsdp) <= end; address += 16) {
+        char *signature = (char*)address;
+        if(signature[0] == 'R' && signature[1] == 'S' && signature[2] == 'D' && signature[3] == ' ' &&
+           signature[4] == 'P' && signature[5] == 'T' && signature[6] == 'R' && signature[7] == ' ' &&
+           checksum_ok((uint8_t*)address, sizeof(struct rsdp))) {
+            return (struct rsdp*)address;
+        }
+    }
+    return NULL;
+}
+
+static struct rsdp *find_rsdp() {
+    uint32_t ebda = (uint32_t)(*(uint16_t*)EBDA_SEGMENT_PTR) << 4;
+    struct rsdp *rsdp = NULL;
+    if(ebda != 0) rsdp = find_rsdp_in(ebda, ebda + 1024);
+    if(rsdp == NULL) rsdp = find_rsdp_in(BIOS_AREA_START, BIOS_AREA_END);
+    return rsdp;
+}
+
+static struct acpi_sdt_header *find_table(struct rsdp *rsdp, char *signature) {
+    struct acpi_sdt_header *rsdt = (struct acpi_sdt_header*)rsdp->rsdt_address;
+    if(rsdt == NULL || !checksum_ok((uint8_t*)rsdt, rsdt->length)) return NULL;
+
+    uint32_t *tables = (uint32_t*)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    uint32_t i;
+    for(i = 0; i < count; i++) {
+        struct acpi_sdt_header *table = (struct acpi_sdt_header*)tables[i];
+        if(table->signature[0] == signature[0] && table->signature[1] == signature[1] &&
+           table->signature[2] == signature[2] && table->signature[3] == signature[3] &&
+           checksum_ok((uint8_t*)table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
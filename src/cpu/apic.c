@@ -0,0 +1,253 @@
+/**
+ * @defgroup   APIC apic
+ * @ingroup    CPU
+ * @brief      This file implements the local APIC and IOAPIC drivers.
+ *
+ * @par
+ * Every CPU calls lapic_init for its own local APIC. The bootstrap CPU then calls ioapic_init, which masks the 8259
+ * PICs and routes the ISA IRQs through the IOAPIC to the same vectors the PIC used (IRQ0..IRQ15), so existing
+ * handlers keep working. Once the IOAPIC is active, IRQs are acknowledged with lapic_eoi instead of the PIC.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/apic.h"
+#include "cpu/cpu.h"
+#include "cpu/isr.h"
+#include "cpu/ports.h"
+#include "cpu/irqsoff.h"
+#include "cpu/spinlock.h"
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define APIC_BASE_ENABLE   0x800
+
+/* Local APIC register offsets */
+#define LAPIC_ID        0x020
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE     0x100
+#define LAPIC_ICR_PENDING    0x1000
+#define LAPIC_LVT_MASKED     0x10000
+#define LAPIC_DIVIDE_16      0x3
+
+/* IOAPIC registers */
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WIN    0x10
+#define IOAPIC_VER    0x01
+#define IOAPIC_REDTBL 0x10
+
+#define IOAPIC_ACTIVE_LOW 0x2000
+#define IOAPIC_LEVEL      0x8000
+#define IOAPIC_MASKED     0x10000
+
+/* MPS INTI flags used by the interrupt source overrides */
+#define INTI_POLARITY_MASK 0x3
+#define INTI_POLARITY_LOW  0x3
+#define INTI_TRIGGER_MASK  0xC
+#define INTI_TRIGGER_LEVEL 0xC
+
+static volatile uint32_t *lapic_base = 0;
+static volatile uint32_t *ioapic_base = 0;
+static uint8_t lapic_enabled = 0;
+static uint8_t ioapic_enabled = 0;
+static uint32_t ioapic_gsi_base;
+static uint32_t irq_redirection[ISA_IRQS]; // Redirection entry (low dword) of every ISA IRQ
+static uint8_t irq_pin[ISA_IRQS];          // IOAPIC input the ISA IRQ arrives on
+static uint8_t irq_routed[ISA_IRQS];
+static spinlock_t ioapic_lock = SPINLOCK_INIT; // IOREGSEL selects the register IOWIN then reaches, for every cpu
+
+// Private function definitions
+static uint32_t lapic_read(uint32_t reg);
+static void lapic_write(uint32_t reg, uint32_t value);
+static uint32_t ioapic_read(uint8_t reg);
+static void ioapic_write(uint8_t reg, uint32_t value);
+static void spurious_interrupt(registers_t *regs);
+
+/**
+ * @brief      Enables the calling CPU's local APIC
+ * @ingroup    APIC
+ * @param[in]  base  The physical (identity mapped) address of the local APIC, from the MADT
+ */
+void lapic_init(uint32_t base) {
+    if(!(cpu_features_edx() & CPUID_EDX_APIC)) return;
+
+    lapic_base = (volatile uint32_t*)base;
+    wrmsr(IA32_APIC_BASE_MSR, (rdmsr(IA32_APIC_BASE_MSR) & 0xFFF) | (base & 0xFFFFF000) | APIC_BASE_ENABLE);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    register_interrupt_handler(LAPIC_SPURIOUS_VECTOR, spurious_interrupt);
+    lapic_enabled = 1;
+}
+
+uint8_t lapic_is_enabled() {
+    return lapic_enabled;
+}
+
+/**
+ * @brief      Gets the id of the calling CPU's local APIC
+ * @ingroup    APIC
+ * @return     The APIC id
+ */
+uint8_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+/**
+ * @brief      Acknowledges the interrupt currently being serviced
+ * @ingroup    APIC
+ */
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/**
+ * @brief      Sends an inter-processor interrupt
+ * @ingroup    APIC
+ * @param[in]  apic_id  The destination APIC id
+ * @param[in]  command  The low dword of the ICR (delivery mode, level and vector)
+ */
+void lapic_send_ipi(uint8_t apic_id, uint32_t command) {
+    while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING);
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING);
+}
+
+/**
+ * @brief      Starts the local APIC timer in one-shot mode on LAPIC_TIMER_VECTOR
+ * @ingroup    APIC
+ * @param[in]  count  The count, in bus clocks / 16, until the interrupt
+ * @param[in]  masked 1 to count without raising the interrupt (used for calibration)
+ */
+void lapic_timer_oneshot(uint32_t count, uint8_t masked) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | (masked ? LAPIC_LVT_MASKED : 0));
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+/**
+ * @brief      Gets the local APIC timer's remaining count
+ * @ingroup    APIC
+ * @return     The current count
+ */
+uint32_t lapic_timer_current() {
+    return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+/**
+ * @brief      Stops the local APIC timer
+ * @ingroup    APIC
+ */
+void lapic_timer_stop() {
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+/**
+ * @brief      Routes the ISA IRQs through the IOAPIC and disables the 8259 PICs
+ * @ingroup    APIC
+ * @param      info         The MADT information
+ * @param[in]  bsp_apic_id  The APIC id that receives every IRQ
+ */
+void ioapic_init(struct madt_info *info, uint8_t bsp_apic_id) {
+    if(!info->has_ioapic || !lapic_enabled) return;
+
+    ioapic_base = (volatile uint32_t*)info->ioapic_address;
+    ioapic_gsi_base = info->ioapic_gsi_base;
+    uint32_t max_entry = (ioapic_read(IOAPIC_VER) >> 16) & 0xFF;
+
+    // A GSI that is the target of an override is not also wired to the ISA IRQ of the same number
+    uint8_t gsi_taken[ISA_IRQS] = {0};
+    int irq;
+    for(irq = 0; irq < ISA_IRQS; irq++) {
+        if(info->irq_gsi[irq] != (uint32_t)irq && info->irq_gsi[irq] < ISA_IRQS) gsi_taken[info->irq_gsi[irq]] = 1;
+    }
+
+    uint32_t flags = local_irq_save();
+    // Mask every line of both PICs; they stay remapped so a stray interrupt lands on a harmless vector
+    port_byte_out(0xA1, 0xFF);
+    port_byte_out(0x21, 0xFF);
+
+    for(irq = 0; irq < ISA_IRQS; irq++) {
+        uint32_t gsi = info->irq_gsi[irq];
+        irq_routed[irq] = 0;
+        if(gsi == (uint32_t)irq && gsi_taken[irq]) continue;
+        if(gsi < ioapic_gsi_base || gsi - ioapic_gsi_base > max_entry) continue;
+
+        uint32_t entry = IRQ0 + irq;
+        if((info->irq_flags[irq] & INTI_POLARITY_MASK) == INTI_POLARITY_LOW) entry |= IOAPIC_ACTIVE_LOW;
+        if((info->irq_flags[irq] & INTI_TRIGGER_MASK) == INTI_TRIGGER_LEVEL) entry |= IOAPIC_LEVEL;
+
+        irq_redirection[irq] = entry;
+        irq_pin[irq] = gsi - ioapic_gsi_base;
+        irq_routed[irq] = 1;
+        if(!irq_is_enabled(irq)) entry |= IOAPIC_MASKED; // Lines nobody handles stay masked here too
+        ioapic_write(IOAPIC_REDTBL + 2 * irq_pin[irq] + 1, (uint32_t)bsp_apic_id << 24);
+        ioapic_write(IOAPIC_REDTBL + 2 * irq_pin[irq], entry);
+    }
+
+    ioapic_enabled = 1;
+    local_irq_restore(flags);
+}
+
+uint8_t ioapic_is_enabled() {
+    return ioapic_enabled;
+}
+
+/**
+ * @brief      Masks or unmasks an ISA IRQ at the IOAPIC
+ * @ingroup    APIC
+ * @param[in]  irq     The ISA IRQ (0-15)
+ * @param[in]  masked  1 to mask, 0 to unmask
+ */
+void ioapic_set_masked(uint8_t irq, uint8_t masked) {
+    if(!ioapic_enabled || irq >= ISA_IRQS || !irq_routed[irq]) return;
+    uint32_t entry = irq_redirection[irq];
+    if(masked) entry |= IOAPIC_MASKED;
+    ioapic_write(IOAPIC_REDTBL + 2 * irq_pin[irq], entry);
+}
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic_base[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_base[reg / 4] = value;
+    (void)lapic_base[LAPIC_ID / 4]; // Wait for the write to land
+}
+
+static uint32_t ioapic_read(uint8_t reg) {
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_base[IOAPIC_REGSEL / 4] = reg;
+    uint32_t value = ioapic_base[IOAPIC_WIN / 4];
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+    return value;
+}
+
+static void ioapic_write(uint8_t reg, uint32_t value) {
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_base[IOAPIC_REGSEL / 4] = reg;
+    ioapic_base[IOAPIC_WIN / 4] = value;
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+/**
+ * @brief      Spurious local APIC interrupts must not be acknowledged
+ * @ingroup    APIC
+ */
+static void spurious_interrupt(registers_t *regs) {
+    (void)regs;
+}
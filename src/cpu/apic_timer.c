@@ -0,0 +1,107 @@
+/**
+ * @defgroup   APIC_TIMER apic timer
+ * @ingroup    CPU
+ * @brief      This file implements the local APIC timer in one-shot (deadline) mode.
+ *
+ * @par
+ * At boot the local APIC timer and the TSC are both measured against a 10ms one-shot count on PIT channel 2. After
+ * that, the TSC is the kernel's clock (apic_timer_now_us) and every CPU arms its own local APIC timer for the next
+ * deadline it cares about, or leaves it stopped when it has none.
+ */
+#include <stdint.h>
+#include "cpu/apic_timer.h"
+#include "cpu/apic.h"
+#include "cpu/cpu.h"
+#include "cpu/ports.h"
+#include "libc/math.h"
+
+#define PIT_FREQUENCY      1193182
+#define PIT_CHANNEL2       0x42
+#define PIT_COMMAND        0x43
+#define PIT_GATE_PORT      0x61
+#define PIT_GATE           0x01
+#define PIT_SPEAKER        0x02
+#define PIT_OUT2           0x20
+#define PIT_CH2_ONESHOT    0xB0 // Channel 2, lobyte/hibyte, mode 0
+
+#define CALIBRATION_MS     10
+#define MAX_ONESHOT_US     1000000 // Longer deadlines are reached in steps
+
+static uint32_t lapic_counts_per_ms = 0;
+static uint32_t tsc_per_us = 0;
+static uint64_t tsc_at_calibration = 0;
+
+/**
+ * @brief      Measures the local APIC timer and TSC frequencies
+ * @ingroup    APIC_TIMER
+ * @note       Runs once, on the bootstrap CPU. The APs share its result; their timers run off the same bus clock.
+ *
+ * @return     1 if the local APIC timer can be used, 0 otherwise
+ */
+uint8_t apic_timer_calibrate() {
+    if(!lapic_is_enabled() || !(cpu_features_edx() & CPUID_EDX_TSC)) return 0;
+
+    uint16_t pit_count = PIT_FREQUENCY / (1000 / CALIBRATION_MS);
+    uint8_t gate = port_byte_in(PIT_GATE_PORT) & ~(PIT_SPEAKER | PIT_GATE);
+    port_byte_out(PIT_GATE_PORT, gate);
+    port_byte_out(PIT_COMMAND, PIT_CH2_ONESHOT);
+    port_byte_out(PIT_CHANNEL2, pit_count & 0xFF);
+    port_byte_out(PIT_CHANNEL2, pit_count >> 8);
+
+    // Raising the gate starts the count
+    port_byte_out(PIT_GATE_PORT, gate | PIT_GATE);
+    uint64_t tsc_start = rdtsc();
+    lapic_timer_oneshot(0xFFFFFFFF, 1);
+    while(!(port_byte_in(PIT_GATE_PORT) & PIT_OUT2));
+    uint32_t lapic_elapsed = 0xFFFFFFFF - lapic_timer_current();
+    uint64_t tsc_elapsed = rdtsc() - tsc_start;
+    lapic_timer_stop();
+    port_byte_out(PIT_GATE_PORT, gate);
+
+    lapic_counts_per_ms = lapic_elapsed / CALIBRATION_MS;
+    tsc_per_us = udiv64(tsc_elapsed, CALIBRATION_MS * 1000, NULL);
+    if(lapic_counts_per_ms == 0 || tsc_per_us == 0) return 0;
+
+    tsc_at_calibration = rdtsc();
+    return 1;
+}
+
+/**
+ * @brief      Gets the time since calibration
+ * @ingroup    APIC_TIMER
+ * @return     Microseconds since apic_timer_calibrate
+ */
+uint64_t apic_timer_now_us() {
+    return udiv64(rdtsc() - tsc_at_calibration, tsc_per_us, NULL);
+}
+
+/**
+ * @brief      Gets the TSC's rate, for turning cycle counts into time
+ * @ingroup    APIC_TIMER
+ * @return     TSC ticks per microsecond, or 0 if apic_timer_calibrate has not measured it
+ */
+uint32_t apic_timer_tsc_per_us() {
+    return tsc_per_us;
+}
+
+/**
+ * @brief      Arms the calling CPU's timer to fire at a deadline
+ * @ingroup    APIC_TIMER
+ * @param[in]  deadline_us  The deadline, on the apic_timer_now_us clock. 0 stops the timer.
+ */
+void apic_timer_set_deadline(uint64_t deadline_us) {
+    if(deadline_us == 0) {
+        lapic_timer_stop();
+        return;
+    }
+
+    uint64_t now = apic_timer_now_us();
+    uint32_t delta;
+    if(deadline_us <= now)                     delta = 0;
+    else if(deadline_us - now > MAX_ONESHOT_US) delta = MAX_ONESHOT_US;
+    else                                        delta = deadline_us - now;
+
+    uint32_t count = (delta / 1000) * lapic_counts_per_ms + (delta % 1000) * lapic_counts_per_ms / 1000;
+    if(count == 0) count = 1;
+    lapic_timer_oneshot(count, 0);
+}
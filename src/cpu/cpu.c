@@ -0,0 +1,86 @@
+/**
+ * @defgroup   CPUFEAT cpu features
+ * @ingroup    CPU
+ * @brief      This file implements helpers for cpuid and the control registers.
+ */
+#include <stdint.h>
+#include "cpu/cpu.h"
+
+/**
+ * @brief      Executes cpuid for the given leaf
+ * @ingroup    CPUFEAT
+ * @param[in]  leaf  The leaf to query
+ * @param      eax   The eax output
+ * @param      ebx   The ebx output
+ * @param      ecx   The ecx output
+ * @param      edx   The edx output
+ */
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid"
+                 : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                 : "a" (leaf), "c" (0));
+}
+
+/**
+ * @brief      Gets the leaf 1 edx feature flags
+ * @ingroup    CPUFEAT
+ * @return     The CPUID_EDX_* flags supported by this cpu
+ */
+uint32_t cpu_features_edx() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return edx;
+}
+
+uint32_t read_cr0() {
+    uint32_t value;
+    asm volatile("mov %%cr0, %0" : "=r" (value));
+    return value;
+}
+
+void write_cr0(uint32_t value) {
+    asm volatile("mov %0, %%cr0" : : "r" (value));
+}
+
+uint32_t read_cr4() {
+    uint32_t value;
+    asm volatile("mov %%cr4, %0" : "=r" (value));
+    return value;
+}
+
+void write_cr4(uint32_t value) {
+    asm volatile("mov %0, %%cr4" : : "r" (value));
+}
+
+/**
+ * @brief      Reads the time stamp counter
+ * @ingroup    CPUFEAT
+ * @return     The number of cycles since reset
+ */
+uint64_t rdtsc() {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief      Reads a model specific register
+ * @ingroup    CPUFEAT
+ * @param[in]  msr   The register number
+ * @return     The 64 bit value of the register
+ */
+uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief      Writes a model specific register
+ * @ingroup    CPUFEAT
+ * @param[in]  msr    The register number
+ * @param[in]  value  The 64 bit value to write
+ */
+void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
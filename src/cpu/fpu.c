@@ -0,0 +1,184 @@
+/**
+ * @defgroup   FPU fpu
+ * @ingroup    CPU
+ * @brief      This file implements lazy x87/SSE context switching.
+ *
+ * @par
+ * The FPU registers are not part of registers_t. Instead, every task switch sets CR0.TS, so the first
+ * x87/SSE instruction a task executes afterwards raises #NM (interrupt 7). The #NM handler saves the
+ * registers of the previous owner into its fxsave area, restores the current task's area and clears TS.
+ * Tasks which never touch the FPU never pay for a save or a restore.
+ *
+ * @par
+ * The owner is tracked per CPU. With more than one CPU a task may be resumed elsewhere, so a task that owns the FPU
+ * when it is switched out has its registers saved right away; restores stay lazy.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/fpu.h"
+#include "cpu/cpu.h"
+#include "cpu/isr.h"
+#include "cpu/task_manager.h"
+#include "cpu/smp.h"
+#include "cpu/irqsoff.h"
+#include "libc/mem.h"
+#include "libc/function.h"
+
+#define MXCSR_DEFAULT 0x1F80 // All SSE exceptions masked, round to nearest
+
+static uint8_t has_fxsr = 0;
+static uint8_t has_sse = 0;
+
+// Private function definitions
+static void fpu_trap(registers_t *regs);
+static void fpu_save(uint8_t *area);
+static void fpu_restore(uint8_t *area);
+static void fpu_reset();
+
+/**
+ * @brief      Enables the FPU and SSE on the calling CPU, and installs the #NM handler
+ * @ingroup    FPU
+ */
+void init_fpu() {
+    uint32_t features = cpu_features_edx();
+    if(!(features & CPUID_EDX_FPU)) return;
+    has_fxsr = (features & CPUID_EDX_FXSR) != 0;
+    has_sse = has_fxsr && (features & CPUID_EDX_SSE);
+
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    if(has_fxsr) {
+        uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+        if(has_sse) cr4 |= CR4_OSXMMEXCPT;
+        write_cr4(cr4);
+    }
+
+    register_interrupt_handler(7, fpu_trap);
+
+    // Nobody owns the FPU yet; the first user traps
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+/**
+ * @brief      Called by the scheduler after it switches to a new task
+ * @ingroup    FPU
+ * @param      prev  The task which was running
+ * @param      next  The task which is about to run
+ */
+void fpu_task_switched(TASK *prev, TASK *next) {
+    struct cpu *cpu = this_cpu();
+    if(num_cpus > 1 && cpu->fpu_owner == prev && prev != next) {
+        asm volatile("clts");
+        fpu_save(prev->fpu_state);
+        cpu->fpu_owner = NULL;
+    }
+
+    if(cpu->fpu_owner == next) asm volatile("clts");
+    else                       write_cr0(read_cr0() | CR0_TS);
+}
+
+/**
+ * @brief      Gives a forked task a copy of its parent's FPU state
+ * @ingroup    FPU
+ * @param[in]  parent  The parent task
+ * @param[in]  child   The child task
+ */
+void fpu_fork(TASK *parent, TASK *child) {
+    child->fpu_state = NULL;
+    if(parent->fpu_state == NULL) return;
+
+    struct cpu *cpu = this_cpu();
+    if(cpu->fpu_owner == parent) {
+        uint32_t cr0 = read_cr0();
+        asm volatile("clts");
+        fpu_save(parent->fpu_state);
+        // fnsave reinitializes the FPU, so the registers are no longer the parent's
+        if(!has_fxsr) cpu->fpu_owner = NULL;
+        write_cr0(cr0 | (cpu->fpu_owner == NULL ? CR0_TS : 0));
+    }
+
+    // Without memory for a copy, the child starts with a fresh FPU on its first FPU instruction instead
+    child->fpu_state = ta_alloc_align(FPU_STATE_SIZE, FPU_STATE_ALIGN);
+    if(child->fpu_state != NULL) memory_copy(parent->fpu_state, child->fpu_state, FPU_STATE_SIZE);
+}
+
+/**
+ * @brief      Drops an exiting task's FPU state
+ * @ingroup    FPU
+ * @param      task  The task, which must be the calling CPU's current task
+ */
+void fpu_task_exit(TASK *task) {
+    struct cpu *cpu = this_cpu();
+    if(cpu->fpu_owner == task) {
+        cpu->fpu_owner = NULL;
+        write_cr0(read_cr0() | CR0_TS);
+    }
+    if(task->fpu_state != NULL) ta_free(task->fpu_state);
+    task->fpu_state = NULL;
+}
+
+/**
+ * @brief      Allows kernel code to use x87/SSE instructions until fpu_kernel_end.
+ * @ingroup    FPU
+ * @note       Interrupts are disabled in between, so the section must be short and must not nest.
+ *
+ * @return     The flags to pass to fpu_kernel_end
+ */
+uint32_t fpu_kernel_begin() {
+    uint32_t flags = local_irq_save();
+    asm volatile("clts");
+    struct cpu *cpu = this_cpu();
+    if(cpu->fpu_owner != NULL) fpu_save(cpu->fpu_owner->fpu_state);
+    cpu->fpu_owner = NULL;
+    fpu_reset();
+    return flags;
+}
+
+/**
+ * @brief      Ends a kernel FPU section started with fpu_kernel_begin
+ * @ingroup    FPU
+ * @param[in]  flags  The flags returned by fpu_kernel_begin
+ */
+void fpu_kernel_end(uint32_t flags) {
+    write_cr0(read_cr0() | CR0_TS);
+    local_irq_restore(flags);
+}
+
+/**
+ * @brief      The #NM handler. Moves the FPU to the current task.
+ * @ingroup    FPU
+ * @param      regs  The register state
+ */
+static void fpu_trap(registers_t *regs) {
+    struct cpu *cpu = this_cpu();
+    TASK *current = cpu->current;
+    asm volatile("clts");
+    if(cpu->fpu_owner == current) return;
+
+    if(cpu->fpu_owner != NULL) fpu_save(cpu->fpu_owner->fpu_state);
+
+    if(current->fpu_state == NULL) {
+        current->fpu_state = ta_alloc_align(FPU_STATE_SIZE, FPU_STATE_ALIGN);
+        fpu_reset();
+    } else {
+        fpu_restore(current->fpu_state);
+    }
+    cpu->fpu_owner = current;
+
+    UNUSED(regs);
+}
+
+static void fpu_save(uint8_t *area) {
+    if(has_fxsr) asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+    else         asm volatile("fnsave (%0)" : : "r" (area) : "memory");
+}
+
+static void fpu_restore(uint8_t *area) {
+    if(has_fxsr) asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+    else         asm volatile("frstor (%0)" : : "r" (area) : "memory");
+}
+
+static void fpu_reset() {
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile("fninit");
+    if(has_sse) asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+}
@@ -0,0 +1,59 @@
+/**
+ * @defgroup   FUTEX futex
+ * @ingroup    CPU
+ * @brief      This file implements wait-on-address: the slow path for locks and events kept in ordinary memory.
+ *
+ * @par
+ * futex_wait sleeps only if the word at an address still holds the value the caller last saw, checked under the
+ * same lock futex_wake takes, so a wake between the caller's check and its sleep is never lost. Sleepers are kept in
+ * a small hash of wait queues, keyed by address. Every task shares the kernel's mappings today, so the virtual
+ * address is a sufficient key.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/futex.h"
+#include "cpu/wait_queue.h"
+#include "cpu/syscall.h"
+
+static struct wait_queue buckets[FUTEX_BUCKETS]; // All zero is an empty queue with its lock free
+
+// Private function definitions
+static struct wait_queue *futex_bucket(uint32_t *address);
+
+/**
+ * @brief      Sleeps until futex_wake is called on address, if *address still equals expected
+ * @ingroup    FUTEX
+ * @param      address   The word
+ * @param[in]  expected  The value the caller last read from it
+ *
+ * @return     0 once woken, or SYSCALL_ERROR if the word had already changed
+ */
+uint32_t futex_wait(uint32_t *address, uint32_t expected) {
+    if(address == NULL || ((uint32_t)address & 3)) return SYSCALL_ERROR;
+    struct wait_queue *bucket = futex_bucket(address);
+
+    uint32_t flags = spin_lock_irqsave(&bucket->lock);
+    if(*(volatile uint32_t*)address != expected) {
+        spin_unlock_irqrestore(&bucket->lock, flags);
+        return SYSCALL_ERROR;
+    }
+    wait_queue_sleep_locked(bucket, (uint32_t)address, flags);
+    return 0;
+}
+
+/**
+ * @brief      Wakes tasks sleeping in futex_wait on an address
+ * @ingroup    FUTEX
+ * @param      address  The word
+ * @param[in]  count    The most tasks to wake
+ *
+ * @return     The number of tasks woken
+ */
+uint32_t futex_wake(uint32_t *address, uint32_t count) {
+    if(address == NULL || ((uint32_t)address & 3)) return SYSCALL_ERROR;
+    return wait_queue_wake(futex_bucket(address), (uint32_t)address, count);
+}
+
+static struct wait_queue *futex_bucket(uint32_t *address) {
+    return &buckets[((uint32_t)address >> 2) & (FUTEX_BUCKETS - 1)];
+}
@@ -0,0 +1,90 @@
+/**
+ * @defgroup   GDT gdt
+ * @ingroup    CPU
+ * @brief      This file implements the kernel's global descriptor table.
+ *
+ * @par
+ * The bootloader's GDT only has flat kernel code and data segments and lives in memory the kernel later reuses. This
+ * table keeps the same two selectors and adds flat ring 3 code and data segments, which sysexit requires, and a TSS
+ * per cpu whose esp0 the scheduler points at the running task's kernel stack.
+ */
+#include <stdint.h>
+#include "cpu/gdt.h"
+#include "libc/mem.h"
+
+static gdt_entry_t gdt[GDT_ENTRIES];
+static tss_t tss[MAX_CPUS];
+static gdt_register_t gdt_reg;
+
+// Private function definitions
+/**
+ * @brief      Loads a cpu's TSS into its task register
+ * @ingroup    GDT
+ * @param[in]  cpu_index  The calling cpu's index
+ */
+void load_tss(uint8_t cpu_index) {
+    uint16_t selector = GDT_TSS_BASE + cpu_index * 8;
+    asm volatile("ltr %0" : : "r" (selector));
+}
+
+/**
+ * @brief      Sets the stack a cpu enters the kernel on from ring 3
+ * @ingroup    GDT
+ * @param[in]  cpu_index  The cpu's index
+ * @param[in]  esp0       The top of the stack
+ */
+void tss_set_esp0(uint8_t cpu_index, uint32_t esp0) {
+    tss[cpu_index].esp0 = esp0;
+}
+
+static void set_gdt_entry(int n, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags);
+
+/**
+ * @brief      Builds the GDT and loads it on the calling CPU
+ * @ingroup    GDT
+ */
+void init_gdt() {
+    set_gdt_entry(0, 0, 0, 0, 0);
+    set_gdt_entry(GDT_KERNEL_CODE / 8, 0, 0xFFFFF, 0x9A, 0xC); // present, ring 0, code, readable
+    set_gdt_entry(GDT_KERNEL_DATA / 8, 0, 0xFFFFF, 0x92, 0xC); // present, ring 0, data, writable
+    set_gdt_entry(GDT_USER_CODE / 8,   0, 0xFFFFF, 0xFA, 0xC); // present, ring 3, code, readable
+    set_gdt_entry(GDT_USER_DATA / 8,   0, 0xFFFFF, 0xF2, 0xC); // present, ring 3, data, writable
+
+    int i;
+    for(i = 0; i < MAX_CPUS; i++) {
+        memory_set((uint8_t*)&tss[i], 0, sizeof(tss_t));
+        tss[i].ss0 = GDT_KERNEL_DATA;
+        tss[i].iomap_base = sizeof(tss_t); // No I/O permission bitmap
+        set_gdt_entry(GDT_TSS_BASE / 8 + i, (uint32_t)&tss[i], sizeof(tss_t) - 1, 0x89, 0x0); // present, 32 bit TSS
+    }
+
+    gdt_reg.base = (uint32_t)&gdt;
+    gdt_reg.limit = sizeof(gdt) - 1;
+    load_gdt();
+}
+
+/**
+ * @brief      Loads the GDT and reloads every segment register from it
+ * @ingroup    GDT
+ */
+void load_gdt() {
+    asm volatile("lgdtl (%0)\n\t"
+                 "ljmp %1, $1f\n\t"
+                 "1:\n\t"
+                 "mov %2, %%ax\n\t"
+                 "mov %%ax, %%ds\n\t"
+                 "mov %%ax, %%es\n\t"
+                 "mov %%ax, %%fs\n\t"
+                 "mov %%ax, %%gs\n\t"
+                 "mov %%ax, %%ss\n\t"
+                 : : "r" (&gdt_reg), "i" (GDT_KERNEL_CODE), "i" (GDT_KERNEL_DATA) : "eax", "memory");
+}
+
+static void set_gdt_entry(int n, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    gdt[n].limit_low = limit & 0xFFFF;
+    gdt[n].base_low = base & 0xFFFF;
+    gdt[n].base_middle = (base >> 16) & 0xFF;
+    gdt[n].access = access;
+    gdt[n].granularity = ((flags & 0xF) << 4) | ((limit >> 16) & 0xF);
+    gdt[n].base_high = (base >> 24) & 0xFF;
+}
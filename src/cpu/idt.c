@@ -27,6 +27,17 @@ void set_idt_gate(int n, uint32_t handler) {
     idt[n].high_offset = handler & 0xFFFF0000;
 }
 
+/**
+ * @brief      Sets an idt gate which ring 3 code may invoke with int
+ * @ingroup    IDT
+ * @param[in]  n        The gate
+ * @param[in]  handler  The handler
+ */
+void set_idt_gate_user(int n, uint32_t handler) {
+    set_idt_gate(n, handler);
+    idt[n].flags = 0xEE; // Present, DPL 3, 32 bit interrupt gate
+}
+
 /**
  * @brief      Loads the IDT
  * @ingroup    IDT
@@ -4,6 +4,10 @@
 
 global irq_common_stub;
 global irq_return;
+global irq_exit
+global switch_to
+global fork_start
+global kthread_start
 
 section .text
 ; Common ISR code
@@ -62,6 +66,7 @@ irq_common_stub:
     cld
     call irq_handler ; Different than the ISR code
 
+irq_exit: ; Expects the registers_t pointer on top of the stack
     pop esp  ; Different than the ISR code
     pop ebx
 
@@ -137,6 +142,14 @@ global irq12
 global irq13
 global irq14
 global irq15
+; Local APIC vectors
+global irq_lapic_timer
+global irq_reschedule
+global irq_spurious
+; System calls
+global syscall_stub
+global sysenter_entry
+global sysenter_call
 
 ; 0: Divide By Zero Exception
 isr0:
@@ -404,4 +417,133 @@ irq14:
 irq15:
     push byte 15
     push byte 47
-    jmp irq_common_stub
\ No newline at end of file
+    jmp irq_common_stub
+
+; 48: Local APIC timer
+irq_lapic_timer:
+    push byte 0
+    push byte 48
+    jmp irq_common_stub
+
+; 49: Reschedule IPI
+irq_reschedule:
+    push byte 0
+    push byte 49
+    jmp irq_common_stub
+
+; 255: Local APIC spurious interrupt
+irq_spurious:
+    push byte 0
+    push dword 255
+    jmp irq_common_stub
+
+; 0x80: System call through int
+syscall_stub:
+    push byte 0
+    push dword 0x80
+    jmp irq_common_stub
+
+[extern sysenter_dispatch]
+; Fast system call. Call with eax = number and ebx, ecx, edx, esi, edi =
+; arguments, exactly like int 0x80; the result comes back in eax and every
+; other register is preserved. sysenter does not save a return address or
+; stack, so they are kept on the caller's stack and found through ebp.
+sysenter_call:
+    pushf
+    push ecx
+    push edx
+    push ebp
+    mov ebp, esp
+    sysenter
+sysenter_return:
+    pop ebp
+    pop edx
+    pop ecx
+    popf
+    ret
+
+; Entered on the per-cpu sysenter stack with interrupts off.
+; [ebp] = ebp, [ebp+4] = edx, [ebp+8] = ecx, [ebp+12] = flags
+sysenter_entry:
+    push ecx
+    mov cx, ds ; The caller's data segment tells us its privilege level
+    test cl, 3
+    pop ecx
+    jnz .entered
+    ; A ring 0 caller is already on its task's kernel stack. Carry on below its
+    ; frame, with its interrupt flag, so that the syscall may block. Ring 3
+    ; callers stay on the per-cpu stack and must not block.
+    mov esp, ebp
+    test dword [ebp+12], 0x200
+    jz .entered
+    sti
+.entered:
+    push ds
+    push ebp
+    push edi
+    push esi
+    push dword [ebp+4]
+    push dword [ebp+8]
+    push ebx
+    push eax
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    cld
+    call sysenter_dispatch
+    add esp, 24
+    pop ebp
+    pop ecx
+    mov ds, cx
+    mov es, cx
+    test cl, 3
+    jnz .to_user
+    ; sysexit can only return to ring 3. A ring 0 caller gets its stack back and
+    ; sysenter_return's popf restores its interrupt flag.
+    mov esp, ebp
+    jmp sysenter_return
+.to_user:
+    mov ecx, ebp
+    mov edx, sysenter_return
+    sti ; Takes effect after sysexit
+    sysexit
+
+[extern finish_task_switch]
+[extern task_exit]
+[extern irqsoff_irq_exit]
+[extern local_irq_enable]
+; void switch_to(uint32_t *prev_esp, uint32_t next_esp)
+; Saves the callee-saved registers on the current kernel stack, parks the
+; stack pointer in *prev_esp and resumes the stack parked at next_esp.
+switch_to:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; Where a forked task first resumes. Its stack holds a pointer to a copy of
+; its parent's interrupt frame, laid out the way irq_exit expects.
+fork_start:
+    call finish_task_switch
+    push dword [esp]
+    call irqsoff_irq_exit
+    add esp, 4
+    jmp irq_exit
+
+; Where a kernel thread first resumes. Its stack holds the entry point and
+; then its argument.
+kthread_start:
+    call finish_task_switch
+    call local_irq_enable
+    pop eax
+    call eax
+    call task_exit
\ No newline at end of file
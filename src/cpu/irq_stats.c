@@ -0,0 +1,111 @@
+/**
+ * @defgroup   IRQ_STATS irq_stats
+ * @ingroup    CPU
+ * @brief      This file implements interrupt accounting: per-vector counts and handler durations, for `irqstat`.
+ *
+ * @par
+ * Every cpu keeps its own counters, so accounting takes no locks. A handler that switches tasks (the timer, a
+ * reschedule IPI) only finishes when the interrupted task runs again; its duration is not recorded, since it would
+ * include whatever ran in between.
+ *
+ * @par
+ * The tables are allocated by irq_stats_init once smp_init knows how many cpus there are. Interrupts before that are
+ * not counted.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/irq_stats.h"
+#include "cpu/cpu.h"
+#include "cpu/smp.h"
+#include "libc/mem.h"
+
+static struct irq_cpu_stats *stats = NULL; // One per cpu
+
+// Private function definitions
+static uint8_t hist_bucket(uint32_t cycles);
+
+/**
+ * @brief      Allocates every cpu's counters
+ * @ingroup    IRQ_STATS
+ * @param[in]  cpu_count  How many cpus there are
+ */
+void irq_stats_init(uint8_t cpu_count) {
+    struct irq_cpu_stats *tables = ta_alloc(cpu_count * sizeof(struct irq_cpu_stats));
+    if(tables == NULL) return;
+    memory_set((uint8_t *) tables, 0, cpu_count * sizeof(struct irq_cpu_stats));
+    stats = tables;
+}
+
+/**
+ * @brief      Accounts the start of an interrupt
+ * @ingroup    IRQ_STATS
+ * @param      sample  Filled in, to be passed to irq_stats_exit
+ * @param[in]  vector  The vector
+ */
+void irq_stats_enter(struct irq_sample *sample, uint8_t vector) {
+    struct cpu *cpu = this_cpu();
+    if(cpu->irq_depth++ > 0 && stats != NULL) stats[cpu->index].nested++;
+
+    sample->cpu = cpu->index;
+    sample->vector = vector;
+    sample->switches = cpu->context_switches;
+    sample->start = rdtsc();
+}
+
+/**
+ * @brief      Accounts the end of an interrupt's handling
+ * @ingroup    IRQ_STATS
+ * @param      sample  What irq_stats_enter filled in
+ */
+void irq_stats_exit(struct irq_sample *sample) {
+    uint64_t end = rdtsc();
+    struct cpu *cpu = this_cpu();
+    cpu->irq_depth--;
+    if(stats == NULL) return;
+
+    struct irq_cpu_stats *cpu_stats = &stats[cpu->index];
+    cpu_stats->count[sample->vector]++;
+    if(cpu->index != sample->cpu || cpu->context_switches != sample->switches) return;
+
+    uint64_t cycles = end - sample->start;
+    uint32_t clamped = (cycles >> 32) ? 0xFFFFFFFF : (uint32_t)cycles;
+    cpu_stats->cycles[sample->vector] += cycles;
+    if(clamped > cpu_stats->max_cycles[sample->vector]) cpu_stats->max_cycles[sample->vector] = clamped;
+    if(sample->vector < IRQ_STATS_HIST_VECTORS) cpu_stats->hist[sample->vector][hist_bucket(clamped)]++;
+}
+
+/**
+ * @brief      Counts a spurious interrupt on the calling cpu
+ * @ingroup    IRQ_STATS
+ */
+void irq_stats_spurious() {
+    if(stats != NULL) stats[this_cpu()->index].spurious++;
+}
+
+/**
+ * @brief      Counts an interrupt nobody had registered a handler for
+ * @ingroup    IRQ_STATS
+ */
+void irq_stats_unhandled() {
+    if(stats != NULL) stats[this_cpu()->index].unhandled++;
+}
+
+/**
+ * @brief      Gets a cpu's statistics
+ * @ingroup    IRQ_STATS
+ * @param[in]  cpu_index  The cpu's index
+ * @return     The statistics, or NULL before irq_stats_init
+ */
+struct irq_cpu_stats *irq_stats_cpu(uint8_t cpu_index) {
+    return stats != NULL ? &stats[cpu_index] : NULL;
+}
+
+static uint8_t hist_bucket(uint32_t cycles) {
+    uint8_t bucket = 0;
+    cycles >>= 8;
+    while(cycles != 0 && bucket < IRQ_STATS_HIST_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
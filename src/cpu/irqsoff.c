@@ -0,0 +1,173 @@
+/**
+ * @defgroup   IRQSOFF irqsoff
+ * @ingroup    CPU
+ * @brief      This file implements the irqsoff tracer: it times every stretch a cpu spends with interrupts disabled
+ *             and keeps the longest ones, with where they started and ended, for the `irqsoff` command.
+ *
+ * @par
+ * Kernel code disables and enables interrupts through local_irq_save/local_irq_restore and local_irq_disable/local_irq_enable, which report
+ * the transitions with their caller's eip. Interrupt entry and exit are traced from the handlers, using the
+ * interrupted flags. The tracer only acts on real transitions of the interrupt flag, so the few untraced cli/sti in
+ * assembly at worst hide a section from it.
+ *
+ * @par
+ * The per-cpu traces are allocated by irqsoff_init once smp_init knows how many cpus there are; nothing is traced
+ * before that.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/irqsoff.h"
+#include "cpu/cpu.h"
+#include "cpu/smp.h"
+#include "libc/mem.h"
+
+static struct irqsoff_cpu *trace = NULL; // One per cpu
+
+// Private function definitions
+static uint32_t read_flags();
+static void section_start(uint32_t eip, uint16_t vector);
+static void section_end(uint32_t eip);
+
+/**
+ * @brief      Allocates every cpu's trace
+ * @ingroup    IRQSOFF
+ * @param[in]  cpu_count  How many cpus there are
+ */
+void irqsoff_init(uint8_t cpu_count) {
+    struct irqsoff_cpu *traces = ta_alloc(cpu_count * sizeof(struct irqsoff_cpu));
+    if(traces == NULL) return;
+    memory_set((uint8_t *) traces, 0, cpu_count * sizeof(struct irqsoff_cpu));
+    trace = traces;
+}
+
+/**
+ * @brief      Disables interrupts
+ * @ingroup    IRQSOFF
+ * @return     The previous flags, to pass to local_irq_restore
+ */
+uint32_t local_irq_save() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    if(flags & EFLAGS_IF) section_start((uint32_t)__builtin_return_address(0), IRQSOFF_NO_VECTOR);
+    return flags;
+}
+
+/**
+ * @brief      Restores the interrupt flag saved by local_irq_save
+ * @ingroup    IRQSOFF
+ * @param[in]  flags  The flags local_irq_save returned
+ */
+void local_irq_restore(uint32_t flags) {
+    if((flags & EFLAGS_IF) && !(read_flags() & EFLAGS_IF)) section_end((uint32_t)__builtin_return_address(0));
+    asm volatile("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+/**
+ * @brief      Disables interrupts
+ * @ingroup    IRQSOFF
+ */
+void local_irq_disable() {
+    uint32_t flags = read_flags();
+    asm volatile("cli" : : : "memory");
+    if(flags & EFLAGS_IF) section_start((uint32_t)__builtin_return_address(0), IRQSOFF_NO_VECTOR);
+}
+
+/**
+ * @brief      Enables interrupts
+ * @ingroup    IRQSOFF
+ */
+void local_irq_enable() {
+    if(!(read_flags() & EFLAGS_IF)) section_end((uint32_t)__builtin_return_address(0));
+    asm volatile("sti" : : : "memory");
+}
+
+/**
+ * @brief      Enables interrupts and halts until the next one, without a window for it to arrive in between
+ * @ingroup    IRQSOFF
+ */
+void local_irq_enable_and_halt() {
+    if(!(read_flags() & EFLAGS_IF)) section_end((uint32_t)__builtin_return_address(0));
+    asm volatile("sti; hlt" : : : "memory"); // sti holds off interrupts until hlt has started
+}
+
+/**
+ * @brief      Traces the start of an interrupt, which the cpu entered with interrupts disabled
+ * @ingroup    IRQSOFF
+ * @param      r     The interrupted register state
+ */
+void irqsoff_irq_enter(registers_t *r) {
+    if(r->eflags & EFLAGS_IF) section_start(r->eip, r->int_no);
+}
+
+/**
+ * @brief      Traces the end of an interrupt; iret enables interrupts again if they were enabled when it came in
+ * @ingroup    IRQSOFF
+ * @param      r     The register state about to be restored
+ */
+void irqsoff_irq_exit(registers_t *r) {
+    if(r->eflags & EFLAGS_IF) section_end(r->eip);
+}
+
+/**
+ * @brief      Gets a cpu's trace
+ * @ingroup    IRQSOFF
+ * @param[in]  cpu_index  The cpu's index
+ * @return     The trace, or NULL before irqsoff_init
+ */
+struct irqsoff_cpu *irqsoff_cpu(uint8_t cpu_index) {
+    return trace != NULL ? &trace[cpu_index] : NULL;
+}
+
+/**
+ * @brief      Forgets every recorded section
+ * @ingroup    IRQSOFF
+ * @note       Other cpus keep tracing meanwhile, so a section they record during the reset may survive it.
+ */
+void irqsoff_reset() {
+    if(trace == NULL) return;
+    uint32_t flags = local_irq_save();
+    int i;
+    for(i = 0; i < num_cpus; i++) memory_set((uint8_t *) &trace[i], 0, sizeof(struct irqsoff_cpu));
+    local_irq_restore(flags);
+}
+
+static uint32_t read_flags() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r" (flags));
+    return flags;
+}
+
+static void section_start(uint32_t eip, uint16_t vector) {
+    if(trace == NULL) return;
+    struct irqsoff_cpu *cpu_trace = &trace[this_cpu()->index];
+    cpu_trace->open = 1;
+    cpu_trace->off_eip = eip;
+    cpu_trace->vector = vector;
+    cpu_trace->since = rdtsc();
+}
+
+static void section_end(uint32_t eip) {
+    if(trace == NULL) return;
+    uint64_t now = rdtsc();
+    uint8_t cpu_index = this_cpu()->index;
+    struct irqsoff_cpu *cpu_trace = &trace[cpu_index];
+    if(!cpu_trace->open) return;
+    cpu_trace->open = 0;
+
+    uint64_t cycles = now - cpu_trace->since;
+    cpu_trace->sections++;
+    cpu_trace->total_cycles += cycles;
+
+    struct irqsoff_section *shortest = &cpu_trace->worst[0];
+    int i;
+    for(i = 1; i < IRQSOFF_WORST; i++) {
+        if(cpu_trace->worst[i].cycles < shortest->cycles) shortest = &cpu_trace->worst[i];
+    }
+    if(cycles <= shortest->cycles) return;
+
+    shortest->cycles = cycles;
+    shortest->off_eip = cpu_trace->off_eip;
+    shortest->on_eip = eip;
+    shortest->vector = cpu_trace->vector;
+    shortest->cpu = cpu_index;
+}
@@ -15,8 +15,28 @@
 #include "cpu/ports.h"
 #include "libc/function.h"
 #include "kernel/kernel.h"
+#include "cpu/apic.h"
+#include "cpu/syscall.h"
+#include "cpu/softirq.h"
+#include "cpu/irq_stats.h"
+#include "cpu/irqsoff.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+#define PIC_CASCADE  (1 << 2) /* IRQ2 carries the slave, and is never masked */
 
 isr_t interrupt_handlers[256];
+static isr_t shared_handlers[ISA_IRQS][IRQ_SHARED_MAX]; /* Every handler on a shared line, called in turn */
+static volatile uint16_t irq_lines_enabled = PIC_CASCADE; /* Bit n set: ISA IRQ n is unmasked */
+
+// Private function definitions
+static void apply_irq_mask(uint8_t irq);
+static uint8_t pic_spurious(uint8_t irq);
+static void shared_irq_handler(registers_t *r);
 extern void irq_return(/*uint32_t a, uint32_t b, uint32_t c*/);
 extern int return_from_task;
 
@@ -67,8 +87,9 @@ void isr_install() {
     port_byte_out(0xA1, 0x02);
     port_byte_out(0x21, 0x01);
     port_byte_out(0xA1, 0x01);
-    port_byte_out(0x21, 0x0);
-    port_byte_out(0xA1, 0x0); 
+    // Lines stay masked until a handler is registered for them
+    port_byte_out(PIC1_DATA, ~irq_lines_enabled & 0xFF);
+    port_byte_out(PIC2_DATA, ~irq_lines_enabled >> 8);
 
     // Install the IRQs
     set_idt_gate(32, (uint32_t)irq0);
@@ -136,16 +157,24 @@ static char *exception_messages[] = {
  * @param      r     The current register state
  */
 void isr_handler(registers_t *r) {
+    struct irq_sample sample;
+    irqsoff_irq_enter(r);
+    irq_stats_enter(&sample, r->int_no);
+
     if (interrupt_handlers[r->int_no] != 0) {
         isr_t handler = interrupt_handlers[r->int_no];
         handler(r);
     } else {
+        irq_stats_unhandled();
         kprint("received interrupt: ");
         kprint(int_to_ascii(r->int_no));
         kprint("\n");
         kprint(exception_messages[r->int_no]);
         kprint("\n");
     }
+
+    irq_stats_exit(&sample);
+    irqsoff_irq_exit(r);
 }
 
 /**
@@ -156,6 +185,71 @@ void isr_handler(registers_t *r) {
  */
 void register_interrupt_handler(uint8_t n, isr_t handler) {
     interrupt_handlers[n] = handler;
+    if (n >= IRQ0 && n < IRQ0 + ISA_IRQS) {
+        if (handler != 0) irq_enable(n - IRQ0);
+        else              irq_disable(n - IRQ0);
+    }
+}
+
+/**
+ * @brief      Adds a handler to an ISA IRQ line that other devices may also use. Every handler on the line runs on
+ *             each interrupt, so each has to check whether its own device raised it.
+ * @ingroup    ISR
+ * @note       A line that already has a handler from register_interrupt_handler is refused rather than taken over.
+ *
+ * @param[in]  n        The interrupt, IRQ0 to IRQ15
+ * @param[in]  handler  The handler
+ *
+ * @return     1 if it was added, 0 if the line is not an ISA IRQ, is held exclusively, or has IRQ_SHARED_MAX handlers
+ */
+uint8_t register_shared_interrupt_handler(uint8_t n, isr_t handler) {
+    if (n < IRQ0 || n >= IRQ0 + ISA_IRQS) return 0;
+    if (interrupt_handlers[n] != 0 && interrupt_handlers[n] != shared_irq_handler) return 0;
+
+    isr_t *handlers = shared_handlers[n - IRQ0];
+    int i;
+    for (i = 0; i < IRQ_SHARED_MAX && handlers[i] != 0; i++);
+    if (i == IRQ_SHARED_MAX) return 0;
+    handlers[i] = handler;
+    register_interrupt_handler(n, shared_irq_handler);
+    return 1;
+}
+
+/**
+ * @brief      Unmasks an ISA IRQ, at the IOAPIC if it is routing them and at the PICs otherwise
+ * @ingroup    ISR
+ * @param[in]  irq   The IRQ (0-15)
+ */
+void irq_enable(uint8_t irq) {
+    if (irq >= ISA_IRQS) return;
+    uint32_t flags = local_irq_save();
+    irq_lines_enabled |= 1 << irq;
+    apply_irq_mask(irq);
+    local_irq_restore(flags);
+}
+
+/**
+ * @brief      Masks an ISA IRQ. The cascade line of the PICs stays open.
+ * @ingroup    ISR
+ * @param[in]  irq   The IRQ (0-15)
+ */
+void irq_disable(uint8_t irq) {
+    if (irq >= ISA_IRQS) return;
+    uint32_t flags = local_irq_save();
+    irq_lines_enabled &= ~(1 << irq);
+    irq_lines_enabled |= PIC_CASCADE;
+    apply_irq_mask(irq);
+    local_irq_restore(flags);
+}
+
+/**
+ * @brief      Tells whether an ISA IRQ is unmasked
+ * @ingroup    ISR
+ * @param[in]  irq   The IRQ (0-15)
+ * @return     1 if it is, 0 otherwise
+ */
+uint8_t irq_is_enabled(uint8_t irq) {
+    return irq < ISA_IRQS && (irq_lines_enabled & (1 << irq)) != 0;
 }
 
 /**
@@ -164,30 +258,93 @@ void register_interrupt_handler(uint8_t n, isr_t handler) {
  * @param      r     The current register state
  */
 void irq_handler(registers_t *r) {
-    /* After every interrupt we need to send an EOI to the PICs
-     * or they will not send another interrupt again */
-    if (r->int_no >= 40) port_byte_out(0xA0, 0x20); /* slave */
-    port_byte_out(0x20, 0x20); /* master */
+    struct irq_sample sample;
+    irqsoff_irq_enter(r);
+    irq_stats_enter(&sample, r->int_no);
+
+    /* Spurious local APIC interrupts are never acknowledged, and
+     * system calls are software interrupts with nothing to acknowledge */
+    if (r->int_no == LAPIC_SPURIOUS_VECTOR) {
+        irq_stats_spurious();
+        irq_stats_exit(&sample);
+        irqsoff_irq_exit(r);
+        return;
+    }
+    if (r->int_no == SYSCALL_VECTOR) {
+        interrupt_handlers[SYSCALL_VECTOR](r);
+        irq_stats_exit(&sample);
+        irqsoff_irq_exit(r);
+        return;
+    }
+
+    /* After every interrupt we need to send an EOI to the PICs (or the
+     * local APIC, once the IOAPIC delivers the ISA IRQs) or they will
+     * not send another interrupt again */
+    if (r->int_no >= IRQ0 + ISA_IRQS || ioapic_is_enabled()) {
+        lapic_eoi();
+    } else {
+        if (pic_spurious(r->int_no - IRQ0)) {
+            irq_stats_spurious();
+            irq_stats_exit(&sample);
+            irqsoff_irq_exit(r);
+            return;
+        }
+        if (r->int_no >= IRQ8) port_byte_out(PIC2_COMMAND, PIC_EOI); /* slave */
+        port_byte_out(PIC1_COMMAND, PIC_EOI); /* master */
+    }
 
     /* Handle the interrupt in a more modular way */
     if (interrupt_handlers[r->int_no] != 0) {
         isr_t handler = interrupt_handlers[r->int_no];
         handler(r);
+    } else {
+        irq_stats_unhandled();
     }
+
+    irq_stats_exit(&sample);
+    softirq_run();
+    irqsoff_irq_exit(r);
+}
+
+static void shared_irq_handler(registers_t *r) {
+    isr_t *handlers = shared_handlers[r->int_no - IRQ0];
+    int i;
+    for (i = 0; i < IRQ_SHARED_MAX && handlers[i] != 0; i++) handlers[i](r);
+}
+
+/**
+ * @brief      Writes the PIC or IOAPIC mask of one IRQ from irq_lines_enabled
+ * @ingroup    ISR
+ * @param[in]  irq   The IRQ (0-15)
+ */
+static void apply_irq_mask(uint8_t irq) {
+    if (ioapic_is_enabled()) {
+        ioapic_set_masked(irq, !irq_is_enabled(irq));
+        return;
+    }
+    if (irq < 8) port_byte_out(PIC1_DATA, ~irq_lines_enabled & 0xFF);
+    else         port_byte_out(PIC2_DATA, ~irq_lines_enabled >> 8);
 }
 
 /**
- * @brief      The disk interrupt to be called on an ATA irq
+ * @brief      Tells a spurious IRQ7 or IRQ15 from a real one. The PIC raises them when a request goes away before it
+ *             is acknowledged, without setting the line in its in-service register.
  * @ingroup    ISR
- * @param      regs  The current register state
+ * @param[in]  irq   The IRQ (0-15)
+ * @return     1 if the IRQ is spurious and has been dealt with, 0 if it must be handled and acknowledged
  */
-void disk_interrupt(registers_t *regs) {
-    //kprint("Recieved ATA Interrupt.\n");
-    port_word_in(0x1F7);
-    UNUSED(regs);
-    port_byte_out(0xA0, 0x20); /* slave */
-    port_byte_out(0x20, 0x20);
-    //irq_common_stub();
+static uint8_t pic_spurious(uint8_t irq) {
+    if (irq == 7) {
+        port_byte_out(PIC1_COMMAND, PIC_READ_ISR);
+        return !(port_byte_in(PIC1_COMMAND) & 0x80);
+    }
+    if (irq == 15) {
+        port_byte_out(PIC2_COMMAND, PIC_READ_ISR);
+        if (port_byte_in(PIC2_COMMAND) & 0x80) return 0;
+        port_byte_out(PIC1_COMMAND, PIC_EOI); /* The master did see a real request, on the cascade */
+        return 1;
+    }
+    return 0;
 }
 
 /**
@@ -196,9 +353,7 @@ void disk_interrupt(registers_t *regs) {
  */
 void irq_install() {
     /* Enable interruptions */
-    asm volatile("sti");
+    local_irq_enable();
     /* IRQ0: timer */
     init_timer(50);
-
-    register_interrupt_handler(46, disk_interrupt);
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+/**
+ * @defgroup   MUTEX mutex
+ * @ingroup    CPU
+ * @brief      This file implements mutexes: locks whose waiters sleep on a wait queue instead of spinning.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/mutex.h"
+#include "cpu/cpu.h"
+
+/**
+ * @brief      Initializes an unlocked mutex
+ * @ingroup    MUTEX
+ * @param      mutex  The mutex
+ * @param[in]  name   The name its statistics are listed under
+ */
+void mutex_init(struct mutex *mutex, const char *name) {
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    wait_queue_init(&mutex->waiters);
+    lock_stats_register(&mutex->stats, name);
+}
+
+/**
+ * @brief      Takes a mutex, sleeping until it is free
+ * @ingroup    MUTEX
+ * @param      mutex  The mutex
+ */
+void mutex_lock(struct mutex *mutex) {
+    uint64_t wait_start = 0;
+    uint8_t contended = 0;
+    while(1) {
+        uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+        if(!mutex->locked) {
+            mutex->locked = 1;
+            mutex->owner = get_current_task();
+            lock_stats_acquired(&mutex->stats, wait_start, contended);
+            spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+            return;
+        }
+        if(!contended) {
+            contended = 1;
+            wait_start = rdtsc();
+        }
+        wait_queue_sleep_locked(&mutex->waiters, WAIT_KEY_ANY, flags);
+    }
+}
+
+/**
+ * @brief      Takes a mutex if it is free
+ * @ingroup    MUTEX
+ * @param      mutex  The mutex
+ * @return     1 if it was taken, 0 otherwise
+ */
+uint8_t mutex_trylock(struct mutex *mutex) {
+    uint8_t taken = 0;
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    if(!mutex->locked) {
+        mutex->locked = 1;
+        mutex->owner = get_current_task();
+        lock_stats_acquired(&mutex->stats, 0, 0);
+        taken = 1;
+    }
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+    return taken;
+}
+
+/**
+ * @brief      Releases a mutex and wakes the first waiter
+ * @ingroup    MUTEX
+ * @param      mutex  The mutex
+ */
+void mutex_unlock(struct mutex *mutex) {
+    uint32_t flags = spin_lock_irqsave(&mutex->waiters.lock);
+    lock_stats_released(&mutex->stats);
+    mutex->locked = 0;
+    mutex->owner = NULL;
+    wait_queue_wake_locked(&mutex->waiters, WAIT_KEY_ANY, 1);
+    spin_unlock_irqrestore(&mutex->waiters.lock, flags);
+}
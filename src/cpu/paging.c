@@ -47,6 +47,7 @@ void enable_paging() {
         kernel_pages.page_directory[i] = ((unsigned int)kernel_pages.page_tables[i]) | 3;
     }
 
+    kernel_pages.maps_kernel = 1;
     switch_cr3(&kernel_pages.page_directory);
 
     register_interrupt_handler(14, page_fault);
@@ -71,6 +72,7 @@ PAGE_STRUCT* copy_nonkernel_pages(PAGE_STRUCT* old) {
         }
         new->page_directory[i] = ((unsigned int)new->page_tables[i]) | 3;
     }
+    new->maps_kernel = 1;
     return new;
 }
 
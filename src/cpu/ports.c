@@ -58,3 +58,48 @@ uint16_t port_word_in (uint16_t port) {
 void port_word_out (uint16_t port, uint16_t data) {
     asm volatile("out %%ax, %%dx" : : "a" (data), "d" (port));
 }
+
+/**
+ * @brief      Reads a double word in from the port
+ * @ingroup    PORTS
+ * @param[in]  port  The port
+ *
+ * @return     The value accessed
+ */
+uint32_t port_dword_in (uint16_t port) {
+    uint32_t result;
+    asm volatile("in %%dx, %%eax" : "=a" (result) : "d" (port));
+    return result;
+}
+
+/**
+ * @brief      Send a double word out to the port
+ * @ingroup    PORTS
+ * @param[in]  port  The port
+ * @param[in]  data  The data to send
+ */
+void port_dword_out (uint16_t port, uint32_t data) {
+    asm volatile("out %%eax, %%dx" : : "a" (data), "d" (port));
+}
+
+/**
+ * @brief      Reads count words from the port into a buffer with a single rep insw
+ * @ingroup    PORTS
+ * @param[in]  port    The port
+ * @param      buffer  The buffer
+ * @param[in]  count   The number of words
+ */
+void port_words_in (uint16_t port, uint16_t *buffer, uint32_t count) {
+    asm volatile("cld; rep insw" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+/**
+ * @brief      Sends count words from a buffer out to the port with a single rep outsw
+ * @ingroup    PORTS
+ * @param[in]  port    The port
+ * @param      buffer  The buffer
+ * @param[in]  count   The number of words
+ */
+void port_words_out (uint16_t port, uint16_t *buffer, uint32_t count) {
+    asm volatile("cld; rep outsw" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
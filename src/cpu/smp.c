@@ -0,0 +1,222 @@
+/**
+ * @defgroup   SMP smp
+ * @ingroup    CPU
+ * @brief      This file implements multiprocessor bring-up.
+ *
+ * @par
+ * smp_init runs on the bootstrap CPU before paging is enabled: it reads the MADT, enables the local APIC and moves
+ * the ISA IRQs to the IOAPIC. smp_boot_aps runs once the kernel page directory exists and starts every other CPU
+ * with INIT-SIPI-SIPI. The application processors enter 16-bit code copied to SMP_TRAMPOLINE_ADDR, switch to
+ * protected mode with paging, and continue in ap_main on their own stack.
+ *
+ * @par
+ * Every CPU has its own run queue (see task_manager.c). An AP sits in its idle context, halted and with its timer
+ * stopped, until a reschedule IPI lets switch_task pick up (or steal) a task.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/smp.h"
+#include "cpu/acpi.h"
+#include "cpu/apic.h"
+#include "cpu/fpu.h"
+#include "cpu/idt.h"
+#include "cpu/isr.h"
+#include "cpu/paging.h"
+#include "cpu/ports.h"
+#include "cpu/timer.h"
+#include "cpu/task_manager.h"
+#include "cpu/gdt.h"
+#include "cpu/syscall.h"
+#include "cpu/irq_stats.h"
+#include "cpu/irqsoff.h"
+#include "libc/mem.h"
+#include "libc/string.h"
+#include "drivers/screen.h"
+
+#define AP_STARTUP_TICKS 10
+
+struct cpu cpus[MAX_CPUS];
+uint8_t num_cpus = 1;
+
+static struct madt_info madt;
+static uint8_t apic_to_cpu[256];
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint32_t smp_trampoline_cr3;
+extern uint32_t smp_trampoline_stack;
+extern uint32_t smp_trampoline_entry;
+
+// Private function definitions
+static void init_cpu(uint8_t index, uint8_t apic_id);
+static void ap_main();
+static void short_delay();
+static void set_trampoline_value(uint32_t *symbol, uint32_t value);
+static void reschedule_callback(registers_t *regs);
+static void find_cpus();
+
+/**
+ * @brief      Finds the CPUs and switches the bootstrap CPU to APIC interrupt delivery
+ * @ingroup    SMP
+ * @note       Must run before enable_paging, so that the ACPI tables are reachable.
+ */
+void smp_init() {
+    init_cpu(0, 0);
+    cpus[0].online = 1;
+    find_cpus();
+
+    // Per-cpu tables sized by what was found, rather than MAX_CPUS of each in .bss, which is part of the boot image
+    irq_stats_init(num_cpus);
+    irqsoff_init(num_cpus);
+}
+
+/**
+ * @brief      Reads the MADT and, if there is a usable local APIC, sets up every CPU's entry and the IOAPIC
+ * @ingroup    SMP
+ */
+static void find_cpus() {
+    if(!acpi_parse_madt(&madt)) return;
+
+    lapic_init(madt.lapic_address);
+    if(!lapic_is_enabled()) return;
+
+    set_idt_gate(LAPIC_TIMER_VECTOR, (uint32_t)irq_lapic_timer);
+    set_idt_gate(IPI_RESCHEDULE_VECTOR, (uint32_t)irq_reschedule);
+    set_idt_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)irq_spurious);
+    register_interrupt_handler(IPI_RESCHEDULE_VECTOR, reschedule_callback);
+
+    uint8_t bsp_apic_id = lapic_id();
+    cpus[0].apic_id = bsp_apic_id;
+    apic_to_cpu[bsp_apic_id] = 0;
+
+    int i;
+    for(i = 0; i < madt.num_cpus; i++) {
+        if(madt.cpu_apic_ids[i] == bsp_apic_id) continue;
+        init_cpu(num_cpus, madt.cpu_apic_ids[i]);
+        apic_to_cpu[madt.cpu_apic_ids[i]] = num_cpus;
+        num_cpus++;
+    }
+
+    ioapic_init(&madt, bsp_apic_id);
+}
+
+/**
+ * @brief      Starts every application processor found by smp_init
+ * @ingroup    SMP
+ * @note       Needs paging enabled and the timer initialized, since the startup delays use wait_ticks.
+ */
+void smp_boot_aps() {
+    if(num_cpus == 1) return;
+
+    memory_copy(smp_trampoline_start, (uint8_t*)SMP_TRAMPOLINE_ADDR, smp_trampoline_end - smp_trampoline_start);
+    set_trampoline_value(&smp_trampoline_cr3, (uint32_t)&kernel_pages.page_directory);
+    set_trampoline_value(&smp_trampoline_entry, (uint32_t)ap_main);
+
+    int i;
+    for(i = 1; i < num_cpus; i++) {
+        struct cpu *cpu = &cpus[i];
+        cpu->stack = ta_alloc_align(AP_STACK_SIZE, 16);
+        set_trampoline_value(&smp_trampoline_stack, (uint32_t)cpu->stack + AP_STACK_SIZE);
+
+        lapic_send_ipi(cpu->apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+        wait_ticks(1);
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+        short_delay();
+        if(!cpu->online) lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (SMP_TRAMPOLINE_ADDR >> 12));
+
+        // The trampoline's stack slot is shared, so wait for this AP before starting the next
+        uint32_t waited = 0;
+        while(!cpu->online && waited < AP_STARTUP_TICKS) {
+            wait_ticks(1);
+            waited++;
+        }
+    }
+
+    uint8_t online = 0;
+    for(i = 0; i < num_cpus; i++) online += cpus[i].online;
+    kprint(int_to_ascii(online));
+    kprintn(" cpus online");
+}
+
+/**
+ * @brief      Gets the per-CPU data of the calling CPU
+ * @ingroup    SMP
+ * @return     The cpu
+ */
+struct cpu *this_cpu() {
+    if(!lapic_is_enabled()) return &cpus[0];
+    return &cpus[apic_to_cpu[lapic_id()]];
+}
+
+/**
+ * @brief      Wakes an idle CPU, if there is one, so that it can steal newly queued work
+ * @ingroup    SMP
+ */
+void smp_kick_idle_cpu() {
+    if(!lapic_is_enabled()) return;
+    struct cpu *self = this_cpu();
+    int i;
+    for(i = 0; i < num_cpus; i++) {
+        if(&cpus[i] != self && cpus[i].online && cpus[i].current == &cpus[i].idle) {
+            lapic_send_ipi(cpus[i].apic_id, ICR_FIXED | IPI_RESCHEDULE_VECTOR);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief      Makes another CPU look at its run queue
+ * @ingroup    SMP
+ * @param      cpu   The CPU
+ */
+void smp_kick_cpu(struct cpu *cpu) {
+    if(!lapic_is_enabled() || cpu == this_cpu() || !cpu->online) return;
+    lapic_send_ipi(cpu->apic_id, ICR_FIXED | IPI_RESCHEDULE_VECTOR);
+}
+
+static void init_cpu(uint8_t index, uint8_t apic_id) {
+    struct cpu *cpu = &cpus[index];
+    memory_set((uint8_t*)cpu, 0, sizeof(struct cpu));
+    cpu->index = index;
+    cpu->apic_id = apic_id;
+    cpu->idle.assoc_paging_struc = &kernel_pages;
+    cpu->current = &cpu->idle;
+    run_queue_init(&cpu->run_queue);
+    timer_wheel_init(&cpu->timers);
+}
+
+/**
+ * @brief      The C entry point of an application processor, called from the trampoline
+ * @ingroup    SMP
+ */
+static void ap_main() {
+    load_gdt();
+    set_idt();
+    lapic_init(madt.lapic_address);
+    init_fpu();
+    syscall_init_cpu();
+
+    struct cpu *cpu = this_cpu();
+    load_tss(cpu->index);
+    cpu->online = 1;
+
+    cpu_idle();
+}
+
+/**
+ * @brief      Waits roughly 200 microseconds, between the two startup IPIs
+ * @ingroup    SMP
+ */
+static void short_delay() {
+    int i;
+    for(i = 0; i < 200; i++) port_byte_in(0x80);
+}
+
+static void set_trampoline_value(uint32_t *symbol, uint32_t value) {
+    uint32_t offset = (uint8_t*)symbol - smp_trampoline_start;
+    *(volatile uint32_t*)(SMP_TRAMPOLINE_ADDR + offset) = value;
+}
+
+static void reschedule_callback(registers_t *regs) {
+    switch_task(regs);
+}
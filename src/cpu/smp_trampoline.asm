@@ -0,0 +1,71 @@
+; Application processor startup code. smp_boot_aps copies everything between
+; smp_trampoline_start and smp_trampoline_end to TRAMPOLINE_BASE and fills in
+; the cr3, stack and entry slots before sending the startup IPI. The AP starts
+; in real mode at TRAMPOLINE_BASE:0, so every absolute address below is
+; computed relative to the copy rather than to where the kernel was linked.
+
+TRAMPOLINE_BASE equ 0x90000 ; Must match SMP_TRAMPOLINE_ADDR in smp.h
+%define REL(label) (TRAMPOLINE_BASE + (label) - smp_trampoline_start)
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_cr3
+global smp_trampoline_stack
+global smp_trampoline_entry
+
+section .text
+[bits 16]
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    lgdt [trampoline_gdt_descriptor - smp_trampoline_start]
+    mov eax, cr0
+    or eax, 0x1
+    mov cr0, eax
+    jmp dword 0x08:REL(trampoline_pm)
+
+[bits 32]
+trampoline_pm:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    mov eax, [REL(smp_trampoline_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    mov esp, [REL(smp_trampoline_stack)]
+    mov ebp, esp
+    mov eax, [REL(smp_trampoline_entry)]
+    call eax
+
+trampoline_halt:
+    cli
+    hlt
+    jmp trampoline_halt
+
+; Same flat layout as the boot GDT, which may have been overwritten by now
+align 8
+trampoline_gdt:
+    dd 0x0
+    dd 0x0
+    dw 0xffff, 0x0
+    db 0x0, 10011010b, 11001111b, 0x0
+    dw 0xffff, 0x0
+    db 0x0, 10010010b, 11001111b, 0x0
+trampoline_gdt_descriptor:
+    dw trampoline_gdt_descriptor - trampoline_gdt - 1
+    dd REL(trampoline_gdt)
+
+align 4
+smp_trampoline_cr3:   dd 0
+smp_trampoline_stack: dd 0
+smp_trampoline_entry: dd 0
+smp_trampoline_end:
@@ -0,0 +1,79 @@
+/**
+ * @defgroup   SOFTIRQ softirq
+ * @ingroup    CPU
+ * @brief      This file implements deferred interrupt work.
+ *
+ * @par
+ * An interrupt handler should only do what cannot wait: acknowledge the device and grab its data. Everything else
+ * is queued with softirq_raise and run by softirq_run on the way out of the interrupt, with interrupts enabled, so
+ * a slow piece of work no longer holds off the timer or the next keystroke. Work runs in the order it was raised on
+ * each cpu, and the cpu is not handed to another task until the queue is empty.
+ *
+ * @note       Work functions run in interrupt context: they must not yield, sleep or exit.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/softirq.h"
+#include "cpu/cpu.h"
+#include "cpu/smp.h"
+#include "cpu/task_manager.h"
+#include "cpu/irqsoff.h"
+
+/**
+ * @brief      Queues fn(data) to run at the end of the current interrupt
+ * @ingroup    SOFTIRQ
+ * @note       Call with interrupts disabled, normally from an interrupt handler.
+ *
+ * @param[in]  fn    The work function
+ * @param[in]  data  Its argument
+ *
+ * @return     1 if queued, 0 if the queue was full and the work was dropped
+ */
+uint8_t softirq_raise(softirq_fn fn, uint32_t data) {
+    struct softirq_queue *queue = &this_cpu()->softirq;
+    uint32_t tail = queue->tail;
+    if(tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == SOFTIRQ_QUEUE_SIZE) {
+        queue->dropped++;
+        return 0;
+    }
+
+    queue->work[tail & (SOFTIRQ_QUEUE_SIZE - 1)].fn = fn;
+    queue->work[tail & (SOFTIRQ_QUEUE_SIZE - 1)].data = data;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief      Drains the calling cpu's deferred work with interrupts enabled. Called on IRQ exit.
+ * @ingroup    SOFTIRQ
+ * @note       Called and returns with interrupts disabled.
+ */
+void softirq_run() {
+    struct cpu *cpu = this_cpu();
+    struct softirq_queue *queue = &cpu->softirq;
+    if(queue->running || queue->head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) return;
+
+    queue->running = 1;
+    cpu->preempt_count++;
+    local_irq_enable();
+
+    uint64_t start = rdtsc();
+    uint32_t head = queue->head;
+    while(head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        struct softirq_work work = queue->work[head & (SOFTIRQ_QUEUE_SIZE - 1)];
+        __atomic_store_n(&queue->head, ++head, __ATOMIC_RELEASE);
+        work.fn(work.data);
+        queue->processed++;
+    }
+    queue->cycles += rdtsc() - start;
+
+    local_irq_disable();
+    cpu->preempt_count--;
+    queue->running = 0;
+
+    // A timeslice that ended while the work ran
+    if(cpu->need_resched) {
+        cpu->need_resched = 0;
+        switch_task(NULL);
+    }
+}
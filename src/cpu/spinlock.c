@@ -0,0 +1,166 @@
+/**
+ * @defgroup   SPINLOCK spinlock
+ * @ingroup    CPU
+ * @brief      This file implements busy-waiting locks for data shared between CPUs.
+ *
+ * @note       A spinlock does not disable interrupts. Locks taken from interrupt handlers, or held where the holder
+ *             could be preempted, must be taken with spin_lock_irqsave.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/spinlock.h"
+#include "cpu/cpu.h"
+#include "cpu/irqsoff.h"
+
+static struct lock_stats *registered_stats = NULL;
+static spinlock_t registry_lock = SPINLOCK_INIT;
+
+/**
+ * @brief      Initializes a spinlock to the unlocked state
+ * @ingroup    SPINLOCK
+ * @param      lock  The lock
+ */
+void spin_init(spinlock_t *lock) {
+    lock->locked = 0;
+    lock->stats = NULL;
+}
+
+/**
+ * @brief      Initializes a spinlock which records contention and hold times
+ * @ingroup    SPINLOCK
+ * @param      lock   The lock
+ * @param      stats  Where to record them
+ * @param[in]  name   The name to list the lock under
+ */
+void spin_init_tracked(spinlock_t *lock, struct lock_stats *stats, const char *name) {
+    spin_init(lock);
+    lock_stats_register(stats, name);
+    lock->stats = stats;
+}
+
+/**
+ * @brief      Tries to take a spinlock once
+ * @ingroup    SPINLOCK
+ * @param      lock  The lock
+ * @return     1 if the lock was taken, 0 otherwise
+ */
+uint8_t spin_trylock(spinlock_t *lock) {
+    uint32_t old = 1;
+    asm volatile("xchg %0, %1" : "+r" (old), "+m" (lock->locked) : : "memory");
+    if(old == 0 && lock->stats != NULL) lock_stats_acquired(lock->stats, 0, 0);
+    return old == 0;
+}
+
+/**
+ * @brief      Takes a spinlock, spinning until it is free
+ * @ingroup    SPINLOCK
+ * @param      lock  The lock
+ */
+void spin_lock(spinlock_t *lock) {
+    uint32_t old = 1;
+    asm volatile("xchg %0, %1" : "+r" (old), "+m" (lock->locked) : : "memory");
+    if(old == 0) {
+        if(lock->stats != NULL) lock_stats_acquired(lock->stats, 0, 0);
+        return;
+    }
+
+    uint64_t wait_start = lock->stats != NULL ? rdtsc() : 0;
+    do {
+        // Spin on a plain read so the cache line is not bounced by xchg
+        while(lock->locked) asm volatile("pause");
+        old = 1;
+        asm volatile("xchg %0, %1" : "+r" (old), "+m" (lock->locked) : : "memory");
+    } while(old != 0);
+    if(lock->stats != NULL) lock_stats_acquired(lock->stats, wait_start, 1);
+}
+
+/**
+ * @brief      Releases a spinlock
+ * @ingroup    SPINLOCK
+ * @param      lock  The lock
+ */
+void spin_unlock(spinlock_t *lock) {
+    if(lock->stats != NULL) lock_stats_released(lock->stats);
+    asm volatile("" : : : "memory");
+    lock->locked = 0;
+}
+
+/**
+ * @brief      Disables interrupts on the calling CPU, then takes a spinlock
+ * @ingroup    SPINLOCK
+ * @param      lock  The lock
+ * @return     The previous flags, to pass to spin_unlock_irqrestore
+ */
+uint32_t spin_lock_irqsave(spinlock_t *lock) {
+    uint32_t flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * @brief      Releases a spinlock taken with spin_lock_irqsave and restores the interrupt flag
+ * @ingroup    SPINLOCK
+ * @param      lock   The lock
+ * @param[in]  flags  The flags spin_lock_irqsave returned
+ */
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+/**
+ * @brief      Adds lock statistics to the list shown by the `locks` command
+ * @ingroup    SPINLOCK
+ * @param      stats  The statistics
+ * @param[in]  name   The lock's name
+ */
+void lock_stats_register(struct lock_stats *stats, const char *name) {
+    stats->name = name;
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->wait_cycles = 0;
+    stats->hold_cycles = 0;
+    stats->max_hold_cycles = 0;
+    stats->acquired_at = 0;
+
+    uint32_t flags = spin_lock_irqsave(&registry_lock);
+    stats->next = registered_stats;
+    registered_stats = stats;
+    spin_unlock_irqrestore(&registry_lock, flags);
+}
+
+/**
+ * @brief      Records an acquisition. Called by the lock's new holder.
+ * @ingroup    SPINLOCK
+ * @param      stats       The statistics
+ * @param[in]  wait_start  When the holder started waiting, if it had to
+ * @param[in]  contended   Whether it had to wait
+ */
+void lock_stats_acquired(struct lock_stats *stats, uint64_t wait_start, uint8_t contended) {
+    stats->acquired_at = rdtsc();
+    stats->acquisitions++;
+    if(contended) {
+        stats->contended++;
+        stats->wait_cycles += stats->acquired_at - wait_start;
+    }
+}
+
+/**
+ * @brief      Records a release. Called by the holder, before it gives the lock up.
+ * @ingroup    SPINLOCK
+ * @param      stats  The statistics
+ */
+void lock_stats_released(struct lock_stats *stats) {
+    uint64_t held = rdtsc() - stats->acquired_at;
+    stats->hold_cycles += held;
+    if(held > stats->max_hold_cycles) stats->max_hold_cycles = held;
+}
+
+/**
+ * @brief      Gets the registered lock statistics
+ * @ingroup    SPINLOCK
+ * @return     The first entry; follow next for the rest
+ */
+struct lock_stats *lock_stats_list() {
+    return registered_stats;
+}
@@ -1,49 +1,189 @@
+/**
+ * @defgroup   SYSCALL syscall
+ * @ingroup    CPU
+ * @brief      This file implements the system call entry points and dispatch table.
+ *
+ * @par
+ * There are two ways in. int $0x80 goes through the common interrupt stub and gives the handler the whole register
+ * frame, which the task syscalls (insert_task, fork, setup_task_paging) need. sysenter (see sysenter_call in
+ * interrupt.asm) skips the interrupt frame entirely and passes the number and arguments in registers; it can reach
+ * every syscall that does not need the frame. Both paths only switch to the kernel page directory when the caller's
+ * address space does not already map the kernel.
+ */
+#include <stdint.h>
+#include <stddef.h>
 #include "cpu/syscall.h"
 #include "cpu/isr.h"
+#include "cpu/idt.h"
+#include "cpu/cpu.h"
+#include "cpu/gdt.h"
+#include "cpu/smp.h"
 #include "cpu/task_manager.h"
+#include "cpu/futex.h"
+#include "libc/mem.h"
+#include "libc/function.h"
+
+#define IA32_SYSENTER_CS  0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+#define SYSENTER_STACK_SIZE 0x2000
+
+typedef uint32_t (*syscall_fn)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+typedef void (*syscall_frame_fn)(registers_t*);
+
+struct syscall_entry {
+	syscall_fn fn;             // Takes its arguments from registers
+	syscall_frame_fn frame_fn; // Needs the interrupt frame, only reachable through int $0x80
+};
+
+extern void syscall_stub();
+extern void sysenter_entry();
 
 void syscall(registers_t* regs);
+uint32_t sysenter_dispatch(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
+static uint32_t sys_null(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
+static uint32_t sys_futex_wait(uint32_t address, uint32_t expected, uint32_t arg3, uint32_t arg4, uint32_t arg5);
+static uint32_t sys_futex_wake(uint32_t address, uint32_t count, uint32_t arg3, uint32_t arg4, uint32_t arg5);
+static uint8_t caller_maps_kernel();
+
+static struct syscall_entry syscall_table[SYSCALL_COUNT] = {
+	[SYS_INSERT_TASK]       = { .frame_fn = insert_task },
+	[SYS_FORK]              = { .frame_fn = fork },
+	[SYS_SETUP_TASK_PAGING] = { .frame_fn = setup_task_paging },
+	[SYS_NULL]              = { .fn = sys_null },
+	[SYS_FUTEX_WAIT]        = { .fn = sys_futex_wait },
+	[SYS_FUTEX_WAKE]        = { .fn = sys_futex_wake },
+};
+static uint8_t fast_available = 0;
 
 int enable_syscalls() {
-	register_interrupt_handler(33, syscall);
+	set_idt_gate_user(SYSCALL_VECTOR, (uint32_t)syscall_stub);
+	register_interrupt_handler(SYSCALL_VECTOR, syscall);
+	fast_available = (cpu_features_edx() & CPUID_EDX_SEP) != 0;
+	syscall_init_cpu();
+	return 0;
+}
+
+/**
+ * @brief      Points the calling CPU's sysenter MSRs at the kernel entry and a per-CPU stack
+ * @ingroup    SYSCALL
+ */
+void syscall_init_cpu() {
+	if(!fast_available) return;
+	struct cpu *cpu = this_cpu();
+	if(cpu->syscall_stack == NULL) cpu->syscall_stack = ta_alloc_align(SYSENTER_STACK_SIZE, 16);
+
+	wrmsr(IA32_SYSENTER_CS, GDT_KERNEL_CODE);
+	wrmsr(IA32_SYSENTER_ESP, (uint32_t)cpu->syscall_stack + SYSENTER_STACK_SIZE);
+	wrmsr(IA32_SYSENTER_EIP, (uint32_t)sysenter_entry);
 }
 
+uint8_t syscall_fast_available() {
+	return fast_available;
+}
+
+/**
+ * @brief      The int $0x80 handler
+ * @ingroup    SYSCALL
+ * @param      regs  The register frame; eax holds the number and receives the result
+ */
 void syscall(registers_t* regs) {
-	switch_cr3(&kernel_pages.page_directory);
-	switch (regs->eax) {
-		case 0:
-			insert_task(regs);
-			break;
-		case 1:
-			fork(regs);
-			break;
-		case 2:
-			setup_task_paging(regs);
-			break;
+	// The interrupt stub restores the caller's cr3 from the frame on the way out
+	if(!caller_maps_kernel()) switch_cr3(&kernel_pages.page_directory);
+
+	if(regs->eax >= SYSCALL_COUNT) {
+		regs->eax = SYSCALL_ERROR;
+	} else if(syscall_table[regs->eax].frame_fn != NULL) {
+		syscall_table[regs->eax].frame_fn(regs);
+	} else {
+		regs->eax = syscall_table[regs->eax].fn(regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi);
 	}
 }
 
+/**
+ * @brief      Called by sysenter_entry with the caller's registers as arguments
+ * @ingroup    SYSCALL
+ * @return     The syscall's result, returned to the caller in eax
+ */
+uint32_t sysenter_dispatch(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+	if(number >= SYSCALL_COUNT || syscall_table[number].fn == NULL) return SYSCALL_ERROR;
+	if(caller_maps_kernel()) return syscall_table[number].fn(arg1, arg2, arg3, arg4, arg5);
+
+	uint32_t caller_cr3;
+	asm volatile("mov %%cr3, %0" : "=r" (caller_cr3));
+	switch_cr3(&kernel_pages.page_directory);
+	uint32_t result = syscall_table[number].fn(arg1, arg2, arg3, arg4, arg5);
+	switch_cr3((void*)caller_cr3);
+	return result;
+}
+
+/**
+ * @brief      Makes a syscall through int $0x80
+ * @ingroup    SYSCALL
+ */
+uint32_t syscall_int(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+	uint32_t result;
+	asm volatile("int $0x80" : "=a" (result) : "a" (number), "b" (arg1), "c" (arg2), "d" (arg3) : "memory");
+	return result;
+}
+
+/**
+ * @brief      Makes a syscall through sysenter
+ * @ingroup    SYSCALL
+ */
+uint32_t syscall_fast(uint32_t number, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+	uint32_t result;
+	asm volatile("call sysenter_call" : "=a" (result) : "a" (number), "b" (arg1), "c" (arg2), "d" (arg3) : "memory");
+	return result;
+}
+
 // eax = 0
 // ebx = address of paging structure
 int sys_insert_task(PAGE_STRUCT *paging_struct) {
     register uint32_t *eax asm("eax");
     register uint32_t *ebx asm("ebx");
-    eax = 0;
+    eax = SYS_INSERT_TASK;
     ebx = paging_struct;
-    __asm__("int $33");
+    __asm__("int $0x80");
 }
 
 // eax = 1
 int sys_fork(PAGE_STRUCT *paging_struct) {
 	register uint32_t *eax asm("eax");
     register uint32_t *ebx asm("ebx");
-    register uint32_t *ecx asm("ecx");
-    ecx = __builtin_return_address(0);
     ebx = paging_struct;
-    eax = 1;
-    __asm__("int $33");
+    eax = SYS_FORK;
+    __asm__("int $0x80");
 }
 
 int sys_stp() {
-    __asm__("int $33");
-}
\ No newline at end of file
+    __asm__("int $0x80");
+}
+
+static uint32_t sys_null(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+	UNUSED(arg1);
+	UNUSED(arg2);
+	UNUSED(arg3);
+	UNUSED(arg4);
+	UNUSED(arg5);
+	return 0;
+}
+
+static uint32_t sys_futex_wait(uint32_t address, uint32_t expected, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+	UNUSED(arg3);
+	UNUSED(arg4);
+	UNUSED(arg5);
+	return futex_wait((uint32_t*)address, expected);
+}
+
+static uint32_t sys_futex_wake(uint32_t address, uint32_t count, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+	UNUSED(arg3);
+	UNUSED(arg4);
+	UNUSED(arg5);
+	return futex_wake((uint32_t*)address, count);
+}
+
+static uint8_t caller_maps_kernel() {
+	PAGE_STRUCT *pages = get_current_task()->assoc_paging_struc;
+	return pages != NULL && pages->maps_kernel;
+}
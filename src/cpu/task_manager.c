@@ -4,46 +4,353 @@
 #include "filesystem/filesystem.h"
 #include "libc/vstddef.h"
 #include "cpu/task_manager.h"
+#include "cpu/fpu.h"
+#include "cpu/smp.h"
+#include "cpu/spinlock.h"
+#include "cpu/timer.h"
+#include "cpu/gdt.h"
+#include "cpu/irqsoff.h"
+#include "libc/function.h"
 #include <stddef.h>
 #include <stdatomic.h>
 
-TASK tasks[256];
-uint8_t num_tasks = 0;
-uint8_t cur_task = 0;
+TASK tasks[MAX_TASKS];
+uint32_t num_tasks = 0; // Slots ever handed out; freed slots below it are reused first
+static spinlock_t task_table_lock = SPINLOCK_INIT;
+
+extern void switch_to(uint32_t *prev_esp, uint32_t next_esp);
+extern void fork_start();
+extern void kthread_start();
+
+static TASK *allocate_task();
+static void context_switch(TASK *next);
+static TASK *pick_next_task(struct cpu *cpu);
+static TASK *run_queue_steal(struct run_queue *queue);
+static TASK *steal_task(struct cpu *thief);
 
 // create a current task from the current page tables and cpu state
 void insert_task(registers_t* regs) {
-	tasks[num_tasks].regs = *regs;
-	tasks[num_tasks].assoc_paging_struc = regs->ebx;
-	cur_task = num_tasks;
-	num_tasks++;
+	TASK *task = allocate_task();
+	task->assoc_paging_struc = regs->ebx;
+	task->fpu_state = NULL;
+	this_cpu()->current = task;
+	regs->eax = task - tasks;
 }
 
+// Round robin on this cpu's run queue; an empty queue steals from the busiest other cpu
 void switch_task(registers_t* regs) {
 	if(num_tasks == 0) return;
 
-	tasks[cur_task % num_tasks].regs = *regs;
-	cur_task++;
-	*regs = tasks[cur_task % num_tasks].regs;
-	regs->cr3 = &(tasks[cur_task % num_tasks].assoc_paging_struc->page_directory);
+	struct cpu *cpu = this_cpu();
+	if(cpu->preempt_count) {
+		cpu->need_resched = 1;
+		return;
+	}
+	TASK *next = pick_next_task(cpu);
+	if(next == NULL) return;
+	context_switch(next);
+	UNUSED(regs);
 }
 
+// The child gets a copy of the parent's kernel stack, so both return from the syscall
 void fork(registers_t *regs) {
-	tasks[cur_task % num_tasks].regs = *regs;
+	TASK *parent = get_current_task();
+	TASK *child = allocate_task();
+	if(child == NULL) {
+		regs->eax = -1;
+		return;
+	}
+	uint32_t child_pid = child - tasks;
+
+	uint8_t *parent_bottom = parent->kernel_stack;
+	uint8_t *parent_top = parent_bottom + KERNEL_STACK_SIZE;
+	uint32_t used = parent_top - (uint8_t*)regs;
+	uint32_t delta = child->kernel_stack - parent_bottom;
+	memory_copy((uint8_t*)regs, child->kernel_stack + KERNEL_STACK_SIZE - used, used);
+
+	registers_t *child_regs = (registers_t*)(child->kernel_stack + KERNEL_STACK_SIZE - used);
+	child->assoc_paging_struc = regs->ebx;
+	child_regs->cr3 = &(child->assoc_paging_struc->page_directory);
+	child_regs->eax = child_pid;
+
+	// Saved frame pointers still point into the parent's stack
+	uint32_t *ebp = &child_regs->ebp;
+	while(*ebp >= (uint32_t)parent_bottom && *ebp < (uint32_t)parent_top) {
+		*ebp += delta;
+		ebp = (uint32_t*)*ebp;
+	}
+
+	// Stack as switch_to leaves it: callee-saved registers, then fork_start and its frame pointer
+	uint32_t *sp = (uint32_t*)child_regs;
+	*--sp = (uint32_t)child_regs;
+	*--sp = (uint32_t)fork_start;
+	*--sp = 0; // ebp
+	*--sp = 0; // ebx
+	*--sp = 0; // esi
+	*--sp = 0; // edi
+	child->esp = (uint32_t)sp;
+	fpu_fork(parent, child);
 
-	tasks[num_tasks].regs = *regs;
-	tasks[num_tasks].assoc_paging_struc = regs->ebx;
-	tasks[num_tasks].regs.eax = num_tasks;
-    tasks[num_tasks].regs.eip = regs->ecx;
-    
 	regs->eax = 0;
-	num_tasks++;
+	run_queue_push(&this_cpu()->run_queue, child);
+	timer_reprogram();
+	smp_kick_idle_cpu();
 }
 
 void setup_task_paging(registers_t *regs) {
-	tasks[cur_task % num_tasks].assoc_paging_struc = copy_nonkernel_pages(&kernel_pages);
+	TASK *current = get_current_task();
+	current->assoc_paging_struc = copy_nonkernel_pages(&kernel_pages);
+	// Tasks run on their kernel stacks; this page is kept for a future user mode stack
 	uint8_t* stack_page = get_first_physical_page()*0x1000;
-    map_page(tasks[cur_task % num_tasks].assoc_paging_struc, 0x5fff000, stack_page);
-    tasks[cur_task % num_tasks].regs.esp = 0x5ffffff;
-    tasks[cur_task % num_tasks].regs.ebp = 0x5ffffff;
-}
\ No newline at end of file
+    map_page(current->assoc_paging_struc, 0x5fff000, stack_page);
+    UNUSED(regs);
+}
+
+/**
+ * @brief      Creates a task which runs entry(arg) on its own kernel stack, in the caller's address space
+ *
+ * @param[in]  entry   The entry point. Returning from it exits the task.
+ * @param      arg     The argument
+ * @param[in]  pinned  Whether the task must stay on the calling cpu
+ *
+ * @return     The task, or NULL if the task table is full
+ */
+TASK *kthread_create(void (*entry)(void *), void *arg, uint8_t pinned) {
+	TASK *task = allocate_task();
+	if(task == NULL) return NULL;
+	task->assoc_paging_struc = get_current_task()->assoc_paging_struc;
+	task->fpu_state = NULL;
+	task->pinned = pinned;
+
+	uint32_t *sp = (uint32_t*)task_stack_top(task);
+	*--sp = (uint32_t)arg;
+	*--sp = (uint32_t)entry;
+	*--sp = (uint32_t)kthread_start;
+	*--sp = 0; // ebp
+	*--sp = 0; // ebx
+	*--sp = 0; // esi
+	*--sp = 0; // edi
+	task->esp = (uint32_t)sp;
+
+	run_queue_push(&this_cpu()->run_queue, task);
+	timer_reprogram();
+	if(!pinned) smp_kick_idle_cpu();
+	return task;
+}
+
+/**
+ * @brief      Gives the cpu to the next queued task, if there is one
+ */
+void task_yield() {
+	uint32_t flags = local_irq_save();
+	TASK *next = pick_next_task(this_cpu());
+	if(next != NULL) context_switch(next);
+	local_irq_restore(flags);
+}
+
+/**
+ * @brief      Ends the calling task. Its slot and kernel stack are reused once another task is running.
+ */
+void task_exit() {
+	local_irq_disable();
+	TASK *task = get_current_task();
+	fpu_task_exit(task);
+	task->state = TASK_DEAD;
+
+	struct cpu *cpu = this_cpu();
+	TASK *next = pick_next_task(cpu);
+	context_switch(next != NULL ? next : &cpu->idle);
+	while(1); // Never resumed
+}
+
+/**
+ * @brief      Switches away from the calling task until task_wake makes it runnable again
+ * @note       Call with interrupts disabled, the task's lock held and its state set to TASK_BLOCKED. The lock is
+ *             released once the task is off the cpu; see finish_task_switch.
+ */
+void task_block() {
+	struct cpu *cpu = this_cpu();
+	TASK *next = pick_next_task(cpu);
+	context_switch(next != NULL ? next : &cpu->idle);
+}
+
+/**
+ * @brief      Makes a blocked task runnable. Does nothing if it is not blocked.
+ *
+ * @param      task  The task
+ */
+void task_wake(TASK *task) {
+	uint32_t flags = spin_lock_irqsave(&task->lock);
+	if(task->state == TASK_BLOCKED) {
+		task->state = TASK_RUNNABLE;
+		struct cpu *cpu = task->pinned ? &cpus[task->last_cpu] : this_cpu();
+		run_queue_push(&cpu->run_queue, task);
+		if(task->pinned) smp_kick_cpu(cpu);
+		else             smp_kick_idle_cpu();
+		if(cpu == this_cpu()) timer_reprogram();
+	}
+	spin_unlock_irqrestore(&task->lock, flags);
+}
+
+/**
+ * @brief      Tells whether the caller may block: a task other than the idle loop, with interrupts and preemption on
+ * @return     1 if it may, 0 otherwise
+ */
+uint8_t task_can_block() {
+	uint32_t flags;
+	asm volatile("pushf; pop %0" : "=r" (flags));
+	struct cpu *cpu = this_cpu();
+	return (flags & EFLAGS_IF) && cpu->current != NULL && cpu->current != &cpu->idle && cpu->preempt_count == 0;
+}
+
+/**
+ * @brief      The idle loop of a cpu's boot context. Runs queued tasks, and halts while there are none.
+ */
+void cpu_idle() {
+	while(1) {
+		local_irq_disable();
+		TASK *next = pick_next_task(this_cpu());
+		if(next != NULL) context_switch(next);
+		local_irq_enable_and_halt();
+	}
+}
+
+/**
+ * @brief      Runs on the new task's stack right after a switch. Requeues or frees the task switched away from;
+ *             doing it any earlier would let another cpu pick it up before switch_to saved its stack pointer.
+ */
+void finish_task_switch() {
+	struct cpu *cpu = this_cpu();
+	TASK *prev = cpu->switched_from;
+	cpu->switched_from = NULL;
+	if(prev == NULL || prev == &cpu->idle) return;
+
+	if(prev->state == TASK_DEAD) {
+		spin_lock(&task_table_lock);
+		prev->state = TASK_UNUSED;
+		spin_unlock(&task_table_lock);
+	} else if(prev->state == TASK_BLOCKED) {
+		spin_unlock(&prev->lock);
+	} else {
+		run_queue_push(&cpu->run_queue, prev);
+	}
+}
+
+TASK *get_current_task() {
+	return this_cpu()->current;
+}
+
+uint32_t task_stack_top(TASK *task) {
+	return (uint32_t)task->kernel_stack + KERNEL_STACK_SIZE;
+}
+
+static TASK *allocate_task() {
+	uint32_t flags = spin_lock_irqsave(&task_table_lock);
+	uint32_t i;
+	for(i = 0; i < num_tasks && tasks[i].state != TASK_UNUSED; i++);
+	if(i == MAX_TASKS) {
+		spin_unlock_irqrestore(&task_table_lock, flags);
+		return NULL;
+	}
+	if(i == num_tasks) num_tasks++;
+	TASK *task = &tasks[i];
+	task->state = TASK_RUNNABLE;
+	spin_unlock_irqrestore(&task_table_lock, flags);
+
+	if(task->kernel_stack == NULL) task->kernel_stack = ta_alloc_align(KERNEL_STACK_SIZE, 16);
+	task->pinned = 0;
+	task->irq_depth = 0;
+	spin_init(&task->lock);
+	task->wait_next = NULL;
+	return task;
+}
+
+// Must be called with interrupts off
+static void context_switch(TASK *next) {
+	struct cpu *cpu = this_cpu();
+	TASK *prev = cpu->current;
+	cpu->switched_from = prev;
+	cpu->current = next;
+	cpu->context_switches++;
+	next->last_cpu = cpu->index;
+	prev->irq_depth = cpu->irq_depth;
+	cpu->irq_depth = next->irq_depth;
+	fpu_task_switched(prev, next);
+	timer_start_slice();
+	if(next->kernel_stack != NULL) tss_set_esp0(cpu->index, task_stack_top(next));
+
+	switch_to(&prev->esp, next->esp);
+	finish_task_switch();
+}
+
+static TASK *pick_next_task(struct cpu *cpu) {
+	TASK *next = run_queue_pop(&cpu->run_queue);
+	if(next == NULL) next = steal_task(cpu);
+	return next;
+}
+
+void run_queue_init(struct run_queue *queue) {
+	spin_init(&queue->lock);
+	queue->head = 0;
+	queue->count = 0;
+}
+
+void run_queue_push(struct run_queue *queue, TASK *task) {
+	uint32_t flags = spin_lock_irqsave(&queue->lock);
+	if(queue->count < RUN_QUEUE_SIZE) {
+		queue->tasks[(queue->head + queue->count) % RUN_QUEUE_SIZE] = task;
+		queue->count++;
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+TASK *run_queue_pop(struct run_queue *queue) {
+	TASK *task = NULL;
+	if(queue->count == 0) return NULL;
+	uint32_t flags = spin_lock_irqsave(&queue->lock);
+	if(queue->count > 0) {
+		task = queue->tasks[queue->head];
+		queue->head = (queue->head + 1) % RUN_QUEUE_SIZE;
+		queue->count--;
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return task;
+}
+
+// Takes the unpinned task nearest the tail, closing the gap it leaves
+static TASK *run_queue_steal(struct run_queue *queue) {
+	TASK *task = NULL;
+	uint32_t flags = spin_lock_irqsave(&queue->lock);
+	uint32_t i = queue->count;
+	while(i > 0 && queue->tasks[(queue->head + i - 1) % RUN_QUEUE_SIZE]->pinned) i--;
+	if(i > 0) {
+		task = queue->tasks[(queue->head + i - 1) % RUN_QUEUE_SIZE];
+		for(; i < queue->count; i++) {
+			queue->tasks[(queue->head + i - 1) % RUN_QUEUE_SIZE] = queue->tasks[(queue->head + i) % RUN_QUEUE_SIZE];
+		}
+		queue->count--;
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return task;
+}
+
+// Tries the busiest other cpu first; its tasks may all be pinned, so the rest are tried after it
+static TASK *steal_task(struct cpu *thief) {
+	struct cpu *victim = NULL;
+	uint32_t longest = 0;
+	int i;
+	for(i = 0; i < num_cpus; i++) {
+		if(&cpus[i] == thief || !cpus[i].online) continue;
+		if(cpus[i].run_queue.count > longest) {
+			longest = cpus[i].run_queue.count;
+			victim = &cpus[i];
+		}
+	}
+	if(victim == NULL) return NULL;
+	TASK *task = run_queue_steal(&victim->run_queue);
+	for(i = 0; task == NULL && i < num_cpus; i++) {
+		if(&cpus[i] == thief || &cpus[i] == victim || !cpus[i].online || cpus[i].run_queue.count == 0) continue;
+		task = run_queue_steal(&cpus[i].run_queue);
+	}
+	return task;
+}
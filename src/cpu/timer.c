@@ -3,6 +3,13 @@
  * @ingroup    CPU
  * @brief      This file implements the timer.
  *
+ * @par
+ * The PIT drives a fixed-rate IRQ0 until the local APIC timer has been calibrated. After that the PIT is stopped and
+ * the kernel is tickless: time comes from the TSC, and each CPU's local APIC timer is armed in one-shot mode for the
+ * nearest of the end of its current timeslice (only while other tasks are queued), its earliest wakeup and its next
+ * kernel timer (see timer_wheel.c). A CPU with nothing to switch to and nobody waiting takes no timer interrupts at
+ * all.
+ *
  * @author     Valerie Whitmire
  * @date       2023
  */
@@ -17,8 +24,22 @@
 #include "libc/mem.h"
 
 #include "cpu/task_manager.h"
+#include "cpu/smp.h"
+#include "cpu/apic.h"
+#include "cpu/apic_timer.h"
+#include "cpu/timer_wheel.h"
+#include "cpu/irqsoff.h"
+#include "libc/math.h"
+
+#define TIMESLICE_US 100000
 
 volatile uint32_t tick = 0;
+static uint32_t us_per_tick = 20000;
+static uint8_t tickless = 0;
+
+// Private function definitions
+static void apic_timer_callback(registers_t *regs);
+static void stop_pit();
 
 /**
  * @brief      The callback to be called on timer IRQs
@@ -32,6 +53,7 @@ static void timer_callback(registers_t *regs) {
         tick = 0;
     }
     
+    timer_wheel_tick();
     if(tick % 5 == 0) {
         switch_task(regs);
     }
@@ -45,6 +67,8 @@ static void timer_callback(registers_t *regs) {
  * @param[in]  freq  The frequency of the timer
  */
 void init_timer(uint32_t freq) {
+    us_per_tick = 1000000 / freq;
+
     /* Install the function we just wrote */
     register_interrupt_handler(IRQ0, timer_callback);
 
@@ -56,13 +80,122 @@ void init_timer(uint32_t freq) {
     port_byte_out(0x43, 0x36); /* Command port */
     port_byte_out(0x40, low);
     port_byte_out(0x40, high);
+
+    if(apic_timer_calibrate()) {
+        register_interrupt_handler(LAPIC_TIMER_VECTOR, apic_timer_callback);
+        stop_pit();
+        tickless = 1;
+    }
+}
+
+/**
+ * @brief      Gets the time since the timer was initialized
+ *
+ * @return     Microseconds
+ */
+uint64_t timer_now_us() {
+    if(tickless) return apic_timer_now_us();
+    return (uint64_t)tick * us_per_tick;
 }
 
+/**
+ * @brief      Gets the number of timer ticks (at the frequency passed to init_timer) since boot
+ *
+ * @return     The ticks
+ */
+uint32_t get_ticks() {
+    if(tickless) return udiv64(timer_now_us(), us_per_tick, NULL);
+    return tick;
+}
+
+/**
+ * @brief      Waits for n_ticks. The CPU halts until its timer fires instead of spinning, when it can.
+ *
+ * @param[in]  n_ticks  The number of ticks
+ */
 void wait_ticks(uint32_t n_ticks) {
-    uint32_t s_tick = tick;
-    while(tick-s_tick < n_ticks) {
-        //kprint(int_to_ascii(n_ticks));
-        //kprint(" ");
-        //kprintn(int_to_ascii(tick-s_tick));
+    uint64_t deadline = timer_now_us() + (uint64_t)n_ticks * us_per_tick;
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r" (flags));
+
+    // A task sleeps on a kernel timer and gives up the cpu; the idle context and interrupt-off callers halt in place
+    if(task_can_block()) {
+        timer_sleep_us((uint64_t)n_ticks * us_per_tick);
+        return;
     }
+
+    while(timer_now_us() < deadline) {
+        if(tickless && (flags & EFLAGS_IF)) {
+            local_irq_disable();
+            timer_request_wakeup(deadline);
+            local_irq_enable_and_halt();
+        }
+    }
+}
+
+/**
+ * @brief      Makes sure the calling CPU's timer fires no later than deadline
+ *
+ * @param[in]  deadline  The deadline, in microseconds on the timer_now_us clock
+ */
+void timer_request_wakeup(uint64_t deadline) {
+    if(!tickless) return;
+    struct cpu *cpu = this_cpu();
+    if(cpu->wakeup_deadline == 0 || deadline < cpu->wakeup_deadline) cpu->wakeup_deadline = deadline;
+    timer_reprogram();
+}
+
+/**
+ * @brief      Starts a new timeslice for the task the calling CPU just switched to
+ */
+void timer_start_slice() {
+    if(!tickless) return;
+    this_cpu()->slice_end = timer_now_us() + TIMESLICE_US;
+    timer_reprogram();
+}
+
+/**
+ * @brief      Arms the calling CPU's local APIC timer for its next deadline, or stops it if there is none
+ */
+void timer_reprogram() {
+    if(!tickless) return;
+    struct cpu *cpu = this_cpu();
+    uint64_t deadline = cpu->wakeup_deadline;
+
+    // A timeslice only needs to end if something else is waiting to run here
+    if(cpu->run_queue.count > 0) {
+        if(cpu->slice_end == 0) cpu->slice_end = timer_now_us() + TIMESLICE_US;
+        if(deadline == 0 || cpu->slice_end < deadline) deadline = cpu->slice_end;
+    }
+
+    uint64_t timers = timer_wheel_next_us();
+    if(timers != 0 && (deadline == 0 || timers < deadline)) deadline = timers;
+
+    apic_timer_set_deadline(deadline);
+}
+
+/**
+ * @brief      The callback to be called on local APIC timer interrupts
+ *
+ * @param      regs  The registers state
+ */
+static void apic_timer_callback(registers_t *regs) {
+    struct cpu *cpu = this_cpu();
+    uint64_t now = timer_now_us();
+
+    if(cpu->wakeup_deadline != 0 && now >= cpu->wakeup_deadline) cpu->wakeup_deadline = 0;
+    timer_wheel_tick();
+    if(cpu->slice_end != 0 && now >= cpu->slice_end) {
+        cpu->slice_end = 0;
+        switch_task(regs);
+    }
+
+    timer_reprogram();
+}
+
+/**
+ * @brief      Masks IRQ0 so the PIT no longer interrupts
+ */
+static void stop_pit() {
+    irq_disable(0);
 }
\ No newline at end of file
@@ -0,0 +1,313 @@
+/**
+ * @defgroup   TIMER_WHEEL timer_wheel
+ * @ingroup    CPU
+ * @brief      This file implements kernel timers: callbacks at a future time, for sleeps, timeouts and periodic jobs.
+ *
+ * @par
+ * Each CPU has a hashed hierarchical timing wheel. timer_add files a timer in the slot of the level whose range
+ * covers its delay, and timer_cancel unlinks it; both are O(1). When the wheel reaches a higher level slot, its
+ * timers are re-filed one level down, so each timer is touched at most once per level. A bitmap of occupied slots
+ * per level lets the wheel skip straight to its next event, so an idle wheel costs nothing per tick and the
+ * tickless timer only needs to fire when something is actually due.
+ *
+ * @par
+ * The timer interrupt only checks whether anything is due (timer_wheel_tick). Expired callbacks run as deferred
+ * work with interrupts enabled, on the CPU the timer was added on.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/timer_wheel.h"
+#include "cpu/timer.h"
+#include "cpu/smp.h"
+#include "cpu/softirq.h"
+#include "cpu/irqsoff.h"
+#include "cpu/task_manager.h"
+#include "libc/math.h"
+#include "libc/mem.h"
+#include "libc/function.h"
+
+#define SLOT_MASK  (TIMER_WHEEL_SLOTS - 1)
+#define NO_EVENT   0xFFFFFFFFFFFFFFFFULL
+#define MAX_DELTA  ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// Private function definitions
+static uint64_t current_tick();
+static uint64_t us_to_ticks(uint64_t us);
+static void wheel_insert(struct timer_wheel *wheel, struct timer *timer);
+static void wheel_remove(struct timer_wheel *wheel, struct timer *timer);
+static void cascade(struct timer_wheel *wheel, uint64_t tick);
+static uint64_t next_event(struct timer_wheel *wheel);
+static int next_occupied(uint64_t bits, uint32_t from);
+static void timer_wheel_run(uint32_t unused);
+static void sleep_expired(void *data);
+
+/**
+ * @brief      Initializes an empty timer wheel
+ * @ingroup    TIMER_WHEEL
+ * @param      wheel  The wheel
+ */
+void timer_wheel_init(struct timer_wheel *wheel) {
+    memory_set((uint8_t*)wheel, 0, sizeof(struct timer_wheel));
+    spin_init(&wheel->lock);
+    wheel->now = current_tick();
+}
+
+/**
+ * @brief      Initializes a timer which is not pending
+ * @ingroup    TIMER_WHEEL
+ * @param      timer  The timer
+ * @param[in]  fn     The callback
+ * @param      data   The callback's argument
+ */
+void timer_init(struct timer *timer, void (*fn)(void *data), void *data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->fn = fn;
+    timer->data = data;
+    timer->period = 0;
+    timer->wheel = NULL;
+}
+
+/**
+ * @brief      Arms a timer to fire once, after at least delay_us. Re-arms it if it was already pending.
+ * @ingroup    TIMER_WHEEL
+ * @param      timer     The timer
+ * @param[in]  delay_us  The delay in microseconds
+ */
+void timer_add(struct timer *timer, uint64_t delay_us) {
+    timer_cancel(timer);
+    struct timer_wheel *wheel = &this_cpu()->timers;
+
+    uint32_t flags = spin_lock_irqsave(&wheel->lock);
+    timer->period = 0;
+    timer->expires = current_tick() + us_to_ticks(delay_us);
+    wheel_insert(wheel, timer);
+    spin_unlock_irqrestore(&wheel->lock, flags);
+    timer_reprogram();
+}
+
+/**
+ * @brief      Arms a timer to fire every period_us, starting one period from now
+ * @ingroup    TIMER_WHEEL
+ * @param      timer      The timer
+ * @param[in]  period_us  The period in microseconds
+ */
+void timer_add_periodic(struct timer *timer, uint64_t period_us) {
+    timer_cancel(timer);
+    struct timer_wheel *wheel = &this_cpu()->timers;
+
+    uint32_t flags = spin_lock_irqsave(&wheel->lock);
+    timer->period = us_to_ticks(period_us);
+    if(timer->period == 0) timer->period = 1;
+    timer->expires = current_tick() + timer->period;
+    wheel_insert(wheel, timer);
+    spin_unlock_irqrestore(&wheel->lock, flags);
+    timer_reprogram();
+}
+
+/**
+ * @brief      Disarms a timer. A callback which has already started is not waited for.
+ * @ingroup    TIMER_WHEEL
+ * @param      timer  The timer
+ * @return     1 if the timer was pending, 0 otherwise
+ */
+uint8_t timer_cancel(struct timer *timer) {
+    struct timer_wheel *wheel = timer->wheel;
+    if(wheel == NULL) return 0;
+
+    uint32_t flags = spin_lock_irqsave(&wheel->lock);
+    uint8_t pending = timer->wheel == wheel;
+    if(pending) wheel_remove(wheel, timer);
+    spin_unlock_irqrestore(&wheel->lock, flags);
+    return pending;
+}
+
+/**
+ * @brief      Blocks the calling task for at least us microseconds
+ * @ingroup    TIMER_WHEEL
+ * @param[in]  us    The time to sleep
+ */
+void timer_sleep_us(uint64_t us) {
+    TASK *task = get_current_task();
+    struct timer timer;
+    timer_init(&timer, sleep_expired, task);
+
+    uint32_t flags = spin_lock_irqsave(&task->lock);
+    task->state = TASK_BLOCKED;
+    timer_add(&timer, us);
+    task_block();
+    local_irq_restore(flags);
+
+    // Woken by someone else first
+    timer_cancel(&timer);
+}
+
+/**
+ * @brief      Called from the timer interrupt. Queues the expired timers' callbacks, if there are any.
+ * @ingroup    TIMER_WHEEL
+ */
+void timer_wheel_tick() {
+    struct timer_wheel *wheel = &this_cpu()->timers;
+    if(wheel->pending == 0) return;
+
+    spin_lock(&wheel->lock);
+    uint64_t next = next_event(wheel);
+    spin_unlock(&wheel->lock);
+    if(next <= current_tick()) softirq_raise(timer_wheel_run, 0);
+}
+
+/**
+ * @brief      Gets when the calling CPU's wheel next needs to run
+ * @ingroup    TIMER_WHEEL
+ * @return     The time on the timer_now_us clock, or 0 if no timer is pending
+ */
+uint64_t timer_wheel_next_us() {
+    struct timer_wheel *wheel = &this_cpu()->timers;
+    if(wheel->pending == 0) return 0;
+
+    uint32_t flags = spin_lock_irqsave(&wheel->lock);
+    uint64_t next = next_event(wheel);
+    spin_unlock_irqrestore(&wheel->lock, flags);
+    if(next == NO_EVENT) return 0;
+    return next * TIMER_WHEEL_TICK_US;
+}
+
+/**
+ * @brief      Runs every timer that has expired on the calling CPU. Deferred work raised by timer_wheel_tick.
+ * @ingroup    TIMER_WHEEL
+ */
+static void timer_wheel_run(uint32_t unused) {
+    struct timer_wheel *wheel = &this_cpu()->timers;
+    uint64_t target = current_tick();
+
+    uint32_t flags = spin_lock_irqsave(&wheel->lock);
+    while(1) {
+        uint64_t tick = next_event(wheel);
+        if(tick == NO_EVENT || tick > target) break;
+
+        cascade(wheel, tick);
+        wheel->now = tick + 1; // Timers added by the callbacks go after this tick
+
+        // Anything added to this slot meanwhile is a full turn away; only take what is due
+        struct timer **link = &wheel->slots[0][tick & SLOT_MASK];
+        while(*link != NULL) {
+            struct timer *timer = *link;
+            if(timer->expires > tick) {
+                link = &timer->next;
+                continue;
+            }
+
+            wheel_remove(wheel, timer);
+            if(timer->period) {
+                timer->expires = tick + timer->period;
+                wheel_insert(wheel, timer);
+            }
+            void (*fn)(void *data) = timer->fn;
+            void *data = timer->data;
+
+            spin_unlock_irqrestore(&wheel->lock, flags);
+            fn(data);
+            flags = spin_lock_irqsave(&wheel->lock);
+            link = &wheel->slots[0][tick & SLOT_MASK];
+        }
+    }
+    if(wheel->now <= target) wheel->now = target + 1;
+    spin_unlock_irqrestore(&wheel->lock, flags);
+
+    timer_reprogram();
+    UNUSED(unused);
+}
+
+static uint64_t current_tick() {
+    return udiv64(timer_now_us(), TIMER_WHEEL_TICK_US, NULL);
+}
+
+// Rounded up, so that a timer never fires early
+static uint64_t us_to_ticks(uint64_t us) {
+    return udiv64(us + TIMER_WHEEL_TICK_US - 1, TIMER_WHEEL_TICK_US, NULL);
+}
+
+static void wheel_insert(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if(expires < wheel->now) expires = wheel->now;
+    uint64_t delta = expires - wheel->now;
+    if(delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel->now + MAX_DELTA;
+    }
+
+    uint8_t level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) level++;
+    uint8_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+
+    struct timer **head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if(*head != NULL) (*head)->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->wheel = wheel;
+    wheel->occupied[level] |= 1ULL << slot;
+    wheel->pending++;
+}
+
+static void wheel_remove(struct timer_wheel *wheel, struct timer *timer) {
+    *timer->pprev = timer->next;
+    if(timer->next != NULL) timer->next->pprev = timer->pprev;
+    if(wheel->slots[timer->level][timer->slot] == NULL) wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->wheel = NULL;
+    wheel->pending--;
+}
+
+// Re-files the higher level slots that start at this tick one level down
+static void cascade(struct timer_wheel *wheel, uint64_t tick) {
+    wheel->now = tick;
+    uint8_t level;
+    for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if(tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) break;
+
+        uint8_t slot = (tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+        while(wheel->slots[level][slot] != NULL) {
+            struct timer *timer = wheel->slots[level][slot];
+            wheel_remove(wheel, timer);
+            wheel_insert(wheel, timer);
+        }
+    }
+}
+
+// The earliest tick at which a level 0 slot falls due or a higher level slot must be cascaded
+static uint64_t next_event(struct timer_wheel *wheel) {
+    uint64_t next = NO_EVENT;
+    if(wheel->pending == 0) return next;
+
+    int k = next_occupied(wheel->occupied[0], wheel->now & SLOT_MASK);
+    if(k >= 0) next = wheel->now + k;
+
+    uint8_t level;
+    for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t block = wheel->now >> (TIMER_WHEEL_BITS * level);
+        k = next_occupied(wheel->occupied[level], (block + 1) & SLOT_MASK);
+        if(k < 0) continue;
+        uint64_t tick = (block + 1 + k) << (TIMER_WHEEL_BITS * level);
+        if(tick < next) next = tick;
+    }
+    return next;
+}
+
+// The smallest k such that bit (from + k) % 64 is set, or -1
+static int next_occupied(uint64_t bits, uint32_t from) {
+    if(bits == 0) return -1;
+    uint64_t rotated = from ? (bits >> from) | (bits << (TIMER_WHEEL_SLOTS - from)) : bits;
+    uint32_t low = (uint32_t)rotated;
+    if(low) return __builtin_ctz(low);
+    return 32 + __builtin_ctz((uint32_t)(rotated >> 32));
+}
+
+static void sleep_expired(void *data) {
+    task_wake((TASK*)data);
+}
@@ -0,0 +1,94 @@
+/**
+ * @defgroup   WAIT_QUEUE wait_queue
+ * @ingroup    CPU
+ * @brief      This file implements wait queues, which let tasks block until an event instead of spinning.
+ *
+ * @par
+ * A sleeper takes the queue's lock with spin_lock_irqsave, checks its condition, and calls wait_queue_sleep_locked
+ * if it has to wait. A waker changes the condition under the same lock and wakes sleepers, so no wakeup can fall
+ * between the check and the sleep. Keys let several conditions share one queue.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+#include "cpu/irqsoff.h"
+
+/**
+ * @brief      Initializes an empty wait queue
+ * @ingroup    WAIT_QUEUE
+ * @param      queue  The queue
+ */
+void wait_queue_init(struct wait_queue *queue) {
+    spin_init(&queue->lock);
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+/**
+ * @brief      Blocks the calling task on a queue until it is woken
+ * @ingroup    WAIT_QUEUE
+ * @note       Call with queue->lock taken by spin_lock_irqsave; returns with it released and the flags restored.
+ *
+ * @param      queue  The queue
+ * @param[in]  key    What the task waits for; wakers pass it, or WAIT_KEY_ANY, to wake it
+ * @param[in]  flags  The flags spin_lock_irqsave returned
+ */
+void wait_queue_sleep_locked(struct wait_queue *queue, uint32_t key, uint32_t flags) {
+    TASK *task = get_current_task();
+    task->wait_key = key;
+    task->wait_next = NULL;
+    if(queue->tail != NULL) queue->tail->wait_next = task;
+    else                    queue->head = task;
+    queue->tail = task;
+
+    spin_lock(&task->lock);
+    task->state = TASK_BLOCKED;
+    spin_unlock(&queue->lock);
+    task_block();
+    local_irq_restore(flags);
+}
+
+/**
+ * @brief      Wakes tasks waiting on a queue
+ * @ingroup    WAIT_QUEUE
+ * @note       Call with queue->lock held.
+ *
+ * @param      queue  The queue
+ * @param[in]  key    Only wake tasks waiting for this key, or any task if WAIT_KEY_ANY
+ * @param[in]  count  The most tasks to wake
+ *
+ * @return     The number of tasks woken
+ */
+uint32_t wait_queue_wake_locked(struct wait_queue *queue, uint32_t key, uint32_t count) {
+    uint32_t woken = 0;
+    TASK *prev = NULL;
+    TASK *task = queue->head;
+    while(task != NULL && woken < count) {
+        TASK *next = task->wait_next;
+        if(key == WAIT_KEY_ANY || task->wait_key == key) {
+            if(prev != NULL) prev->wait_next = next;
+            else             queue->head = next;
+            if(queue->tail == task) queue->tail = prev;
+            task->wait_next = NULL;
+            task_wake(task);
+            woken++;
+        } else {
+            prev = task;
+        }
+        task = next;
+    }
+    return woken;
+}
+
+/**
+ * @brief      Takes the queue's lock and wakes tasks waiting on it
+ * @ingroup    WAIT_QUEUE
+ * @see        wait_queue_wake_locked
+ */
+uint32_t wait_queue_wake(struct wait_queue *queue, uint32_t key, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&queue->lock);
+    uint32_t woken = wait_queue_wake_locked(queue, key, count);
+    spin_unlock_irqrestore(&queue->lock, flags);
+    return woken;
+}
@@ -0,0 +1,798 @@
+/**
+ * @defgroup   AHCI ahci
+ * @ingroup    DRIVERS
+ * @brief      This file implements a driver for SATA disks behind an AHCI controller, such as QEMU's ich9-ahci.
+ *
+ * @par
+ * Each port with a disk gets a command list of up to 32 slots, a receive area for the FISes the disk sends back,
+ * and a command table per slot holding the command FIS and a scatter-gather list (PRDT). Disks that support native
+ * command queuing get READ/WRITE FPDMA QUEUED, tagged with their slot, so they can reorder up to 32 commands;
+ * others get READ/WRITE DMA EXT, which the controller runs one after another.
+ *
+ * @par
+ * Every disk is registered as block device "sata0", "sata1" and so on, with submit and reap ops, so its disk queue
+ * keeps all but one slot busy. Non-queued commands (IDENTIFY, FLUSH CACHE) may not run beside queued ones: they
+ * wait for the port to empty and hold it while they run.
+ *
+ * @par
+ * The interrupt handler collects finished commands and kicks the queues. A timer does the same every AHCI_POLL_US
+ * in case an interrupt was missed, and stops a port whose commands take longer than AHCI_TIMEOUT_US. After an
+ * error every command in flight on the port is failed; the disk queue's callers see the error. Restarting the port
+ * busy-waits for the controller, so neither does it: the dispatcher does, from reap, or a caller that is polling the
+ * port anyway. Commands issued in the meantime are held back and issued once the port runs again.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/ahci.h"
+#include "drivers/block_device.h"
+#include "drivers/disk_queue.h"
+#include "drivers/ata.h"
+#include "drivers/pci.h"
+#include "cpu/isr.h"
+#include "cpu/timer.h"
+#include "cpu/timer_wheel.h"
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+#include "libc/function.h"
+#include "libc/mem.h"
+
+/* Generic host control registers */
+#define HBA_CAP  0x00
+#define HBA_GHC  0x04
+#define HBA_IS   0x08 // Bit n set: port n has an interrupt pending
+#define HBA_PI   0x0C // Bit n set: port n is implemented
+
+#define CAP_NCQ              (1u << 30)
+#define GHC_INTERRUPT_ENABLE (1u << 1)
+#define GHC_AHCI_ENABLE      (1u << 31)
+
+/* Port registers, at PORT_BASE + n * PORT_SIZE */
+#define PORT_BASE 0x100
+#define PORT_SIZE 0x80
+#define PORT_CLB  0x00 // Command list base
+#define PORT_CLBU 0x04
+#define PORT_FB   0x08 // FIS receive area base
+#define PORT_FBU  0x0C
+#define PORT_IS   0x10
+#define PORT_IE   0x14
+#define PORT_CMD  0x18
+#define PORT_TFD  0x20 // The disk's status in bits 0-7, its error register in bits 8-15
+#define PORT_SIG  0x24
+#define PORT_SSTS 0x28
+#define PORT_SERR 0x30
+#define PORT_SACT 0x34 // Bit n set: queued command n is outstanding
+#define PORT_CI   0x38 // Bit n set: command n has been issued and not completed
+
+#define CMD_START        (1u << 0)
+#define CMD_FIS_RECEIVE  (1u << 4)
+#define CMD_FIS_RUNNING  (1u << 14)
+#define CMD_LIST_RUNNING (1u << 15)
+
+#define IS_D2H_FIS       (1u << 0)
+#define IS_PIO_SETUP     (1u << 1)
+#define IS_DMA_SETUP     (1u << 2)
+#define IS_SET_DEVICE_BITS (1u << 3) // Sent when queued commands complete
+#define IS_INTERFACE     (1u << 27)
+#define IS_HOST_DATA     (1u << 28)
+#define IS_HOST_BUS      (1u << 29)
+#define IS_TASK_FILE     (1u << 30) // The disk reported an error
+#define IS_ERRORS        (IS_INTERFACE | IS_HOST_DATA | IS_HOST_BUS | IS_TASK_FILE)
+#define IE_WANTED        (IS_D2H_FIS | IS_PIO_SETUP | IS_DMA_SETUP | IS_SET_DEVICE_BITS | IS_ERRORS)
+
+#define SSTS_DET_PRESENT 0x3 // A device is attached and communication is established
+#define SSTS_IPM_ACTIVE  0x1
+#define SIG_ATA          0x00000101
+
+#define TFD_BSY   0x80
+#define TFD_DRQ   0x08
+#define ERROR_ABRT 0x04
+#define ERROR_IDNF 0x10
+#define ERROR_UNC  0x40
+#define ERROR_BBK  0x80
+
+#define FIS_TYPE_H2D     0x27
+#define FIS_COMMAND      0x80 // The FIS carries a command rather than a control update
+#define FIS_DEVICE_LBA   0x40
+
+#define ATA_READ_DMA_EXT      0x25
+#define ATA_WRITE_DMA_EXT     0x35
+#define ATA_READ_FPDMA_QUEUED  0x60
+#define ATA_WRITE_FPDMA_QUEUED 0x61
+#define ATA_FLUSH_CACHE_EXT   0xEA
+#define ATA_IDENTIFY          0xEC
+
+#define IDENTIFY_QUEUE_DEPTH   75
+#define IDENTIFY_SATA_CAPS     76
+#define IDENTIFY_COMMAND_SETS  83
+#define IDENTIFY_LBA48_SECTORS 100
+#define SATA_CAP_NCQ      0x100
+#define COMMAND_SET_LBA48 0x400
+
+#define HEADER_FIS_DWORDS 5   // A host-to-device FIS is 20 bytes
+#define HEADER_WRITE      0x40
+
+#define AHCI_DMA_LIMIT    0x4fff000 // Memory below this is identity mapped in every address space
+#define PORT_STOP_US      500000
+#define PORT_FAILED       1
+#define PORT_RESTARTING   2
+#define WAKE_ALL          0xFFFFFFFF
+
+/* An entry of the command list */
+struct command_header {
+    uint16_t flags;           // FIS length in dwords, direction and the like
+    uint16_t prdt_length;     // Entries in the command table's PRDT
+    volatile uint32_t prd_byte_count;
+    uint32_t table_low;       // 128-byte aligned
+    uint32_t table_high;
+    uint32_t reserved[4];
+} __attribute__((packed));
+
+/* A physical region descriptor: one contiguous piece of the command's data */
+struct prdt_entry {
+    uint32_t address_low;     // Word aligned
+    uint32_t address_high;
+    uint32_t reserved;
+    uint32_t byte_count;      // Less one, in bits 0-21
+} __attribute__((packed));
+
+struct command_table {
+    uint8_t fis[64];
+    uint8_t atapi[16];
+    uint8_t reserved[48];
+    struct prdt_entry prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed));
+
+/* What the driver knows about a slot's command */
+struct ahci_command {
+    struct disk_request *batch[DISK_QUEUE_MERGE_MAX]; // The disk queue's requests; none for synchronous commands
+    uint32_t count;
+    uint8_t *bounce;          // Holds the data when the callers' buffers could not be handed to the controller
+    uint8_t sync;             // A synchronous caller waits for it. Otherwise reap finishes it.
+    uint8_t exclusive;        // Not queued: nothing else may run beside it
+    uint8_t queued;           // Tagged with its slot in SACT
+    volatile uint8_t done;
+    int result;
+    uint64_t deadline;
+};
+
+struct ahci_port {
+    struct block_device device;
+    volatile uint32_t *regs;
+    struct command_header *headers;
+    struct command_table *tables;
+    uint8_t *fis;
+    uint32_t slots;           // Slots the driver uses: the controller's, or fewer if the disk queues fewer
+    uint8_t ncq;
+    uint64_t sectors;
+    uint32_t busy;            // Slots handed out
+    uint32_t active;          // Slots issued and not yet collected
+    uint32_t finished;        // Slots collected and not yet handed back
+    uint8_t exclusive;        // A non-queued command waits for the port, or holds it
+    uint8_t stopped;          // PORT_FAILED after an error, PORT_RESTARTING while port_restart runs
+    struct wait_queue wait;   // Its lock guards the fields above and the commands
+    struct ahci_command commands[AHCI_MAX_SLOTS];
+};
+
+static volatile uint32_t *hba;
+static struct ahci_port *ports[AHCI_MAX_PORTS];
+static uint32_t disks_found = 0;
+static struct timer poll_timer;
+
+// Private function definitions
+static void init_port(uint32_t number, uint32_t slots, uint8_t ncq);
+static void port_stop(struct ahci_port *port);
+static void port_start(struct ahci_port *port);
+static void port_restart(struct ahci_port *port);
+static int get_slot(struct ahci_port *port, uint8_t sync, uint8_t exclusive);
+static void put_slot(struct ahci_port *port, uint32_t slot);
+static void fill_prd(struct ahci_port *port, uint32_t slot, uint32_t index, uint8_t *buffer, uint32_t bytes);
+static void issue(struct ahci_port *port, uint32_t slot, uint8_t command, uint64_t LBA, uint32_t sectors,
+                  uint32_t prds, uint8_t write);
+static int wait_command(struct ahci_port *port, uint32_t slot);
+static uint32_t collect(struct ahci_port *port);
+static int decode_error(struct ahci_port *port, uint32_t status);
+static uint8_t dma_usable(uint32_t address, uint32_t bytes);
+static int sync_command(struct ahci_port *port, uint8_t command, uint64_t LBA, uint32_t sectors, uint8_t *buffer,
+                        uint32_t bytes, uint8_t write, uint8_t exclusive);
+static int sync_transfer(struct ahci_port *port, uint32_t address, uint32_t LBA, uint32_t sector_count, uint8_t write);
+static uint8_t transfer_command(struct ahci_port *port, uint8_t write);
+static void ahci_interrupt(registers_t *regs);
+static void ahci_poll(void *data);
+static int ahci_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int ahci_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int ahci_flush(struct block_device *device);
+static uint64_t ahci_capacity(struct block_device *device);
+static uint32_t ahci_optimal_sectors(struct block_device *device);
+static int ahci_submit(struct block_device *device, struct disk_request **batch, uint32_t count);
+static void ahci_reap(struct block_device *device);
+
+static const struct block_device_ops ahci_ops = {
+    .read = ahci_read,
+    .write = ahci_write,
+    .flush = ahci_flush,
+    .capacity = ahci_capacity,
+    .optimal_sectors = ahci_optimal_sectors,
+    .submit = ahci_submit,
+    .reap = ahci_reap
+};
+
+/**
+ * @brief      Finds the first AHCI controller on the PCI bus, and sets up and registers every SATA disk on it
+ * @ingroup    AHCI
+ */
+void init_ahci() {
+    struct pci_device pci;
+    if(!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, &pci) || pci.prog_if != PCI_PROG_IF_AHCI) return;
+    uint32_t bar5 = pci_config_read(&pci, PCI_BAR5);
+    if((bar5 & PCI_BAR_IO) || (bar5 & ~0xF) == 0) return;
+    pci_enable(&pci, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+    hba = (volatile uint32_t *)(bar5 & ~0xF);
+
+    hba[HBA_GHC / 4] |= GHC_AHCI_ENABLE;
+    uint32_t cap = hba[HBA_CAP / 4];
+    uint32_t implemented = hba[HBA_PI / 4];
+    uint32_t i;
+    for(i = 0; i < AHCI_MAX_PORTS; i++) {
+        if(implemented & (1u << i)) init_port(i, ((cap >> 8) & 0x1F) + 1, (cap & CAP_NCQ) != 0);
+    }
+    if(disks_found == 0) return;
+
+    // Shared with whatever else is on the line; refused only if a driver owns it outright, and then ahci_poll copes
+    if(pci.irq_line < 16) register_shared_interrupt_handler(IRQ0 + pci.irq_line, ahci_interrupt);
+    hba[HBA_IS / 4] = 0xFFFFFFFF;
+    hba[HBA_GHC / 4] |= GHC_INTERRUPT_ENABLE;
+    timer_init(&poll_timer, ahci_poll, NULL);
+    timer_add_periodic(&poll_timer, AHCI_POLL_US);
+}
+
+/**
+ * @brief      Sets up a port's command list and FIS receive area, and registers its disk, if it has one that
+ *             supports LBA48
+ * @ingroup    AHCI
+ *
+ * @param[in]  number  The port
+ * @param[in]  slots   Command slots the controller has per port
+ * @param[in]  ncq     1 if the controller supports native command queuing
+ */
+static void init_port(uint32_t number, uint32_t slots, uint8_t ncq) {
+    volatile uint32_t *regs = hba + (PORT_BASE + number * PORT_SIZE) / 4;
+    uint32_t status = regs[PORT_SSTS / 4];
+    if((status & 0xF) != SSTS_DET_PRESENT || ((status >> 8) & 0xF) != SSTS_IPM_ACTIVE) return;
+    if(regs[PORT_SIG / 4] != SIG_ATA) return; // ATAPI drives, port multipliers and bridges are not supported
+
+    struct ahci_port *port = ta_alloc(sizeof(struct ahci_port));
+    uint16_t *identify = ta_alloc_align(512, 512);
+    if(port == NULL || identify == NULL) {
+        if(port != NULL) ta_free(port);
+        if(identify != NULL) ta_free(identify);
+        return;
+    }
+    memory_set((uint8_t *)port, 0, sizeof(struct ahci_port));
+    port->headers = ta_alloc_align(sizeof(struct command_header) * AHCI_MAX_SLOTS, 1024);
+    port->tables = ta_alloc_align(sizeof(struct command_table) * AHCI_MAX_SLOTS, 128);
+    port->fis = ta_alloc_align(256, 256);
+    if(port->headers == NULL || port->tables == NULL || port->fis == NULL) goto fail;
+    memory_set((uint8_t *)port->headers, 0, sizeof(struct command_header) * AHCI_MAX_SLOTS);
+    memory_set((uint8_t *)port->tables, 0, sizeof(struct command_table) * AHCI_MAX_SLOTS);
+    memory_set(port->fis, 0, 256);
+    port->regs = regs;
+    port->slots = slots;
+    wait_queue_init(&port->wait);
+
+    port_stop(port);
+    uint32_t i;
+    for(i = 0; i < AHCI_MAX_SLOTS; i++) port->headers[i].table_low = (uint32_t)&port->tables[i];
+    regs[PORT_CLB / 4] = (uint32_t)port->headers;
+    regs[PORT_CLBU / 4] = 0;
+    regs[PORT_FB / 4] = (uint32_t)port->fis;
+    regs[PORT_FBU / 4] = 0;
+    regs[PORT_SERR / 4] = 0xFFFFFFFF;
+    regs[PORT_IS / 4] = 0xFFFFFFFF;
+    port_start(port);
+    regs[PORT_IE / 4] = IE_WANTED;
+
+    if(sync_command(port, ATA_IDENTIFY, 0, 0, (uint8_t *)identify, 512, 0, 1) != ATA_OK) goto fail;
+    if(!(identify[IDENTIFY_COMMAND_SETS] & COMMAND_SET_LBA48)) goto fail;
+    port->sectors = 0;
+    for(i = 0; i < 4; i++) port->sectors |= (uint64_t)identify[IDENTIFY_LBA48_SECTORS + i] << (16 * i);
+    port->ncq = ncq && (identify[IDENTIFY_SATA_CAPS] & SATA_CAP_NCQ);
+    if(port->ncq && (uint32_t)(identify[IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1 < port->slots) {
+        port->slots = (identify[IDENTIFY_QUEUE_DEPTH] & 0x1F) + 1;
+    }
+    ta_free(identify);
+
+    char name[BLOCK_DEVICE_NAME] = "sata";
+    uint32_t disk = disks_found++;
+    i = 4;
+    if(disk >= 10) name[i++] = '0' + disk / 10;
+    name[i++] = '0' + disk % 10;
+    name[i] = '\0';
+
+    ports[number] = port;
+    port->device.queue_depth = port->slots > 1 ? port->slots - 1 : 1;
+    block_device_register(&port->device, name, &ahci_ops, port);
+    return;
+
+fail:
+    if(port->regs != NULL) {
+        regs[PORT_IE / 4] = 0;
+        port_stop(port);
+    }
+    if(port->headers != NULL) ta_free(port->headers);
+    if(port->tables != NULL) ta_free(port->tables);
+    if(port->fis != NULL) ta_free(port->fis);
+    ta_free(port);
+    ta_free(identify);
+}
+
+/**
+ * @brief      Stops a port's command list and FIS receive engines. Every issued command is dropped.
+ * @ingroup    AHCI
+ * @param      port  The port
+ */
+static void port_stop(struct ahci_port *port) {
+    volatile uint32_t *regs = port->regs;
+    uint64_t deadline = timer_now_us() + PORT_STOP_US;
+    regs[PORT_CMD / 4] &= ~CMD_START;
+    while((regs[PORT_CMD / 4] & CMD_LIST_RUNNING) && timer_now_us() < deadline);
+    regs[PORT_CMD / 4] &= ~CMD_FIS_RECEIVE;
+    while((regs[PORT_CMD / 4] & CMD_FIS_RUNNING) && timer_now_us() < deadline);
+}
+
+static void port_start(struct ahci_port *port) {
+    volatile uint32_t *regs = port->regs;
+    uint64_t deadline = timer_now_us() + PORT_STOP_US;
+    while((regs[PORT_TFD / 4] & (TFD_BSY | TFD_DRQ)) && timer_now_us() < deadline);
+    regs[PORT_CMD / 4] |= CMD_FIS_RECEIVE;
+    regs[PORT_CMD / 4] |= CMD_START;
+}
+
+/**
+ * @brief      Restarts a port that collect stopped after an error, then issues the commands held back meanwhile.
+ *             Busy-waits for the controller, so it must not run from the interrupt handler or the poll timer.
+ * @ingroup    AHCI
+ * @param      port  The port
+ */
+static void port_restart(struct ahci_port *port) {
+    uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+    if(port->stopped != PORT_FAILED) {
+        spin_unlock_irqrestore(&port->wait.lock, flags);
+        return;
+    }
+    port->stopped = PORT_RESTARTING;
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+
+    volatile uint32_t *regs = port->regs;
+    port_stop(port);
+    regs[PORT_SERR / 4] = 0xFFFFFFFF;
+    regs[PORT_IS / 4] = 0xFFFFFFFF;
+    port_start(port);
+
+    flags = spin_lock_irqsave(&port->wait.lock);
+    port->stopped = 0;
+    uint64_t deadline = timer_now_us() + AHCI_TIMEOUT_US;
+    uint32_t queued = 0;
+    uint32_t slot;
+    for(slot = 0; slot < port->slots; slot++) {
+        if(!(port->active & (1u << slot))) continue;
+        port->commands[slot].deadline = deadline;
+        if(port->commands[slot].queued) queued |= 1u << slot;
+    }
+    if(port->active) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(queued) regs[PORT_SACT / 4] = queued;
+        regs[PORT_CI / 4] = port->active;
+    }
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+}
+
+static int ahci_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    return sync_transfer(device->private, target_address, LBA, sector_count, 0);
+}
+
+static int ahci_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    return sync_transfer(device->private, (uint32_t)bytes, LBA, sector_count, 1);
+}
+
+static int ahci_flush(struct block_device *device) {
+    return sync_command(device->private, ATA_FLUSH_CACHE_EXT, 0, 0, NULL, 0, 0, 1);
+}
+
+static uint64_t ahci_capacity(struct block_device *device) {
+    struct ahci_port *port = device->private;
+    return port->sectors;
+}
+
+static uint32_t ahci_optimal_sectors(struct block_device *device) {
+    UNUSED(device);
+    return AHCI_OPTIMAL;
+}
+
+/**
+ * @brief      Starts one command for requests from the disk queue, and returns without waiting for it
+ * @ingroup    AHCI
+ *
+ * @param      device  The device
+ * @param      batch   The requests, each continuing the one before it
+ * @param[in]  count   How many there are
+ *
+ * @return     ATA_OK, or an ATA_ERR_* code if the command could not be started
+ */
+static int ahci_submit(struct block_device *device, struct disk_request **batch, uint32_t count) {
+    struct ahci_port *port = device->private;
+    uint32_t i;
+    uint32_t sectors = 0;
+    uint8_t direct = count <= AHCI_PRDT_ENTRIES;
+    for(i = 0; i < count; i++) {
+        if(!dma_usable((uint32_t)batch[i]->buffer, batch[i]->count * 512)) direct = 0;
+        sectors += batch[i]->count;
+    }
+    if((uint64_t)batch[0]->lba + sectors > port->sectors) return ATA_ERR_RANGE;
+
+    int slot = get_slot(port, 0, 0);
+    if(slot < 0) return ATA_ERR_TIMEOUT;
+    struct ahci_command *command = &port->commands[slot];
+    uint8_t write = batch[0]->write;
+    if(direct) {
+        for(i = 0; i < count; i++) fill_prd(port, slot, i, batch[i]->buffer, batch[i]->count * 512);
+    } else {
+        command->bounce = ta_alloc_align(sectors * 512, 512);
+        if(command->bounce == NULL) {
+            put_slot(port, slot);
+            return ATA_ERR_DEVICE;
+        }
+        uint8_t *at = command->bounce;
+        for(i = 0; write && i < count; at += batch[i]->count * 512, i++) memory_copy(batch[i]->buffer, at, batch[i]->count * 512);
+        fill_prd(port, slot, 0, command->bounce, sectors * 512);
+    }
+    for(i = 0; i < count; i++) command->batch[i] = batch[i];
+    command->count = count;
+    issue(port, slot, transfer_command(port, write), batch[0]->lba, sectors, direct ? count : 1, write);
+    return ATA_OK;
+}
+
+/**
+ * @brief      Hands the disk queue's finished commands back to it, and restarts the port after an error. Runs on
+ *             the dispatcher after disk_queue_kick.
+ * @ingroup    AHCI
+ * @param      device  The device
+ */
+static void ahci_reap(struct block_device *device) {
+    struct ahci_port *port = device->private;
+    collect(port);
+    port_restart(port);
+    uint32_t slot;
+    for(slot = 0; slot < port->slots; slot++) {
+        struct ahci_command *command = &port->commands[slot];
+        uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+        uint8_t finished = (port->finished & (1u << slot)) && !command->sync;
+        spin_unlock_irqrestore(&port->wait.lock, flags);
+        if(!finished) continue;
+
+        if(command->result == ATA_OK && command->bounce != NULL && !command->batch[0]->write) {
+            uint8_t *at = command->bounce;
+            uint32_t i;
+            for(i = 0; i < command->count; at += command->batch[i]->count * 512, i++) {
+                memory_copy(at, command->batch[i]->buffer, command->batch[i]->count * 512);
+            }
+        }
+        disk_queue_finish(&device->queue, command->batch, command->count, command->result);
+        put_slot(port, slot);
+    }
+}
+
+/**
+ * @brief      Reads or writes sectors and waits for them, in commands of up to AHCI_OPTIMAL sectors
+ * @ingroup    AHCI
+ *
+ * @param      port          The port
+ * @param[in]  address       The buffer
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ * @param[in]  write         1 to write the buffer to the disk, 0 to read into it
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int sync_transfer(struct ahci_port *port, uint32_t address, uint32_t LBA, uint32_t sector_count, uint8_t write) {
+    if((uint64_t)LBA + sector_count > port->sectors) return ATA_ERR_RANGE;
+    int result = ATA_OK;
+    while(sector_count > 0 && result == ATA_OK) {
+        uint32_t sectors = sector_count < AHCI_OPTIMAL ? sector_count : AHCI_OPTIMAL;
+        result = sync_command(port, transfer_command(port, write), LBA, sectors, (uint8_t *)address, sectors * 512,
+                              write, 0);
+        address += sectors * 512;
+        LBA += sectors;
+        sector_count -= sectors;
+    }
+    return result;
+}
+
+/**
+ * @brief      Runs one command and waits for it
+ * @ingroup    AHCI
+ *
+ * @param      port       The port
+ * @param[in]  command    The ATA command
+ * @param[in]  LBA        Its LBA, if it takes one
+ * @param[in]  sectors    Its sector count, if it takes one
+ * @param      buffer     Its data, or NULL
+ * @param[in]  bytes      The data's length
+ * @param[in]  write      1 if the data goes to the disk
+ * @param[in]  exclusive  1 for commands that cannot be queued beside others
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int sync_command(struct ahci_port *port, uint8_t command, uint64_t LBA, uint32_t sectors, uint8_t *buffer,
+                        uint32_t bytes, uint8_t write, uint8_t exclusive) {
+    int slot = get_slot(port, 1, exclusive);
+    if(slot < 0) return ATA_ERR_TIMEOUT;
+    uint8_t *bounce = NULL;
+    if(bytes > 0 && !dma_usable((uint32_t)buffer, bytes)) {
+        bounce = ta_alloc_align(bytes, 512);
+        if(bounce == NULL) {
+            put_slot(port, slot);
+            return ATA_ERR_DEVICE;
+        }
+        if(write) memory_copy(buffer, bounce, bytes);
+        port->commands[slot].bounce = bounce;
+    }
+    if(bytes > 0) fill_prd(port, slot, 0, bounce != NULL ? bounce : buffer, bytes);
+    issue(port, slot, command, LBA, sectors, bytes > 0 ? 1 : 0, write);
+    int result = wait_command(port, slot);
+    if(result == ATA_OK && !write && bounce != NULL) memory_copy(bounce, buffer, bytes);
+    put_slot(port, slot);
+    return result;
+}
+
+static uint8_t transfer_command(struct ahci_port *port, uint8_t write) {
+    if(port->ncq) return write ? ATA_WRITE_FPDMA_QUEUED : ATA_READ_FPDMA_QUEUED;
+    return write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT;
+}
+
+/**
+ * @brief      Takes a free slot. An exclusive caller also waits for every other command on the port to finish,
+ *             and keeps new ones out until it puts its slot back.
+ * @ingroup    AHCI
+ *
+ * @param      port       The port
+ * @param[in]  sync       1 if the caller will wait for the command itself, 0 if it is the disk queue's
+ * @param[in]  exclusive  1 for a command that cannot be queued beside others
+ *
+ * @return     The slot, or -1 if a caller that cannot sleep waited AHCI_TIMEOUT_US for one
+ */
+static int get_slot(struct ahci_port *port, uint8_t sync, uint8_t exclusive) {
+    uint64_t deadline = timer_now_us() + AHCI_TIMEOUT_US;
+    uint8_t claimed = 0;
+    uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+    while(1) {
+        if(exclusive && !claimed && !port->exclusive) port->exclusive = claimed = 1;
+        uint8_t ready = exclusive ? claimed && (port->busy & ~port->finished) == 0 : !port->exclusive;
+        uint32_t slot;
+        for(slot = 0; ready && slot < port->slots; slot++) {
+            if(port->busy & (1u << slot)) continue;
+            struct ahci_command *command = &port->commands[slot];
+            port->busy |= 1u << slot;
+            command->sync = sync;
+            command->exclusive = exclusive;
+            command->count = 0;
+            command->bounce = NULL;
+            command->done = 0;
+            spin_unlock_irqrestore(&port->wait.lock, flags);
+            return slot;
+        }
+
+        if(task_can_block()) {
+            wait_queue_sleep_locked(&port->wait, (uint32_t)port, flags);
+            flags = spin_lock_irqsave(&port->wait.lock);
+            continue;
+        }
+        spin_unlock_irqrestore(&port->wait.lock, flags);
+        if(collect(port) > 0) disk_queue_kick(&port->device.queue);
+        port_restart(port);
+        flags = spin_lock_irqsave(&port->wait.lock);
+        if(timer_now_us() > deadline) break;
+    }
+    if(claimed) {
+        port->exclusive = 0;
+        wait_queue_wake_locked(&port->wait, (uint32_t)port, WAKE_ALL);
+    }
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+    return -1;
+}
+
+static void put_slot(struct ahci_port *port, uint32_t slot) {
+    struct ahci_command *command = &port->commands[slot];
+    uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+    uint8_t *bounce = command->bounce;
+    command->bounce = NULL;
+    port->busy &= ~(1u << slot);
+    port->finished &= ~(1u << slot);
+    if(command->exclusive) port->exclusive = 0;
+    wait_queue_wake_locked(&port->wait, (uint32_t)port, WAKE_ALL);
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+    if(bounce != NULL) ta_free(bounce);
+}
+
+static void fill_prd(struct ahci_port *port, uint32_t slot, uint32_t index, uint8_t *buffer, uint32_t bytes) {
+    struct prdt_entry *entry = &port->tables[slot].prdt[index];
+    entry->address_low = (uint32_t)buffer;
+    entry->address_high = 0;
+    entry->reserved = 0;
+    entry->byte_count = bytes - 1;
+}
+
+/**
+ * @brief      Builds a slot's command FIS and issues it. Queued reads and writes are tagged with the slot.
+ * @ingroup    AHCI
+ *
+ * @param      port     The port
+ * @param[in]  slot     The slot, with its PRDT filled in
+ * @param[in]  command  The ATA command
+ * @param[in]  LBA      The first sector
+ * @param[in]  sectors  How many sectors
+ * @param[in]  prds     How many PRDT entries the command uses
+ * @param[in]  write    1 if the data goes to the disk
+ */
+static void issue(struct ahci_port *port, uint32_t slot, uint8_t command, uint64_t LBA, uint32_t sectors,
+                  uint32_t prds, uint8_t write) {
+    uint8_t queued = command == ATA_READ_FPDMA_QUEUED || command == ATA_WRITE_FPDMA_QUEUED;
+    uint8_t *fis = port->tables[slot].fis;
+    memory_set(fis, 0, 20);
+    fis[0] = FIS_TYPE_H2D;
+    fis[1] = FIS_COMMAND;
+    fis[2] = command;
+    fis[4] = LBA & 0xFF;
+    fis[5] = (LBA >> 8) & 0xFF;
+    fis[6] = (LBA >> 16) & 0xFF;
+    fis[7] = FIS_DEVICE_LBA;
+    fis[8] = (LBA >> 24) & 0xFF;
+    fis[9] = (LBA >> 32) & 0xFF;
+    fis[10] = (LBA >> 40) & 0xFF;
+    if(queued) {
+        // The sector count moves to the features register; the count register carries the tag
+        fis[3] = sectors & 0xFF;
+        fis[11] = (sectors >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = sectors & 0xFF;
+        fis[13] = (sectors >> 8) & 0xFF;
+    }
+
+    struct command_header *header = &port->headers[slot];
+    header->flags = HEADER_FIS_DWORDS | (write ? HEADER_WRITE : 0);
+    header->prdt_length = prds;
+    header->prd_byte_count = 0;
+
+    uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+    port->commands[slot].deadline = timer_now_us() + AHCI_TIMEOUT_US;
+    port->commands[slot].queued = queued;
+    port->active |= 1u << slot;
+    if(!port->stopped) { // Otherwise port_restart issues it
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // The controller must see the table before the command is issued
+        if(queued) port->regs[PORT_SACT / 4] = 1u << slot;
+        port->regs[PORT_CI / 4] = 1u << slot;
+    }
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+}
+
+/**
+ * @brief      Waits for a synchronous command. Tasks sleep; callers that cannot sleep poll the port.
+ * @ingroup    AHCI
+ * @param      port  The port
+ * @param[in]  slot  The command's slot
+ * @return     ATA_OK or an ATA_ERR_* code; commands that never finish end with ATA_ERR_TIMEOUT
+ */
+static int wait_command(struct ahci_port *port, uint32_t slot) {
+    struct ahci_command *command = &port->commands[slot];
+    if(task_can_block()) {
+        uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+        while(!command->done) {
+            wait_queue_sleep_locked(&port->wait, (uint32_t)&command->done, flags);
+            flags = spin_lock_irqsave(&port->wait.lock);
+        }
+        spin_unlock_irqrestore(&port->wait.lock, flags);
+    } else {
+        while(!command->done) {
+            if(collect(port) > 0) disk_queue_kick(&port->device.queue);
+            port_restart(port);
+        }
+    }
+    return command->result;
+}
+
+/**
+ * @brief      Marks the port's finished commands as done and wakes their synchronous callers. After an error, or
+ *             when a command has run past its deadline, every command in flight fails and the port is left
+ *             stopped for port_restart. Runs from the interrupt handler and the poll timer too, so it never waits.
+ * @ingroup    AHCI
+ * @param      port  The port
+ * @return     How many of the finished commands reap has to hand back, plus one while the port waits for a restart
+ */
+static uint32_t collect(struct ahci_port *port) {
+    uint32_t async = 0;
+    uint32_t flags = spin_lock_irqsave(&port->wait.lock);
+    volatile uint32_t *regs = port->regs;
+    uint32_t status = regs[PORT_IS / 4];
+    regs[PORT_IS / 4] = status;
+    if(port->stopped) { // CI and SACT mean nothing until the port runs again
+        async = port->stopped == PORT_FAILED;
+        spin_unlock_irqrestore(&port->wait.lock, flags);
+        return async;
+    }
+
+    uint32_t completed = port->active & ~(regs[PORT_CI / 4] | regs[PORT_SACT / 4]);
+    uint32_t failed = 0;
+    int error = ATA_OK;
+    if(status & IS_ERRORS) {
+        error = decode_error(port, status);
+    } else {
+        uint64_t now = timer_now_us();
+        uint32_t slot;
+        for(slot = 0; slot < port->slots; slot++) {
+            if((port->active & ~completed & (1u << slot)) && port->commands[slot].deadline < now) error = ATA_ERR_TIMEOUT;
+        }
+    }
+    if(error != ATA_OK) {
+        failed = port->active & ~completed;
+        port->stopped = PORT_FAILED;
+        async++; // So the dispatcher runs reap, which restarts the port
+    }
+
+    uint32_t slot;
+    for(slot = 0; slot < port->slots; slot++) {
+        uint32_t bit = 1u << slot;
+        if(!((completed | failed) & bit)) continue;
+        struct ahci_command *command = &port->commands[slot];
+        port->active &= ~bit;
+        port->finished |= bit;
+        command->result = (failed & bit) ? error : ATA_OK;
+        command->done = 1;
+        if(command->sync) wait_queue_wake_locked(&port->wait, (uint32_t)&command->done, 1);
+        else async++;
+    }
+    if(completed | failed) wait_queue_wake_locked(&port->wait, (uint32_t)port, WAKE_ALL);
+    spin_unlock_irqrestore(&port->wait.lock, flags);
+    return async;
+}
+
+/**
+ * @brief      Turns a port's interrupt status and the disk's error register into an ATA_ERR_* code
+ * @ingroup    AHCI
+ */
+static int decode_error(struct ahci_port *port, uint32_t status) {
+    if(status & (IS_HOST_BUS | IS_HOST_DATA)) return ATA_ERR_DMA;
+    if(!(status & IS_TASK_FILE)) return ATA_ERR_DEVICE;
+    uint8_t error = (port->regs[PORT_TFD / 4] >> 8) & 0xFF;
+    if(error & (ERROR_UNC | ERROR_BBK)) return ATA_ERR_BAD_SECTOR;
+    if(error & ERROR_IDNF)              return ATA_ERR_NOT_FOUND;
+    if(error & ERROR_ABRT)              return ATA_ERR_ABORTED;
+    return ATA_ERR_DEVICE;
+}
+
+static uint8_t dma_usable(uint32_t address, uint32_t bytes) {
+    return !(address & 1) && address + bytes <= AHCI_DMA_LIMIT;
+}
+
+/**
+ * @brief      Handles the controller's interrupt, for every port that raised it
+ * @ingroup    AHCI
+ * @param      regs  The current register state
+ */
+static void ahci_interrupt(registers_t *regs) {
+    uint32_t pending = hba[HBA_IS / 4];
+    uint32_t i;
+    for(i = 0; i < AHCI_MAX_PORTS; i++) {
+        if(!(pending & (1u << i)) || ports[i] == NULL) continue;
+        if(collect(ports[i]) > 0) disk_queue_kick(&ports[i]->device.queue);
+    }
+    hba[HBA_IS / 4] = pending;
+    UNUSED(regs);
+}
+
+static void ahci_poll(void *data) {
+    uint32_t i;
+    for(i = 0; i < AHCI_MAX_PORTS; i++) {
+        if(ports[i] != NULL && collect(ports[i]) > 0) disk_queue_kick(&ports[i]->device.queue);
+    }
+    UNUSED(data);
+}
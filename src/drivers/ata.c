@@ -9,6 +9,20 @@
  * 
  * @par
  * All code in the ATA driver should be effectively private. All communication to and from the disk should be handled by the filesystem driver rather than the ATA driver.
+ *
+ * @par
+ * read_sectors_ATA and write_sectors_ATA use bus-master DMA when init_ata found an IDE controller that supports it,
+ * and the buffer is in identity-mapped memory. Otherwise, or if the DMA transfer fails, they fall back to PIO.
+ *
+ * @par
+ * Both IDE channels are driven, with their master and slave drives. The drives are registered as block devices
+ * "ata0" (primary master), "ata1" (primary slave), "ata2" (secondary master) and "ata3" (secondary slave), which is
+ * how the rest of the kernel should reach them; ata0 is always registered, the others only if they answer IDENTIFY.
+ * Each channel runs one command at a time, but the two channels work independently.
+ *
+ * @par
+ * Commands complete on IRQ14 or IRQ15: a task that issued one sleeps until the interrupt handler wakes it, or until a
+ * timer gives up on the drive. Callers that cannot sleep (the boot path, interrupts disabled) poll the status register.
  * 
  * @author     Valerie Whitmire
  * @date       2023
@@ -16,6 +30,17 @@
 #include <stdint.h>
 #include "cpu/ports.h"
 #include "drivers/ata.h"
+#include "cpu/timer.h"
+#include "cpu/timer_wheel.h"
+#include "cpu/mutex.h"
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+#include "cpu/isr.h"
+#include "cpu/cpu.h"
+#include "drivers/pci.h"
+#include "drivers/block_device.h"
+#include "libc/function.h"
+#include "libc/mem.h"
 
 /*
 BSY: a 1 means that the controller is busy executing a command. No register should be accessed (except the digital output register) while this bit is set.
@@ -34,99 +59,860 @@ ERR: a 1 indicates that an error occured. An error code has been placed in the e
 #define STATUS_DF 0x20
 #define STATUS_ERR 0x01 // A 1 on this port indicates that an error occured. An error code has been placed in the error register.
 
-#define ATA_DATA           0x1F0 // ATA Data Register
-#define ATA_ERROR          0x1F1 // ATA Error Register
-#define ATA_SECTOR_COUNT   0x1F2 // ATA Sector Count Register
-#define ATA_LBA_LOW        0x1F3 // ATA LBA Register Low Byte
-#define ATA_LBA_MID        0x1F4 // ATA LBA Register Mid Byte
-#define ATA_LBA_HIGH       0x1F5 // ATA LBA Register High Byte
-#define ATA_SELECT_DRIVE   0x1F6 // ATA Select Drive Register
-#define ATA_STATUS_COMMAND 0x1F7 // ATA Status Command Register
+/* Task file registers, from a channel's io_base */
+#define ATA_DATA           0x0 // ATA Data Register
+#define ATA_ERROR          0x1 // ATA Error Register
+#define ATA_SECTOR_COUNT   0x2 // ATA Sector Count Register
+#define ATA_LBA_LOW        0x3 // ATA LBA Register Low Byte
+#define ATA_LBA_MID        0x4 // ATA LBA Register Mid Byte
+#define ATA_LBA_HIGH       0x5 // ATA LBA Register High Byte
+#define ATA_SELECT_DRIVE   0x6 // ATA Select Drive Register
+#define ATA_STATUS_COMMAND 0x7 // ATA Status Command Register
+
+/* Each channel's task file, and its Device Control Register; reads of that return the status without clearing the IRQ */
+#define ATA_PRIMARY_IO        0x1F0
+#define ATA_PRIMARY_CONTROL   0x3F6
+#define ATA_SECONDARY_IO      0x170
+#define ATA_SECONDARY_CONTROL 0x376
+#define SELECT_SLAVE          0x10 // In the select register: address the slave drive
+
+#define ERROR_AMNF  0x01 // Address mark not found
+#define ERROR_TK0NF 0x02 // Track 0 not found
+#define ERROR_ABRT  0x04 // Command aborted
+#define ERROR_IDNF  0x10 // Sector ID not found
+#define ERROR_UNC   0x40 // Uncorrectable data error
+#define ERROR_BBK   0x80 // Bad block
 
 #define ATA_READ_SECTORS   0x20 // ATA Read Sectors Command
 #define ATA_WRITE_SECTORS  0x30 // ATA Write Sectors Command
+#define ATA_READ_SECTORS_EXT   0x24 // The LBA48 forms of the read and write commands
+#define ATA_READ_DMA_EXT       0x25
+#define ATA_READ_MULTIPLE_EXT  0x29
+#define ATA_WRITE_SECTORS_EXT  0x34
+#define ATA_WRITE_DMA_EXT      0x35
+#define ATA_WRITE_MULTIPLE_EXT 0x39
+#define ATA_IDENTIFY       0xEC // ATA Identify Device Command
+#define ATA_READ_MULTIPLE  0xC4 // ATA Read Multiple Command: one interrupt per block of multiple_sectors
+#define ATA_WRITE_MULTIPLE 0xC5 // ATA Write Multiple Command
+#define ATA_SET_MULTIPLE   0xC6 // ATA Set Multiple Mode Command
+#define ATA_READ_DMA       0xC8 // ATA Read DMA Command
+#define ATA_WRITE_DMA      0xCA // ATA Write DMA Command
+#define ATA_FLUSH_CACHE    0xE7 // ATA Flush Cache Command: write the drive's cache to the medium
+#define ATA_FLUSH_CACHE_EXT 0xEA
+
+/* Bus master IDE registers, at BAR4 of the controller; the primary channel's come first */
+#define BM_COMMAND 0x0
+#define BM_STATUS  0x2
+#define BM_PRDT    0x4
+#define BM_CHANNEL_STRIDE 0x8 // The secondary channel's registers follow the primary's
+
+#define BM_COMMAND_START 0x01
+#define BM_COMMAND_READ  0x08 // The bus master writes to memory
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERROR  0x02
+#define BM_STATUS_IRQ    0x04 // The drive raised its interrupt; write 1 to clear
+
+#define PRD_END_OF_TABLE 0x8000
+#define ATA_PRD_ENTRIES  8          // 255 sectors span at most 4 regions; a region may not cross a 64 KiB boundary
+#define ATA_DMA_LIMIT    0x4fff000  // Memory below this is identity mapped in every address space
+
+/* A physical region descriptor: one contiguous piece of a DMA transfer */
+struct prd {
+    uint32_t address;
+    uint16_t byte_count; // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed));
+
+#define ATA_TIMEOUT_US 2000000 // How long a single wait for the drive may take
+#define ATA_MULTIPLE_SECTORS 16 // Largest block size asked for with SET MULTIPLE MODE
+#define ATA_LBA28_LIMIT 0x10000000 // First sector a 28-bit command cannot reach
+
+/* IDENTIFY DEVICE words */
+#define IDENTIFY_MODEL         27 // 20 words of byte-swapped ASCII
+#define IDENTIFY_MAX_MULTIPLE  47
+#define IDENTIFY_CAPABILITIES  49
+#define IDENTIFY_LBA28_SECTORS 60
+#define IDENTIFY_MWDMA_MODES   63
+#define IDENTIFY_COMMAND_SETS  83
+#define IDENTIFY_UDMA_MODES    88
+#define IDENTIFY_LBA48_SECTORS 100
+
+#define CAPABILITY_DMA  0x100
+#define COMMAND_SET_LBA48 0x400
+#define ATA_MAX_COMMAND_SECTORS 255 // The most one 28-bit command can move; 0 would mean 256
+
+/* One IDE channel, and the command in flight on it */
+struct ata_channel {
+    uint16_t io_base;
+    uint16_t control;
+    uint16_t bm_base;               // 0 if there is no usable bus master
+    struct prd *prd_table;
+    struct mutex mutex;             // One command at a time; also guards prd_table and the command state below
+    uint8_t selected;               // The drive the select register points at: 0 master, 1 slave, 0xFF unknown
+
+    /* Completion of the command in flight, guarded by irq_queue.lock */
+    struct wait_queue irq_queue;
+    volatile uint8_t irq_fired;
+    volatile uint8_t irq_status;
+    volatile uint8_t timed_out;
+    uint32_t command_sequence;      // Lets a timeout that fires late recognise it belongs to an older command
+};
+
+struct ata_drive {
+    struct ata_channel *channel;
+    uint8_t slave;
+    uint8_t multiple_sectors;       // Sectors per interrupt under READ/WRITE MULTIPLE; 1 if the drive refused it
+    struct ata_identity identity;
+    struct ata_stats stats;         // Updated with the channel held
+    struct block_device device;
+};
+
+static struct ata_channel channels[ATA_CHANNELS] = {
+    { .io_base = ATA_PRIMARY_IO, .control = ATA_PRIMARY_CONTROL, .selected = 0xFF },
+    { .io_base = ATA_SECONDARY_IO, .control = ATA_SECONDARY_CONTROL, .selected = 0xFF }
+};
+static struct ata_drive drives[ATA_DRIVES]; // Primary master, primary slave, secondary master, secondary slave
+static volatile uint8_t dma_enabled = 1;
 
 // Private function definitions
-static void ATA_wait_BSY();
-static void ATA_wait_RDY();
+static int ATA_wait_BSY(struct ata_channel *channel);
+static int ATA_wait_DRQ(struct ata_channel *channel);
+static void ATA_select(struct ata_drive *drive, uint8_t value);
+static void ATA_set_multiple(struct ata_drive *drive, uint8_t sectors);
+static void ATA_identify(struct ata_drive *drive);
+static int ATA_issue(struct ata_drive *drive, uint32_t LBA, uint8_t sector_count, uint8_t command28, uint8_t command48);
+static uint8_t ATA_command_sectors(struct ata_drive *drive);
+static int ATA_transfer(struct ata_drive *drive, uint32_t address, uint32_t LBA, uint8_t sector_count, uint8_t write);
+static int ATA_read_PIO(struct ata_drive *drive, uint32_t target_address, uint32_t LBA, uint8_t sector_count);
+static int ATA_write_PIO(struct ata_drive *drive, uint32_t LBA, uint8_t sector_count, uint16_t *bytes);
+static int ATA_read(struct ata_drive *drive, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int ATA_write(struct ata_drive *drive, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int ATA_flush(struct ata_drive *drive);
+static void ata_interrupt(registers_t *regs);
+static void ata_timeout(void *tag);
+static void ATA_arm_IRQ(struct ata_channel *channel);
+static int ATA_wait_IRQ(struct ata_channel *channel, uint8_t *status, uint8_t dma);
+static int ATA_decode_error(struct ata_channel *channel, uint8_t status);
+static uint8_t dma_usable(struct ata_drive *drive, uint32_t address, uint8_t sector_count);
+static int ATA_DMA(struct ata_drive *drive, uint32_t address, uint32_t LBA, uint8_t sector_count, uint8_t write);
+static int ata_device_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int ata_device_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int ata_device_flush(struct block_device *device);
+static uint64_t ata_device_capacity(struct block_device *device);
+static uint32_t ata_device_optimal_sectors(struct block_device *device);
+
+static const struct block_device_ops ata_ops = {
+    .read = ata_device_read,
+    .write = ata_device_write,
+    .flush = ata_device_flush,
+    .capacity = ata_device_capacity,
+    .optimal_sectors = ata_device_optimal_sectors
+};
+
+/**
+ * @brief      Installs the IRQ14 and IRQ15 handlers, identifies the drives on both channels, and finds the IDE
+ *             controller on the PCI bus to set up bus-master DMA, if it supports it
+ * @ingroup    ATA
+ */
+void init_ata() {
+    static const char *names[ATA_DRIVES] = { "ata0", "ata1", "ata2", "ata3" };
+    int i;
+    for(i = 0; i < ATA_CHANNELS; i++) {
+        mutex_init(&channels[i].mutex, "ata");
+        wait_queue_init(&channels[i].irq_queue);
+        port_byte_out(channels[i].control, 0); // Clear nIEN: the drive raises its IRQ when a command needs attention
+    }
+    register_interrupt_handler(IRQ14, ata_interrupt);
+
+    for(i = 0; i < ATA_DRIVES; i++) {
+        struct ata_drive *drive = &drives[i];
+        drive->channel = &channels[i / 2];
+        drive->slave = i % 2;
+        drive->multiple_sectors = 1;
+        ATA_identify(drive);
+        if(drive->identity.max_multiple > 1) {
+            uint8_t block = ATA_MULTIPLE_SECTORS;
+            while(block > drive->identity.max_multiple) block >>= 1;
+            ATA_set_multiple(drive, block);
+        }
+        // The primary master is always there to boot from, even if it did not answer IDENTIFY
+        if(i == 0 || drive->identity.present) block_device_register(&drive->device, names[i], &ata_ops, drive);
+    }
+    if(drives[2].identity.present || drives[3].identity.present) register_interrupt_handler(IRQ15, ata_interrupt);
+
+    struct pci_device ide;
+    if(!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &ide)) return;
+    uint32_t bar4 = pci_config_read(&ide, PCI_BAR4);
+    if(!(bar4 & PCI_BAR_IO) || (bar4 & 0xFFFC) == 0) return;
+
+    pci_enable(&ide, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    for(i = 0; i < ATA_CHANNELS; i++) {
+        // Aligned to its own size, so the table cannot cross a 64 KiB boundary either
+        channels[i].prd_table = ta_alloc_align(sizeof(struct prd) * ATA_PRD_ENTRIES, sizeof(struct prd) * ATA_PRD_ENTRIES);
+        if(channels[i].prd_table != NULL) channels[i].bm_base = (bar4 & 0xFFFC) + i * BM_CHANNEL_STRIDE;
+    }
+}
 
 /**
- * @brief      Reads sectors from the hard disk through ATA PIO method
+ * @brief      Reads sectors from the primary master, with DMA when possible. Requests of any length are split into
+ *             as many commands as they need.
  * @ingroup    ATA
  *
  * @param[in]  target_address  The address to read the data into
  * @param[in]  LBA             The logical block address to read from
  * @param[in]  sector_count    How many sectors to read from
- * 
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int read_sectors_ATA(uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    return ATA_read(&drives[0], target_address, LBA, sector_count);
+}
+
+/**
+ * @brief      Writes sectors to the primary master, with DMA when possible
+ * @ingroup    ATA
+ *
+ * @param[in]  LBA           The logical block address to write to
+ * @param[in]  sector_count  How many sectors to write
+ * @param      bytes         Array of the bytes to be written
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int write_sectors_ATA(uint32_t LBA, uint32_t sector_count, uint16_t* bytes) {
+    return ATA_write(&drives[0], LBA, sector_count, bytes);
+}
+
+/**
+ * @brief      Gets what IDENTIFY DEVICE reported about the primary master; present is 0 if it did not answer
+ * @ingroup    ATA
+ * @return     The drive's identity
+ */
+const struct ata_identity *ata_identity() {
+    return &drives[0].identity;
+}
+
+/**
+ * @brief      Gets what IDENTIFY DEVICE reported about any drive
+ * @ingroup    ATA
+ * @param[in]  index  0 primary master, 1 primary slave, 2 secondary master, 3 secondary slave
+ * @return     The drive's identity, or NULL for an index past the last drive
+ */
+const struct ata_identity *ata_drive_identity(uint8_t index) {
+    return index < ATA_DRIVES ? &drives[index].identity : NULL;
+}
+
+/**
+ * @brief      Gets how many of a drive's commands went by DMA and by PIO, and the time PIO took
+ * @ingroup    ATA
+ * @param[in]  index  0 primary master, 1 primary slave, 2 secondary master, 3 secondary slave
+ * @return     The drive's counters, or NULL for an index past the last drive
+ */
+const struct ata_stats *ata_drive_stats(uint8_t index) {
+    return index < ATA_DRIVES ? &drives[index].stats : NULL;
+}
+
+/**
+ * @brief      Writes the primary master's volatile write cache to the medium
+ * @ingroup    ATA
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int flush_cache_ATA() {
+    return ATA_flush(&drives[0]);
+}
+
+/**
+ * @brief      Gets the largest transfer the driver moves with one command to the primary master, a good request
+ *             size for callers
+ * @ingroup    ATA
+ * @return     The size in sectors
+ */
+uint32_t ata_optimal_sectors() {
+    return ATA_command_sectors(&drives[0]);
+}
+
+/**
+ * @brief      Turns DMA on or off, for comparing it with PIO. Commands already running keep their mode.
+ * @ingroup    ATA
+ * @param[in]  enabled  1 to use DMA when the controller and buffer allow it, 0 to always use PIO
+ * @return     The previous setting
+ */
+uint8_t ata_use_dma(uint8_t enabled) {
+    uint8_t previous = dma_enabled;
+    dma_enabled = enabled;
+    return previous;
+}
+
+/**
+ * @brief      Reads sectors from the primary master through ATA PIO method
+ * @ingroup    ATA
+ * @note       Callers other than read_sectors_ATA must make sure no other command is in flight.
+ *
+ * @param[in]  target_address  The address to read the data into
+ * @param[in]  LBA             The logical block address to read from
+ * @param[in]  sector_count    How many sectors to read from
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ *
  * @code
  * uint8_t  size_of_data = 256;
  * uint8_t* data_to_be_read = ta_alloc(sizeof(uint8_t) * 512 * (uint8_t)(size_of_data/512)+1);
  * read_sectors_ATA_PIO((uint32_t)data_to_be_read, 17, (uint8_t)(size_of_data/512)+1);
  * @endcode
  */
-void read_sectors_ATA_PIO(uint32_t target_address, uint32_t LBA, uint8_t sector_count) {
-    ATA_wait_BSY();
-    port_byte_out(ATA_SELECT_DRIVE,   0xE0 | ((LBA >>24) & 0xF));
-    port_byte_out(ATA_SECTOR_COUNT,   sector_count);
-    port_byte_out(ATA_LBA_LOW,        (uint8_t) LBA);
-    port_byte_out(ATA_LBA_MID,        (uint8_t)(LBA >> 8));
-    port_byte_out(ATA_LBA_HIGH,       (uint8_t)(LBA >> 16)); 
-    port_byte_out(ATA_STATUS_COMMAND, ATA_READ_SECTORS);
+int read_sectors_ATA_PIO(uint32_t target_address, uint32_t LBA, uint8_t sector_count) {
+    return ATA_read_PIO(&drives[0], target_address, LBA, sector_count);
+}
 
-    uint16_t *target = (uint16_t*) target_address;
+/**
+ * @brief      Writes sectors to the primary master through ATA PIO method
+ * @ingroup    ATA
+ * @note       Callers other than write_sectors_ATA must make sure no other command is in flight.
+ *
+ * @param[in]  LBA           The logical block address to write to
+ * @param[in]  sector_count  How many sectors to write
+ * @param      bytes         Array of the bytes to be written
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int write_sectors_ATA_PIO(uint32_t LBA, uint8_t sector_count, uint16_t* bytes) {
+    return ATA_write_PIO(&drives[0], LBA, sector_count, bytes);
+}
 
-    int j = 0;
-    for (j = 0;j<sector_count;j++) {
-        ATA_wait_BSY();
-        ATA_wait_RDY();
-        int i = 0;
-        for(i = 0;i < 256; i++) {
-            target[i] = port_word_in(ATA_DATA);
-        }
-        target += 256;
+/**
+ * @brief      Describes an ATA_ERR_* code
+ * @ingroup    ATA
+ * @param[in]  error  The code
+ * @return     The description
+ */
+const char *ata_strerror(int error) {
+    switch(error) {
+        case ATA_OK:             return "no error";
+        case ATA_ERR_TIMEOUT:    return "drive timed out";
+        case ATA_ERR_DMA:        return "DMA transfer failed";
+        case ATA_ERR_ABORTED:    return "command aborted";
+        case ATA_ERR_BAD_SECTOR: return "uncorrectable data error";
+        case ATA_ERR_NOT_FOUND:  return "sector not found";
+        default:                 return "drive fault";
     }
 }
 
 /**
- * @brief      Writes sectors to the hard disk through ATA PIO method
+ * @brief      Reads sectors from a drive, in as many commands as they need
  * @ingroup    ATA
  *
+ * @param      drive           The drive
+ * @param[in]  target_address  The address to read the data into
+ * @param[in]  LBA             The logical block address to read from
+ * @param[in]  sector_count    How many sectors to read
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int ATA_read(struct ata_drive *drive, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    int result = ATA_OK;
+    mutex_lock(&drive->channel->mutex);
+    uint8_t per_command = ATA_command_sectors(drive);
+    while(sector_count > 0 && result == ATA_OK) {
+        uint8_t count = sector_count > per_command ? per_command : sector_count;
+        result = ATA_transfer(drive, target_address, LBA, count, 0);
+        target_address += (uint32_t)count * 512;
+        LBA += count;
+        sector_count -= count;
+    }
+    mutex_unlock(&drive->channel->mutex);
+    return result;
+}
+
+/**
+ * @brief      Writes sectors to a drive, in as many commands as they need
+ * @ingroup    ATA
+ *
+ * @param      drive         The drive
  * @param[in]  LBA           The logical block address to write to
  * @param[in]  sector_count  How many sectors to write
  * @param      bytes         Array of the bytes to be written
- * 
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
  */
-void write_sectors_ATA_PIO(uint32_t LBA, uint8_t sector_count, uint16_t* bytes) {
-    ATA_wait_BSY();
-    port_byte_out(ATA_SELECT_DRIVE,   (0xE0 | ((LBA >>24) & 0xF)));
-    port_byte_out(ATA_SECTOR_COUNT,   sector_count);
-    port_byte_out(ATA_LBA_LOW,        (uint8_t) LBA);
-    port_byte_out(ATA_LBA_MID,        (uint8_t)(LBA >> 8));
-    port_byte_out(ATA_LBA_HIGH,       (uint8_t)(LBA >> 16)); 
-    port_byte_out(ATA_STATUS_COMMAND, ATA_WRITE_SECTORS);
+static int ATA_write(struct ata_drive *drive, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    int result = ATA_OK;
+    mutex_lock(&drive->channel->mutex);
+    uint8_t per_command = ATA_command_sectors(drive);
+    while(sector_count > 0 && result == ATA_OK) {
+        uint8_t count = sector_count > per_command ? per_command : sector_count;
+        result = ATA_transfer(drive, (uint32_t)bytes, LBA, count, 1);
+        bytes += (uint32_t)count * 256;
+        LBA += count;
+        sector_count -= count;
+    }
+    mutex_unlock(&drive->channel->mutex);
+    return result;
+}
 
+/**
+ * @brief      Writes a drive's volatile write cache to the medium
+ * @ingroup    ATA
+ * @param      drive  The drive
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int ATA_flush(struct ata_drive *drive) {
+    struct ata_channel *channel = drive->channel;
+    mutex_lock(&channel->mutex);
+    int result = ATA_wait_BSY(channel);
+    if(result == ATA_OK) {
+        ATA_arm_IRQ(channel);
+        ATA_select(drive, 0xE0);
+        port_byte_out(channel->io_base + ATA_STATUS_COMMAND, drive->identity.lba48 ? ATA_FLUSH_CACHE_EXT : ATA_FLUSH_CACHE);
+        uint8_t status;
+        result = ATA_wait_IRQ(channel, &status, 0);
+        if(result == ATA_OK && (status & (STATUS_ERR | STATUS_DF))) result = ATA_decode_error(channel, status);
+    }
+    mutex_unlock(&channel->mutex);
+    return result;
+}
+
+/**
+ * @brief      Reads sectors through ATA PIO method
+ * @ingroup    ATA
+ * @note       Call with the drive's channel mutex held.
+ */
+static int ATA_read_PIO(struct ata_drive *drive, uint32_t target_address, uint32_t LBA, uint8_t sector_count) {
+    struct ata_channel *channel = drive->channel;
+    if(ATA_wait_BSY(channel) != ATA_OK) return ATA_ERR_TIMEOUT;
+    ATA_arm_IRQ(channel);
+    int result = drive->multiple_sectors > 1 ? ATA_issue(drive, LBA, sector_count, ATA_READ_MULTIPLE, ATA_READ_MULTIPLE_EXT)
+                                             : ATA_issue(drive, LBA, sector_count, ATA_READ_SECTORS, ATA_READ_SECTORS_EXT);
+    if(result != ATA_OK) return result;
+
+    uint16_t *target = (uint16_t*) target_address;
+
+    int j = 0;
+    while (j < sector_count) {
+        // The drive interrupts once each block is ready in its buffer
+        uint8_t status;
+        result = ATA_wait_IRQ(channel, &status, 0);
+        if(result != ATA_OK) return result;
+        if(status & (STATUS_ERR | STATUS_DF)) return ATA_decode_error(channel, status);
+
+        int block = sector_count - j < drive->multiple_sectors ? sector_count - j : drive->multiple_sectors;
+        if(j + block < sector_count) ATA_arm_IRQ(channel);
+        port_words_in(channel->io_base + ATA_DATA, target, block * 256);
+        target += block * 256;
+        j += block;
+    }
+    return ATA_OK;
+}
+
+/**
+ * @brief      Writes sectors through ATA PIO method
+ * @ingroup    ATA
+ * @note       Call with the drive's channel mutex held.
+ */
+static int ATA_write_PIO(struct ata_drive *drive, uint32_t LBA, uint8_t sector_count, uint16_t *bytes) {
+    struct ata_channel *channel = drive->channel;
+    if(ATA_wait_BSY(channel) != ATA_OK) return ATA_ERR_TIMEOUT;
+    int result = drive->multiple_sectors > 1 ? ATA_issue(drive, LBA, sector_count, ATA_WRITE_MULTIPLE, ATA_WRITE_MULTIPLE_EXT)
+                                             : ATA_issue(drive, LBA, sector_count, ATA_WRITE_SECTORS, ATA_WRITE_SECTORS_EXT);
+    if(result != ATA_OK) return result;
+
+    // The first block is asked for without an interrupt; each one written after that raises one
+    result = ATA_wait_DRQ(channel);
+    if(result != ATA_OK) return result;
     int j = 0;
-    for (j = 0; j < sector_count; j++) {
-        ATA_wait_BSY();
-        ATA_wait_RDY();
-        int i = 0;
-        for(i = 0; i < 256; i++) {
-            port_word_out(ATA_DATA, bytes[i]); 
+    while (j < sector_count) {
+        int block = sector_count - j < drive->multiple_sectors ? sector_count - j : drive->multiple_sectors;
+        ATA_arm_IRQ(channel);
+        port_words_out(channel->io_base + ATA_DATA, bytes, block * 256);
+        bytes += block * 256;
+        j += block;
+
+        uint8_t status;
+        result = ATA_wait_IRQ(channel, &status, 0);
+        if(result != ATA_OK) return result;
+        if(status & (STATUS_ERR | STATUS_DF)) return ATA_decode_error(channel, status);
+    }
+    return ATA_OK;
+}
+
+/**
+ * @brief      Moves up to ATA_MAX_COMMAND_SECTORS sectors with one command: DMA if it can, PIO otherwise or if the
+ *             bus master fails
+ * @ingroup    ATA
+ *
+ * @param      drive         The drive
+ * @param[in]  address       The buffer
+ * @param[in]  LBA           The logical block address
+ * @param[in]  sector_count  How many sectors to transfer
+ * @param[in]  write         1 to write the buffer to the disk, 0 to read into it
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int ATA_transfer(struct ata_drive *drive, uint32_t address, uint32_t LBA, uint8_t sector_count, uint8_t write) {
+    int result = ATA_ERR_DMA;
+    if(dma_enabled && dma_usable(drive, address, sector_count)) {
+        drive->stats.dma_commands++;
+        result = ATA_DMA(drive, address, LBA, sector_count, write);
+        if(result == ATA_ERR_DMA) drive->stats.dma_fallbacks++;
+    }
+    if(result != ATA_ERR_DMA) return result;
+
+    uint64_t start = rdtsc();
+    result = write ? ATA_write_PIO(drive, LBA, sector_count, (uint16_t *)address)
+                   : ATA_read_PIO(drive, address, LBA, sector_count);
+    drive->stats.pio_commands++;
+    drive->stats.pio_sectors += sector_count;
+    drive->stats.pio_cycles += rdtsc() - start;
+    return result;
+}
+
+/**
+ * @brief      Gets how many sectors one command should move: as many as fit, in whole READ/WRITE MULTIPLE blocks
+ * @ingroup    ATA
+ * @param      drive  The drive
+ * @return     The sector count
+ */
+static uint8_t ATA_command_sectors(struct ata_drive *drive) {
+    return ATA_MAX_COMMAND_SECTORS - ATA_MAX_COMMAND_SECTORS % drive->multiple_sectors;
+}
+
+/**
+ * @brief      Writes the select register, then gives the drive the 400 ns it needs to answer if it was not the one
+ *             selected before
+ * @ingroup    ATA
+ * @param      drive  The drive
+ * @param[in]  value  The register's value for a master; the slave bit is added for a slave
+ */
+static void ATA_select(struct ata_drive *drive, uint8_t value) {
+    struct ata_channel *channel = drive->channel;
+    port_byte_out(channel->io_base + ATA_SELECT_DRIVE, value | (drive->slave ? SELECT_SLAVE : 0));
+    if(channel->selected == drive->slave) return;
+    channel->selected = drive->slave;
+    int i;
+    for(i = 0; i < 4; i++) port_byte_in(channel->control);
+}
+
+/**
+ * @brief      Asks the drive to move several sectors per interrupt under READ/WRITE MULTIPLE. Drives that refuse
+ *             keep using READ/WRITE SECTORS.
+ * @ingroup    ATA
+ * @param      drive    The drive
+ * @param[in]  sectors  The block size, a power of two
+ */
+static void ATA_set_multiple(struct ata_drive *drive, uint8_t sectors) {
+    struct ata_channel *channel = drive->channel;
+    if(ATA_wait_BSY(channel) != ATA_OK) return;
+    ATA_arm_IRQ(channel);
+    ATA_select(drive, 0xE0);
+    port_byte_out(channel->io_base + ATA_SECTOR_COUNT,   sectors);
+    port_byte_out(channel->io_base + ATA_STATUS_COMMAND, ATA_SET_MULTIPLE);
+
+    uint8_t status;
+    if(ATA_wait_IRQ(channel, &status, 0) != ATA_OK || (status & (STATUS_ERR | STATUS_DF))) return;
+    drive->multiple_sectors = sectors;
+}
+
+/**
+ * @brief      Writes the address registers and a command, with the LBA48 form when the sectors lie past LBA28
+ * @ingroup    ATA
+ *
+ * @param      drive         The drive
+ * @param[in]  LBA           The logical block address
+ * @param[in]  sector_count  The sector count
+ * @param[in]  command28     The command's 28-bit form
+ * @param[in]  command48     The command's LBA48 form
+ *
+ * @return     ATA_OK, or ATA_ERR_RANGE if the drive cannot address the sectors
+ */
+static int ATA_issue(struct ata_drive *drive, uint32_t LBA, uint8_t sector_count, uint8_t command28, uint8_t command48) {
+    uint16_t io = drive->channel->io_base;
+    uint64_t end = (uint64_t)LBA + sector_count;
+    if(drive->identity.present && end > drive->identity.sectors) return ATA_ERR_RANGE;
+
+    if(end <= ATA_LBA28_LIMIT) {
+        ATA_select(drive, 0xE0 | ((LBA >>24) & 0xF));
+        port_byte_out(io + ATA_SECTOR_COUNT,   sector_count);
+        port_byte_out(io + ATA_LBA_LOW,        (uint8_t) LBA);
+        port_byte_out(io + ATA_LBA_MID,        (uint8_t)(LBA >> 8));
+        port_byte_out(io + ATA_LBA_HIGH,       (uint8_t)(LBA >> 16));
+        port_byte_out(io + ATA_STATUS_COMMAND, command28);
+        return ATA_OK;
+    }
+    if(!drive->identity.lba48) return ATA_ERR_RANGE;
+
+    // Each register takes its high byte first, then its low byte
+    ATA_select(drive, 0x40);
+    port_byte_out(io + ATA_SECTOR_COUNT,   0);
+    port_byte_out(io + ATA_LBA_LOW,        (uint8_t)(LBA >> 24));
+    port_byte_out(io + ATA_LBA_MID,        0);
+    port_byte_out(io + ATA_LBA_HIGH,       0);
+    port_byte_out(io + ATA_SECTOR_COUNT,   sector_count);
+    port_byte_out(io + ATA_LBA_LOW,        (uint8_t) LBA);
+    port_byte_out(io + ATA_LBA_MID,        (uint8_t)(LBA >> 8));
+    port_byte_out(io + ATA_LBA_HIGH,       (uint8_t)(LBA >> 16));
+    port_byte_out(io + ATA_STATUS_COMMAND, command48);
+    return ATA_OK;
+}
+
+/**
+ * @brief      Runs IDENTIFY DEVICE and fills in the drive's identity. Leaves present at 0 if no ATA drive answers.
+ * @ingroup    ATA
+ * @param      drive  The drive
+ */
+static void ATA_identify(struct ata_drive *drive) {
+    struct ata_channel *channel = drive->channel;
+    uint16_t io = channel->io_base;
+    ATA_select(drive, 0xA0);
+    port_byte_out(io + ATA_SECTOR_COUNT,   0);
+    port_byte_out(io + ATA_LBA_LOW,        0);
+    port_byte_out(io + ATA_LBA_MID,        0);
+    port_byte_out(io + ATA_LBA_HIGH,       0);
+    ATA_arm_IRQ(channel);
+    port_byte_out(io + ATA_STATUS_COMMAND, ATA_IDENTIFY);
+    uint8_t status = port_byte_in(io + ATA_STATUS_COMMAND);
+    if(status == 0 || status == 0xFF) return; // No drive, or a floating bus without a channel
+    if(ATA_wait_BSY(channel) != ATA_OK) return;
+    if(port_byte_in(io + ATA_LBA_MID) != 0 || port_byte_in(io + ATA_LBA_HIGH) != 0) return; // ATAPI or SATA signature
+    if(ATA_wait_DRQ(channel) != ATA_OK) return;
+
+    uint16_t words[256];
+    port_words_in(io + ATA_DATA, words, 256);
+
+    struct ata_identity *identity = &drive->identity;
+    identity->present = 1;
+    identity->max_multiple = words[IDENTIFY_MAX_MULTIPLE] & 0xFF;
+    identity->dma = (words[IDENTIFY_CAPABILITIES] & CAPABILITY_DMA) != 0;
+    identity->mwdma_modes = words[IDENTIFY_MWDMA_MODES] & 0xFF;
+    identity->udma_modes = words[IDENTIFY_UDMA_MODES] & 0xFF;
+    identity->lba48 = (words[IDENTIFY_COMMAND_SETS] & COMMAND_SET_LBA48) != 0;
+    if(identity->lba48) {
+        identity->sectors = (uint64_t)words[IDENTIFY_LBA48_SECTORS] | ((uint64_t)words[IDENTIFY_LBA48_SECTORS + 1] << 16) |
+                            ((uint64_t)words[IDENTIFY_LBA48_SECTORS + 2] << 32) | ((uint64_t)words[IDENTIFY_LBA48_SECTORS + 3] << 48);
+    } else {
+        identity->sectors = (uint32_t)words[IDENTIFY_LBA28_SECTORS] | ((uint32_t)words[IDENTIFY_LBA28_SECTORS + 1] << 16);
+    }
+
+    int i;
+    for(i = 0; i < 20; i++) {
+        identity->model[2 * i] = words[IDENTIFY_MODEL + i] >> 8;
+        identity->model[2 * i + 1] = words[IDENTIFY_MODEL + i] & 0xFF;
+    }
+    for(i = 40; i > 0 && (identity->model[i - 1] == ' ' || identity->model[i - 1] == '\0'); i--);
+    identity->model[i] = '\0';
+}
+
+/**
+ * @brief      Tells whether a buffer can be the target of a DMA transfer
+ * @ingroup    ATA
+ * @param      drive         The drive
+ * @param[in]  address       The buffer
+ * @param[in]  sector_count  The transfer's length in sectors
+ * @return     1 if it can, 0 otherwise
+ */
+static uint8_t dma_usable(struct ata_drive *drive, uint32_t address, uint8_t sector_count) {
+    if(drive->channel->bm_base == 0 || sector_count == 0) return 0;
+    if(drive->identity.present && !drive->identity.dma) return 0;
+    if(address & 1) return 0; // The bus master transfers words
+    return address + (uint32_t)sector_count * 512 <= ATA_DMA_LIMIT;
+}
+
+/**
+ * @brief      Runs a READ DMA or WRITE DMA command and waits for it to complete
+ * @ingroup    ATA
+ *
+ * @param      drive         The drive
+ * @param[in]  address       The buffer, physically contiguous
+ * @param[in]  LBA           The logical block address
+ * @param[in]  sector_count  How many sectors to transfer
+ * @param[in]  write         1 to write the buffer to the disk, 0 to read into it
+ *
+ * @return     ATA_OK, ATA_ERR_DMA if the bus master failed, or another ATA_ERR_* code
+ */
+static int ATA_DMA(struct ata_drive *drive, uint32_t address, uint32_t LBA, uint8_t sector_count, uint8_t write) {
+    struct ata_channel *channel = drive->channel;
+    struct prd *prd_table = channel->prd_table;
+    uint16_t bm_base = channel->bm_base;
+    uint32_t remaining = (uint32_t)sector_count * 512;
+    int entries = 0;
+    while(remaining > 0) {
+        uint32_t length = 0x10000 - (address & 0xFFFF);
+        if(length > remaining) length = remaining;
+        prd_table[entries].address = address;
+        prd_table[entries].byte_count = length & 0xFFFF;
+        prd_table[entries].flags = 0;
+        address += length;
+        remaining -= length;
+        entries++;
+    }
+    prd_table[entries - 1].flags = PRD_END_OF_TABLE;
+
+    if(ATA_wait_BSY(channel) != ATA_OK) return ATA_ERR_TIMEOUT;
+    uint8_t direction = write ? 0 : BM_COMMAND_READ;
+    port_byte_out(bm_base + BM_COMMAND, direction);
+    port_dword_out(bm_base + BM_PRDT, (uint32_t)prd_table);
+    port_byte_out(bm_base + BM_STATUS, port_byte_in(bm_base + BM_STATUS) | BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+    ATA_arm_IRQ(channel);
+    int result = write ? ATA_issue(drive, LBA, sector_count, ATA_WRITE_DMA, ATA_WRITE_DMA_EXT)
+                       : ATA_issue(drive, LBA, sector_count, ATA_READ_DMA, ATA_READ_DMA_EXT);
+    if(result != ATA_OK) return result;
+    port_byte_out(bm_base + BM_COMMAND, direction | BM_COMMAND_START);
+
+    uint8_t status;
+    result = ATA_wait_IRQ(channel, &status, 1);
+    port_byte_out(bm_base + BM_COMMAND, direction);
+    uint8_t bm_status = port_byte_in(bm_base + BM_STATUS);
+    port_byte_out(bm_base + BM_STATUS, BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+    if(result != ATA_OK) return result;
+    if(status & (STATUS_ERR | STATUS_DF)) return ATA_decode_error(channel, status);
+    if(bm_status & BM_STATUS_ERROR) return ATA_ERR_DMA;
+    return ATA_OK;
+}
+
+/**
+ * @brief      Handles IRQ14 and IRQ15. Reading the status acknowledges the drive; the task waiting for it is woken.
+ * @ingroup    ATA
+ * @param      regs  The current register state
+ */
+static void ata_interrupt(registers_t *regs) {
+    struct ata_channel *channel = &channels[regs->int_no == IRQ15 ? 1 : 0];
+    uint8_t status = port_byte_in(channel->io_base + ATA_STATUS_COMMAND);
+    spin_lock(&channel->irq_queue.lock);
+    channel->irq_status = status;
+    channel->irq_fired = 1;
+    wait_queue_wake_locked(&channel->irq_queue, WAIT_KEY_ANY, 1);
+    spin_unlock(&channel->irq_queue.lock);
+}
+
+/**
+ * @brief      Gives up on the command in flight on a channel, unless it has already completed
+ * @ingroup    ATA
+ * @param      tag   The channel's index in bit 0, and the command_sequence of the command the timer was armed for
+ *                   above it
+ */
+static void ata_timeout(void *tag) {
+    struct ata_channel *channel = &channels[(uint32_t)tag & 1];
+    uint32_t flags = spin_lock_irqsave(&channel->irq_queue.lock);
+    if((uint32_t)tag >> 1 == (channel->command_sequence & 0x7FFFFFFF)) {
+        channel->timed_out = 1;
+        wait_queue_wake_locked(&channel->irq_queue, WAIT_KEY_ANY, 1);
+    }
+    spin_unlock_irqrestore(&channel->irq_queue.lock, flags);
+}
+
+/**
+ * @brief      Forgets earlier interrupts, before a command or data transfer that will raise the next one
+ * @ingroup    ATA
+ * @param      channel  The channel
+ */
+static void ATA_arm_IRQ(struct ata_channel *channel) {
+    uint32_t flags = spin_lock_irqsave(&channel->irq_queue.lock);
+    channel->irq_fired = 0;
+    channel->timed_out = 0;
+    channel->command_sequence++;
+    spin_unlock_irqrestore(&channel->irq_queue.lock, flags);
+}
+
+/**
+ * @brief      Waits for the drive's interrupt. Tasks sleep; callers that cannot sleep poll the status register.
+ * @ingroup    ATA
+ * @param      channel  The channel
+ * @param      status   Set to the drive's status
+ * @param[in]  dma      1 if a DMA transfer is in flight; pollers then watch the bus master, since the drive stays busy
+ * @return     ATA_OK, or ATA_ERR_TIMEOUT after ATA_TIMEOUT_US
+ */
+static int ATA_wait_IRQ(struct ata_channel *channel, uint8_t *status, uint8_t dma) {
+    if(!task_can_block()) {
+        uint64_t deadline = timer_now_us() + ATA_TIMEOUT_US;
+        while(dma ? !(port_byte_in(channel->bm_base + BM_STATUS) & BM_STATUS_IRQ)
+                  : (port_byte_in(channel->control) & STATUS_BSY)) {
+            if(timer_now_us() > deadline) return ATA_ERR_TIMEOUT;
         }
+        *status = port_byte_in(channel->io_base + ATA_STATUS_COMMAND);
+        return ATA_OK;
     }
+
+    struct timer timer;
+    uint32_t flags = spin_lock_irqsave(&channel->irq_queue.lock);
+    timer_init(&timer, ata_timeout, (void *)((channel->command_sequence << 1) | (uint32_t)(channel - channels)));
+    timer_add(&timer, ATA_TIMEOUT_US);
+    while(!channel->irq_fired && !channel->timed_out) {
+        wait_queue_sleep_locked(&channel->irq_queue, WAIT_KEY_ANY, flags);
+        flags = spin_lock_irqsave(&channel->irq_queue.lock);
+    }
+    uint8_t fired = channel->irq_fired;
+    *status = channel->irq_status;
+    spin_unlock_irqrestore(&channel->irq_queue.lock, flags);
+    timer_cancel(&timer);
+    return fired ? ATA_OK : ATA_ERR_TIMEOUT;
 }
+
+/**
+ * @brief      Turns the error register into an ATA_ERR_* code, after a command ended with ERR or DF set
+ * @ingroup    ATA
+ * @param      channel  The channel
+ * @param[in]  status   The status the command ended with
+ * @return     The code
+ */
+static int ATA_decode_error(struct ata_channel *channel, uint8_t status) {
+    if(!(status & STATUS_ERR)) return ATA_ERR_DEVICE;
+    uint8_t error = port_byte_in(channel->io_base + ATA_ERROR);
+    if(error & (ERROR_UNC | ERROR_BBK))                return ATA_ERR_BAD_SECTOR;
+    if(error & (ERROR_IDNF | ERROR_AMNF | ERROR_TK0NF)) return ATA_ERR_NOT_FOUND;
+    if(error & ERROR_ABRT)                             return ATA_ERR_ABORTED;
+    return ATA_ERR_DEVICE;
+}
+
 /**
  * @brief Loops until ATA Busy port is not true
  * @ingroup    ATA
+ * @param      channel  The channel
+ * @return     ATA_OK, or ATA_ERR_TIMEOUT after ATA_TIMEOUT_US
  **/
-static void ATA_wait_BSY() {
-    while(port_byte_in(ATA_STATUS_COMMAND)&STATUS_BSY);
+static int ATA_wait_BSY(struct ata_channel *channel) {
+    uint64_t deadline = timer_now_us() + ATA_TIMEOUT_US;
+    while(port_byte_in(channel->io_base + ATA_STATUS_COMMAND)&STATUS_BSY) {
+        if(timer_now_us() > deadline) return ATA_ERR_TIMEOUT;
+    }
+    return ATA_OK;
 }
 
 /**
- * @brief Loops until ATA Ready port is true
+ * @brief      Loops until the drive asks for data, or reports an error
  * @ingroup    ATA
- **/
-static void ATA_wait_RDY() {
-    while(!(port_byte_in(ATA_STATUS_COMMAND)&STATUS_RDY));
-}
\ No newline at end of file
+ * @param      channel  The channel
+ * @return     ATA_OK, an ATA_ERR_* code if the command failed, or ATA_ERR_TIMEOUT after ATA_TIMEOUT_US
+ */
+static int ATA_wait_DRQ(struct ata_channel *channel) {
+    uint64_t deadline = timer_now_us() + ATA_TIMEOUT_US;
+    uint8_t status;
+    while(((status = port_byte_in(channel->control)) & STATUS_BSY) || !(status & (STATUS_DRQ | STATUS_ERR | STATUS_DF))) {
+        if(timer_now_us() > deadline) return ATA_ERR_TIMEOUT;
+    }
+    if(status & (STATUS_ERR | STATUS_DF)) return ATA_decode_error(channel, port_byte_in(channel->io_base + ATA_STATUS_COMMAND));
+    return ATA_OK;
+}
+
+static int ata_device_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    return ATA_read(device->private, target_address, LBA, sector_count);
+}
+
+static int ata_device_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    return ATA_write(device->private, LBA, sector_count, bytes);
+}
+
+static int ata_device_flush(struct block_device *device) {
+    return ATA_flush(device->private);
+}
+
+/**
+ * @brief      Gets the drive's capacity. A drive that did not answer IDENTIFY is taken to reach as far as LBA28 does.
+ * @ingroup    ATA
+ */
+static uint64_t ata_device_capacity(struct block_device *device) {
+    struct ata_drive *drive = device->private;
+    return drive->identity.present ? drive->identity.sectors : ATA_LBA28_LIMIT;
+}
+
+static uint32_t ata_device_optimal_sectors(struct block_device *device) {
+    return ATA_command_sectors(device->private);
+}
@@ -0,0 +1,150 @@
+/**
+ * @defgroup   BLOCK_DEVICE block_device
+ * @ingroup    DRIVERS
+ * @brief      This file implements the block-device layer: the one interface to storage that code above the
+ *             drivers uses.
+ *
+ * @par
+ * A driver fills in a block_device_ops table and registers a device under a name. Every device gets its own disk
+ * queue, whose dispatcher calls the driver's read and write ops; block_device_read and block_device_write go through
+ * it. Devices registered before block_devices_start carry requests out synchronously until it runs.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/block_device.h"
+#include "drivers/disk_queue.h"
+#include "drivers/ata.h"
+#include "cpu/spinlock.h"
+#include "libc/string.h"
+
+static struct block_device *devices = NULL;
+static spinlock_t devices_lock = SPINLOCK_INIT; // Guards devices and started
+static uint8_t started = 0;
+
+/**
+ * @brief      Adds a device. It can be used from then on.
+ * @ingroup    BLOCK_DEVICE
+ *
+ * @param      device   The device, which must stay in memory
+ * @param[in]  name     Its name, shortened to BLOCK_DEVICE_NAME - 1 characters
+ * @param[in]  ops      The driver's functions
+ * @param      private  Anything the driver wants back in device->private
+ */
+void block_device_register(struct block_device *device, const char *name, const struct block_device_ops *ops,
+                           void *private) {
+    int i;
+    for(i = 0; i < BLOCK_DEVICE_NAME - 1 && name[i] != '\0'; i++) device->name[i] = name[i];
+    device->name[i] = '\0';
+    device->ops = ops;
+    device->private = private;
+    disk_queue_init(&device->queue, device, ops->optimal_sectors(device));
+
+    uint32_t flags = spin_lock_irqsave(&devices_lock);
+    struct block_device **link = &devices;
+    while(*link != NULL) link = &(*link)->next;
+    device->next = NULL;
+    *link = device;
+    uint8_t start = started;
+    spin_unlock_irqrestore(&devices_lock, flags);
+
+    if(start) disk_queue_start(&device->queue);
+}
+
+/**
+ * @brief      Starts the disk queues of the devices registered so far, and of any registered later. Needs the
+ *             scheduler.
+ * @ingroup    BLOCK_DEVICE
+ */
+void block_devices_start() {
+    uint32_t flags = spin_lock_irqsave(&devices_lock);
+    started = 1;
+    spin_unlock_irqrestore(&devices_lock, flags);
+
+    struct block_device *device;
+    for(device = devices; device != NULL; device = device->next) disk_queue_start(&device->queue);
+}
+
+/**
+ * @brief      Finds a device by name
+ * @ingroup    BLOCK_DEVICE
+ * @param[in]  name  The name
+ * @return     The device, or NULL if there is none by that name
+ */
+struct block_device *block_device_find(const char *name) {
+    struct block_device *device;
+    for(device = devices; device != NULL; device = device->next) {
+        if(strcmp(device->name, (char *)name) == 0) return device;
+    }
+    return NULL;
+}
+
+/**
+ * @brief      Gets the registered devices, linked through next. Devices are never removed.
+ * @ingroup    BLOCK_DEVICE
+ * @return     The first device, or NULL
+ */
+struct block_device *block_device_list() {
+    return devices;
+}
+
+/**
+ * @brief      Reads sectors through the device's queue, sleeping until they arrive
+ * @ingroup    BLOCK_DEVICE
+ *
+ * @param      device          The device
+ * @param[in]  target_address  The address to read the data into
+ * @param[in]  LBA             The first sector
+ * @param[in]  sector_count    How many sectors to read
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int block_device_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    if((uint64_t)LBA + sector_count > device->ops->capacity(device)) return ATA_ERR_RANGE;
+    return disk_queue_read(&device->queue, target_address, LBA, sector_count);
+}
+
+/**
+ * @brief      Writes sectors through the device's queue, sleeping until they are written
+ * @ingroup    BLOCK_DEVICE
+ *
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors to write
+ * @param      bytes         The data
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int block_device_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    if((uint64_t)LBA + sector_count > device->ops->capacity(device)) return ATA_ERR_RANGE;
+    return disk_queue_write(&device->queue, LBA, sector_count, bytes);
+}
+
+/**
+ * @brief      Asks the device to make what was written durable
+ * @ingroup    BLOCK_DEVICE
+ * @param      device  The device
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int block_device_flush(struct block_device *device) {
+    return device->ops->flush(device);
+}
+
+/**
+ * @brief      Gets a device's size
+ * @ingroup    BLOCK_DEVICE
+ * @param      device  The device
+ * @return     The capacity in 512-byte sectors
+ */
+uint64_t block_device_capacity(struct block_device *device) {
+    return device->ops->capacity(device);
+}
+
+/**
+ * @brief      Gets the request size that suits a device best
+ * @ingroup    BLOCK_DEVICE
+ * @param      device  The device
+ * @return     The size in sectors
+ */
+uint32_t block_device_optimal_sectors(struct block_device *device) {
+    return device->ops->optimal_sectors(device);
+}
@@ -0,0 +1,473 @@
+/**
+ * @defgroup   DISK_QUEUE disk_queue
+ * @ingroup    DRIVERS
+ * @brief      This file implements a request queue in front of a block device, with an elevator and request merging.
+ *
+ * @par
+ * Submitted requests are kept sorted by LBA. A dispatcher thread per queue takes them in C-LOOK order: the first
+ * request at or after where the last command ended, wrapping around to the lowest LBA. A request that has waited past
+ * its deadline is taken first, so a steady stream of requests further along cannot starve it. Requests that continue
+ * the one taken, in the same direction, go out with it as a single command.
+ *
+ * @par
+ * A device with synchronous ops gets one command at a time. A device with submit and reap ops gets up to its
+ * queue_depth commands at once: its interrupt handler calls disk_queue_kick, and the dispatcher then calls reap,
+ * which hands each finished command back through disk_queue_finish.
+ *
+ * @par
+ * Until disk_queue_start runs, and for callers that cannot sleep, requests are carried out at once by the caller.
+ *
+ * @par
+ * Each queue keeps iostat-style statistics of its device's work in queue->stats, timed with the TSC: how much was
+ * read and written, how often the head had to move, how long commands took from dispatch to completion, and how
+ * long the device was busy and the queue was deep.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/disk_queue.h"
+#include "drivers/block_device.h"
+#include "drivers/ata.h"
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+#include "cpu/timer.h"
+#include "cpu/cpu.h"
+#include "libc/mem.h"
+
+// Private function definitions
+static void dispatcher(void *arg);
+static uint8_t can_dispatch(struct disk_queue *queue);
+static uint32_t take_batch(struct disk_queue *queue, struct disk_request **batch);
+static void run_batch(struct disk_queue *queue, struct disk_request **batch, uint32_t count);
+static int run_one(struct disk_queue *queue, struct disk_request *request);
+static void complete(struct disk_queue *queue, struct disk_request **batch, uint32_t count);
+static uint64_t stats_advance(struct disk_queue *queue);
+static void account_submit(struct disk_queue *queue, struct disk_request *request);
+static void account_dispatch(struct disk_queue *queue, struct disk_request *first);
+static void account_complete(struct disk_queue *queue, uint8_t write, uint64_t service, uint64_t waited, uint32_t failed);
+static uint8_t hist_bucket(uint64_t cycles);
+
+/**
+ * @brief      Initializes an empty queue for a block device
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue        The queue
+ * @param      device       The device, whose read and write ops carry requests out
+ * @param[in]  max_sectors  The largest command to build by merging requests
+ */
+void disk_queue_init(struct disk_queue *queue, struct block_device *device, uint32_t max_sectors) {
+    memory_set((uint8_t *)queue, 0, sizeof(struct disk_queue));
+    queue->device = device;
+    queue->max_sectors = max_sectors;
+    wait_queue_init(&queue->wait);
+    queue->stats.since = queue->stats.last_change = rdtsc();
+}
+
+/**
+ * @brief      Starts the queue's dispatcher thread. Requests submitted before this were carried out synchronously.
+ * @ingroup    DISK_QUEUE
+ * @param      queue  The queue
+ */
+void disk_queue_start(struct disk_queue *queue) {
+    if(kthread_create(dispatcher, queue, 0) != NULL) queue->running = 1;
+}
+
+/**
+ * @brief      Queues a request. It completes asynchronously: see disk_queue_wait, or set request->end_io.
+ * @ingroup    DISK_QUEUE
+ * @note       A request with an end_io function belongs to the queue until end_io is called, and must not be waited on.
+ *
+ * @param      queue    The queue
+ * @param      request  The request, with lba, count, buffer, write, end_io and private filled in
+ */
+void disk_queue_submit(struct disk_queue *queue, struct disk_request *request) {
+    request->done = 0;
+    request->result = ATA_OK;
+    request->next = NULL;
+
+    if(!queue->running || !task_can_block()) {
+        uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+        account_submit(queue, request);
+        queue->submitted++;
+        queue->depth++;
+        account_dispatch(queue, request);
+        queue->head_lba = request->lba + request->count;
+        spin_unlock_irqrestore(&queue->wait.lock, flags);
+        request->result = run_one(queue, request);
+        complete(queue, &request, 1);
+        return;
+    }
+
+    request->deadline = timer_now_us() + (request->write ? DISK_WRITE_DEADLINE_US : DISK_READ_DEADLINE_US);
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    struct disk_request **link = &queue->pending;
+    while(*link != NULL && (*link)->lba <= request->lba) link = &(*link)->next;
+    request->next = *link;
+    *link = request;
+
+    account_submit(queue, request);
+    queue->submitted++;
+    queue->depth++;
+    if(queue->depth > queue->max_depth) queue->max_depth = queue->depth;
+    wait_queue_wake_locked(&queue->wait, (uint32_t)queue, 1);
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+}
+
+/**
+ * @brief      Sleeps until a request without an end_io function completes
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue    The queue it was submitted to
+ * @param      request  The request
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int disk_queue_wait(struct disk_queue *queue, struct disk_request *request) {
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    while(!request->done) {
+        wait_queue_sleep_locked(&queue->wait, (uint32_t)request, flags);
+        flags = spin_lock_irqsave(&queue->wait.lock);
+    }
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+    return request->result;
+}
+
+/**
+ * @brief      Reads sectors through the queue, sleeping until they arrive
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue           The queue
+ * @param[in]  target_address  The address to read the data into
+ * @param[in]  LBA             The first sector
+ * @param[in]  sector_count    How many sectors to read
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int disk_queue_read(struct disk_queue *queue, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    struct disk_request request = {
+        .lba = LBA,
+        .count = sector_count,
+        .buffer = (uint8_t *)target_address,
+        .write = 0,
+        .end_io = NULL
+    };
+    disk_queue_submit(queue, &request);
+    return disk_queue_wait(queue, &request);
+}
+
+/**
+ * @brief      Writes sectors through the queue, sleeping until they are written
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue         The queue
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors to write
+ * @param      bytes         The data
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int disk_queue_write(struct disk_queue *queue, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    struct disk_request request = {
+        .lba = LBA,
+        .count = sector_count,
+        .buffer = (uint8_t *)bytes,
+        .write = 1,
+        .end_io = NULL
+    };
+    disk_queue_submit(queue, &request);
+    return disk_queue_wait(queue, &request);
+}
+
+/**
+ * @brief      Tells the dispatcher that the device has finished commands. Safe from an interrupt handler.
+ * @ingroup    DISK_QUEUE
+ * @param      queue  The device's queue
+ */
+void disk_queue_kick(struct disk_queue *queue) {
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    queue->reap_requested = 1;
+    wait_queue_wake_locked(&queue->wait, (uint32_t)queue, 1);
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+}
+
+/**
+ * @brief      Hands back a command that a device's submit op started
+ * @ingroup    DISK_QUEUE
+ * @note       Called from the device's reap op, on the dispatcher, since end_io functions may sleep.
+ *
+ * @param      queue   The device's queue
+ * @param      batch   The requests the command carried, as passed to submit
+ * @param[in]  count   How many there are
+ * @param[in]  result  ATA_OK or an ATA_ERR_* code
+ */
+void disk_queue_finish(struct disk_queue *queue, struct disk_request **batch, uint32_t count, int result) {
+    uint32_t i;
+    for(i = 0; i < count; i++) batch[i]->result = result;
+    complete(queue, batch, count);
+
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    queue->in_flight--;
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+}
+
+/**
+ * @brief      Copies a queue's statistics, with the busy time and integrated depth brought up to now
+ * @ingroup    DISK_QUEUE
+ * @param      queue  The queue
+ * @param      stats  Filled in
+ */
+void disk_queue_get_stats(struct disk_queue *queue, struct disk_stats *stats) {
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    stats_advance(queue);
+    memory_copy((uint8_t *)&queue->stats, (uint8_t *)stats, sizeof(struct disk_stats));
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+}
+
+static void dispatcher(void *arg) {
+    struct disk_queue *queue = arg;
+    struct block_device *device = queue->device;
+    struct disk_request *batch[DISK_QUEUE_MERGE_MAX];
+    while(1) {
+        uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+        while(!queue->reap_requested && !can_dispatch(queue)) {
+            wait_queue_sleep_locked(&queue->wait, (uint32_t)queue, flags);
+            flags = spin_lock_irqsave(&queue->wait.lock);
+        }
+        uint8_t reap = queue->reap_requested;
+        queue->reap_requested = 0;
+        uint32_t count = can_dispatch(queue) ? take_batch(queue, batch) : 0;
+        if(count > 0) queue->in_flight++;
+        spin_unlock_irqrestore(&queue->wait.lock, flags);
+
+        if(reap) device->ops->reap(device);
+        if(count == 0) continue;
+
+        if(device->ops->submit != NULL) {
+            int result = device->ops->submit(device, batch, count);
+            if(result != ATA_OK) disk_queue_finish(queue, batch, count, result);
+            continue;
+        }
+        run_batch(queue, batch, count);
+        complete(queue, batch, count);
+        flags = spin_lock_irqsave(&queue->wait.lock);
+        queue->in_flight--;
+        spin_unlock_irqrestore(&queue->wait.lock, flags);
+    }
+}
+
+/**
+ * @brief      Checks whether the dispatcher can start another command
+ * @ingroup    DISK_QUEUE
+ * @note       Call with queue->wait.lock held.
+ */
+static uint8_t can_dispatch(struct disk_queue *queue) {
+    uint32_t limit = queue->device->ops->submit != NULL ? queue->device->queue_depth : 1;
+    return queue->pending != NULL && queue->in_flight < limit;
+}
+
+/**
+ * @brief      Takes the next request off the queue, with the requests that continue it
+ * @ingroup    DISK_QUEUE
+ * @note       Call with queue->wait.lock held, and at least one request pending.
+ *
+ * @param      queue  The queue
+ * @param      batch  Filled in with the requests, in LBA order
+ *
+ * @return     How many requests were taken
+ */
+static uint32_t take_batch(struct disk_queue *queue, struct disk_request **batch) {
+    uint64_t now = timer_now_us();
+    struct disk_request **link = NULL;
+    struct disk_request **expired = NULL;
+    struct disk_request **scan;
+    for(scan = &queue->pending; *scan != NULL; scan = &(*scan)->next) {
+        if((*scan)->deadline <= now && (expired == NULL || (*scan)->deadline < (*expired)->deadline)) expired = scan;
+        if(link == NULL && (*scan)->lba >= queue->head_lba) link = scan;
+    }
+    if(expired != NULL) {
+        link = expired;
+        queue->expired++;
+    } else if(link == NULL) {
+        link = &queue->pending; // Back to the lowest LBA
+    }
+
+    struct disk_request *first = *link;
+    *link = first->next;
+    batch[0] = first;
+    uint32_t count = 1;
+    uint32_t sectors = first->count;
+
+    // *link is now the request after first
+    while(*link != NULL && count < DISK_QUEUE_MERGE_MAX) {
+        struct disk_request *candidate = *link;
+        if(candidate->write != first->write || candidate->lba != first->lba + sectors) break;
+        if(sectors + candidate->count > queue->max_sectors) break;
+        *link = candidate->next;
+        batch[count++] = candidate;
+        sectors += candidate->count;
+    }
+
+    queue->dispatched++;
+    queue->merged += count - 1;
+    account_dispatch(queue, first);
+    queue->head_lba = first->lba + sectors;
+    return count;
+}
+
+/**
+ * @brief      Sends merged requests to the driver as one command, through a bounce buffer unless their buffers are
+ *             already laid out back to back
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue  The queue
+ * @param      batch  The requests, each continuing the one before it
+ * @param[in]  count  How many there are
+ */
+static void run_batch(struct disk_queue *queue, struct disk_request **batch, uint32_t count) {
+    uint32_t i;
+    uint32_t sectors = 0;
+    uint8_t adjacent = 1;
+    for(i = 0; i < count; i++) {
+        if(i > 0 && batch[i]->buffer != batch[i - 1]->buffer + batch[i - 1]->count * 512) adjacent = 0;
+        sectors += batch[i]->count;
+    }
+
+    struct disk_request *first = batch[0];
+    // Merges of two or more requests stay within max_sectors, so one bounce buffer that size serves them all
+    if(!adjacent && queue->bounce == NULL) queue->bounce = ta_alloc_align(queue->max_sectors * 512, 512);
+    uint8_t *buffer = adjacent ? first->buffer : queue->bounce;
+    if(buffer == NULL) {
+        for(i = 0; i < count; i++) batch[i]->result = run_one(queue, batch[i]);
+        return;
+    }
+
+    uint8_t *at;
+    if(!adjacent && first->write) {
+        for(i = 0, at = buffer; i < count; at += batch[i]->count * 512, i++) memory_copy(batch[i]->buffer, at, batch[i]->count * 512);
+    }
+    struct block_device *device = queue->device;
+    int result = first->write ? device->ops->write(device, first->lba, sectors, (uint16_t *)buffer)
+                              : device->ops->read(device, (uint32_t)buffer, first->lba, sectors);
+    if(!adjacent && !first->write && result == ATA_OK) {
+        for(i = 0, at = buffer; i < count; at += batch[i]->count * 512, i++) memory_copy(at, batch[i]->buffer, batch[i]->count * 512);
+    }
+
+    for(i = 0; i < count; i++) batch[i]->result = result;
+}
+
+static int run_one(struct disk_queue *queue, struct disk_request *request) {
+    struct block_device *device = queue->device;
+    if(request->write) return device->ops->write(device, request->lba, request->count, (uint16_t *)request->buffer);
+    return device->ops->read(device, (uint32_t)request->buffer, request->lba, request->count);
+}
+
+/**
+ * @brief      Hands finished requests back: end_io for those that have one, a wakeup for the rest
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue  The queue
+ * @param      batch  The requests, with their results set
+ * @param[in]  count  How many there are
+ */
+static void complete(struct disk_queue *queue, struct disk_request **batch, uint32_t count) {
+    uint32_t i;
+    // Requests may be freed by their end_io, or by a waiter as soon as done is set; nothing may touch them after
+    uint32_t handed_off = 0;
+    uint64_t now = rdtsc();
+    uint64_t waited = 0;
+    uint32_t failed = 0;
+    uint8_t write = batch[0]->write != 0;
+    uint64_t service = now - batch[0]->dispatched;
+    for(i = 0; i < count; i++) {
+        if(batch[i]->end_io != NULL) handed_off |= 1u << i;
+        if(batch[i]->result != ATA_OK) failed++;
+        waited += now - batch[i]->submitted;
+    }
+    for(i = 0; i < count; i++) {
+        if(handed_off & (1u << i)) batch[i]->end_io(batch[i]);
+    }
+    uint32_t flags = spin_lock_irqsave(&queue->wait.lock);
+    account_complete(queue, write, service, waited, failed);
+    for(i = 0; i < count; i++) {
+        queue->depth--;
+        if(handed_off & (1u << i)) continue;
+        batch[i]->done = 1;
+        wait_queue_wake_locked(&queue->wait, (uint32_t)batch[i], 1);
+    }
+    spin_unlock_irqrestore(&queue->wait.lock, flags);
+}
+
+/**
+ * @brief      Brings the busy time and the integrated depth up to now, before either changes
+ * @ingroup    DISK_QUEUE
+ * @note       Call with queue->wait.lock held.
+ *
+ * @param      queue  The queue
+ *
+ * @return     rdtsc now
+ */
+static uint64_t stats_advance(struct disk_queue *queue) {
+    struct disk_stats *stats = &queue->stats;
+    uint64_t now = rdtsc();
+    if(now > stats->last_change) { // Another cpu's TSC may be a little behind
+        uint64_t elapsed = now - stats->last_change;
+        stats->depth_cycles += elapsed * queue->depth;
+        if(stats->active > 0) stats->busy_cycles += elapsed;
+        stats->last_change = now;
+    }
+    return now;
+}
+
+/**
+ * @brief      Counts a request as it is queued. Call with queue->wait.lock held, before the depth goes up.
+ * @ingroup    DISK_QUEUE
+ */
+static void account_submit(struct disk_queue *queue, struct disk_request *request) {
+    request->submitted = stats_advance(queue);
+    uint8_t write = request->write != 0;
+    queue->stats.requests[write]++;
+    queue->stats.sectors[write] += request->count;
+}
+
+/**
+ * @brief      Counts a command as it goes to the device. Call with queue->wait.lock held, before head_lba moves.
+ * @ingroup    DISK_QUEUE
+ * @param      queue  The queue
+ * @param      first  The command's first request, which carries its start time
+ */
+static void account_dispatch(struct disk_queue *queue, struct disk_request *first) {
+    first->dispatched = stats_advance(queue);
+    if(first->lba != queue->head_lba) queue->stats.seeks++;
+    queue->stats.commands[first->write != 0]++;
+    queue->stats.active++;
+}
+
+/**
+ * @brief      Counts a finished command. Call with queue->wait.lock held, before the depth goes down.
+ * @ingroup    DISK_QUEUE
+ *
+ * @param      queue    The queue
+ * @param[in]  write    The command's direction
+ * @param[in]  service  Cycles from dispatch to completion
+ * @param[in]  waited   Cycles from submission to completion, summed over the command's requests
+ * @param[in]  failed   How many of its requests failed
+ */
+static void account_complete(struct disk_queue *queue, uint8_t write, uint64_t service, uint64_t waited, uint32_t failed) {
+    struct disk_stats *stats = &queue->stats;
+    stats_advance(queue);
+    stats->active--;
+    stats->errors += failed;
+    stats->service_cycles[write] += service;
+    if(service > stats->max_service_cycles[write]) stats->max_service_cycles[write] = service;
+    stats->wait_cycles[write] += waited;
+    stats->hist[write][hist_bucket(service)]++;
+}
+
+static uint8_t hist_bucket(uint64_t cycles) {
+    uint8_t bucket = 0;
+    cycles >>= 12;
+    while(cycles != 0 && bucket < DISK_STATS_HIST_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
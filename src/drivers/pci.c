@@ -0,0 +1,147 @@
+/**
+ * @defgroup   PCI pci
+ * @ingroup    DRIVERS
+ * @brief      This file implements PCI configuration space access (mechanism #1, ports 0xCF8/0xCFC) and device lookup.
+ *
+ * @par
+ * The first lookup walks every bus, slot and function once and keeps what it finds in a table; lookups after that
+ * search the table.
+ */
+#include <stdint.h>
+#include "drivers/pci.h"
+#include "cpu/ports.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+#define PCI_CONFIG_ENABLE  0x80000000
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static uint32_t device_count = 0;
+static uint8_t enumerated = 0;
+
+// Private function definitions
+static uint32_t config_read(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset);
+static void fill_device(struct pci_device *device, uint8_t bus, uint8_t slot, uint8_t function);
+static void enumerate();
+
+/**
+ * @brief      Reads a dword of a device's configuration space
+ * @ingroup    PCI
+ * @param      device  The device
+ * @param[in]  offset  The offset, a multiple of 4
+ * @return     The value
+ */
+uint32_t pci_config_read(struct pci_device *device, uint8_t offset) {
+    return config_read(device->bus, device->slot, device->function, offset);
+}
+
+/**
+ * @brief      Writes a dword of a device's configuration space
+ * @ingroup    PCI
+ * @param      device  The device
+ * @param[in]  offset  The offset, a multiple of 4
+ * @param[in]  value   The value
+ */
+void pci_config_write(struct pci_device *device, uint8_t offset, uint32_t value) {
+    port_dword_out(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (device->bus << 16) | (device->slot << 11) |
+                                       (device->function << 8) | (offset & 0xFC));
+    port_dword_out(PCI_CONFIG_DATA, value);
+}
+
+/**
+ * @brief      Gets every device on the PCI buses
+ * @ingroup    PCI
+ * @param      count  Set to the number of devices
+ * @return     The devices, in bus, slot and function order
+ */
+struct pci_device *pci_devices(uint32_t *count) {
+    if(!enumerated) enumerate();
+    *count = device_count;
+    return devices;
+}
+
+/**
+ * @brief      Finds the first device of a class
+ * @ingroup    PCI
+ * @param[in]  class_code  The class
+ * @param[in]  subclass    The subclass
+ * @param      device      Filled in with the device, if one is found
+ * @return     1 if a device was found, 0 otherwise
+ */
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device *device) {
+    if(!enumerated) enumerate();
+    uint32_t i;
+    for(i = 0; i < device_count; i++) {
+        if(devices[i].class_code != class_code || devices[i].subclass != subclass) continue;
+        *device = devices[i];
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief      Finds a device by its vendor and device ids
+ * @ingroup    PCI
+ * @param[in]  vendor_id  The vendor
+ * @param[in]  device_id  The device
+ * @param[in]  index      Which of several matching devices to find, counting from 0
+ * @param      device     Filled in with the device, if one is found
+ * @return     1 if a device was found, 0 otherwise
+ */
+uint8_t pci_find_device(uint16_t vendor_id, uint16_t device_id, uint32_t index, struct pci_device *device) {
+    if(!enumerated) enumerate();
+    uint32_t i;
+    for(i = 0; i < device_count; i++) {
+        if(devices[i].vendor_id != vendor_id || devices[i].device_id != device_id) continue;
+        if(index-- > 0) continue;
+        *device = devices[i];
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief      Sets bits of a device's command register, such as I/O decoding or bus mastering
+ * @ingroup    PCI
+ * @param      device        The device
+ * @param[in]  command_bits  The PCI_COMMAND_* bits to set
+ */
+void pci_enable(struct pci_device *device, uint16_t command_bits) {
+    // The status register shares the dword; writing it back as zero leaves its write-1-to-clear bits alone
+    uint32_t command = pci_config_read(device, PCI_COMMAND) & 0xFFFF;
+    pci_config_write(device, PCI_COMMAND, command | command_bits);
+}
+
+static uint32_t config_read(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
+    port_dword_out(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (bus << 16) | (slot << 11) | (function << 8) | (offset & 0xFC));
+    return port_dword_in(PCI_CONFIG_DATA);
+}
+
+static void fill_device(struct pci_device *device, uint8_t bus, uint8_t slot, uint8_t function) {
+    uint32_t id = config_read(bus, slot, function, PCI_VENDOR_ID);
+    uint32_t class = config_read(bus, slot, function, PCI_CLASS);
+    device->bus = bus;
+    device->slot = slot;
+    device->function = function;
+    device->vendor_id = id & 0xFFFF;
+    device->device_id = id >> 16;
+    device->class_code = class >> 24;
+    device->subclass = (class >> 16) & 0xFF;
+    device->prog_if = (class >> 8) & 0xFF;
+    device->irq_line = config_read(bus, slot, function, PCI_INTERRUPT) & 0xFF;
+}
+
+static void enumerate() {
+    uint32_t bus, slot, function;
+    for(bus = 0; bus < 256; bus++) {
+        for(slot = 0; slot < 32; slot++) {
+            if((config_read(bus, slot, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+            uint8_t functions = (config_read(bus, slot, 0, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION ? 8 : 1;
+            for(function = 0; function < functions && device_count < PCI_MAX_DEVICES; function++) {
+                if((config_read(bus, slot, function, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+                fill_device(&devices[device_count++], bus, slot, function);
+            }
+        }
+    }
+    enumerated = 1;
+}
@@ -0,0 +1,175 @@
+/**
+ * @defgroup   RAID0 raid0
+ * @ingroup    DRIVERS
+ * @brief      This file implements striping: a block device made of several others, which take turns holding its
+ *             stripes.
+ *
+ * @par
+ * Stripe n of the volume is stripe n / count of member n % count. A request is cut at stripe boundaries and the
+ * pieces are queued on their members together, so members on different channels or controllers work on them at
+ * the same time. The volume is as large as its smallest member allows, times the number of members.
+ *
+ * @par
+ * Volumes are named md0, md1 and so on. Nothing about them is written to the members: they have to be put together
+ * the same way on every boot.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/raid0.h"
+#include "drivers/block_device.h"
+#include "drivers/disk_queue.h"
+#include "drivers/ata.h"
+#include "libc/mem.h"
+#include "libc/math.h"
+
+struct raid0 {
+    struct block_device device;
+    struct block_device *members[RAID0_MAX_MEMBERS];
+    uint32_t count;
+    uint32_t stripe;            // Sectors
+    uint64_t sectors;
+};
+
+static uint32_t volumes_created = 0;
+
+// Private function definitions
+static int raid0_transfer(struct raid0 *raid, uint8_t *buffer, uint32_t LBA, uint32_t sector_count, uint8_t write);
+static int raid0_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int raid0_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int raid0_flush(struct block_device *device);
+static uint64_t raid0_capacity(struct block_device *device);
+static uint32_t raid0_optimal_sectors(struct block_device *device);
+
+static const struct block_device_ops raid0_ops = {
+    .read = raid0_read,
+    .write = raid0_write,
+    .flush = raid0_flush,
+    .capacity = raid0_capacity,
+    .optimal_sectors = raid0_optimal_sectors
+};
+
+/**
+ * @brief      Creates and registers a volume striped across devices
+ * @ingroup    RAID0
+ *
+ * @param      members         The devices, in stripe order
+ * @param[in]  count           How many there are, 2 to RAID0_MAX_MEMBERS
+ * @param[in]  stripe_sectors  The stripe size in sectors
+ *
+ * @return     The volume, or NULL if the arguments are out of range or there is no memory for it
+ */
+struct block_device *raid0_create(struct block_device **members, uint32_t count, uint32_t stripe_sectors) {
+    if(count < 2 || count > RAID0_MAX_MEMBERS || stripe_sectors == 0) return NULL;
+    uint64_t smallest = block_device_capacity(members[0]);
+    uint32_t i;
+    for(i = 1; i < count; i++) {
+        if(block_device_capacity(members[i]) < smallest) smallest = block_device_capacity(members[i]);
+    }
+    uint64_t stripes = udiv64(smallest, stripe_sectors, NULL);
+    if(stripes == 0) return NULL;
+
+    struct raid0 *raid = ta_alloc(sizeof(struct raid0));
+    if(raid == NULL) return NULL;
+    for(i = 0; i < count; i++) raid->members[i] = members[i];
+    raid->count = count;
+    raid->stripe = stripe_sectors;
+    raid->sectors = stripes * stripe_sectors * count;
+    if(raid->sectors > 0xFFFFFFFF) raid->sectors = 0xFFFFFFFF; // Block devices take 32-bit LBAs
+
+    char name[BLOCK_DEVICE_NAME] = "md";
+    char digits[BLOCK_DEVICE_NAME - 3];
+    uint32_t number = volumes_created++;
+    int length = 0;
+    int at = 2;
+    do {
+        digits[length++] = '0' + number % 10;
+        number /= 10;
+    } while(number > 0 && length < BLOCK_DEVICE_NAME - 3);
+    while(length > 0) name[at++] = digits[--length];
+    name[at] = '\0';
+
+    block_device_register(&raid->device, name, &raid0_ops, raid);
+    return &raid->device;
+}
+
+/**
+ * @brief      Cuts a request at stripe boundaries and queues the pieces on their members, RAID0_BATCH at a time
+ * @ingroup    RAID0
+ *
+ * @param      raid          The volume
+ * @param      buffer        The data
+ * @param[in]  LBA           The volume's first sector
+ * @param[in]  sector_count  How many sectors
+ * @param[in]  write         1 to write the buffer, 0 to read into it
+ *
+ * @return     ATA_OK, or the first error a member returned
+ */
+static int raid0_transfer(struct raid0 *raid, uint8_t *buffer, uint32_t LBA, uint32_t sector_count, uint8_t write) {
+    if((uint64_t)LBA + sector_count > raid->sectors) return ATA_ERR_RANGE;
+    struct disk_request requests[RAID0_BATCH];
+    struct block_device *targets[RAID0_BATCH];
+    int result = ATA_OK;
+    while(sector_count > 0 && result == ATA_OK) {
+        uint32_t pieces = 0;
+        while(sector_count > 0 && pieces < RAID0_BATCH) {
+            uint32_t stripe = LBA / raid->stripe;
+            uint32_t offset = LBA % raid->stripe;
+            uint32_t sectors = raid->stripe - offset;
+            if(sectors > sector_count) sectors = sector_count;
+
+            struct disk_request *request = &requests[pieces];
+            request->lba = stripe / raid->count * raid->stripe + offset;
+            request->count = sectors;
+            request->buffer = buffer;
+            request->write = write;
+            request->end_io = NULL;
+            targets[pieces] = raid->members[stripe % raid->count];
+            disk_queue_submit(&targets[pieces]->queue, request);
+            pieces++;
+
+            buffer += sectors * 512;
+            LBA += sectors;
+            sector_count -= sectors;
+        }
+
+        uint32_t i;
+        for(i = 0; i < pieces; i++) {
+            int piece = disk_queue_wait(&targets[i]->queue, &requests[i]);
+            if(result == ATA_OK) result = piece;
+        }
+    }
+    return result;
+}
+
+static int raid0_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    return raid0_transfer(device->private, (uint8_t *)target_address, LBA, sector_count, 0);
+}
+
+static int raid0_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    return raid0_transfer(device->private, (uint8_t *)bytes, LBA, sector_count, 1);
+}
+
+static int raid0_flush(struct block_device *device) {
+    struct raid0 *raid = device->private;
+    int result = ATA_OK;
+    uint32_t i;
+    for(i = 0; i < raid->count; i++) {
+        int member = block_device_flush(raid->members[i]);
+        if(result == ATA_OK) result = member;
+    }
+    return result;
+}
+
+static uint64_t raid0_capacity(struct block_device *device) {
+    struct raid0 *raid = device->private;
+    return raid->sectors;
+}
+
+/**
+ * @brief      Gets a full row of stripes, so that one request keeps every member busy
+ * @ingroup    RAID0
+ */
+static uint32_t raid0_optimal_sectors(struct block_device *device) {
+    struct raid0 *raid = device->private;
+    return raid->stripe * raid->count;
+}
@@ -0,0 +1,100 @@
+/**
+ * @defgroup   RAMDISK ramdisk
+ * @ingroup    DRIVERS
+ * @brief      This file implements a block device kept in memory, as a fast scratch volume and for benchmarking
+ *             the layers above the drivers without a disk's latency.
+ *
+ * @par
+ * RAM disks are named ram0, ram1 and so on, start zeroed, and are lost on reboot.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/ramdisk.h"
+#include "drivers/block_device.h"
+#include "drivers/ata.h"
+#include "libc/mem.h"
+#include "libc/function.h"
+
+struct ramdisk {
+    struct block_device device;
+    uint8_t *data;
+    uint32_t sectors;
+};
+
+static uint32_t ramdisks_created = 0;
+
+// Private function definitions
+static int ramdisk_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int ramdisk_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int ramdisk_flush(struct block_device *device);
+static uint64_t ramdisk_capacity(struct block_device *device);
+static uint32_t ramdisk_optimal_sectors(struct block_device *device);
+
+static const struct block_device_ops ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .flush = ramdisk_flush,
+    .capacity = ramdisk_capacity,
+    .optimal_sectors = ramdisk_optimal_sectors
+};
+
+/**
+ * @brief      Creates and registers a zeroed RAM disk
+ * @ingroup    RAMDISK
+ * @param[in]  sectors  Its size in 512-byte sectors
+ * @return     The device, or NULL without memory for it
+ */
+struct block_device *ramdisk_create(uint32_t sectors) {
+    struct ramdisk *disk = ta_alloc(sizeof(struct ramdisk));
+    if(disk == NULL) return NULL;
+    disk->data = ta_alloc(sectors * 512);
+    if(disk->data == NULL) {
+        ta_free(disk);
+        return NULL;
+    }
+    memory_set(disk->data, 0, sectors * 512);
+    disk->sectors = sectors;
+
+    char name[BLOCK_DEVICE_NAME] = "ram";
+    char digits[BLOCK_DEVICE_NAME - 4];
+    uint32_t number = ramdisks_created++;
+    int count = 0;
+    int i = 3;
+    do {
+        digits[count++] = '0' + number % 10;
+        number /= 10;
+    } while(number > 0 && count < BLOCK_DEVICE_NAME - 4);
+    while(count > 0) name[i++] = digits[--count];
+    name[i] = '\0';
+
+    block_device_register(&disk->device, name, &ramdisk_ops, disk);
+    return &disk->device;
+}
+
+static int ramdisk_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    struct ramdisk *disk = device->private;
+    if((uint64_t)LBA + sector_count > disk->sectors) return ATA_ERR_RANGE;
+    memory_copy(disk->data + LBA * 512, (uint8_t *)target_address, sector_count * 512);
+    return ATA_OK;
+}
+
+static int ramdisk_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    struct ramdisk *disk = device->private;
+    if((uint64_t)LBA + sector_count > disk->sectors) return ATA_ERR_RANGE;
+    memory_copy((uint8_t *)bytes, disk->data + LBA * 512, sector_count * 512);
+    return ATA_OK;
+}
+
+static int ramdisk_flush(struct block_device *device) {
+    UNUSED(device);
+    return ATA_OK;
+}
+
+static uint64_t ramdisk_capacity(struct block_device *device) {
+    return ((struct ramdisk *)device->private)->sectors;
+}
+
+static uint32_t ramdisk_optimal_sectors(struct block_device *device) {
+    UNUSED(device);
+    return RAMDISK_OPTIMAL_SECTORS;
+}
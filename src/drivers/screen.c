@@ -15,8 +15,10 @@
 #include "libc/mem.h"
 #include "kernel/windows.h"
 #include "cpu/task_manager.h"
+#include "cpu/spinlock.h"
 
 // Private function declarations
+static void print_at(char *message, int col, int row);
 static int get_cursor_offset();
 static void set_cursor_offset(int offset);
 static int print_char(char c, int col, int row, char attr);
@@ -27,6 +29,7 @@ static int get_offset_col(int offset);
 extern uint8_t is_alternate_process_running;
 
 static uint32_t *blocked_write_locations = NULL;
+static spinlock_t screen_lock = SPINLOCK_INIT;
 
 void clear_bwl() {
     if(blocked_write_locations != NULL) ta_free (blocked_write_locations);
@@ -65,7 +68,34 @@ void add_bwl(uint32_t new) {
  * @param[in]  row      The row
  */
 void kprint_at(char *message, int col, int row) {
-    asm volatile("cli");
+    uint32_t flags = spin_lock_irqsave(&screen_lock);
+    print_at(message, col, row);
+    spin_unlock_irqrestore(&screen_lock, flags);
+}
+
+/**
+ * @brief      Print a message at the specified location, preserving cursor position
+ * @ingroup    SCREEN
+ * @param      message  The message
+ * @param[in]  col      The col
+ * @param[in]  row      The row
+ */
+void kprint_at_preserve(char *message, int col, int row) {
+    uint32_t flags = spin_lock_irqsave(&screen_lock);
+    int offset = get_cursor_offset();
+    print_at(message, col, row);
+    set_cursor_offset(offset);
+    spin_unlock_irqrestore(&screen_lock, flags);
+}
+
+/**
+ * @brief      Prints a message at the specified location. The caller holds screen_lock.
+ * @ingroup    SCREEN
+ * @param      message  The message
+ * @param[in]  col      The column
+ * @param[in]  row      The row
+ */
+static void print_at(char *message, int col, int row) {
     /* Set cursor if col/row are negative */
     int offset;
     if (col >= 0 && row >= 0)
@@ -84,22 +114,6 @@ void kprint_at(char *message, int col, int row) {
         row = get_offset_row(offset);
         col = get_offset_col(offset);
     }
-    asm volatile("sti");
-}
-
-/**
- * @brief      Print a message at the specified location, preserving cursor position
- * @ingroup    SCREEN
- * @param      message  The message
- * @param[in]  col      The col
- * @param[in]  row      The row
- */
-void kprint_at_preserve(char *message, int col, int row) {
-    asm volatile("cli");
-    int offset = get_cursor_offset();
-    kprint_at(message, col, row);
-    set_cursor_offset(offset);
-    asm volatile("sti");
 }
 
 /**
@@ -126,10 +140,11 @@ void kprint(char *message) {
  * @ingroup    SCREEN
  */
 void kprint_backspace() {
-    asm volatile("cli");
+    uint32_t flags = spin_lock_irqsave(&screen_lock);
     uint32_t *current = blocked_write_locations;
     while(*current != 0) {
         if(get_cursor_offset() == *current) {
+            spin_unlock_irqrestore(&screen_lock, flags);
             return;
         }
         current++;
@@ -138,7 +153,7 @@ void kprint_backspace() {
     int row = get_offset_row(offset);
     int col = get_offset_col(offset);
     print_char(0x08, col, row, WHITE_ON_BLACK);
-    asm volatile("sti");
+    spin_unlock_irqrestore(&screen_lock, flags);
 }
 
 /**
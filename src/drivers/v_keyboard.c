@@ -10,6 +10,9 @@
 #include "libc/mem.h"
 #include "cpu/timer.h"
 #include "cpu/task_manager.h"
+#include "cpu/softirq.h"
+
+#define KEY_SHIFTED 0x100
 
 char* key_buffer = NULL;
 vf_ptr_s key_callback = NULL;
@@ -34,12 +37,13 @@ uint8_t keys_pressed[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
 
 
 
-static void default_keyboard_callback(registers_t *regs) { 
-    uint8_t scancode = port_byte_in(0x60);
-
-    if(scancode < 0x81) keys_pressed[scancode] = 1;
-    else                keys_pressed[scancode-0x80] = 0;
-
+/**
+ * @brief      Does the work for a key press, deferred out of the IRQ handler
+ *
+ * @param[in]  data  The scancode, with KEY_SHIFTED set if shift was held when it arrived
+ */
+static void keyboard_process(uint32_t data) {
+    uint8_t scancode = data & 0xFF;
     if(scancode < 0x81) {
         if (scancode == BACKSPACE) {
             backspace(key_buffer);
@@ -50,7 +54,7 @@ static void default_keyboard_callback(registers_t *regs) {
         }  else if (scancode == 0x1C) {
             append(key_buffer, 0x1C); 
         } else {                                                    
-            char letter = (keys_pressed[0x2A] || keys_pressed[0x36]) ? ascii_shift[(int) scancode] : ascii[(int) scancode];
+            char letter = (data & KEY_SHIFTED) ? ascii_shift[(int) scancode] : ascii[(int) scancode];
             char str[2] = {letter, '\0'}; 
             append(key_buffer, letter); 
             kprint(str);
@@ -62,6 +66,20 @@ static void default_keyboard_callback(registers_t *regs) {
     }
 
     if(key_callback != NULL) key_callback(key_buffer);
+}
+
+/**
+ * @brief      The IRQ1 handler. Only reads the scancode and tracks modifier state; the rest runs as deferred work.
+ *
+ * @param      regs  The registers state
+ */
+static void default_keyboard_callback(registers_t *regs) { 
+    uint8_t scancode = port_byte_in(0x60);
+
+    if(scancode < 0x81) keys_pressed[scancode] = 1;
+    else                keys_pressed[scancode-0x80] = 0;
+
+    softirq_raise(keyboard_process, scancode | ((keys_pressed[0x2A] || keys_pressed[0x36]) ? KEY_SHIFTED : 0));
 
     UNUSED(regs);
 }
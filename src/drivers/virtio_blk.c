@@ -0,0 +1,546 @@
+/**
+ * @defgroup   VIRTIO_BLK virtio_blk
+ * @ingroup    DRIVERS
+ * @brief      This file implements a driver for virtio block devices, the paravirtual disks of QEMU and most
+ *             hypervisors, through the legacy virtio-pci interface.
+ *
+ * @par
+ * The driver and the device share one virtqueue: a table of buffer descriptors, a ring of commands the driver has
+ * made available, and a ring of those the device has used. A command is a chain of descriptors: a header saying
+ * what to do and where, the data buffers, then a status byte the device fills in. The descriptor table is split
+ * into slots of VIRTIO_BLK_SEGMENTS + 2 descriptors, one per command in flight.
+ *
+ * @par
+ * The disk is registered as block device "vblk0" with submit and reap ops, so its disk queue keeps all but one of
+ * the slots busy; the last is left for synchronous callers. The interrupt handler only collects used commands and
+ * kicks the queue, whose dispatcher then finishes them. Synchronous reads and writes sleep until their command is
+ * used, or poll the used ring when they cannot sleep. A timer checks the ring every VIRTIO_BLK_POLL_US, in case an
+ * interrupt was lost or the line is routed somewhere the driver does not know about.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "drivers/virtio_blk.h"
+#include "drivers/block_device.h"
+#include "drivers/disk_queue.h"
+#include "drivers/ata.h"
+#include "drivers/pci.h"
+#include "cpu/ports.h"
+#include "cpu/isr.h"
+#include "cpu/timer.h"
+#include "cpu/timer_wheel.h"
+#include "cpu/wait_queue.h"
+#include "cpu/task_manager.h"
+#include "libc/function.h"
+#include "libc/mem.h"
+
+/* Legacy virtio-pci registers, in the I/O range at BAR0 */
+#define VIRTIO_DEVICE_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES  0x04
+#define VIRTIO_QUEUE_PFN       0x08 // Physical page of the virtqueue
+#define VIRTIO_QUEUE_SIZE      0x0C
+#define VIRTIO_QUEUE_SELECT    0x0E
+#define VIRTIO_QUEUE_NOTIFY    0x10
+#define VIRTIO_STATUS          0x12
+#define VIRTIO_ISR             0x13 // Reading it acknowledges the interrupt
+#define VIRTIO_CONFIG          0x14 // Device-specific configuration, when MSI-X is off
+
+#define VIRTIO_BLK_CAPACITY    (VIRTIO_CONFIG + 0)  // 64 bits, in 512-byte sectors
+#define VIRTIO_BLK_SEG_MAX     (VIRTIO_CONFIG + 12) // Most data buffers in one command
+
+#define STATUS_ACKNOWLEDGE 0x01
+#define STATUS_DRIVER      0x02
+#define STATUS_DRIVER_OK   0x04
+#define STATUS_FAILED      0x80
+
+#define FEATURE_SEG_MAX    (1 << 2)
+#define FEATURE_FLUSH      (1 << 9)
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2 // The device writes to the buffer
+#define VRING_ALIGN        4096
+
+#define VIRTIO_DMA_LIMIT   0x4fff000 // Memory below this is identity mapped in every address space
+
+struct vring_desc {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} __attribute__((packed));
+
+struct vring_used_elem {
+    uint32_t id;     // The head descriptor of the command
+    uint32_t length;
+} __attribute__((packed));
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t index;
+    struct vring_used_elem ring[];
+} __attribute__((packed));
+
+struct request_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed));
+
+/* A command, and who is waiting for it */
+struct slot {
+    struct request_header header;  // Read by the device
+    volatile uint8_t status;       // Written by the device
+    uint8_t in_use;
+    volatile uint8_t done;         // The device has used the command
+    uint8_t sync;                  // A synchronous caller waits for it. Otherwise reap finishes it.
+    struct disk_request *batch[DISK_QUEUE_MERGE_MAX]; // The disk queue's requests; none for synchronous commands
+    uint32_t count;
+    uint8_t *bounce;               // Holds the data when the callers' buffers could not be handed to the device
+};
+
+static uint16_t io_base;
+static uint16_t queue_size;
+static struct vring_desc *descriptors;
+static volatile struct vring_avail *avail;
+static volatile struct vring_used *used;
+static uint16_t last_used;      // Used ring entries before this one have been collected
+static uint32_t features;       // Those both sides agreed on
+static uint32_t segments;       // Data descriptors in a slot
+static uint32_t slot_count;
+static struct slot *slots;
+static uint64_t capacity;
+static struct wait_queue wait;  // Its lock guards the rings and the slots
+static struct timer poll_timer;
+static struct block_device device;
+
+// Private function definitions
+static struct slot *get_slot(uint8_t sync);
+static void put_slot(struct slot *slot);
+static uint16_t slot_head(struct slot *slot);
+static void fill_data(struct slot *slot, uint32_t index, uint8_t *buffer, uint32_t bytes, uint8_t write);
+static void issue(struct slot *slot, uint32_t type, uint64_t LBA, uint32_t data);
+static int wait_slot(struct slot *slot);
+static uint32_t collect();
+static int decode_status(uint8_t status);
+static uint8_t dma_usable(uint32_t address, uint32_t bytes);
+static int sync_transfer(uint32_t address, uint32_t LBA, uint32_t sector_count, uint8_t write);
+static void virtio_blk_interrupt(registers_t *regs);
+static void virtio_blk_poll(void *data);
+static int virtio_blk_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count);
+static int virtio_blk_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes);
+static int virtio_blk_flush(struct block_device *device);
+static uint64_t virtio_blk_capacity(struct block_device *device);
+static uint32_t virtio_blk_optimal_sectors(struct block_device *device);
+static int virtio_blk_submit(struct block_device *device, struct disk_request **batch, uint32_t count);
+static void virtio_blk_reap(struct block_device *device);
+
+static const struct block_device_ops virtio_blk_ops = {
+    .read = virtio_blk_read,
+    .write = virtio_blk_write,
+    .flush = virtio_blk_flush,
+    .capacity = virtio_blk_capacity,
+    .optimal_sectors = virtio_blk_optimal_sectors,
+    .submit = virtio_blk_submit,
+    .reap = virtio_blk_reap
+};
+
+/**
+ * @brief      Finds the first virtio block device on the PCI bus, sets up its virtqueue and registers it as "vblk0"
+ * @ingroup    VIRTIO_BLK
+ */
+void init_virtio_blk() {
+    struct pci_device pci;
+    if(!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, 0, &pci)) return;
+    uint32_t bar0 = pci_config_read(&pci, PCI_BAR0);
+    if(!(bar0 & PCI_BAR_IO) || (bar0 & 0xFFFC) == 0) return;
+    io_base = bar0 & 0xFFFC;
+    pci_enable(&pci, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    port_byte_out(io_base + VIRTIO_STATUS, 0); // Reset
+    port_byte_out(io_base + VIRTIO_STATUS, STATUS_ACKNOWLEDGE);
+    port_byte_out(io_base + VIRTIO_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+    features = port_dword_in(io_base + VIRTIO_DEVICE_FEATURES) & (FEATURE_SEG_MAX | FEATURE_FLUSH);
+    port_dword_out(io_base + VIRTIO_GUEST_FEATURES, features);
+
+    segments = VIRTIO_BLK_SEGMENTS;
+    if(features & FEATURE_SEG_MAX) {
+        uint32_t seg_max = port_dword_in(io_base + VIRTIO_BLK_SEG_MAX);
+        if(seg_max > 0 && seg_max < segments) segments = seg_max;
+    }
+    port_word_out(io_base + VIRTIO_QUEUE_SELECT, 0);
+    queue_size = port_word_in(io_base + VIRTIO_QUEUE_SIZE);
+    slot_count = queue_size / (segments + 2);
+    if(slot_count > VIRTIO_BLK_MAX_SLOTS) slot_count = VIRTIO_BLK_MAX_SLOTS;
+
+    // The legacy layout: descriptors, then the available ring, then the used ring on a page of its own
+    uint32_t avail_offset = queue_size * sizeof(struct vring_desc);
+    uint32_t used_offset = (avail_offset + 6 + 2 * queue_size + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1);
+    uint32_t ring_bytes = used_offset + ((6 + 8 * queue_size + VRING_ALIGN - 1) & ~(VRING_ALIGN - 1));
+    uint8_t *ring = slot_count > 0 ? ta_alloc_align(ring_bytes, VRING_ALIGN) : NULL;
+    slots = slot_count > 0 ? ta_alloc(sizeof(struct slot) * slot_count) : NULL;
+    if(ring == NULL || slots == NULL) {
+        if(ring != NULL) ta_free(ring);
+        if(slots != NULL) ta_free(slots);
+        port_byte_out(io_base + VIRTIO_STATUS, STATUS_FAILED);
+        return;
+    }
+    memory_set(ring, 0, ring_bytes);
+    memory_set((uint8_t *)slots, 0, sizeof(struct slot) * slot_count);
+    descriptors = (struct vring_desc *)ring;
+    avail = (struct vring_avail *)(ring + avail_offset);
+    used = (struct vring_used *)(ring + used_offset);
+    last_used = 0;
+    port_dword_out(io_base + VIRTIO_QUEUE_PFN, (uint32_t)ring / VRING_ALIGN);
+
+    capacity = port_dword_in(io_base + VIRTIO_BLK_CAPACITY) |
+               (uint64_t)port_dword_in(io_base + VIRTIO_BLK_CAPACITY + 4) << 32;
+
+    wait_queue_init(&wait);
+    // PCI lines are often shared. If this one is held exclusively, the poll timer alone finds completions.
+    if(pci.irq_line < 16) register_shared_interrupt_handler(IRQ0 + pci.irq_line, virtio_blk_interrupt);
+    port_byte_out(io_base + VIRTIO_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+    timer_init(&poll_timer, virtio_blk_poll, NULL);
+    timer_add_periodic(&poll_timer, VIRTIO_BLK_POLL_US);
+
+    device.queue_depth = slot_count > 1 ? slot_count - 1 : 1;
+    block_device_register(&device, "vblk0", &virtio_blk_ops, NULL);
+}
+
+static int virtio_blk_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    UNUSED(device);
+    return sync_transfer(target_address, LBA, sector_count, 0);
+}
+
+static int virtio_blk_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    UNUSED(device);
+    return sync_transfer((uint32_t)bytes, LBA, sector_count, 1);
+}
+
+static int virtio_blk_flush(struct block_device *device) {
+    UNUSED(device);
+    if(!(features & FEATURE_FLUSH)) return ATA_OK; // The device has no write cache to flush
+    struct slot *slot = get_slot(1);
+    if(slot == NULL) return ATA_ERR_TIMEOUT;
+    issue(slot, VIRTIO_BLK_T_FLUSH, 0, 0);
+    int result = wait_slot(slot);
+    if(result != ATA_ERR_TIMEOUT) put_slot(slot);
+    return result;
+}
+
+static uint64_t virtio_blk_capacity(struct block_device *device) {
+    UNUSED(device);
+    return capacity;
+}
+
+static uint32_t virtio_blk_optimal_sectors(struct block_device *device) {
+    UNUSED(device);
+    return VIRTIO_BLK_OPTIMAL;
+}
+
+/**
+ * @brief      Starts one command for requests from the disk queue, and returns without waiting for it
+ * @ingroup    VIRTIO_BLK
+ *
+ * @param      device  The device
+ * @param      batch   The requests, each continuing the one before it
+ * @param[in]  count   How many there are
+ *
+ * @return     ATA_OK, or an ATA_ERR_* code if the command could not be started
+ */
+static int virtio_blk_submit(struct block_device *device, struct disk_request **batch, uint32_t count) {
+    UNUSED(device);
+    uint32_t i;
+    uint32_t sectors = 0;
+    uint8_t direct = count <= segments;
+    for(i = 0; i < count; i++) {
+        if(!dma_usable((uint32_t)batch[i]->buffer, batch[i]->count * 512)) direct = 0;
+        sectors += batch[i]->count;
+    }
+    if((uint64_t)batch[0]->lba + sectors > capacity) return ATA_ERR_RANGE;
+
+    struct slot *slot = get_slot(0);
+    if(slot == NULL) return ATA_ERR_TIMEOUT;
+    uint8_t write = batch[0]->write;
+    if(direct) {
+        for(i = 0; i < count; i++) fill_data(slot, i, batch[i]->buffer, batch[i]->count * 512, write);
+    } else {
+        slot->bounce = ta_alloc_align(sectors * 512, 512);
+        if(slot->bounce == NULL) {
+            put_slot(slot);
+            return ATA_ERR_DEVICE;
+        }
+        uint8_t *at = slot->bounce;
+        for(i = 0; write && i < count; at += batch[i]->count * 512, i++) memory_copy(batch[i]->buffer, at, batch[i]->count * 512);
+        fill_data(slot, 0, slot->bounce, sectors * 512, write);
+    }
+    for(i = 0; i < count; i++) slot->batch[i] = batch[i];
+    slot->count = count;
+    issue(slot, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, batch[0]->lba, direct ? count : 1);
+    return ATA_OK;
+}
+
+/**
+ * @brief      Hands the disk queue's finished commands back to it. Runs on the dispatcher after disk_queue_kick.
+ * @ingroup    VIRTIO_BLK
+ * @param      device  The device
+ */
+static void virtio_blk_reap(struct block_device *device) {
+    collect();
+    uint32_t i;
+    for(i = 0; i < slot_count; i++) {
+        struct slot *slot = &slots[i];
+        uint32_t flags = spin_lock_irqsave(&wait.lock);
+        uint8_t finished = slot->in_use && slot->done && !slot->sync;
+        spin_unlock_irqrestore(&wait.lock, flags);
+        if(!finished) continue;
+
+        // A command without requests was given up on by a synchronous caller; it only has to be freed
+        if(slot->count > 0) {
+            int result = decode_status(slot->status);
+            if(result == ATA_OK && slot->bounce != NULL && !slot->batch[0]->write) {
+                uint8_t *at = slot->bounce;
+                uint32_t j;
+                for(j = 0; j < slot->count; at += slot->batch[j]->count * 512, j++) {
+                    memory_copy(at, slot->batch[j]->buffer, slot->batch[j]->count * 512);
+                }
+            }
+            disk_queue_finish(&device->queue, slot->batch, slot->count, result);
+        }
+        put_slot(slot);
+    }
+}
+
+/**
+ * @brief      Reads or writes sectors and waits for them, in commands of up to VIRTIO_BLK_OPTIMAL sectors
+ * @ingroup    VIRTIO_BLK
+ *
+ * @param[in]  address       The buffer
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ * @param[in]  write         1 to write the buffer to the disk, 0 to read into it
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+static int sync_transfer(uint32_t address, uint32_t LBA, uint32_t sector_count, uint8_t write) {
+    if((uint64_t)LBA + sector_count > capacity) return ATA_ERR_RANGE;
+    int result = ATA_OK;
+    while(sector_count > 0 && result == ATA_OK) {
+        uint32_t sectors = sector_count < VIRTIO_BLK_OPTIMAL ? sector_count : VIRTIO_BLK_OPTIMAL;
+        uint32_t bytes = sectors * 512;
+        struct slot *slot = get_slot(1);
+        if(slot == NULL) return ATA_ERR_TIMEOUT;
+
+        uint8_t *buffer = (uint8_t *)address;
+        if(!dma_usable(address, bytes)) {
+            slot->bounce = ta_alloc_align(bytes, 512);
+            if(slot->bounce == NULL) {
+                put_slot(slot);
+                return ATA_ERR_DEVICE;
+            }
+            if(write) memory_copy(buffer, slot->bounce, bytes);
+            buffer = slot->bounce;
+        }
+        fill_data(slot, 0, buffer, bytes, write);
+        issue(slot, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, LBA, 1);
+        result = wait_slot(slot);
+        if(result == ATA_ERR_TIMEOUT) return result; // The slot now belongs to reap
+        if(result == ATA_OK && !write && slot->bounce != NULL) memory_copy(slot->bounce, (uint8_t *)address, bytes);
+        put_slot(slot);
+
+        address += bytes;
+        LBA += sectors;
+        sector_count -= sectors;
+    }
+    return result;
+}
+
+/**
+ * @brief      Takes a free slot, sleeping for one if the caller can
+ * @ingroup    VIRTIO_BLK
+ * @param[in]  sync  1 if the caller will wait for the command itself, 0 if it is the disk queue's
+ * @return     The slot, or NULL if none is free and the caller cannot sleep
+ */
+static struct slot *get_slot(uint8_t sync) {
+    uint32_t flags = spin_lock_irqsave(&wait.lock);
+    while(1) {
+        uint32_t i;
+        for(i = 0; i < slot_count; i++) {
+            if(slots[i].in_use) continue;
+            slots[i].in_use = 1;
+            slots[i].done = 0;
+            slots[i].sync = sync;
+            slots[i].count = 0;
+            slots[i].bounce = NULL;
+            spin_unlock_irqrestore(&wait.lock, flags);
+            return &slots[i];
+        }
+        if(!task_can_block()) {
+            spin_unlock_irqrestore(&wait.lock, flags);
+            return NULL;
+        }
+        wait_queue_sleep_locked(&wait, (uint32_t)slots, flags);
+        flags = spin_lock_irqsave(&wait.lock);
+    }
+}
+
+static void put_slot(struct slot *slot) {
+    uint32_t flags = spin_lock_irqsave(&wait.lock);
+    uint8_t *bounce = slot->bounce;
+    slot->bounce = NULL;
+    slot->in_use = 0;
+    wait_queue_wake_locked(&wait, (uint32_t)slots, 1);
+    spin_unlock_irqrestore(&wait.lock, flags);
+    if(bounce != NULL) ta_free(bounce);
+}
+
+static uint16_t slot_head(struct slot *slot) {
+    return (slot - slots) * (segments + 2);
+}
+
+/**
+ * @brief      Points one of a slot's data descriptors at a buffer
+ * @ingroup    VIRTIO_BLK
+ *
+ * @param      slot    The slot
+ * @param[in]  index   Which data descriptor, below segments
+ * @param      buffer  The buffer, in identity-mapped memory
+ * @param[in]  bytes   Its length
+ * @param[in]  write   1 if the device reads the buffer, 0 if it fills it
+ */
+static void fill_data(struct slot *slot, uint32_t index, uint8_t *buffer, uint32_t bytes, uint8_t write) {
+    struct vring_desc *descriptor = &descriptors[slot_head(slot) + 1 + index];
+    descriptor->address = (uint32_t)buffer;
+    descriptor->length = bytes;
+    descriptor->flags = write ? 0 : VRING_DESC_F_WRITE;
+}
+
+/**
+ * @brief      Chains a slot's header, data and status descriptors, and makes the command available to the device
+ * @ingroup    VIRTIO_BLK
+ *
+ * @param      slot  The slot, with its data descriptors filled in
+ * @param[in]  type  VIRTIO_BLK_T_IN, _OUT or _FLUSH
+ * @param[in]  LBA   The first sector
+ * @param[in]  data  How many data descriptors the command uses
+ */
+static void issue(struct slot *slot, uint32_t type, uint64_t LBA, uint32_t data) {
+    uint16_t head = slot_head(slot);
+    slot->header.type = type;
+    slot->header.reserved = 0;
+    slot->header.sector = LBA;
+    slot->status = 0xFF;
+
+    descriptors[head].address = (uint32_t)&slot->header;
+    descriptors[head].length = sizeof(struct request_header);
+    descriptors[head].flags = 0;
+    uint32_t i;
+    for(i = 0; i <= data; i++) {
+        descriptors[head + i].flags |= VRING_DESC_F_NEXT;
+        descriptors[head + i].next = head + i + 1;
+    }
+    struct vring_desc *status = &descriptors[head + 1 + data];
+    status->address = (uint32_t)&slot->status;
+    status->length = 1;
+    status->flags = VRING_DESC_F_WRITE;
+    status->next = 0;
+
+    uint32_t flags = spin_lock_irqsave(&wait.lock);
+    avail->ring[avail->index % queue_size] = head;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // The device must see the descriptors before the new index
+    avail->index++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    spin_unlock_irqrestore(&wait.lock, flags);
+    port_word_out(io_base + VIRTIO_QUEUE_NOTIFY, 0);
+}
+
+/**
+ * @brief      Waits for a synchronous command. Tasks sleep; callers that cannot sleep poll the used ring.
+ * @ingroup    VIRTIO_BLK
+ * @param      slot  The slot
+ * @return     ATA_OK, an ATA_ERR_* code, or ATA_ERR_TIMEOUT if a poller gave up, in which case the slot is left for
+ *             reap to free whenever the device is done with it
+ */
+static int wait_slot(struct slot *slot) {
+    uint32_t flags;
+    if(task_can_block()) {
+        flags = spin_lock_irqsave(&wait.lock);
+        while(!slot->done) {
+            wait_queue_sleep_locked(&wait, (uint32_t)&slot->done, flags);
+            flags = spin_lock_irqsave(&wait.lock);
+        }
+        spin_unlock_irqrestore(&wait.lock, flags);
+        return decode_status(slot->status);
+    }
+
+    uint64_t deadline = timer_now_us() + VIRTIO_BLK_TIMEOUT_US;
+    while(!slot->done) {
+        if(collect() > 0) disk_queue_kick(&device.queue);
+        if(timer_now_us() <= deadline) continue;
+        flags = spin_lock_irqsave(&wait.lock);
+        uint8_t done = slot->done;
+        if(!done) slot->sync = 0;
+        spin_unlock_irqrestore(&wait.lock, flags);
+        if(!done) return ATA_ERR_TIMEOUT;
+    }
+    return decode_status(slot->status);
+}
+
+/**
+ * @brief      Marks the commands the device has used since the last call as done, and wakes their synchronous
+ *             callers
+ * @ingroup    VIRTIO_BLK
+ * @return     How many of them reap has to finish
+ */
+static uint32_t collect() {
+    uint32_t finished = 0;
+    uint32_t flags = spin_lock_irqsave(&wait.lock);
+    while(last_used != used->index) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // Read the entry only after seeing the index
+        struct slot *slot = &slots[used->ring[last_used % queue_size].id / (segments + 2)];
+        last_used++;
+        slot->done = 1;
+        if(slot->sync) wait_queue_wake_locked(&wait, (uint32_t)&slot->done, 1);
+        else finished++;
+    }
+    spin_unlock_irqrestore(&wait.lock, flags);
+    return finished;
+}
+
+static int decode_status(uint8_t status) {
+    if(status == VIRTIO_BLK_S_OK)     return ATA_OK;
+    if(status == VIRTIO_BLK_S_UNSUPP) return ATA_ERR_ABORTED;
+    return ATA_ERR_DEVICE;
+}
+
+static uint8_t dma_usable(uint32_t address, uint32_t bytes) {
+    return address + bytes <= VIRTIO_DMA_LIMIT;
+}
+
+/**
+ * @brief      Handles the device's interrupt. Reading the ISR register acknowledges it.
+ * @ingroup    VIRTIO_BLK
+ * @param      regs  The current register state
+ */
+static void virtio_blk_interrupt(registers_t *regs) {
+    port_byte_in(io_base + VIRTIO_ISR);
+    if(collect() > 0) disk_queue_kick(&device.queue);
+    UNUSED(regs);
+}
+
+static void virtio_blk_poll(void *data) {
+    if(collect() > 0) disk_queue_kick(&device.queue);
+    UNUSED(data);
+}
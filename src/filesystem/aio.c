@@ -0,0 +1,217 @@
+/**
+ * @defgroup   AIO aio
+ * @ingroup    FILESYSTEM
+ * @brief      This file implements asynchronous disk I/O, so one task can keep several operations in flight and
+ *             compute while they run.
+ *
+ * @par
+ * A task creates a context, submits reads and writes to it by LBA or by offset in an open file, each with a token of
+ * its choosing, and later reaps the tokens of finished operations with aio_poll or aio_wait. Operations go to the
+ * device's request queue, which may reorder and merge them; the finished ones appear in the context in the order they
+ * complete.
+ *
+ * @par
+ * Like direct I/O, operations go around the block cache: dirty cached sectors are written back first, and a write
+ * drops the cached copies of the sectors it covers and keeps the cache from taking them in again until it is done.
+ * Buffers must stay valid until the operation is reaped.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "filesystem/aio.h"
+#include "filesystem/block_cache.h"
+#include "drivers/ata.h"
+#include "drivers/block_device.h"
+#include "drivers/disk_queue.h"
+#include "cpu/wait_queue.h"
+#include "libc/mem.h"
+
+/* An operation in flight */
+struct aio_operation {
+    struct disk_request request;
+    struct aio_context *context;
+    uint32_t token;
+    struct block_cache_write cache_write; /* Registered for writes */
+};
+
+// Private function definitions
+static void aio_complete(struct disk_request *request);
+static uint32_t reap(struct aio_context *context, struct aio_event *events, uint32_t max);
+
+/**
+ * @brief      Creates an empty completion queue
+ * @ingroup    AIO
+ * @return     The context, or NULL without memory for it. <b>Must be freed with aio_destroy</b>
+ */
+struct aio_context *aio_create() {
+    struct aio_context *context = ta_alloc(sizeof(struct aio_context));
+    if(context == NULL) return NULL;
+    wait_queue_init(&context->wait);
+    context->head = 0;
+    context->ready = 0;
+    context->in_flight = 0;
+    return context;
+}
+
+/**
+ * @brief      Waits for a context's operations to finish, discards their events and frees it
+ * @ingroup    AIO
+ * @param      context  The context
+ */
+void aio_destroy(struct aio_context *context) {
+    uint32_t flags = spin_lock_irqsave(&context->wait.lock);
+    while(context->in_flight > 0) {
+        wait_queue_sleep_locked(&context->wait, WAIT_KEY_ANY, flags);
+        flags = spin_lock_irqsave(&context->wait.lock);
+    }
+    spin_unlock_irqrestore(&context->wait.lock, flags);
+    ta_free(context);
+}
+
+/**
+ * @brief      Starts reading or writing sectors
+ * @ingroup    AIO
+ *
+ * @param      context       The context whose queue gets the completion
+ * @param      device        The device
+ * @param[in]  write         1 to write the buffer to the disk, 0 to read into it
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ * @param      buffer        The data, which must stay valid until the operation is reaped
+ * @param[in]  token         Returned in the operation's aio_event
+ *
+ * @return     ATA_OK if the operation was started, or an AIO_ERR_* or ATA_ERR_* code
+ */
+int aio_submit(struct aio_context *context, struct block_device *device, uint8_t write, uint32_t LBA,
+               uint32_t sector_count, void *buffer, uint32_t token) {
+    uint32_t flags = spin_lock_irqsave(&context->wait.lock);
+    if(context->in_flight + context->ready >= AIO_QUEUE_DEPTH) {
+        spin_unlock_irqrestore(&context->wait.lock, flags);
+        return AIO_ERR_BUSY;
+    }
+    context->in_flight++; // Holds the operation's slot in events
+    spin_unlock_irqrestore(&context->wait.lock, flags);
+
+    struct aio_operation *operation = ta_alloc(sizeof(struct aio_operation));
+    if(operation != NULL && write) block_cache_write_begin(&operation->cache_write, device, LBA, sector_count);
+    int result = operation != NULL ? block_cache_sync_range(device, LBA, sector_count, write) : AIO_ERR_NOMEM;
+    if(result != ATA_OK) {
+        if(operation != NULL && write) block_cache_write_end(&operation->cache_write);
+        if(operation != NULL) ta_free(operation);
+        flags = spin_lock_irqsave(&context->wait.lock);
+        context->in_flight--;
+        wait_queue_wake_locked(&context->wait, WAIT_KEY_ANY, 1);
+        spin_unlock_irqrestore(&context->wait.lock, flags);
+        return result;
+    }
+
+    operation->request.lba = LBA;
+    operation->request.count = sector_count;
+    operation->request.buffer = buffer;
+    operation->request.write = write;
+    operation->request.end_io = aio_complete;
+    operation->request.private = operation;
+    operation->context = context;
+    operation->token = token;
+    disk_queue_submit(&device->queue, &operation->request);
+    return ATA_OK;
+}
+
+/**
+ * @brief      Starts reading or writing part of an open file. Writes cannot make the file longer.
+ * @ingroup    AIO
+ *
+ * @param      context     The context whose queue gets the completion
+ * @param[in]  write       1 to write the buffer to the file, 0 to read into it
+ * @param      file        The open file
+ * @param[in]  offset      Where to start, in bytes; a multiple of 512
+ * @param      buffer      The data, which must stay valid until the operation is reaped
+ * @param[in]  size_bytes  How much to transfer; a multiple of 512
+ * @param[in]  token       Returned in the operation's aio_event
+ *
+ * @return     ATA_OK if the operation was started, or an AIO_ERR_* or ATA_ERR_* code
+ */
+int aio_submit_file(struct aio_context *context, uint8_t write, struct open_file *file, uint32_t offset,
+                    void *buffer, uint32_t size_bytes, uint32_t token) {
+    if(offset % 512 != 0 || size_bytes % 512 != 0) return AIO_ERR_ALIGN;
+    uint32_t first = offset / 512;
+    uint32_t count = size_bytes / 512;
+    if(first > file->length || count > file->length - first) return AIO_ERR_RANGE;
+    return aio_submit(context, file->device, write, file->lba + first, count, buffer, token);
+}
+
+/**
+ * @brief      Reaps finished operations without waiting
+ * @ingroup    AIO
+ *
+ * @param      context  The context
+ * @param      events   Filled in with the operations, in the order they finished
+ * @param[in]  max      The most to reap
+ *
+ * @return     How many were reaped
+ */
+uint32_t aio_poll(struct aio_context *context, struct aio_event *events, uint32_t max) {
+    uint32_t flags = spin_lock_irqsave(&context->wait.lock);
+    uint32_t reaped = reap(context, events, max);
+    spin_unlock_irqrestore(&context->wait.lock, flags);
+    return reaped;
+}
+
+/**
+ * @brief      Sleeps until at least min operations have finished, or none are left in flight, and reaps them
+ * @ingroup    AIO
+ *
+ * @param      context  The context
+ * @param      events   Filled in with the operations, in the order they finished
+ * @param[in]  min      How many to wait for
+ * @param[in]  max      The most to reap
+ *
+ * @return     How many were reaped
+ */
+uint32_t aio_wait(struct aio_context *context, struct aio_event *events, uint32_t min, uint32_t max) {
+    if(min > max) min = max;
+    uint32_t flags = spin_lock_irqsave(&context->wait.lock);
+    while(context->ready < min && context->in_flight > 0) {
+        wait_queue_sleep_locked(&context->wait, WAIT_KEY_ANY, flags);
+        flags = spin_lock_irqsave(&context->wait.lock);
+    }
+    uint32_t reaped = reap(context, events, max);
+    spin_unlock_irqrestore(&context->wait.lock, flags);
+    return reaped;
+}
+
+/**
+ * @brief      Queues an operation's event in its context. Runs on the disk queue's dispatcher.
+ * @ingroup    AIO
+ * @param      request  The operation's request
+ */
+static void aio_complete(struct disk_request *request) {
+    struct aio_operation *operation = request->private;
+    struct aio_context *context = operation->context;
+    if(request->write) block_cache_write_end(&operation->cache_write);
+
+    uint32_t flags = spin_lock_irqsave(&context->wait.lock);
+    struct aio_event *event = &context->events[(context->head + context->ready) % AIO_QUEUE_DEPTH];
+    event->token = operation->token;
+    event->result = request->result;
+    event->bytes = request->result == ATA_OK ? request->count * 512 : 0;
+    context->ready++;
+    context->in_flight--;
+    wait_queue_wake_locked(&context->wait, WAIT_KEY_ANY, 1);
+    spin_unlock_irqrestore(&context->wait.lock, flags);
+    ta_free(operation);
+}
+
+/**
+ * @brief      Takes events off a context's queue
+ * @ingroup    AIO
+ * @note       Call with context->wait.lock held.
+ */
+static uint32_t reap(struct aio_context *context, struct aio_event *events, uint32_t max) {
+    uint32_t reaped = 0;
+    while(reaped < max && context->ready > 0) {
+        events[reaped++] = context->events[context->head];
+        context->head = (context->head + 1) % AIO_QUEUE_DEPTH;
+        context->ready--;
+    }
+    return reaped;
+}
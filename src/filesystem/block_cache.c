@@ -0,0 +1,662 @@
+/**
+ * @defgroup   BLOCK_CACHE block_cache
+ * @ingroup    FILESYSTEM
+ * @brief      This file implements a write-back cache of disk sectors between the filesystem and the block devices.
+ *
+ * @par
+ * Cached sectors are found through a hash of their device and LBA and evicted with the CLOCK algorithm: a sector that was used
+ * since the hand last passed it gets a second chance. Writes only mark sectors dirty; they reach the disk when they
+ * are evicted, when block_cache_flush is called, or from the flusher thread, which a periodic timer wakes every
+ * BLOCK_CACHE_FLUSH_US, after which the devices are asked to make the data durable. All disk access goes through the
+ * devices' request queues, which merge neighbouring sectors.
+ *
+ * @par
+ * Requests longer than BLOCK_CACHE_BYPASS sectors go to the disk directly, merged with whatever the cache holds for
+ * the same sectors, so one large file does not push out the metadata everything else keeps re-reading.
+ *
+ * @par
+ * block_cache_prefetch reads ahead asynchronously. The disk queue's dispatcher cannot take cache_mutex, so finished
+ * read-aheads wait on a list until the next read or prefetch moves them into the cache. A read that reaches sectors
+ * a read-ahead is still fetching waits for it rather than reading them a second time.
+ *
+ * @par
+ * Writes that go around the cache, like aio's, are registered with block_cache_write_begin while they are in
+ * flight. The elevator may serve a read of the same sectors before them, so no read or read-ahead that finishes in
+ * the meantime is cached.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "filesystem/block_cache.h"
+#include "drivers/ata.h"
+#include "drivers/disk_queue.h"
+#include "drivers/block_device.h"
+#include "cpu/mutex.h"
+#include "cpu/spinlock.h"
+#include "cpu/wait_queue.h"
+#include "cpu/timer_wheel.h"
+#include "cpu/task_manager.h"
+#include "libc/mem.h"
+#include "libc/function.h"
+
+#define NO_LBA 0xFFFFFFFF
+#define WAKE_ALL 0xFFFFFFFF
+
+/* A read-ahead in flight, or finished and waiting to be moved into the cache */
+struct prefetch {
+    struct disk_request request;
+    struct block_device *device;
+    uint32_t epoch;             /* write_epoch when it was submitted */
+    volatile uint8_t done;      /* On the finished list; set under prefetch_wait's lock */
+    uint8_t absorbed;           /* Off the pending list, its sectors moved into the cache */
+    uint32_t waiters;           /* Reads waiting for it, which free it if it was absorbed meanwhile */
+    struct prefetch *next;      /* On the finished list */
+    struct prefetch *pending_next;
+};
+
+struct cache_block {
+    struct block_device *device;
+    uint32_t lba;               /* NO_LBA if the block is free */
+    uint8_t dirty;
+    uint8_t referenced;         /* Used since the clock hand last passed */
+    uint8_t *data;
+    struct cache_block *hash_next;
+};
+
+static struct cache_block blocks[BLOCK_CACHE_BLOCKS];
+static struct cache_block *buckets[BLOCK_CACHE_BUCKETS];
+static uint32_t clock_hand = 0;
+static struct block_cache_stats stats;
+static volatile uint32_t write_epoch = 0; // Bumped by every write to the disk, see block_cache_disk_written
+static struct mutex cache_mutex; // Guards everything above; held across disk writes, but not reads
+
+static struct prefetch *pending = NULL;    // Read-aheads not yet absorbed, guarded by cache_mutex
+static struct prefetch *prefetched = NULL; // Finished read-aheads, guarded by prefetch_wait's lock
+static struct wait_queue prefetch_wait = WAIT_QUEUE_INIT;
+
+static struct block_cache_write *direct_writes = NULL; // In flight around the cache, guarded by direct_writes_lock
+static spinlock_t direct_writes_lock = SPINLOCK_INIT;
+
+static struct timer flush_timer;
+static struct wait_queue flush_queue;
+static volatile uint8_t flush_requested = 0;
+
+// Private function definitions
+static struct cache_block *lookup(struct block_device *device, uint32_t lba);
+static struct cache_block *allocate(struct block_device *device, uint32_t lba);
+static void hash_remove(struct cache_block *block);
+static int write_back(struct cache_block **dirty, uint32_t count);
+static int flush_locked(struct block_device *device, uint32_t LBA, uint32_t sector_count);
+static void start_prefetch(struct block_device *device, uint32_t LBA, uint32_t sector_count);
+static void prefetch_done(struct disk_request *request);
+static void absorb_prefetches();
+static struct prefetch *find_prefetch(struct block_device *device, uint32_t lba);
+static void wait_prefetch(struct prefetch *prefetch);
+static void free_prefetch(struct prefetch *prefetch);
+static uint8_t being_written(struct block_device *device, uint32_t lba);
+static void flush_tick(void *data);
+static void flusher(void *arg);
+
+/**
+ * @brief      Sets up the cache, and the flusher thread with its periodic timer
+ * @ingroup    BLOCK_CACHE
+ */
+void init_block_cache() {
+    mutex_init(&cache_mutex, "block cache");
+    wait_queue_init(&flush_queue);
+
+    uint8_t *data = ta_alloc_align(BLOCK_CACHE_BLOCKS * 512, 512);
+    int i;
+    for(i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        blocks[i].device = NULL;
+        blocks[i].lba = NO_LBA;
+        blocks[i].dirty = 0;
+        blocks[i].referenced = 0;
+        blocks[i].data = data + i * 512;
+        blocks[i].hash_next = NULL;
+    }
+    for(i = 0; i < BLOCK_CACHE_BUCKETS; i++) buckets[i] = NULL;
+
+    kthread_create(flusher, NULL, 0);
+    timer_init(&flush_timer, flush_tick, NULL);
+    timer_add_periodic(&flush_timer, BLOCK_CACHE_FLUSH_US);
+}
+
+/**
+ * @brief      Reads sectors through the cache
+ * @ingroup    BLOCK_CACHE
+ *
+ * @param      device          The device
+ * @param[in]  target_address  The address to read the data into
+ * @param[in]  LBA             The first sector
+ * @param[in]  sector_count    How many sectors to read
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int block_cache_read(struct block_device *device, uint32_t target_address, uint32_t LBA, uint32_t sector_count) {
+    uint8_t *target = (uint8_t *)target_address;
+    uint8_t bypass = sector_count > BLOCK_CACHE_BYPASS;
+    int result = ATA_OK;
+    uint32_t i = 0;
+
+    mutex_lock(&cache_mutex);
+    absorb_prefetches();
+    while(i < sector_count && result == ATA_OK) {
+        struct cache_block *block = lookup(device, LBA + i);
+        if(block != NULL) {
+            memory_copy(block->data, target + i * 512, 512);
+            block->referenced = 1;
+            stats.hits++;
+            i++;
+            continue;
+        }
+
+        struct prefetch *prefetch = find_prefetch(device, LBA + i);
+        if(prefetch != NULL) {
+            // Already on its way: wait for the read-ahead, then look again
+            prefetch->waiters++;
+            mutex_unlock(&cache_mutex);
+            wait_prefetch(prefetch);
+            mutex_lock(&cache_mutex);
+            absorb_prefetches();
+            if(--prefetch->waiters == 0) free_prefetch(prefetch);
+            // If its sectors could not be cached, the prefetch is gone and they are read below
+            if(lookup(device, LBA + i) != NULL) continue;
+        }
+
+        // Read the whole run of missing sectors with one command, letting other tasks use the cache meanwhile
+        uint32_t run = 1;
+        while(i + run < sector_count && lookup(device, LBA + i + run) == NULL &&
+              find_prefetch(device, LBA + i + run) == NULL) run++;
+        stats.misses += run;
+        uint32_t epoch = write_epoch;
+        mutex_unlock(&cache_mutex);
+        result = block_device_read(device, (uint32_t)(target + i * 512), LBA + i, run);
+        mutex_lock(&cache_mutex);
+        if(result == ATA_OK) {
+            uint32_t j;
+            for(j = 0; j < run; j++) {
+                block = lookup(device, LBA + i + j);
+                if(block != NULL) {
+                    // Cached, and maybe written, while the read was in flight: that copy is the newer one
+                    memory_copy(block->data, target + (i + j) * 512, 512);
+                    continue;
+                }
+                // A write that reached the disk meanwhile, or is still on its way, may have been ordered after the read
+                if(bypass || epoch != write_epoch || being_written(device, LBA + i + j)) continue;
+                block = allocate(device, LBA + i + j);
+                if(block == NULL) break;
+                memory_copy(target + (i + j) * 512, block->data, 512);
+            }
+        }
+        i += run;
+    }
+    mutex_unlock(&cache_mutex);
+    return result;
+}
+
+/**
+ * @brief      Starts reading sectors into the cache in the background, so a later block_cache_read finds them there
+ * @ingroup    BLOCK_CACHE
+ *
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors to read
+ */
+void block_cache_prefetch(struct block_device *device, uint32_t LBA, uint32_t sector_count) {
+    uint32_t i = 0;
+    mutex_lock(&cache_mutex);
+    absorb_prefetches();
+    while(i < sector_count) {
+        if(lookup(device, LBA + i) != NULL || find_prefetch(device, LBA + i) != NULL) {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while(i + run < sector_count && lookup(device, LBA + i + run) == NULL &&
+              find_prefetch(device, LBA + i + run) == NULL) run++;
+        start_prefetch(device, LBA + i, run);
+        i += run;
+    }
+    mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief      Writes sectors through the cache. Short writes are only marked dirty; see block_cache_flush.
+ * @ingroup    BLOCK_CACHE
+ *
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors to write
+ * @param      bytes         The data
+ *
+ * @return     ATA_OK or an ATA_ERR_* code
+ */
+int block_cache_write(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint16_t *bytes) {
+    uint8_t *source = (uint8_t *)bytes;
+    int result = ATA_OK;
+    uint32_t i;
+
+    mutex_lock(&cache_mutex);
+    if(sector_count > BLOCK_CACHE_BYPASS) {
+        // Written through; cached copies are refreshed so they stay current
+        result = block_device_write(device, LBA, sector_count, bytes);
+        block_cache_disk_written();
+        for(i = 0; i < sector_count; i++) {
+            struct cache_block *block = lookup(device, LBA + i);
+            if(block == NULL) continue;
+            memory_copy(source + i * 512, block->data, 512);
+            if(block->dirty && result == ATA_OK) stats.dirty--;
+            if(result == ATA_OK) block->dirty = 0;
+        }
+        mutex_unlock(&cache_mutex);
+        return result;
+    }
+
+    for(i = 0; i < sector_count; i++) {
+        struct cache_block *block = lookup(device, LBA + i);
+        if(block == NULL) block = allocate(device, LBA + i);
+        if(block == NULL) {
+            // Every block was dirty and writing one back failed; fall back to writing through
+            result = block_device_write(device, LBA + i, 1, (uint16_t *)(source + i * 512));
+            block_cache_disk_written();
+            if(result != ATA_OK) break;
+            continue;
+        }
+        memory_copy(source + i * 512, block->data, 512);
+        block->referenced = 1;
+        if(!block->dirty) stats.dirty++;
+        block->dirty = 1;
+    }
+    mutex_unlock(&cache_mutex);
+    return result;
+}
+
+/**
+ * @brief      Writes every dirty sector to its device, then asks the devices that were written to make it durable
+ * @ingroup    BLOCK_CACHE
+ * @return     ATA_OK or the first ATA_ERR_* code; sectors that failed stay dirty
+ */
+int block_cache_flush() {
+    mutex_lock(&cache_mutex);
+    uint32_t written = stats.writebacks;
+    int result = flush_locked(NULL, 0, NO_LBA);
+    written = stats.writebacks - written;
+    mutex_unlock(&cache_mutex);
+
+    struct block_device *device;
+    for(device = block_device_list(); device != NULL && written > 0; device = device->next) {
+        int flushed = block_device_flush(device);
+        if(result == ATA_OK) result = flushed;
+    }
+    return result;
+}
+
+/**
+ * @brief      Makes the disk agree with the cache over a range, for I/O that goes around the cache: dirty sectors
+ *             are written back and, before the disk is written directly, cached copies are dropped
+ * @ingroup    BLOCK_CACHE
+ *
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ * @param[in]  invalidate    1 to drop the cached copies as well
+ *
+ * @return     ATA_OK or an ATA_ERR_* code from the write-back
+ */
+int block_cache_sync_range(struct block_device *device, uint32_t LBA, uint32_t sector_count, uint8_t invalidate) {
+    mutex_lock(&cache_mutex);
+    absorb_prefetches();
+    int result = flush_locked(device, LBA, sector_count);
+    if(invalidate && result == ATA_OK) {
+        int i;
+        for(i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+            if(blocks[i].device == device && blocks[i].lba != NO_LBA && blocks[i].lba - LBA < sector_count) {
+                hash_remove(&blocks[i]);
+            }
+        }
+        block_cache_disk_written(); // Reads in flight now may return what the disk held before
+    }
+    mutex_unlock(&cache_mutex);
+    return result;
+}
+
+/**
+ * @brief      Records that something wrote to the disk, so reads that were in flight at the time do not fill the
+ *             cache. Does not take cache_mutex, so it may be called from a disk request's end_io.
+ * @ingroup    BLOCK_CACHE
+ */
+void block_cache_disk_written() {
+    __atomic_add_fetch(&write_epoch, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief      Registers a write that goes around the cache. Until block_cache_write_end, reads of its sectors are
+ *             not cached. Call it before the cached copies are dropped with block_cache_sync_range, so that no read
+ *             finishing in between can cache them again.
+ * @ingroup    BLOCK_CACHE
+ *
+ * @param      write         Kept by the caller until block_cache_write_end
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ */
+void block_cache_write_begin(struct block_cache_write *write, struct block_device *device, uint32_t LBA,
+                             uint32_t sector_count) {
+    write->device = device;
+    write->lba = LBA;
+    write->count = sector_count;
+    uint32_t flags = spin_lock_irqsave(&direct_writes_lock);
+    write->next = direct_writes;
+    direct_writes = write;
+    spin_unlock_irqrestore(&direct_writes_lock, flags);
+}
+
+/**
+ * @brief      Ends a write registered with block_cache_write_begin, once it is on the disk or has failed. Does not
+ *             take cache_mutex, so it may be called from a disk request's end_io.
+ * @ingroup    BLOCK_CACHE
+ * @param      write  The write
+ */
+void block_cache_write_end(struct block_cache_write *write) {
+    uint32_t flags = spin_lock_irqsave(&direct_writes_lock);
+    struct block_cache_write **link = &direct_writes;
+    while(*link != write) link = &(*link)->next;
+    *link = write->next;
+    // Reads that were in flight alongside it and finish later must not be cached either
+    block_cache_disk_written();
+    spin_unlock_irqrestore(&direct_writes_lock, flags);
+}
+
+/**
+ * @brief      Copies the cache's statistics
+ * @ingroup    BLOCK_CACHE
+ * @param      out   Filled in with the statistics
+ */
+void block_cache_get_stats(struct block_cache_stats *out) {
+    mutex_lock(&cache_mutex);
+    *out = stats;
+    mutex_unlock(&cache_mutex);
+}
+
+static struct cache_block *lookup(struct block_device *device, uint32_t lba) {
+    struct cache_block *block = buckets[lba % BLOCK_CACHE_BUCKETS];
+    while(block != NULL && (block->lba != lba || block->device != device)) block = block->hash_next;
+    return block;
+}
+
+/**
+ * @brief      Takes a block for a sector with the CLOCK algorithm, writing it back first if it is dirty
+ * @ingroup    BLOCK_CACHE
+ * @param      device  The device the sector is on
+ * @param[in]  lba     The sector the block will hold
+ * @return     The block, hashed under lba, or NULL if the only candidates could not be written back
+ */
+static struct cache_block *allocate(struct block_device *device, uint32_t lba) {
+    uint32_t scanned;
+    struct cache_block *block = NULL;
+    // Two full turns: the first may only clear reference bits
+    for(scanned = 0; scanned < 2 * BLOCK_CACHE_BLOCKS; scanned++) {
+        struct cache_block *candidate = &blocks[clock_hand];
+        clock_hand = (clock_hand + 1) % BLOCK_CACHE_BLOCKS;
+        if(candidate->lba == NO_LBA) {
+            block = candidate;
+            break;
+        }
+        if(candidate->referenced) {
+            candidate->referenced = 0;
+            continue;
+        }
+        if(candidate->dirty && write_back(&candidate, 1) != ATA_OK) continue;
+        stats.evictions++;
+        hash_remove(candidate);
+        block = candidate;
+        break;
+    }
+    if(block == NULL) return NULL;
+
+    block->device = device;
+    block->lba = lba;
+    block->dirty = 0;
+    block->referenced = 1;
+    block->hash_next = buckets[lba % BLOCK_CACHE_BUCKETS];
+    buckets[lba % BLOCK_CACHE_BUCKETS] = block;
+    return block;
+}
+
+static void hash_remove(struct cache_block *block) {
+    struct cache_block **link = &buckets[block->lba % BLOCK_CACHE_BUCKETS];
+    while(*link != block) link = &(*link)->hash_next;
+    *link = block->hash_next;
+    block->device = NULL;
+    block->lba = NO_LBA;
+    block->hash_next = NULL;
+}
+
+/**
+ * @brief      Writes dirty blocks to the disk, all submitted at once so the disk queue can merge neighbours
+ * @ingroup    BLOCK_CACHE
+ * @param      dirty  The blocks
+ * @param[in]  count  How many there are
+ * @return     ATA_OK or the first ATA_ERR_* code
+ */
+static int write_back(struct cache_block **dirty, uint32_t count) {
+    struct disk_request single;
+    struct disk_request *requests = count > 1 ? ta_alloc(sizeof(struct disk_request) * count) : NULL;
+    uint32_t batch = requests != NULL ? count : 1; // One at a time if there was no memory for more
+    if(requests == NULL) requests = &single;
+
+    int result = ATA_OK;
+    uint32_t i, j;
+    block_cache_disk_written();
+    for(i = 0; i < count; i += batch) {
+        uint32_t n = count - i < batch ? count - i : batch;
+        for(j = 0; j < n; j++) {
+            requests[j].lba = dirty[i + j]->lba;
+            requests[j].count = 1;
+            requests[j].buffer = dirty[i + j]->data;
+            requests[j].write = 1;
+            requests[j].end_io = NULL;
+            disk_queue_submit(&dirty[i + j]->device->queue, &requests[j]);
+        }
+        for(j = 0; j < n; j++) {
+            int written = disk_queue_wait(&dirty[i + j]->device->queue, &requests[j]);
+            if(written == ATA_OK) {
+                dirty[i + j]->dirty = 0;
+                stats.writebacks++;
+                stats.dirty--;
+            } else if(result == ATA_OK) {
+                result = written;
+            }
+        }
+    }
+    if(requests != &single) ta_free(requests);
+    return result;
+}
+
+/**
+ * @brief      Writes the dirty sectors in a range to the disk
+ * @ingroup    BLOCK_CACHE
+ * @note       Call with cache_mutex held.
+ *
+ * @param      device        The device, or NULL for every device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors
+ *
+ * @return     ATA_OK or the first ATA_ERR_* code; sectors that failed stay dirty
+ */
+static int flush_locked(struct block_device *device, uint32_t LBA, uint32_t sector_count) {
+    if(stats.dirty == 0) return ATA_OK;
+
+    // Insertion sort by device and LBA, so each disk queue sees neighbouring sectors next to each other
+    struct cache_block **dirty = ta_alloc(sizeof(struct cache_block *) * BLOCK_CACHE_BLOCKS);
+    uint32_t count = 0;
+    int i;
+    for(i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        if(!blocks[i].dirty || blocks[i].lba - LBA >= sector_count) continue;
+        if(device != NULL && blocks[i].device != device) continue;
+        int j = count++;
+        while(j > 0 && (dirty[j - 1]->device > blocks[i].device ||
+                        (dirty[j - 1]->device == blocks[i].device && dirty[j - 1]->lba > blocks[i].lba))) {
+            dirty[j] = dirty[j - 1];
+            j--;
+        }
+        dirty[j] = &blocks[i];
+    }
+
+    int result = write_back(dirty, count);
+    ta_free(dirty);
+    return result;
+}
+
+/**
+ * @brief      Submits one read-ahead. Without memory for its buffer, it is skipped.
+ * @ingroup    BLOCK_CACHE
+ * @note       Call with cache_mutex held.
+ *
+ * @param      device        The device
+ * @param[in]  LBA           The first sector
+ * @param[in]  sector_count  How many sectors to read
+ */
+static void start_prefetch(struct block_device *device, uint32_t LBA, uint32_t sector_count) {
+    struct prefetch *prefetch = ta_alloc(sizeof(struct prefetch));
+    if(prefetch == NULL) return;
+    prefetch->request.buffer = ta_alloc_align(sector_count * 512, 512);
+    if(prefetch->request.buffer == NULL) {
+        ta_free(prefetch);
+        return;
+    }
+    prefetch->request.lba = LBA;
+    prefetch->request.count = sector_count;
+    prefetch->request.write = 0;
+    prefetch->request.end_io = prefetch_done;
+    prefetch->request.private = prefetch;
+    prefetch->device = device;
+    prefetch->epoch = write_epoch;
+    prefetch->done = 0;
+    prefetch->absorbed = 0;
+    prefetch->waiters = 0;
+    prefetch->pending_next = pending;
+    pending = prefetch;
+    disk_queue_submit(&device->queue, &prefetch->request);
+}
+
+/**
+ * @brief      Completes a read-ahead by handing it to the next task that takes cache_mutex. It runs on the disk
+ *             queue's dispatcher, which may not wait for cache_mutex: a flush holds it while waiting for the disk.
+ * @ingroup    BLOCK_CACHE
+ * @param      request  The read-ahead's request
+ */
+static void prefetch_done(struct disk_request *request) {
+    struct prefetch *prefetch = request->private;
+    uint32_t flags = spin_lock_irqsave(&prefetch_wait.lock);
+    prefetch->next = prefetched;
+    prefetched = prefetch;
+    prefetch->done = 1;
+    wait_queue_wake_locked(&prefetch_wait, (uint32_t)prefetch, WAKE_ALL);
+    spin_unlock_irqrestore(&prefetch_wait.lock, flags);
+}
+
+/**
+ * @brief      Moves finished read-aheads into the cache
+ * @ingroup    BLOCK_CACHE
+ * @note       Call with cache_mutex held.
+ */
+static void absorb_prefetches() {
+    uint32_t flags = spin_lock_irqsave(&prefetch_wait.lock);
+    struct prefetch *prefetch = prefetched;
+    prefetched = NULL;
+    spin_unlock_irqrestore(&prefetch_wait.lock, flags);
+
+    while(prefetch != NULL) {
+        struct prefetch *next = prefetch->next;
+        // Skipped if a write reached the disk meanwhile; sectors cached meanwhile are newer than the read-ahead
+        if(prefetch->request.result == ATA_OK && prefetch->epoch == write_epoch) {
+            uint32_t i;
+            for(i = 0; i < prefetch->request.count; i++) {
+                if(lookup(prefetch->device, prefetch->request.lba + i) != NULL) continue;
+                if(being_written(prefetch->device, prefetch->request.lba + i)) continue;
+                struct cache_block *block = allocate(prefetch->device, prefetch->request.lba + i);
+                if(block == NULL) break;
+                memory_copy(prefetch->request.buffer + i * 512, block->data, 512);
+                block->referenced = 0; // Not used yet; a read-ahead nobody wants should go first
+                stats.prefetched++;
+            }
+        }
+        struct prefetch **link = &pending;
+        while(*link != prefetch) link = &(*link)->pending_next;
+        *link = prefetch->pending_next;
+        prefetch->absorbed = 1;
+        if(prefetch->waiters == 0) free_prefetch(prefetch);
+        prefetch = next;
+    }
+}
+
+/**
+ * @brief      Finds the read-ahead, in flight or not yet absorbed, that covers a sector
+ * @ingroup    BLOCK_CACHE
+ * @note       Call with cache_mutex held.
+ *
+ * @param      device  The device
+ * @param[in]  lba     The sector
+ *
+ * @return     The read-ahead, or NULL if none covers the sector
+ */
+static struct prefetch *find_prefetch(struct block_device *device, uint32_t lba) {
+    struct prefetch *prefetch = pending;
+    while(prefetch != NULL && (prefetch->device != device || lba - prefetch->request.lba >= prefetch->request.count)) {
+        prefetch = prefetch->pending_next;
+    }
+    return prefetch;
+}
+
+static uint8_t being_written(struct block_device *device, uint32_t lba) {
+    uint32_t flags = spin_lock_irqsave(&direct_writes_lock);
+    struct block_cache_write *write = direct_writes;
+    while(write != NULL && (write->device != device || lba - write->lba >= write->count)) write = write->next;
+    spin_unlock_irqrestore(&direct_writes_lock, flags);
+    return write != NULL;
+}
+
+static void wait_prefetch(struct prefetch *prefetch) {
+    uint32_t flags = spin_lock_irqsave(&prefetch_wait.lock);
+    while(!prefetch->done) {
+        wait_queue_sleep_locked(&prefetch_wait, (uint32_t)prefetch, flags);
+        flags = spin_lock_irqsave(&prefetch_wait.lock);
+    }
+    spin_unlock_irqrestore(&prefetch_wait.lock, flags);
+}
+
+// Frees an absorbed read-ahead; one still pending is kept, and freed once absorbed. Call with cache_mutex held.
+static void free_prefetch(struct prefetch *prefetch) {
+    if(!prefetch->absorbed) return;
+    ta_free(prefetch->request.buffer);
+    ta_free(prefetch);
+}
+
+/**
+ * @brief      The periodic timer: wakes the flusher thread, since writing to the disk may sleep
+ * @ingroup    BLOCK_CACHE
+ * @param      data  Unused
+ */
+static void flush_tick(void *data) {
+    UNUSED(data);
+    if(stats.dirty == 0) return;
+    uint32_t flags = spin_lock_irqsave(&flush_queue.lock);
+    flush_requested = 1;
+    wait_queue_wake_locked(&flush_queue, WAIT_KEY_ANY, 1);
+    spin_unlock_irqrestore(&flush_queue.lock, flags);
+}
+
+static void flusher(void *arg) {
+    UNUSED(arg);
+    while(1) {
+        uint32_t flags = spin_lock_irqsave(&flush_queue.lock);
+        while(!flush_requested) {
+            wait_queue_sleep_locked(&flush_queue, WAIT_KEY_ANY, flags);
+            flags = spin_lock_irqsave(&flush_queue.lock);
+        }
+        flush_requested = 0;
+        spin_unlock_irqrestore(&flush_queue.lock, flags);
+        block_cache_flush();
+    }
+}
@@ -4,7 +4,16 @@
  * @brief      This file implements a FAT filesystem.
  * 
  * @par 
- * Read and write from the filesystem using the read_file and write_file functions. The FAT table must be set up using load_fat_from_disk before reading and writing. 
+ * Read and write from the filesystem using the read_file and write_file functions. A block device must be mounted with mount_filesystem before reading and writing; FAT_LBA and FIRST_DATA_LBA are sectors on that device. 
+ * 
+ * @par
+ * Large files can also be read in pieces with open_file and read_file_at, which read ahead while access is sequential.
+ * 
+ * @par
+ * Names are looked up through a hash index over the table, rebuilt by index_files when the table is loaded or grows.
+ * The table starts in FAT_SECTORS sectors at FAT_LBA. When it fills, it is doubled into a new extent in the data area,
+ * and INIT_NODE, the first entry at FAT_LBA, records the extent in its lba and length. Only the sectors holding a
+ * changed entry are written back.
  * 
  * @note       A prior version of the tedit stock program caused major issues, possible due to issues in either the filesystem or ATA driver.
  * 
@@ -14,31 +23,57 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "filesystem/filesystem.h"
+#include "filesystem/block_cache.h"
 #include "drivers/ata.h"
 #include "drivers/screen.h"
 #include "libc/mem.h"
 #include "libc/string.h"
+#include "cpu/mutex.h"
+
+struct mutex fat_mutex; // Guards the FAT and the file data it points to
+struct block_device *fs_volume = NULL; // The mounted device
+uint32_t fat_lba = FAT_LBA;
+uint32_t fat_sectors = FAT_SECTORS;
+static struct fs_stats stats; // Guarded by fat_mutex
+static file_handle_t *index_buckets = NULL; // The first file in each bucket's chain, or FILE_NOT_FOUND
+static file_handle_t *index_next = NULL;    // Per table entry, the next file in its chain
+static uint32_t index_mask = 0;             // Buckets - 1
 
 // Private function definitions
-static void update_disk_fat();
-static uint8_t get_file(char* name);
+static void update_disk_fat(file_handle_t handle);
+static file_handle_t get_file(char* name);
+static uint32_t hash_name(char* name);
+static void index_add(file_handle_t handle);
+static int grow_fat();
+static void read_ahead(struct open_file *file, uint32_t first, uint32_t end);
 
 /**
  * @brief      Gets a file.
  * @ingroup    FILESYSTEM
+ * @note       Call with fat_mutex held.
  * @param      name  The name of the file
  *	
- * @return     The file index.
- */
-static uint8_t get_file(char* name) {
-	uint32_t offset = 0;
-	struct file *current = fat_head;
-	while(current->magic == 0xFFFFFFFF) {
-		if(strcmp(current->name, name) == 0) return offset;
-		current++;
-		offset++;
-	}
-	return 0;
+ * @return     The file's handle, or FILE_NOT_FOUND
+ */
+static file_handle_t get_file(char* name) {
+	if(index_buckets == NULL) return FILE_NOT_FOUND;
+	file_handle_t handle = index_buckets[hash_name(name) & index_mask];
+	while(handle != FILE_NOT_FOUND && strcmp(fat_head[handle].name, name) != 0) handle = index_next[handle];
+	return handle;
+}
+
+/**
+ * @brief      Looks a file up by name
+ * @ingroup    FILESYSTEM
+ * @param      name  The name of the file
+ *
+ * @return     The file's handle, an index into get_files(), or FILE_NOT_FOUND
+ */
+file_handle_t find_file(char* name) {
+	mutex_lock(&fat_mutex);
+	file_handle_t handle = get_file(name);
+	mutex_unlock(&fat_mutex);
+	return handle;
 }
 
 /**
@@ -49,9 +84,17 @@ static uint8_t get_file(char* name) {
  * @param[in]  size_bytes  The size of the file, in bytes
  */
 void write_file(char* name, void *file_data, uint32_t size_bytes) {
-	if(get_file(name) != 0) return;
+	mutex_lock(&fat_mutex);
+	uint32_t capacity = fat_sectors*512/sizeof(struct file);
+	// The entry after the last stays free, to end the table
+	if(strlen(name) >= (int)sizeof(fat_head->name) || get_file(name) != FILE_NOT_FOUND ||
+	   (num_registered_files + 2 > capacity && grow_fat() != 0)) {
+		mutex_unlock(&fat_mutex);
+		return;
+	}
 
-	struct file *node = fat_head+num_registered_files; // needs updating
+	file_handle_t handle = num_registered_files;
+	struct file *node = fat_head+handle;
 	uint32_t size_sectors = size_bytes/512;
 	if(size_sectors == 0) size_sectors = 1;
 
@@ -61,9 +104,14 @@ void write_file(char* name, void *file_data, uint32_t size_bytes) {
 	node->magic = 0xFFFFFFFF;
 	first_ta_free_sector += size_sectors;
 
-	write_sectors_ATA_PIO(node->lba, size_sectors ,(uint16_t*)file_data);	
+	block_cache_write(fs_volume, node->lba, size_sectors ,(uint16_t*)file_data);	
+	stats.file_writes++;
+	stats.file_sectors += size_sectors;
 	num_registered_files++;
-	update_disk_fat();
+	memory_set((uint8_t*)(node+1), 0, sizeof(struct file));
+	index_add(handle);
+	update_disk_fat(handle);
+	mutex_unlock(&fat_mutex);
 }
 
 /**
@@ -76,29 +124,36 @@ void write_file(char* name, void *file_data, uint32_t size_bytes) {
  * @todo       Add procedure to delete and re-create the file if it is too big.
  */
 void overwrite_file(char* name, void *file_data, uint32_t size_bytes) {
-	uint8_t file_number = get_file(name);
-	if(file_number == 0) return;
+	mutex_lock(&fat_mutex);
+	file_handle_t handle = get_file(name);
+	if(handle == FILE_NOT_FOUND) {
+		mutex_unlock(&fat_mutex);
+		return;
+	}
 
-	struct file *node = fat_head+file_number;
+	struct file *node = fat_head+handle;
 	uint32_t size_sectors = size_bytes/512;
 	if(size_sectors == 0) size_sectors = 1;
 	if(size_sectors <= node->length) {
 		memory_copy((uint8_t*)name, (uint8_t*)&(node->name), strlen(name)+1);
 		node->magic = 0xFFFFFFFF;
 
-		write_sectors_ATA_PIO(node->lba, size_sectors ,(uint16_t*)file_data);	
+		block_cache_write(fs_volume, node->lba, size_sectors ,(uint16_t*)file_data);	
+		stats.file_writes++;
+		stats.file_sectors += size_sectors;
 	} else {
 		// Delete and re-create
 	}
-	update_disk_fat();
+	update_disk_fat(handle);
+	mutex_unlock(&fat_mutex);
 }
 
 /**
- * @brief      Reads a file.
+ * @brief      Reads a file, all of it with one request
  * @ingroup    FILESYSTEM
  * @param      name  The name of the file
  *
- * @return     A void pointer to that file in memory. <b>Must be ta_free'd</b>
+ * @return     A void pointer to that file in memory, NULL if there is no such file or it could not be read. <b>Must be ta_free'd</b>
  */
 struct file_descriptor read_file(char* name) {
 	struct file_descriptor file = {
@@ -106,29 +161,231 @@ struct file_descriptor read_file(char* name) {
 		.size_bytes = 0
 	};
 
-	uint8_t offset = get_file(name);
-	if(offset == 0) return file;
-	struct file *file_to_read = fat_head+offset;
-	void *return_file = ta_alloc(file_to_read->length*512);
-	read_sectors_ATA_PIO((uint32_t)return_file, file_to_read->lba, file_to_read->length);
+	mutex_lock(&fat_mutex);
+	file_handle_t handle = get_file(name);
+	if(handle == FILE_NOT_FOUND) {
+		mutex_unlock(&fat_mutex);
+		return file;
+	}
+	// Files never move, so the data can be read without holding up other tasks' FAT lookups
+	uint32_t lba = fat_head[handle].lba;
+	uint32_t length = fat_head[handle].length;
+	mutex_unlock(&fat_mutex);
+
+	void *return_file = ta_alloc(length*512);
+	if(return_file == NULL) return file;
+	if(block_cache_read(fs_volume, (uint32_t)return_file, lba, length) != ATA_OK) {
+		ta_free(return_file);
+		return file;
+	}
 
 	file.address = return_file;
-	file.size_bytes = file_to_read->length*512;
+	file.size_bytes = length*512;
 
 	return file;
 } 
 
 /**
- * @brief      Updates the FAT table to disk
+ * @brief      Opens a file to read it in pieces with read_file_at
  * @ingroup    FILESYSTEM
+ * @param      name  The name of the file
+ *
+ * @return     The open file, or NULL if there is no such file. <b>Must be closed with close_file</b>
  */
-static void update_disk_fat() {
-	uint8_t num_sectors = (sizeof(struct file)*num_registered_files/512 > 1 ) ? sizeof(struct file)*num_registered_files/512 : 1;
-	uint16_t* t_storage = ta_alloc(num_sectors*512);
-	memory_copy((uint8_t*)fat_head, (uint8_t*)t_storage,sizeof(struct file)*num_registered_files);
-	write_sectors_ATA_PIO(FAT_LBA, num_sectors, (uint16_t*)fat_head);
-	ta_free(t_storage); // major source of memory leaking
-	t_storage = NULL;
+struct open_file *open_file(char* name) {
+	mutex_lock(&fat_mutex);
+	file_handle_t handle = get_file(name);
+	if(handle == FILE_NOT_FOUND) {
+		mutex_unlock(&fat_mutex);
+		return NULL;
+	}
+	struct open_file *file = ta_alloc(sizeof(struct open_file));
+	if(file != NULL) {
+		file->device = fs_volume;
+		file->lba = fat_head[handle].lba;
+		file->length = fat_head[handle].length;
+		file->next_sector = 0;
+		file->ra_start = 0;
+		file->ra_size = 0;
+	}
+	mutex_unlock(&fat_mutex);
+	return file;
+}
+
+/**
+ * @brief      Reads part of an open file. While reads follow on from each other, the sectors after them are read
+ *             ahead in the background, in windows that grow up to READAHEAD_MAX_SECTORS.
+ * @ingroup    FILESYSTEM
+ *
+ * @param      file        The open file
+ * @param[in]  offset      Where to start, in bytes
+ * @param      buffer      Where to put the data
+ * @param[in]  size_bytes  How much to read
+ *
+ * @return     How many bytes were read: fewer than asked for at the end of the file, 0 on a disk error
+ */
+uint32_t read_file_at(struct open_file *file, uint32_t offset, void *buffer, uint32_t size_bytes) {
+	uint32_t file_bytes = file->length*512;
+	if(offset >= file_bytes) return 0;
+	if(size_bytes > file_bytes - offset) size_bytes = file_bytes - offset;
+	if(size_bytes == 0) return 0;
+
+	uint32_t first = offset/512;
+	uint32_t end = (offset + size_bytes + 511)/512;
+	read_ahead(file, first, end);
+
+	// Whole sectors go straight into the buffer; anything else through a copy
+	uint8_t aligned = offset % 512 == 0 && size_bytes % 512 == 0;
+	uint8_t *sectors = aligned ? buffer : ta_alloc((end - first)*512);
+	if(sectors == NULL) return 0;
+	int result = block_cache_read(file->device, (uint32_t)sectors, file->lba + first, end - first);
+	if(!aligned) {
+		if(result == ATA_OK) memory_copy(sectors + offset%512, (uint8_t*)buffer, size_bytes);
+		ta_free(sectors);
+	}
+	return result == ATA_OK ? size_bytes : 0;
+}
+
+/**
+ * @brief      Closes a file opened with open_file
+ * @ingroup    FILESYSTEM
+ * @param      file  The open file
+ */
+void close_file(struct open_file *file) {
+	ta_free(file);
+}
+
+/**
+ * @brief      Decides whether to read ahead of a read, and starts it. The window after the current one is read once
+ *             the reader gets into the current one, so a sequential reader finds its data already in memory.
+ * @ingroup    FILESYSTEM
+ *
+ * @param      file   The open file
+ * @param[in]  first  The first sector being read, relative to the file
+ * @param[in]  end    The sector after the last one being read
+ */
+static void read_ahead(struct open_file *file, uint32_t first, uint32_t end) {
+	uint32_t start = 0;
+	uint32_t size;
+	if(first != file->next_sector) {
+		// Not sequential: stop reading ahead until it is again
+		file->ra_size = 0;
+		size = 0;
+	} else if(file->ra_size == 0) {
+		start = end;
+		size = READAHEAD_MIN_SECTORS;
+	} else if(end > file->ra_start) {
+		start = file->ra_start + file->ra_size;
+		if(start < end) start = end;
+		size = file->ra_size*2 > READAHEAD_MAX_SECTORS ? READAHEAD_MAX_SECTORS : file->ra_size*2;
+	} else {
+		size = 0; // Still short of the last window
+	}
+	file->next_sector = end;
+	if(size == 0) return;
+
+	file->ra_start = start;
+	file->ra_size = size;
+	if(start >= file->length) return;
+	if(size > file->length - start) size = file->length - start;
+	block_cache_prefetch(file->device, file->lba + start, size);
+}
+
+/**
+ * @brief      Writes a changed entry of the FAT table to disk, with the one after it, which may be the new end
+ * @ingroup    FILESYSTEM
+ * @param[in]  handle  The entry
+ */
+static void update_disk_fat(file_handle_t handle) {
+	uint32_t first = handle*sizeof(struct file)/512;
+	uint32_t end = ((handle+2)*sizeof(struct file) + 511)/512;
+	if(end > fat_sectors) end = fat_sectors;
+	block_cache_write(fs_volume, fat_lba + first, end - first, (uint16_t*)((uint8_t*)fat_head + first*512));
+	stats.fat_writes++;
+	stats.fat_sectors += end - first;
+}
+
+/**
+ * @brief      Doubles the FAT table into a new extent at the end of the used space
+ * @ingroup    FILESYSTEM
+ * @note       Call with fat_mutex held. The old extent, if the table had already moved, is not reused.
+ * @return     0, or -1 if there is no room on the volume or in memory
+ */
+static int grow_fat() {
+	uint32_t sectors = fat_sectors*2;
+	if((uint64_t)first_ta_free_sector + sectors > block_device_capacity(fs_volume)) return -1;
+	struct file *table = ta_alloc(sectors*512);
+	if(table == NULL) return -1;
+	memory_set((uint8_t*)table, 0, sectors*512);
+	memory_copy((uint8_t*)fat_head, (uint8_t*)table, fat_sectors*512);
+	table->lba = first_ta_free_sector;
+	table->length = sectors;
+	first_ta_free_sector += sectors;
+
+	// The table has to be in place before INIT_NODE at home points to it
+	block_cache_write(fs_volume, table->lba, sectors, (uint16_t*)table);
+	block_cache_sync_range(fs_volume, table->lba, sectors, 0);
+	block_cache_write(fs_volume, FAT_LBA, 1, (uint16_t*)table);
+	stats.fat_writes += 2;
+	stats.fat_sectors += sectors + 1;
+
+	ta_free(fat_head);
+	fat_head = table;
+	fat_lba = table->lba;
+	fat_sectors = sectors;
+	index_files();
+	return 0;
+}
+
+/**
+ * @brief      Rebuilds the name index over the whole table, with a bucket for every entry the table has room for
+ * @ingroup    FILESYSTEM
+ * @note       Call with fat_mutex held, after the table is loaded or moved.
+ */
+void index_files() {
+	uint32_t entries = fat_sectors*512/sizeof(struct file);
+	uint32_t buckets = FILE_INDEX_MIN_BUCKETS;
+	while(buckets < entries) buckets *= 2;
+
+	if(index_buckets != NULL) ta_free(index_buckets);
+	if(index_next != NULL) ta_free(index_next);
+	index_buckets = ta_alloc(buckets*sizeof(file_handle_t));
+	index_next = ta_alloc(entries*sizeof(file_handle_t));
+	if(index_buckets == NULL || index_next == NULL) {
+		kprintn("Out of memory for the file index");
+		if(index_buckets != NULL) ta_free(index_buckets);
+		if(index_next != NULL) ta_free(index_next);
+		index_buckets = NULL;
+		index_next = NULL;
+		return;
+	}
+	index_mask = buckets - 1;
+	memory_set((uint8_t*)index_buckets, 0xFF, buckets*sizeof(file_handle_t));
+
+	// Backwards, so that of two files with the same name the first is found, as before there was an index
+	file_handle_t handle;
+	for(handle = num_registered_files; handle > 1; handle--) index_add(handle - 1);
+}
+
+static void index_add(file_handle_t handle) {
+	if(index_buckets == NULL) return;
+	uint32_t bucket = hash_name(fat_head[handle].name) & index_mask;
+	index_next[handle] = index_buckets[bucket];
+	index_buckets[bucket] = handle;
+}
+
+/**
+ * @brief      FNV-1a over a name, up to the length of a table entry's name field
+ * @ingroup    FILESYSTEM
+ */
+static uint32_t hash_name(char* name) {
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for(i = 0; i < sizeof(fat_head->name) && name[i] != '\0'; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619;
+	}
+	return hash;
 }
 
 /**
@@ -138,4 +395,15 @@ static void update_disk_fat() {
  */
 struct file *get_files() {
 	return fat_head;
+}
+
+/**
+ * @brief      Copies the counts of file data and FAT writes
+ * @ingroup    FILESYSTEM
+ * @param      out   Filled in
+ */
+void fs_get_stats(struct fs_stats *out) {
+	mutex_lock(&fat_mutex);
+	*out = stats;
+	mutex_unlock(&fat_mutex);
 } 
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "filesystem/filesystem.h"
 #include "libc/mem.h"
-#include "drivers/ata.h"
+#include "drivers/block_device.h"
+#include "filesystem/block_cache.h"
 #include "drivers/screen.h"
+#include "cpu/mutex.h"
 
 
 static void initialize_empty_fat_to_disk();
@@ -9,18 +11,53 @@ struct program_identifier* rescue_program_headers() ;
 #define initial_node_name "INIT_NODE"
 
 void init_fat_info() {
+   mutex_init(&fat_mutex, "fat");
    num_registered_files = 1;
    first_ta_free_sector = FIRST_DATA_LBA+1;
 }
 
 /**
- * @brief      Loads a FAT table from disk.
+ * @brief      Makes a block device the filesystem's volume and loads its FAT
+ * @ingroup    FILESYSTEM
+ * @param      device  The device
+ * @return     0, or -1 if the device is too small to hold a FAT
+ */
+int mount_filesystem(struct block_device *device) {
+   if(block_device_capacity(device) <= FIRST_DATA_LBA) return -1;
+   block_cache_flush();
+   mutex_lock(&fat_mutex);
+   if(fat_head != NULL) ta_free(fat_head);
+   fat_head = NULL;
+   fs_volume = device;
+   load_fat_from_disk();
+   mutex_unlock(&fat_mutex);
+   return 0;
+}
+
+/**
+ * @brief      Loads a FAT table from disk, from wherever INIT_NODE says it has moved to, and indexes its names.
  * @ingroup    FILESYSTEM
  * @note       If no FAT table is present, it will attempt to initialize one.
  */
 void load_fat_from_disk() {
-   fat_head = ta_alloc(sizeof(uint8_t)*6*512); // ta_free handled
-   read_sectors_ATA_PIO((uint32_t)fat_head, FAT_LBA, 6);
+   fat_head = ta_alloc(sizeof(uint8_t)*FAT_SECTORS*512); // ta_free handled
+   fat_lba = FAT_LBA;
+   fat_sectors = FAT_SECTORS;
+   block_cache_read(fs_volume, (uint32_t)fat_head, FAT_LBA, FAT_SECTORS);
+   if(fat_head->magic == 0xFFFFFFFF && fat_head->lba != FIRST_DATA_LBA) {
+      // The table outgrew its home
+      struct file *table = ta_alloc(fat_head->length*512);
+      if(table != NULL && block_cache_read(fs_volume, (uint32_t)table, fat_head->lba, fat_head->length) == 0 &&
+         table->magic == 0xFFFFFFFF) {
+         fat_lba = fat_head->lba;
+         fat_sectors = fat_head->length;
+         ta_free(fat_head);
+         fat_head = table;
+      } else {
+         kprintn("Loading the moved FAT failed, using the copy at its home");
+         if(table != NULL) ta_free(table);
+      }
+   }
    if(fat_head->magic != 0xFFFFFFFF) {
       kprintn("Loading FAT from disk failed, invalid allocation table. Creating new FAT");
       initialize_empty_fat_to_disk();
@@ -28,16 +65,19 @@ void load_fat_from_disk() {
       fat_head = NULL;
       load_fat_from_disk();
    } else {
+      uint32_t capacity = fat_sectors*512/sizeof(struct file);
       num_registered_files = 1;
       first_ta_free_sector = FIRST_DATA_LBA+1;
+      if(fat_lba != FAT_LBA) first_ta_free_sector = fat_lba+fat_sectors;
       kprintn("Successfully loaded FAT");
       struct file* files = get_files()+1;
-      while(files->magic == 0xFFFFFFFF) {
+      while(num_registered_files < capacity && files->magic == 0xFFFFFFFF) {
          //kprintn(files->name);
+         if (files->lba+files->length > first_ta_free_sector) first_ta_free_sector = files->lba+files->length;
          files++;
          num_registered_files++;
-         if (files->lba > first_ta_free_sector) first_ta_free_sector = files->lba+1;
       }
+      index_files();
    }
 }
 
@@ -49,7 +89,8 @@ void load_fat_from_disk() {
  * @todo       Removing that for loop causes the hard disk driver to hang
  */
 static void initialize_empty_fat_to_disk() {
-   fat_head = (struct file*)ta_alloc(512*3);
+   fat_head = (struct file*)ta_alloc(FAT_SECTORS*512);
+   memory_set((uint8_t*)fat_head, 0, FAT_SECTORS*512);
    memory_copy((uint8_t*)&initial_node_name, (uint8_t*)&(fat_head->name), 9);
    fat_head->lba = FIRST_DATA_LBA;
    fat_head->length = 1;
@@ -59,7 +100,7 @@ static void initialize_empty_fat_to_disk() {
    int i = 0;
    for(i = 1; i < rescued_programs_lba[0].magic[0]; i++) {
       void* program = ta_alloc(rescued_programs_lba[i].length*512);
-      read_sectors_ATA_PIO((uint32_t)program, rescued_programs_lba[i].lba, rescued_programs_lba[i].length);
+      block_cache_read(fs_volume, (uint32_t)program, rescued_programs_lba[i].lba, rescued_programs_lba[i].length);
       struct file* node = fat_head+i;
       memory_copy((uint8_t*)&(((struct program_identifier*)program)->name), (uint8_t*)&(node->name), 32);
       node->lba = rescued_programs_lba[i].lba;
@@ -70,9 +111,7 @@ static void initialize_empty_fat_to_disk() {
       first_ta_free_sector += rescued_programs_lba[i].length;
    }
 
-   uint16_t* t_storage = ta_alloc(512*3);
-   memory_copy((uint8_t*)fat_head, (uint8_t*)t_storage,sizeof(fat_head));
-   write_sectors_ATA_PIO(FAT_LBA, 2, (uint16_t*)fat_head);
+   block_cache_write(fs_volume, FAT_LBA, FAT_SECTORS, (uint16_t*)fat_head);
 }
 
 struct program_identifier* rescue_program_headers() {
@@ -81,7 +120,10 @@ struct program_identifier* rescue_program_headers() {
     int i = 0;
     for(i = 0; i < 256; i++) {
         void* program = ta_alloc(512);
-        read_sectors_ATA_PIO((uint32_t)program, i*8, 1);
+        if(block_device_read(fs_volume, (uint32_t)program, i*8, 1) != 0) {
+            ta_free(program);
+            break; // Past the end of a small volume
+        }
         if(((struct program_identifier*) program)->magic[0] == 0xFFFFFFFF &&
            ((struct program_identifier*) program)->magic[1] == 0xFFFFFFFF &&
            ((struct program_identifier*) program)->magic[2] == 0xFFFFFFFF &&
@@ -20,6 +20,39 @@
 #include "libc/function.h"
 #include "filesystem/filesystem.h"
 #include "cpu/task_manager.h"
+#include "cpu/smp.h"
+#include "cpu/syscall.h"
+#include "cpu/cpu.h"
+#include "cpu/spinlock.h"
+#include "cpu/irq_stats.h"
+#include "cpu/irqsoff.h"
+#include "libc/math.h"
+#include "drivers/ata.h"
+#include "filesystem/block_cache.h"
+#include "filesystem/aio.h"
+#include "drivers/block_device.h"
+#include "drivers/ramdisk.h"
+#include "drivers/pci.h"
+#include "drivers/raid0.h"
+#include "cpu/timer.h"
+#include "cpu/apic_timer.h"
+
+#define SYSBENCH_ITERATIONS 10000
+#define CTXBENCH_ROUNDS     10000
+#define PRIMES_LIMIT        1000000
+#define DISKBENCH_SECTORS   256 // At the end of ata0, past what the filesystem has allocated
+#define DISKBENCH_ROUNDS    16
+#define DISKBENCH_AIO_OPS   8
+
+static char *irq_vector_name(uint32_t vector);
+static void print_cycles(uint64_t cycles);
+static void print_service(char *label, struct disk_stats *stats, uint8_t write);
+static void print_disk_rate(char *label, int result, uint64_t us);
+
+static volatile uint32_t pingpong_rounds;
+static uint32_t prime_workers;
+static volatile uint32_t primes_found;
+static volatile uint32_t primes_running;
 extern struct command_block *command_resolver_head;
 extern void* kernel_paging_structure;
 
@@ -31,6 +64,7 @@ void ECHO(char *args) {
 }
 
 void END(char *args) {
+	block_cache_flush();
 	kprint("Stopping the CPU. Bye!\n");
     asm volatile("hlt");
 
@@ -86,4 +120,696 @@ void RUN(char *args) {
 void LESS(char *args) {
 
 	UNUSED(args);
-}
\ No newline at end of file
+}
+
+void CPUS(char *args) {
+	int i;
+	for(i = 0; i < num_cpus; i++) {
+		kprint("cpu ");
+		kprint(int_to_ascii(i));
+		kprint(": apic ");
+		kprint(int_to_ascii(cpus[i].apic_id));
+		kprint(cpus[i].online ? " online, " : " offline, ");
+		kprint(int_to_ascii(cpus[i].run_queue.count));
+		kprint(" queued, running ");
+		if(cpus[i].current == &cpus[i].idle) kprintn("idle");
+		else                                 kprintn(int_to_ascii(cpus[i].current - tasks));
+	}
+
+	UNUSED(args);
+}
+
+static uint32_t cycles_per_call(uint64_t start, uint64_t end) {
+	return udiv64(end - start, SYSBENCH_ITERATIONS, NULL);
+}
+
+void SYSBENCH(char *args) {
+	uint64_t start, end;
+	int i;
+
+	start = rdtsc();
+	for(i = 0; i < SYSBENCH_ITERATIONS; i++) syscall_int(SYS_NULL, 0, 0, 0);
+	end = rdtsc();
+	kprint("int $0x80: ");
+	kprint(int_to_ascii(cycles_per_call(start, end)));
+	kprintn(" cycles per null syscall");
+
+	if(!syscall_fast_available()) {
+		kprintn("sysenter: not supported by this cpu");
+		return;
+	}
+	start = rdtsc();
+	for(i = 0; i < SYSBENCH_ITERATIONS; i++) syscall_fast(SYS_NULL, 0, 0, 0);
+	end = rdtsc();
+	kprint("sysenter:  ");
+	kprint(int_to_ascii(cycles_per_call(start, end)));
+	kprintn(" cycles per null syscall");
+
+	UNUSED(args);
+}
+
+static void pingpong_partner(void *arg) {
+	while(pingpong_rounds > 0) task_yield();
+	UNUSED(arg);
+}
+
+void CTXBENCH(char *args) {
+	pingpong_rounds = CTXBENCH_ROUNDS;
+	// Both ends are pinned, so they stay on this cpu and every yield switches to the other one
+	TASK *self = get_current_task();
+	uint8_t was_pinned = self->pinned;
+	self->pinned = 1;
+	if(kthread_create(pingpong_partner, NULL, 1) == NULL) {
+		self->pinned = was_pinned;
+		kprintn("ctxbench: the task table is full");
+		return;
+	}
+
+	uint64_t start = rdtsc();
+	while(pingpong_rounds > 0) {
+		pingpong_rounds--;
+		task_yield();
+	}
+	uint64_t end = rdtsc();
+	self->pinned = was_pinned;
+
+	kprint("ping-pong: ");
+	kprint(int_to_ascii(udiv64(end - start, 2 * CTXBENCH_ROUNDS, NULL)));
+	kprintn(" cycles per context switch");
+
+	UNUSED(args);
+}
+
+// Worker n of prime_workers tests every prime_workers-th number from 2 + n, so the work is spread evenly
+static void count_primes(void *arg) {
+	uint32_t found = 0;
+	uint32_t number;
+	for(number = 2 + (uint32_t)arg; number < PRIMES_LIMIT; number += prime_workers) {
+		uint32_t divisor;
+		for(divisor = 2; divisor * divisor <= number && number % divisor != 0; divisor++);
+		if(divisor * divisor > number) found++;
+	}
+	__atomic_fetch_add(&primes_found, found, __ATOMIC_SEQ_CST);
+	__atomic_fetch_sub(&primes_running, 1, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t time_primes(uint32_t workers) {
+	prime_workers = workers;
+	primes_found = 0;
+	primes_running = workers;
+	uint64_t start = timer_now_us();
+	uint32_t i;
+	for(i = 0; i < workers; i++) {
+		if(kthread_create(count_primes, (void *)i, 0) == NULL) primes_running--;
+	}
+	while(primes_running > 0) task_yield();
+	return timer_now_us() - start;
+}
+
+/**
+ * @brief      Counts the primes below PRIMES_LIMIT, like the prime program, first with one kernel thread and then
+ *             with one per cpu, and prints how much faster the second run was
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void PRIMES(char *args) {
+	uint64_t one = time_primes(1);
+	uint32_t found = primes_found;
+	uint64_t all = time_primes(num_cpus);
+	if(primes_found != found) {
+		kprintn("primes: a worker could not be started");
+		return;
+	}
+
+	kprint(int_to_ascii(found));
+	kprint(" primes below ");
+	kprintn(int_to_ascii(PRIMES_LIMIT));
+	kprint("1 thread:  ");
+	kprint(int_to_ascii(udiv64(one, 1000, NULL)));
+	kprintn(" ms");
+	kprint(int_to_ascii(num_cpus));
+	kprint(" threads: ");
+	kprint(int_to_ascii(udiv64(all, 1000, NULL)));
+	kprint(" ms, ");
+	kprint(int_to_ascii(udiv64(one * 100, all > 0 ? all : 1, NULL)));
+	kprintn("% of one thread's speed");
+
+	UNUSED(args);
+}
+
+/**
+ * @brief      Measures sequential disk throughput with DMA and with PIO, and with asynchronous reads, on the last
+ *             DISKBENCH_SECTORS sectors of ata0. `diskbench write` also times writes, which put back the data just
+ *             read, as long as the filesystem has not grown into those sectors.
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  "write", or nothing
+ */
+void DISKBENCH(char *args) {
+	uint8_t write = strcmp(args, "write") == 0;
+	if(args[0] != '\0' && !write) {
+		kprintn("Usage: diskbench [write]");
+		return;
+	}
+	struct block_device *device = block_device_find("ata0");
+	if(device == NULL || block_device_capacity(device) < FIRST_DATA_LBA + DISKBENCH_SECTORS) {
+		kprintn("No disk large enough to benchmark.");
+		return;
+	}
+	uint32_t lba = block_device_capacity(device) - DISKBENCH_SECTORS;
+	mutex_lock(&fat_mutex);
+	uint8_t in_use = device == fs_volume && first_ta_free_sector > lba;
+	mutex_unlock(&fat_mutex);
+	if(write && in_use) {
+		kprintn("The filesystem has reached the end of the disk; not writing to it.");
+		return;
+	}
+
+	const struct ata_identity *disk = ata_identity();
+	if(disk->present) {
+		kprint((char *)disk->model);
+		kprint(": ");
+		kprint(int_to_ascii(udiv64(disk->sectors, 2048, NULL)));
+		kprint(" MiB");
+		kprint(disk->lba48 ? ", lba48" : "");
+		kprint(", ");
+		kprint(int_to_ascii(ata_optimal_sectors()));
+		kprintn(" sectors per command");
+	}
+
+	uint16_t *buffer = ta_alloc_align(DISKBENCH_SECTORS * 512, 512);
+	if(buffer == NULL) {
+		kprintn("diskbench: no memory for the buffer");
+		return;
+	}
+	int mode;
+	for(mode = 0; mode < 2; mode++) {
+		uint8_t dma = mode == 0;
+		uint8_t previous = ata_use_dma(dma);
+		int result = ATA_OK;
+		int i;
+
+		uint64_t start = timer_now_us();
+		for(i = 0; i < DISKBENCH_ROUNDS && result == ATA_OK; i++) result = read_sectors_ATA((uint32_t)buffer, lba, DISKBENCH_SECTORS);
+		print_disk_rate(dma ? "dma read:  " : "pio read:  ", result, timer_now_us() - start);
+
+		if(write) {
+			start = timer_now_us();
+			for(i = 0; i < DISKBENCH_ROUNDS && result == ATA_OK; i++) result = write_sectors_ATA(lba, DISKBENCH_SECTORS, buffer);
+			print_disk_rate(dma ? "dma write: " : "pio write: ", result, timer_now_us() - start);
+		}
+
+		ata_use_dma(previous);
+	}
+
+	// The same reads, split into DISKBENCH_AIO_OPS operations kept in flight together for the disk queue to merge
+	struct aio_context *context = aio_create();
+	if(context != NULL) {
+		struct aio_event events[DISKBENCH_AIO_OPS];
+		uint32_t per_op = DISKBENCH_SECTORS / DISKBENCH_AIO_OPS;
+		int result = ATA_OK;
+		int i, j;
+
+		uint64_t start = timer_now_us();
+		for(i = 0; i < DISKBENCH_ROUNDS && result == ATA_OK; i++) {
+			uint32_t submitted = 0;
+			while(submitted < DISKBENCH_AIO_OPS && result == ATA_OK) {
+				result = aio_submit(context, device, 0, lba + submitted * per_op, per_op,
+				                    (uint8_t *)buffer + submitted * per_op * 512, submitted);
+				if(result == ATA_OK) submitted++;
+			}
+			// Reap whatever was started, even after a failed submit, before the buffer is reused
+			uint32_t reaped = aio_wait(context, events, submitted, submitted);
+			for(j = 0; j < (int)reaped && result == ATA_OK; j++) result = events[j].result;
+			if(result == ATA_OK && reaped != DISKBENCH_AIO_OPS) result = ATA_ERR_TIMEOUT; // Some never finished
+		}
+		print_disk_rate("aio read:  ", result, timer_now_us() - start);
+	}
+	if(context != NULL) aio_destroy(context);
+	ta_free(buffer);
+}
+
+/**
+ * @brief      Prints how often each tracked lock was taken and contended, and how long it was held and waited for
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void LOCKS(char *args) {
+	struct lock_stats *stats;
+	for(stats = lock_stats_list(); stats != NULL; stats = stats->next) {
+		kprint((char *)stats->name);
+		kprint(": ");
+		kprint(int_to_ascii(stats->acquisitions));
+		kprint(" taken, ");
+		kprint(int_to_ascii(stats->contended));
+		kprint(" contended");
+		if(stats->acquisitions > 0) {
+			kprint(", avg hold ");
+			kprint(int_to_ascii(udiv64(stats->hold_cycles, stats->acquisitions, NULL)));
+			kprint(", max hold ");
+			kprint(int_to_ascii(stats->max_hold_cycles));
+		}
+		if(stats->contended > 0) {
+			kprint(", avg wait ");
+			kprint(int_to_ascii(udiv64(stats->wait_cycles, stats->contended, NULL)));
+		}
+		kprintn(" cycles");
+	}
+	UNUSED(args);
+}
+
+/**
+ * @brief      Prints interrupt counts and handler durations, summed over all cpus
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void IRQSTAT(char *args) {
+	uint32_t nested = 0, spurious = 0, unhandled = 0, softirqs = 0;
+	uint64_t softirq_cycles = 0;
+	uint32_t vector;
+	int i, j;
+	if(irq_stats_cpu(0) == NULL) return;
+
+	for(vector = 0; vector < 256; vector++) {
+		uint32_t count = 0, max = 0, timed = 0;
+		uint64_t cycles = 0;
+		uint32_t hist[IRQ_STATS_HIST_BUCKETS];
+		memory_set((uint8_t *) hist, 0, sizeof(hist));
+
+		for(i = 0; i < num_cpus; i++) {
+			struct irq_cpu_stats *stats = irq_stats_cpu(i);
+			count += stats->count[vector];
+			cycles += stats->cycles[vector];
+			if(stats->max_cycles[vector] > max) max = stats->max_cycles[vector];
+			if(vector < IRQ_STATS_HIST_VECTORS)
+				for(j = 0; j < IRQ_STATS_HIST_BUCKETS; j++) hist[j] += stats->hist[vector][j];
+		}
+		if(count == 0) continue;
+
+		kprint(int_to_ascii(vector));
+		kprint(" ");
+		kprint(irq_vector_name(vector));
+		kprint(": ");
+		kprint(int_to_ascii(count));
+		if(vector < IRQ_STATS_HIST_VECTORS) {
+			for(j = 0; j < IRQ_STATS_HIST_BUCKETS; j++) timed += hist[j];
+			if(timed > 0) {
+				kprint(", avg ");
+				kprint(int_to_ascii(udiv64(cycles, timed, NULL)));
+				kprint(", max ");
+				kprint(int_to_ascii(max));
+				kprint(" cycles\n  ");
+				for(j = 0; j < IRQ_STATS_HIST_BUCKETS; j++) {
+					if(hist[j] == 0) continue;
+					kprint(j == IRQ_STATS_HIST_BUCKETS - 1 ? ">=2^" : "<2^");
+					kprint(int_to_ascii(j == IRQ_STATS_HIST_BUCKETS - 1 ? j + 7 : j + 8));
+					kprint(":");
+					kprint(int_to_ascii(hist[j]));
+					kprint(" ");
+				}
+			}
+		} else if(max > 0) {
+			kprint(", max ");
+			kprint(int_to_ascii(max));
+			kprint(" cycles");
+		}
+		kprint("\n");
+	}
+
+	for(i = 0; i < num_cpus; i++) {
+		struct irq_cpu_stats *stats = irq_stats_cpu(i);
+		nested += stats->nested;
+		spurious += stats->spurious;
+		unhandled += stats->unhandled;
+		softirqs += cpus[i].softirq.processed;
+		softirq_cycles += cpus[i].softirq.cycles;
+	}
+	kprint("nested ");
+	kprint(int_to_ascii(nested));
+	kprint(", spurious ");
+	kprint(int_to_ascii(spurious));
+	kprint(", unhandled ");
+	kprint(int_to_ascii(unhandled));
+	kprint(", softirqs ");
+	kprint(int_to_ascii(softirqs));
+	if(softirqs > 0) {
+		kprint(" avg ");
+		kprint(int_to_ascii(udiv64(softirq_cycles, softirqs, NULL)));
+		kprint(" cycles");
+	}
+	kprint("\n");
+	UNUSED(args);
+}
+
+/**
+ * @brief      Prints the longest interrupts-disabled sections on any cpu, longest first. `irqsoff reset` clears them.
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  "reset", or nothing
+ */
+void IRQSOFF(char *args) {
+	if(strcmp(args, "reset") == 0) {
+		irqsoff_reset();
+		return;
+	}
+
+	struct irqsoff_section *printed[IRQSOFF_WORST];
+	int shown, i, j, k;
+	if(irqsoff_cpu(0) == NULL) return;
+	for(i = 0; i < num_cpus; i++) {
+		struct irqsoff_cpu *trace = irqsoff_cpu(i);
+		kprint("cpu ");
+		kprint(int_to_ascii(i));
+		kprint(": ");
+		kprint(int_to_ascii(trace->sections));
+		kprint(" sections");
+		if(trace->sections > 0) {
+			kprint(", avg ");
+			kprint(int_to_ascii(udiv64(trace->total_cycles, trace->sections, NULL)));
+			kprint(" cycles");
+		}
+		kprint("\n");
+	}
+
+	// Selection over every cpu's list; they are short
+	for(shown = 0; shown < IRQSOFF_WORST; shown++) {
+		struct irqsoff_section *longest = NULL;
+		for(i = 0; i < num_cpus; i++) {
+			for(j = 0; j < IRQSOFF_WORST; j++) {
+				struct irqsoff_section *section = &irqsoff_cpu(i)->worst[j];
+				if(section->cycles == 0) continue;
+				for(k = 0; k < shown && printed[k] != section; k++);
+				if(k < shown) continue;
+				if(longest == NULL || section->cycles > longest->cycles) longest = section;
+			}
+		}
+		if(longest == NULL) break;
+		printed[shown] = longest;
+
+		kprint(int_to_ascii(longest->cycles));
+		kprint(" cycles on cpu ");
+		kprint(int_to_ascii(longest->cpu));
+		if(longest->vector != IRQSOFF_NO_VECTOR) {
+			kprint(", vector ");
+			kprint(int_to_ascii(longest->vector));
+			kprint(" at ");
+		} else {
+			kprint(", off at ");
+		}
+		kprint(hex_to_ascii(longest->off_eip));
+		kprint(", on at ");
+		kprintn(hex_to_ascii(longest->on_eip));
+	}
+}
+
+/**
+ * @brief      Writes every dirty cached sector to the disk
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void SYNC(char *args) {
+	int result = block_cache_flush();
+	if(result != ATA_OK) {
+		kprint("sync failed: ");
+		kprintn((char *)ata_strerror(result));
+	}
+
+	UNUSED(args);
+}
+
+/**
+ * @brief      Prints the block cache's hit rate and write-back counters
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void BCACHE(char *args) {
+	struct block_cache_stats stats;
+	block_cache_get_stats(&stats);
+
+	uint32_t lookups = stats.hits + stats.misses;
+	kprint("hits ");
+	kprint(int_to_ascii(stats.hits));
+	kprint(", misses ");
+	kprint(int_to_ascii(stats.misses));
+	kprint(", hit rate ");
+	kprint(int_to_ascii(lookups > 0 ? (uint32_t)udiv64((uint64_t)stats.hits * 100, lookups, NULL) : 0));
+	kprintn("%");
+	kprint("evictions ");
+	kprint(int_to_ascii(stats.evictions));
+	kprint(", written back ");
+	kprint(int_to_ascii(stats.writebacks));
+	kprint(", dirty ");
+	kprint(int_to_ascii(stats.dirty));
+	kprint(", read ahead ");
+	kprintn(int_to_ascii(stats.prefetched));
+
+	UNUSED(args);
+}
+
+/**
+ * @brief      Lists the block devices, or mounts one as the filesystem's volume. `mount ram` mounts RAM disk ram0,
+ *             creating it the first time, so mounting it again gets back the files written to it.
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  The device's name, or nothing to list them
+ */
+void MOUNT(char *args) {
+	struct block_device *device;
+	if(args[0] == '\0') {
+		for(device = block_device_list(); device != NULL; device = device->next) {
+			kprint(device->name);
+			kprint(": ");
+			kprint(int_to_ascii(udiv64(block_device_capacity(device), 2048, NULL)));
+			kprint(" MiB");
+			kprintn(device == fs_volume ? ", mounted" : "");
+		}
+		return;
+	}
+
+	if(strcmp(args, "ram") == 0) {
+		device = block_device_find("ram0");
+		if(device == NULL) device = ramdisk_create(RAMDISK_DEFAULT_SECTORS);
+	} else {
+		device = block_device_find(args);
+	}
+	if(device == NULL) {
+		kprintn("No such device.");
+		return;
+	}
+	if(mount_filesystem(device) != 0) {
+		kprintn("The device is too small.");
+		return;
+	}
+	kprint("Mounted ");
+	kprintn(device->name);
+}
+
+/**
+ * @brief      Stripes the ATA drives other than the boot disk (ata1 to ata3, those that are present) into one volume
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  The stripe size in sectors, or nothing for RAID0_DEFAULT_STRIPE
+ */
+void RAID(char *args) {
+	static char *names[] = { "ata1", "ata2", "ata3" };
+	struct block_device *members[RAID0_MAX_MEMBERS];
+	uint32_t count = 0;
+	uint32_t i;
+	for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		struct block_device *device = block_device_find(names[i]);
+		if(device != NULL) members[count++] = device;
+	}
+
+	uint32_t stripe = 0;
+	for(i = 0; args[i] >= '0' && args[i] <= '9'; i++) stripe = stripe * 10 + args[i] - '0';
+	if(args[i] != '\0' || (i > 0 && stripe == 0)) {
+		kprintn("Usage: raid [stripe sectors]");
+		return;
+	}
+	if(stripe == 0) stripe = RAID0_DEFAULT_STRIPE;
+
+	struct block_device *volume = raid0_create(members, count, stripe);
+	if(volume == NULL) {
+		kprintn("Striping needs at least two drives besides ata0.");
+		return;
+	}
+	kprint(volume->name);
+	kprint(": ");
+	kprint(int_to_ascii(count));
+	kprint(" drives, ");
+	kprint(int_to_ascii(udiv64(block_device_capacity(volume), 2048, NULL)));
+	kprint(" MiB, stripe ");
+	kprint(int_to_ascii(stripe));
+	kprintn(" sectors");
+}
+
+/**
+ * @brief      Lists the devices found on the PCI bus
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void LSPCI(char *args) {
+	uint32_t count;
+	struct pci_device *devices = pci_devices(&count);
+	uint32_t i;
+	for(i = 0; i < count; i++) {
+		kprint(int_to_ascii(devices[i].bus));
+		kprint(":");
+		kprint(int_to_ascii(devices[i].slot));
+		kprint(".");
+		kprint(int_to_ascii(devices[i].function));
+		kprint(" vendor ");
+		kprint(hex_to_ascii(devices[i].vendor_id));
+		kprint(" device ");
+		kprint(hex_to_ascii(devices[i].device_id));
+		kprint(" class ");
+		kprint(hex_to_ascii(devices[i].class_code));
+		kprint(".");
+		kprint(hex_to_ascii(devices[i].subclass));
+		kprint(" irq ");
+		kprintn(int_to_ascii(devices[i].irq_line));
+	}
+
+	UNUSED(args);
+}
+
+/**
+ * @brief      Prints each block device's request counts, utilization, queue depth and service-time histograms, then
+ *             how the ATA drives moved their data and where the filesystem's writes went
+ * @ingroup    BASIC_COMMANDS
+ * @param      args  Unused
+ */
+void IOSTAT(char *args) {
+	struct block_device *device;
+	struct disk_stats stats;
+	for(device = block_device_list(); device != NULL; device = device->next) {
+		disk_queue_get_stats(&device->queue, &stats);
+		if(stats.requests[0] + stats.requests[1] == 0) continue;
+
+		uint64_t elapsed = stats.last_change - stats.since;
+		if(elapsed == 0) elapsed = 1;
+		uint32_t depth = udiv64(stats.depth_cycles * 100, elapsed, NULL);
+		kprint(device->name);
+		kprint(": read ");
+		kprint(int_to_ascii(stats.requests[0]));
+		kprint(" requests, ");
+		kprint(int_to_ascii(stats.sectors[0]));
+		kprint(" sectors; write ");
+		kprint(int_to_ascii(stats.requests[1]));
+		kprint(" requests, ");
+		kprint(int_to_ascii(stats.sectors[1]));
+		kprintn(" sectors");
+		kprint("  merged ");
+		kprint(int_to_ascii(device->queue.merged));
+		kprint(", seeks ");
+		kprint(int_to_ascii(stats.seeks));
+		kprint(", errors ");
+		kprint(int_to_ascii(stats.errors));
+		kprint(", busy ");
+		kprint(int_to_ascii(udiv64(stats.busy_cycles * 100, elapsed, NULL)));
+		kprint("%, avg depth ");
+		kprint(int_to_ascii(depth / 100));
+		kprint(".");
+		if(depth % 100 < 10) kprint("0");
+		kprint(int_to_ascii(depth % 100));
+		kprint(", max depth ");
+		kprintn(int_to_ascii(device->queue.max_depth));
+		print_service("  read: ", &stats, 0);
+		print_service("  write: ", &stats, 1);
+	}
+
+	uint8_t i;
+	for(i = 0; i < ATA_DRIVES; i++) {
+		const struct ata_stats *ata = ata_drive_stats(i);
+		if(ata->dma_commands + ata->pio_commands == 0) continue;
+		kprint("ata");
+		kprint(int_to_ascii(i));
+		kprint(": dma ");
+		kprint(int_to_ascii(ata->dma_commands));
+		kprint(" commands, ");
+		kprint(int_to_ascii(ata->dma_fallbacks));
+		kprint(" fell back; pio ");
+		kprint(int_to_ascii(ata->pio_commands));
+		kprint(" commands, ");
+		kprint(int_to_ascii(ata->pio_sectors));
+		kprint(" sectors, ");
+		print_cycles(ata->pio_cycles);
+		kprint("\n");
+	}
+
+	struct fs_stats fs;
+	fs_get_stats(&fs);
+	kprint("fs: file data ");
+	kprint(int_to_ascii(fs.file_writes));
+	kprint(" writes, ");
+	kprint(int_to_ascii(fs.file_sectors));
+	kprint(" sectors; FAT ");
+	kprint(int_to_ascii(fs.fat_writes));
+	kprint(" writes, ");
+	kprint(int_to_ascii(fs.fat_sectors));
+	kprintn(" sectors");
+
+	UNUSED(args);
+}
+
+static void print_disk_rate(char *label, int result, uint64_t us) {
+	kprint(label);
+	if(result != ATA_OK) {
+		kprintn((char *)ata_strerror(result));
+		return;
+	}
+	// Bytes per microsecond are MB/s; keep one decimal
+	uint32_t tenths = udiv64((uint64_t)DISKBENCH_ROUNDS * DISKBENCH_SECTORS * 512 * 10, us > 0 ? us : 1, NULL);
+	kprint(int_to_ascii(tenths / 10));
+	kprint(".");
+	kprint(int_to_ascii(tenths % 10));
+	kprintn(" MB/s");
+}
+
+static void print_cycles(uint64_t cycles) {
+	uint32_t tsc_per_us = apic_timer_tsc_per_us();
+	if(tsc_per_us == 0) {
+		kprint(int_to_ascii(cycles));
+		kprint(" cycles");
+		return;
+	}
+	kprint(int_to_ascii(udiv64(cycles, tsc_per_us, NULL)));
+	kprint(" us");
+}
+
+static void print_service(char *label, struct disk_stats *stats, uint8_t write) {
+	uint32_t commands = stats->commands[write];
+	if(commands == 0) return;
+	int j;
+	kprint(label);
+	kprint(int_to_ascii(commands));
+	kprint(" commands, service avg ");
+	print_cycles(udiv64(stats->service_cycles[write], commands, NULL));
+	kprint(", max ");
+	print_cycles(stats->max_service_cycles[write]);
+	kprint(", wait avg ");
+	print_cycles(udiv64(stats->wait_cycles[write], stats->requests[write] > 0 ? stats->requests[write] : 1, NULL));
+	kprint("\n    cycles ");
+	for(j = 0; j < DISK_STATS_HIST_BUCKETS; j++) {
+		if(stats->hist[write][j] == 0) continue;
+		kprint(j == DISK_STATS_HIST_BUCKETS - 1 ? ">=2^" : "<2^");
+		kprint(int_to_ascii(j == DISK_STATS_HIST_BUCKETS - 1 ? j + 11 : j + 12));
+		kprint(":");
+		kprint(int_to_ascii(stats->hist[write][j]));
+		kprint(" ");
+	}
+	kprint("\n");
+}
+
+static char *irq_vector_name(uint32_t vector) {
+	switch(vector) {
+		case 7:   return "fpu";
+		case 13:  return "gpf";
+		case 14:  return "page fault";
+		case 32:  return "pit";
+		case 33:  return "keyboard";
+		case 46:  return "ata primary";
+		case 47:  return "ata secondary";
+		case 48:  return "lapic timer";
+		case 49:  return "reschedule";
+		case 128: return "syscall";
+		case 255: return "spurious";
+		default:  return vector < 32 ? "exception" : "irq";
+	}
+}
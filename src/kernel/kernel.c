@@ -11,6 +11,8 @@
 #include "cpu/isr.h"
 #include "drivers/screen.h"
 #include "drivers/ata.h"
+#include "drivers/virtio_blk.h"
+#include "drivers/ahci.h"
 #include "libc/function.h"
 #include "libc/string.h"
 #include "libc/mem.h"
@@ -18,6 +20,8 @@
 #include "kernel/kernel.h"
 #include "kernel/commands.h"
 #include "filesystem/filesystem.h"
+#include "filesystem/block_cache.h"
+#include "drivers/block_device.h"
 #include "drivers/keyboard.h"
 #include "cpu/timer.h"
 #include "cpu/paging.h"
@@ -25,11 +29,16 @@
 #include "kernel/windows.h"
 #include "cpu/task_manager.h"
 #include "cpu/syscall.h"
+#include "cpu/fpu.h"
+#include "cpu/smp.h"
+#include "cpu/gdt.h"
 
 struct command_block *command_resolver_head;
 char **lkeybuffer = NULL;
 vf_ptr_s next_function = NULL;
 
+static void start_tasks(void *arg);
+
 /**
  * @brief      The kernel entry point.
  * @ingroup    KERNEL
@@ -40,13 +49,21 @@ extern uint32_t length_linker;
 
 __attribute__((section(".kernel_entry")))  void kernel_main() {
     ta_init(0x100000, 0x4fff000, 0xfffff, 16, 8);
+    init_gdt();
     isr_install();
+    smp_init();
+    load_tss(0);
+    init_fpu();
     irq_install();
+    init_ata();
+    init_virtio_blk();
+    init_ahci();
 
     lkeybuffer = ta_alloc(256);
     init_keyboard(lkeybuffer, NULL);
 
     enable_paging();
+    smp_boot_aps();
 
     command_resolver_head = ta_alloc(sizeof(struct command_block)); // Does not need to be ta_freed; should always stay in memory
     command_resolver_head->function = NULLFUNC;
@@ -60,24 +77,43 @@ __attribute__((section(".kernel_entry")))  void kernel_main() {
     register_command(command_resolver_head, HELP, "help");
     register_command(command_resolver_head, DEBUG_PAUSE, "debug_command");
     register_command(command_resolver_head, RUN, "run");
+    register_command(command_resolver_head, CPUS, "cpus");
+    register_command(command_resolver_head, SYSBENCH, "sysbench");
+    register_command(command_resolver_head, CTXBENCH, "ctxbench");
+    register_command(command_resolver_head, PRIMES, "primes");
+    register_command(command_resolver_head, LOCKS, "locks");
+    register_command(command_resolver_head, IRQSTAT, "irqstat");
+    register_command(command_resolver_head, IRQSOFF, "irqsoff");
+    register_command(command_resolver_head, DISKBENCH, "diskbench");
+    register_command(command_resolver_head, SYNC, "sync");
+    register_command(command_resolver_head, BCACHE, "bcache");
+    register_command(command_resolver_head, MOUNT, "mount");
+    register_command(command_resolver_head, LSPCI, "lspci");
+    register_command(command_resolver_head, IOSTAT, "iostat");
+    register_command(command_resolver_head, RAID, "raid");
 
+    block_devices_start();
+    init_block_cache();
+    init_fat_info();
     enable_syscalls();
 
-    // Construct our mother task
-    sys_insert_task(&kernel_pages);
-
-    map_page(&kernel_pages, 0x5ffe000, get_first_physical_page()*0x1000);
-    map_page(&kernel_pages, 0x5fff000, get_first_physical_page()*0x1000);
-    map_page(&kernel_pages, 0x6000000, get_first_physical_page()*0x1000);
-    tasks[0].regs.esp = 0x5ffffff;
-    __asm__("mov $0x5ffffff, %ebp");
-    __asm__("mov $0x5ffffff, %esp");
+    // Construct our mother task; the boot context becomes this cpu's idle loop
+    kthread_create(start_tasks, NULL, 0);
+    cpu_idle();
+}
 
+/**
+ * @brief      The mother task. Forks the shell.
+ * @ingroup    KERNEL
+ * @param      arg   Unused
+ */
+static void start_tasks(void *arg) {
+    UNUSED(arg);
     int result = sys_fork(&kernel_pages);
     kprint(int_to_ascii(result));
     kprintn(" is the tasks PID.");
     if(result == 0) {
-        while(1);
+        task_exit();
     } else {
         sys_stp();
         kernel_loop();
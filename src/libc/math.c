@@ -19,4 +19,26 @@ uint16_t logi(uint32_t n, uint8_t base) {
 		return_value++;
 	}
 	return return_value;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief      Divides a 64 bit number by a 32 bit one
+ * @note       The kernel is not linked against libgcc, so 64 bit '/' and '%' cannot be used.
+ *
+ * @param[in]  n          The dividend
+ * @param[in]  d          The divisor
+ * @param      remainder  Receives the remainder, if not NULL
+ *
+ * @return     The quotient
+ */
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t *remainder) {
+	uint32_t high = n >> 32;
+	uint32_t low = (uint32_t)n;
+	uint32_t quotient_high = high / d;
+	uint32_t quotient_low, rem;
+	high %= d;
+	// high < d now, so the quotient of high:low / d fits in 32 bits
+	asm("divl %4" : "=a" (quotient_low), "=d" (rem) : "a" (low), "d" (high), "rm" (d));
+	if(remainder != NULL) *remainder = rem;
+	return ((uint64_t)quotient_high << 32) | quotient_low;
+}
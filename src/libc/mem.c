@@ -34,6 +34,7 @@
  * 
  * When returning the ta_alloc'd block, or when ta_freeing a block, the address returned/used is the address of data, so that pointers can be assigned directly to the return value of ta_alloc. <br>
  * To ta_free a block, the address used is stepped back until the magic number is valid (0x0FBC). Then, the block is properly aligned and can be ta_freed.
+ * ta_alloc_align returns an address past the start of its block, so ta_free takes any address inside a used block.
  * 
  * @author     Valerie Whitmire
  * @date       2023
@@ -45,6 +46,7 @@
 #include "libc/function.h"
 #include "drivers/screen.h"
 #include "cpu/task_manager.h"
+#include "cpu/spinlock.h"
 
 #define false 0
 #define true 1
@@ -54,6 +56,8 @@ static const void *heap_limit = NULL;
 static size_t heap_split_thresh;
 static size_t heap_alignment;
 static size_t heap_max_blocks;
+static spinlock_t heap_lock = SPINLOCK_INIT;
+static struct lock_stats heap_lock_stats;
 
 /**
  * @brief      Copys memory from source to dest
@@ -158,6 +162,7 @@ bool ta_init(const void *base, const void *limit, const size_t heap_blocks, cons
     heap_split_thresh = split_thresh;
     heap_alignment = alignment;
     heap_max_blocks = heap_blocks;
+    spin_init_tracked(&heap_lock, &heap_lock_stats, "heap");
 
     heap->free   = NULL;
     heap->used   = NULL;
@@ -175,10 +180,11 @@ bool ta_init(const void *base, const void *limit, const size_t heap_blocks, cons
 }
 
 bool ta_free(void *free) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
     Block *block = heap->used;
     Block *prev  = NULL;
     while (block != NULL) {
-        if (free == block->addr) {
+        if ((size_t)free >= (size_t)block->addr && ((size_t)free < (size_t)block->addr + block->size || free == block->addr)) {
             if (prev) {
                 prev->next = block->next;
             } else {
@@ -188,11 +194,13 @@ bool ta_free(void *free) {
 #ifndef TA_DISABLE_COMPACT
             compact();
 #endif
+            spin_unlock_irqrestore(&heap_lock, flags);
             return true;
         }
         prev  = block;
         block = block->next;
     }
+    spin_unlock_irqrestore(&heap_lock, flags);
     return false;
 }
 
@@ -252,7 +260,9 @@ static Block *alloc_block(size_t num) {
 }
 
 void *ta_alloc(size_t num) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
     Block *block = alloc_block(num);
+    spin_unlock_irqrestore(&heap_lock, flags);
     if (block != NULL) {
         return block->addr;
     }
@@ -260,7 +270,9 @@ void *ta_alloc(size_t num) {
 }
 
 void *ta_alloc_align(size_t num, size_t alignment) {
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
     Block *block = alloc_block(num+alignment);
+    spin_unlock_irqrestore(&heap_lock, flags);
     if (block != NULL) {
         void * addr = (void*)(((size_t)block->addr + alignment) & -alignment);
         return addr;
@@ -284,7 +296,9 @@ static void memclear(void *ptr, size_t num) {
 
 void *ta_calloc(size_t num, size_t size) {
     num *= size;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
     Block *block = alloc_block(num);
+    spin_unlock_irqrestore(&heap_lock, flags);
     if (block != NULL) {
         memclear(block->addr, num);
         return block->addr;
@@ -101,12 +101,7 @@ static void initialize() {
 	kprint_at_preserve(footer_00,0,24);
 	kprint("\n");
 
-	struct file* files = get_files()+1;
-	while(files->magic == 0xFFFFFFFF) {
-		if(strcmp(files->name,file_name) == 0) break;
-		files++;
-	}
-	if(files->magic != 0xFFFFFFFF) {
+	if(find_file(file_name) == FILE_NOT_FOUND) {
 		// procedure for new file
 		new_file = TRUE;
 	} else {